@@ -1,179 +1,269 @@
 #include "avreceiver.hpp"
-#include "avutils.hpp"
-#include <chrono>
+#include "tracing.hpp"
+#include <cstring>
 #include <iostream>
-#include <opencv2/core.hpp>
-#include <opencv2/highgui.hpp>
-#include <opencv2/imgcodecs.hpp>
-#include <opencv2/imgproc.hpp>
-#include <thread>
-#include <vector>
-#include <zmq.hpp>
-
-AVReceiver::AVReceiver(const std::string &host, const unsigned int port)
-    : ctx(1) {
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+AVReceiver::AVReceiver(const std::string &endpoint, int hwm,
+                       std::unique_ptr<FeedbackClient> feedback,
+                       const DecodeSettings &decode)
+    : own_ctx(new zmq::context_t(1)), pool(4),
+      feedback(std::move(feedback)), decode_settings(decode),
+      frames_decoded(0), packets_lost(0), packets_skipped(0),
+      keyframe_requests(0), bytes_received(0) {
+  connect(*own_ctx, endpoint, hwm);
+}
+
+AVReceiver::AVReceiver(zmq::context_t &ctx, const std::string &endpoint,
+                       int hwm, std::unique_ptr<FeedbackClient> feedback,
+                       const DecodeSettings &decode)
+    : pool(4), feedback(std::move(feedback)),
+      decode_settings(decode), frames_decoded(0), packets_lost(0),
+      packets_skipped(0), keyframe_requests(0),
+      bytes_received(0) {
+  connect(ctx, endpoint, hwm);
+}
+
+void AVReceiver::connect(zmq::context_t &ctx, const std::string &endpoint,
+                         int hwm) {
+  if (decode_settings.pool && feedback) {
+    // the client is not thread safe, and would be used by both threads
+    throw std::invalid_argument("Feedback needs decoding on the receiver");
+  }
+  stop.store(false);
   socket = zmq::socket_t(ctx, zmq::socket_type::sub);
-  const auto connect_str =
-      std::string("tcp://") + host + ":" + std::to_string(port);
+  socket.set(zmq::sockopt::rcvhwm, hwm);
   socket.set(zmq::sockopt::subscribe, "");
-  socket.set(zmq::sockopt::rcvhwm, 2);
-  socket.connect(connect_str);
-  std::cout << "Connected socket to " << connect_str << std::endl;
-  const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_VP9);
-  if (!codec) {
-    throw std::runtime_error("Could not find decoder");
-  }
-  dec_ctx = avcodec_alloc_context3(codec);
-  if (!dec_ctx) {
-    throw std::runtime_error("Could not allocate decoder context");
+  // wake up regularly to check for stop
+  socket.set(zmq::sockopt::rcvtimeo, 100);
+  socket.set(zmq::sockopt::linger, 0);
+  socket.connect(endpoint);
+  current_packet = av_packet_alloc();
+  current_frame = av_frame_alloc();
+  runner = std::thread(&AVReceiver::run, this);
+}
+
+void AVReceiver::update_decoder(const ZmqPacketHeader &header,
+                                const std::string &config) {
+  const auto codec_id = static_cast<AVCodecID>(header.codec_id);
+  if (dec_ctx && dec_ctx->codec_id == codec_id && dec_config == config) {
+    return;
   }
-  parser = av_parser_init(codec->id);
-  if (!parser) {
-    throw std::runtime_error("Could not init parser");
+  avcodec_free_context(&dec_ctx);
+  AVCodecParameters *par = avcodec_parameters_alloc();
+  par->codec_type = AVMEDIA_TYPE_VIDEO;
+  par->codec_id = codec_id;
+  if (!config.empty()) {
+    par->extradata = static_cast<std::uint8_t *>(
+        av_mallocz(config.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+    std::memcpy(par->extradata, config.data(), config.size());
+    par->extradata_size = config.size();
   }
-  /* const AVRational dst_fps = {fps, 1}; */
-  dec_ctx->codec_tag = 0;
-  dec_ctx->codec_type = AVMEDIA_TYPE_VIDEO;
-  int res = avcodec_open2(dec_ctx, codec, nullptr);
-  if (res < 0) {
-    throw std::runtime_error("Could not open decoder context: " +
-                             avutils::av_strerror2(res));
+  try {
+    dec_ctx = avutils::initialize_decoder(par, false, decode_settings.threads);
+    dec_config = config;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
   }
+  avcodec_parameters_free(&par);
 }
 
-int AVReceiver::decode(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt) {
-  int ret;
-
-  ret = avcodec_send_packet(dec_ctx, pkt);
-  if (ret < 0) {
+void AVReceiver::decode_packet(AVPacket *packet,
+                               const ZmqPacketHeader &header,
+                               const std::string &config,
+                               std::int64_t packet_received, bool gap) {
+  waiting_for_keyframe = waiting_for_keyframe || gap;
+  const bool key = header.flags & zmq_packet_key;
+  if (key) {
+    update_decoder(header, config);
+  }
+  if ((waiting_for_keyframe && !key) || !dec_ctx) {
+    av_packet_unref(packet);
+    ++packets_skipped;
+    if (feedback) {
+      // ids come from the sender, so it can tell whether a keyframe is
+      // already on its way
+      feedback->request_keyframe(header.frame_id);
+      keyframe_requests.store(feedback->keyframe_requests());
+    }
+    return;
+  }
+  tracing::ScopedSpan decode_span(tracing::Stage::Decode, header.frame_id);
+  const int success = avcodec_send_packet(dec_ctx, packet);
+  av_packet_unref(packet);
+  // the rest of the GOP is undecodable if the decoder rejected this
+  waiting_for_keyframe = success < 0;
+  if (success < 0) {
     std::cerr << "Error sending packet for decoding: "
-              << avutils::av_strerror2(ret) << std::endl;
-    return ret;
-  } else {
-    /* std::cout << "Sent packet of size " << pkt->size << " bytes" <<
-     * std::endl; */
+              << avutils::av_strerror2(success) << std::endl;
   }
-
-  while (ret >= 0) {
-    ret = avcodec_receive_frame(dec_ctx, frame);
-    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-      /* std::cerr << "Decoder shits bed: " << avutils::av_strerror2(ret) <<
-       * std::endl;
-       */
-      return ret;
-    } else if (ret < 0) {
-      std::cerr << "Error during decoding: " << avutils::av_strerror2(ret)
-                << std::endl;
-      return ret;
+  while (success >= 0 && avcodec_receive_frame(dec_ctx, current_frame) == 0) {
+    DecodedFrame decoded;
+    decoded.frame_id = current_frame->pts;
+    if (decode_settings.yuv) {
+      // the consumer converts, the decoder's buffer is shared until then
+      decoded.yuv = avutils::share_frame(current_frame);
     } else {
-      // Ok to return? might be more than one frame ready? add callback for
-      // this
-      return 0;
+      tracing::ScopedSpan span(tracing::Stage::ColorConvert, decoded.frame_id);
+      // consumers hold on to the image, it returns to the pool once they
+      // drop it
+      decoded.image =
+          pool.acquire(current_frame->height, current_frame->width, CV_8UC4);
+      avutils::avframe_to_bgr(current_frame, decoded.image, 4);
     }
+    av_frame_unref(current_frame);
+    mailbox.put(std::move(decoded));
+    ++frames_decoded;
+  }
+  if (feedback) {
+    feedback->record_decode(tracing::now_ns() - packet_received);
   }
-  return 0;
 }
 
-void AVReceiver::receive() {
-  bool more = true;
-  int num_pkts = 0;
-  zmq::message_t incoming;
-  std::vector<std::uint8_t> buffer;
-  AVFrame *frame = av_frame_alloc();
-  AVPacket *pkt = av_packet_alloc();
-  while (more) {
-    socket.recv(incoming, zmq::recv_flags::none);
-    bytes_received += incoming.size();
-    ++num_pkts;
-    /* std::cout << "Received packet of size " << incoming.size() <<
-     * std::endl; */
-    if (incoming.to_string().find("packet") != std::string::npos) {
+void AVReceiver::run() {
+  zmq::message_t header_part;
+  zmq::message_t payload;
+  zmq::message_t config_part;
+  std::uint64_t expected_sequence = 0;
+  bool synced = false;
+  // a packet is a frame, more than a few queued means decoding can't keep up
+  constexpr std::size_t max_backlog = 8;
+  while (!stop.load()) {
+    if (feedback) {
+      feedback->report(mailbox.dropped());
+    }
+    if (!socket.recv(header_part)) {
+      continue; // timed out
+    }
+    // the other parts of a message arrive together with the first
+    bool complete = header_part.more() && socket.recv(payload);
+    const bool has_config = complete && payload.more();
+    if (has_config) {
+      complete = static_cast<bool>(socket.recv(config_part));
+    }
+    ZmqPacketHeader header;
+    if (!complete || header_part.size() != sizeof(header)) {
+      std::cerr << "Malformed message" << std::endl;
       continue;
-    } else {
-      static int i = 0;
-      buffer.resize(incoming.size() + AV_INPUT_BUFFER_PADDING_SIZE);
-      memcpy(&buffer[0], incoming.data(), incoming.size());
-      more = socket.get(zmq::sockopt::rcvmore) > 0;
-      /* std::cout << "Attempt to parse " << incoming.size() << " bytes" */
-      /*           << std::endl; */
-      int in_len = incoming.size();
-      while (in_len) {
-        int result = av_parser_parse2(
-            this->parser, this->dec_ctx, &pkt->data, &pkt->size,
-            static_cast<std::uint8_t *>(&buffer[0]), incoming.size(),
-            AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
-        in_len -= result;
-        if (result < 0) {
-          std::cerr << "Parsing packet failed" << std::endl;
-        } else {
-          if (pkt->size > 0) {
-            /* std::cout << "Decoding packet of size " << pkt->size <<
-             * std::endl; */
-            result = this->decode(dec_ctx, frame, pkt);
-            if (result < 0) {
-              std::cerr << "Could not decode: " << avutils::av_strerror2(result)
-                        << std::endl;
-            } else {
-              using namespace std::chrono;
-              std::cout << std::fixed << std::setprecision(2)
-                        << duration_cast<milliseconds>(
-                               system_clock::now().time_since_epoch())
-                                   .count() /
-                               1000.0
-                        << std::endl;
-              /* std::cout << "Decoded" << std::endl; */
-              ++successes;
-              std::vector<int> sizes = {frame->height, frame->width};
-              std::vector<size_t> steps{
-                  static_cast<size_t>(frame->linesize[0])};
-
-              // manual conversion of YUV data to rgb8
-              const auto height = frame->height;
-              const auto width = frame->width;
-              const auto actual_size = cv::Size(width, height);
-              void *y = frame->data[0];
-              void *u = frame->data[1];
-              void *v = frame->data[2];
-
-              cv::Mat y_mat(height, width, CV_8UC1, y, frame->linesize[0]);
-              cv::Mat u_mat(height / 2, width / 2, CV_8UC1, u,
-                            frame->linesize[1]);
-              cv::Mat v_mat(height / 2, width / 2, CV_8UC1, v,
-                            frame->linesize[2]);
-              cv::Mat u_resized, v_resized;
-              cv::resize(u_mat, u_resized, actual_size, 0, 0,
-                         cv::INTER_NEAREST); // repeat u values 4 times
-              cv::resize(v_mat, v_resized, actual_size, 0, 0,
-                         cv::INTER_NEAREST); // repeat v values 4 times
-
-              cv::Mat yuv;
-
-              std::vector<cv::Mat> yuv_channels = {y_mat, u_resized, v_resized};
-              cv::merge(yuv_channels, yuv);
-
-              cv::Mat image;
-              cv::cvtColor(yuv, image, cv::COLOR_YUV2BGR);
-
-              /* cv::Mat image(sizes, type, frame->data[0], &steps[0]); */
-              /* cv::Mat image_converted; */
-              /* cv::cvtColor(image, image_converted, cv::COLOR_YUV2BGR); */
-              cv::imshow("decoded", image);
-              cv::waitKey(20);
-            }
-          }
+    }
+    std::memcpy(&header, header_part.data(), sizeof(header));
+    if (header.magic != zmq_packet_magic) {
+      std::cerr << "Not a packet message" << std::endl;
+      continue;
+    }
+    const std::int64_t packet_received = tracing::now_ns();
+    tracing::record(tracing::Stage::Receive, header.frame_id, packet_received,
+                    packet_received);
+    bytes_received += payload.size();
+    if (feedback) {
+      feedback->record_arrival(header.frame_id, packet_received);
+      feedback->record_received();
+    }
+
+    bool gap = false;
+    // sequence numbers count sent messages, so frames the transmitter drops
+    // before encoding leave no gap, unlike a gap in the pts would
+    if (synced && header.sequence != expected_sequence) {
+      // the publisher dropped for us, the rest of the GOP is undecodable
+      if (header.sequence > expected_sequence) {
+        packets_lost += header.sequence - expected_sequence;
+        if (feedback) {
+          feedback->record_loss(header.sequence - expected_sequence);
         }
       }
+      gap = true;
+    }
+    synced = true;
+    expected_sequence = header.sequence + 1;
+
+    std::shared_ptr<AVPacket> shared;
+    AVPacket *packet = current_packet;
+    if (decode_settings.pool) {
+      shared.reset(av_packet_alloc(),
+                   [](AVPacket *unused) { av_packet_free(&unused); });
+      packet = shared.get();
+    }
+    // copied, since the decoder needs padding after the data
+    const int success = packet ? av_new_packet(packet, payload.size())
+                               : AVERROR(ENOMEM);
+    if (success < 0) {
+      std::cerr << "Could not allocate packet: "
+                << avutils::av_strerror2(success) << std::endl;
+      continue;
     }
+    std::memcpy(packet->data, payload.data(), payload.size());
+    packet->pts = header.frame_id;
+    if (header.flags & zmq_packet_key) {
+      packet->flags |= AV_PKT_FLAG_KEY;
+    }
+    const std::string config =
+        has_config ? config_part.to_string() : std::string();
+    if (!decode_settings.pool) {
+      decode_packet(packet, header, config, packet_received, gap);
+      continue;
+    }
+    const std::size_t backlog = decode_settings.pool->post(
+        strand, [this, shared, header, config, packet_received, gap]() {
+          decode_packet(shared.get(), header, config, packet_received, gap);
+        });
+    if (backlog > max_backlog) {
+      // skipping packets breaks the references, so start over at the next
+      // keyframe
+      decode_settings.pool->cancel(strand);
+      decode_settings.pool->post(strand, [this]() {
+        waiting_for_keyframe = true;
+        if (dec_ctx) {
+          avcodec_flush_buffers(dec_ctx);
+        }
+      });
+    }
+  }
+}
+
+cv::Mat AVReceiver::get() { return get_frame().image; }
+
+AVReceiver::DecodedFrame AVReceiver::get_frame() {
+  DecodedFrame frame{tracing::no_frame, cv::Mat(), nullptr};
+  while (!mailbox.get_latest(frame, std::chrono::milliseconds(100)) &&
+         !mailbox.closed()) {
   }
-  av_frame_free(&frame);
-  av_packet_free(&pkt);
-  /* std::cout << "Received " << num_pkts << std::endl; */
+  return frame;
+}
+
+bool AVReceiver::try_get_frame(DecodedFrame &frame) {
+  return mailbox.try_get(frame);
+}
+
+bool AVReceiver::get_latest_frame(DecodedFrame &frame,
+                             std::chrono::milliseconds timeout) {
+  return mailbox.get_latest(frame, timeout);
+}
+
+AVReceiver::Stats AVReceiver::get_stats() const {
+  return Stats{frames_decoded.load(), packets_lost.load(),
+               packets_skipped.load(), mailbox.dropped(),
+               keyframe_requests.load(), bytes_received.load(),
+               pool.allocations()};
+}
+
+void AVReceiver::setStop() {
+  stop.store(true);
+  mailbox.close();
 }
 
 AVReceiver::~AVReceiver() {
+  stop.store(true);
+  // wakes up consumers waiting for a frame
+  mailbox.close();
+  runner.join();
+  if (decode_settings.pool) {
+    decode_settings.pool->cancel(strand);
+  }
   socket.close();
-  av_parser_close(parser);
   avcodec_free_context(&dec_ctx);
-  std::cout << "Decoded " << successes << " frames." << std::endl;
-  std::cout << "Received " << bytes_received / KB << " KB" << std::endl;
+  av_frame_free(&current_frame);
+  av_packet_free(&current_packet);
 }
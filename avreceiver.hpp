@@ -2,48 +2,180 @@
 #define AVRECEIVER_HPP_SHCTCYOW
 
 #include "avutils.hpp"
+#include "decode_pool.hpp"
+#include "feedback.hpp"
+#include "frame_pool.hpp"
+#include "mailbox.hpp"
+#include "zmq_sink.hpp"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <opencv2/core.hpp>
+#include <string>
+#include <thread>
 #include <zmq.hpp>
 
 /**
- * @brief   A class which receives encoded video packets over zmq and decodes
- * them to opencv images which are displayed
- * @warning This is more or less test code to proof of concept.
+ * @brief   A class which subscribes to packets published by a \ref ZmqSink
+ * and decodes them to BGRA images on a background thread. The decoder is
+ * set up from the stream itself at the first keyframe. After lost packets,
+ * everything up to the next keyframe is skipped, and a keyframe is requested
+ * from the sender if there is a feedback channel.
  */
 class AVReceiver {
-  zmq::socket_t socket; ///< receiver socket
-  zmq::context_t ctx;
-  AVCodecContext *dec_ctx;      ///< decoding context
-  AVCodecParserContext *parser; ///< parser
+public:
+  /**
+   * @brief Decoded image with the id of the frame it came from
+   */
+  struct DecodedFrame {
+    std::int64_t frame_id;
+    cv::Mat image;
+    /// with DecodeSettings::yuv, instead of the image
+    std::shared_ptr<AVFrame> yuv;
+  };
+
+  /**
+   * @brief Counters since construction
+   */
+  struct Stats {
+    std::uint64_t frames_decoded;
+    std::uint64_t packets_lost;    ///< gaps in the sequence numbers
+    std::uint64_t packets_skipped; ///< discarded waiting for a keyframe
+    std::uint64_t frames_dropped;  ///< replaced before the consumer took them
+    std::uint64_t keyframe_requests;
+    std::uint64_t bytes_received;
+    std::uint64_t allocations; ///< output images allocated, constant once
+                               ///< the pool is warm
+  };
 
-  // keep some stats for printing
-  int successes = 0;
-  size_t bytes_received = 0;
+private:
+  std::unique_ptr<zmq::context_t> own_ctx; ///< when not given one
+  zmq::socket_t socket;                    ///< receiver socket
+  AVCodecContext *dec_ctx = nullptr;       ///< created at the first keyframe
+  std::string dec_config;                  ///< extradata dec_ctx was made with
+  AVFrame *current_frame;
+  AVPacket *current_packet;
+  Mailbox<DecodedFrame> mailbox; ///< decoding never waits for the consumer
+  // the one in the mailbox, the one being decoded into and a couple held by
+  // the consumer
+  FramePool pool;
+  std::unique_ptr<FeedbackClient> feedback;
+  DecodeSettings decode_settings;
+  DecodePool::Strand strand; ///< decoding on the pool, if any
+  bool waiting_for_keyframe = true; ///< only touched by decoding
+
+  std::atomic<std::uint64_t> frames_decoded;
+  std::atomic<std::uint64_t> packets_lost;
+  std::atomic<std::uint64_t> packets_skipped;
+  std::atomic<std::uint64_t> keyframe_requests;
+  std::atomic<std::uint64_t> bytes_received;
+
+  std::atomic<bool> stop;
+  std::thread runner;
+
+  /**
+   * @brief Connect the socket and start receiving
+   */
+  void connect(zmq::context_t &ctx, const std::string &endpoint, int hwm);
+
+  /**
+   * @brief (Re)create the decoder if the stream's codec or extradata changed
+   *
+   * @param header  header of a keyframe
+   * @param config  extradata sent along, may be empty
+   */
+  void update_decoder(const ZmqPacketHeader &header, const std::string &config);
+
+  /**
+   * @brief Decode a packet and publish the frames it completes, or skip it
+   * while waiting for a keyframe. Runs on the receiving thread, or on the
+   * decode pool.
+   *
+   * @param packet  unreferenced when done
+   * @param header  packet header
+   * @param config  extradata sent along, may be empty
+   * @param packet_received when it arrived
+   * @param gap packets were lost right before it
+   */
+  void decode_packet(AVPacket *packet, const ZmqPacketHeader &header,
+                     const std::string &config, std::int64_t packet_received,
+                     bool gap);
+
+  /**
+   * @brief Receive until stopped, decoding or handing packets to the pool
+   */
+  void run();
 
 public:
   /**
-   * @brief ctor
+   * @brief ctor. Connects and starts receiving.
+   *
+   * @param endpoint    publisher to subscribe to, e.g.
+   * `tcp://localhost:15001`
+   * @param hwm max number of packets queued on this end
+   * @param feedback    channel to request keyframes after loss, optional
+   * @param decode  where to decode and what to output
+   * @throw std::invalid_argument for feedback with a decode pool
+   */
+  explicit AVReceiver(const std::string &endpoint, int hwm = 30,
+                      std::unique_ptr<FeedbackClient> feedback = nullptr,
+                      const DecodeSettings &decode = DecodeSettings());
+
+  /**
+   * @brief ctor for a context shared with the sender, which `inproc://`
+   * endpoints need
+   *
+   * @param ctx context, must outlive the receiver
+   * @param endpoint    publisher to subscribe to
+   * @param hwm max number of packets queued on this end
+   * @param feedback    channel to request keyframes after loss, optional
+   * @param decode  where to decode and what to output
+   * @throw std::invalid_argument for feedback with a decode pool
+   */
+  AVReceiver(zmq::context_t &ctx, const std::string &endpoint, int hwm = 30,
+             std::unique_ptr<FeedbackClient> feedback = nullptr,
+             const DecodeSettings &decode = DecodeSettings());
+
+  /**
+   * @brief Wait for the next decoded image
+   *
+   * @return    empty image if the receiver was stopped
+   */
+  cv::Mat get();
+
+  /**
+   * @brief Wait for the next decoded frame
+   *
+   * @return    frame with empty image if the receiver was stopped
+   */
+  DecodedFrame get_frame();
+
+  /**
+   * @brief Get the newest decoded frame without waiting
    *
-   * @param host    Interface to bind to
-   * @param port    Port to bind to
+   * @return    false if there is no frame the consumer hasn't seen
    */
-  AVReceiver(const std::string &host, const unsigned int port);
+  bool try_get_frame(DecodedFrame &frame);
 
   /**
-   * @brief Decode packets into frames (potentially). Each invocation might lead
-   * to a new frame being ready, require more data, or error.
+   * @brief Get the newest decoded frame, waiting for one for a while
    *
-   * @param dec_ctx Decoding context
-   * @param frame   Frame to fill
-   * @param pkt New packet to decode
+   * @return    false on timeout or if the receiver was stopped
+   */
+  bool get_latest_frame(DecodedFrame &frame,
+                        std::chrono::milliseconds timeout);
+
+  /**
+   * @brief Get counters
    *
-   * @return    0 if new frame is complete, < 0 otherwise.
+   * @return    snapshot of current stats
    */
-  int decode(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt);
+  Stats get_stats() const;
 
   /**
-   * @brief Run the receive loop
+   * @brief Stop receiving and wake up consumers waiting in get_frame()
    */
-  void receive();
+  void setStop();
 
   ~AVReceiver();
 };
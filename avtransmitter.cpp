@@ -1,5 +1,8 @@
 #include "avtransmitter.hpp"
+#include "tracing.hpp"
+#include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 extern "C" {
@@ -7,123 +10,623 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
-#include <libswscale/swscale.h>
 }
 
 AVTransmitter::AVTransmitter(const std::string &host, const unsigned int port,
                              unsigned int fps, unsigned int gop_size,
-                             unsigned int target_bitrate)
-    : fps_(fps), sdp_(""), gop_size_(gop_size),
-      target_bitrate_(target_bitrate) {
+                             unsigned int target_bitrate,
+                             const std::string &codec)
+    : AVTransmitter(fps, gop_size, target_bitrate, codec) {
+  // written directly, sending UDP datagrams does not block
+  rtp_sink_ = std::make_shared<RtpSink>(host, port);
+  add_sink(rtp_sink_, 0);
+}
+
+AVTransmitter::AVTransmitter(unsigned int fps, unsigned int gop_size,
+                             unsigned int target_bitrate,
+                             const std::string &codec)
+    : fps_(fps), profile_(codec_profile(codec)), gop_size_(gop_size),
+      target_bitrate_(target_bitrate), rate_change_pending_(false),
+      frames_submitted_(0), frames_encoded_(0), bytes_sent_(0),
+      keyframes_forced_(0), bitrate_changes_(0), encoder_delay_(0),
+      keyframe_requested_(false),
+      last_keyframe_id_(tracing::no_frame) {
 
-  AVOutputFormat *format = av_guess_format("rtp", nullptr, nullptr);
-  if (!format) {
-    throw std::runtime_error("Could not guess output format.");
+  this->out_codec = avcodec_find_encoder_by_name(profile_.encoder.c_str());
+  if (!this->out_codec) {
+    throw std::runtime_error("Could not find encoder " + profile_.encoder);
+  }
+  this->out_codec_ctx = avcodec_alloc_context3(this->out_codec);
+  if (!this->out_codec_ctx) {
+    throw std::runtime_error("Could not allocate output codec context");
   }
-  const auto url = std::string("rtp://") + host + ":" + std::to_string(port);
-  int success =
-      avutils::initialize_avformat_context(this->ofmt_ctx, format, url.c_str());
-  this->ofmt_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
-  this->ofmt_ctx->flags = AVFMT_FLAG_NOBUFFER | AVFMT_FLAG_FLUSH_PACKETS;
 
+  // Global header is optional. If present, PPS and SPS h264 info will get
+  // written to AVFormatContext's extradata, and consequently show up in the SDP
+  // file. Otherwise the same info is only present inside the packet stream.
+  if (profile_.global_header) {
+    this->out_codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+}
+
+void AVTransmitter::initialize(unsigned int width, unsigned int height) {
+  if (output_width_ > 0) {
+    width_ = output_width_;
+    height_ = output_height_;
+  } else {
+    // 4:2:0 needs even sizes
+    width_ = std::max(2u, width / scale_divisor_ / 2 * 2);
+    height_ = std::max(2u, height / scale_divisor_ / 2 * 2);
+  }
+  input_width_ = width;
+  input_height_ = height;
+  first_time_ = false;
+  avutils::set_codec_params(this->out_codec_ctx, width_, height_, fps_,
+                            target_bitrate_, gop_size_, profile_.pix_fmt);
+  threading_ = resolve_threading(profile_, width_, height_, threading_);
+  int success = avutils::open_encoder(out_codec_ctx, out_codec,
+                                     encoder_options(out_codec_ctx));
   if (success != 0) {
-    throw std::runtime_error("Could not allocate output format context! " +
-                             avutils::av_strerror2(success));
+    throw std::invalid_argument("Could not open encoder " +
+                                avutils::av_strerror2(success));
   }
+  time_base_ = out_codec_ctx->time_base;
+  frame_ = avutils::allocate_frame_buffer(this->out_codec_ctx, width_, height_);
 
-  this->out_codec = avcodec_find_encoder(AV_CODEC_ID_VP9);
-  if (!this->out_codec) {
-    throw std::runtime_error("Could not find encoder");
+  std::lock_guard<std::mutex> lock(sinks_mutex_);
+  for (auto &entry : sinks_) {
+    entry.sink->open(out_codec_ctx, profile_);
   }
-  this->out_stream = avformat_new_stream(this->ofmt_ctx, this->out_codec);
-  if (!this->out_stream) {
-    throw std::runtime_error("Could not find stream");
+  sinks_open_ = true;
+}
+
+void AVTransmitter::check_not_initialized() const {
+  if (!first_time_) {
+    throw std::logic_error("The stream size is fixed after the first frame");
   }
-  this->out_codec_ctx = avcodec_alloc_context3(this->out_codec);
+}
 
-  // Global header is optional. If present, PPS and SPS h264 info will get
-  // written to AVFormatContext's extradata, and consequently show up in the SDP
-  // file. However the same info seems to be present inside the packet stream
-  // when disabled, making it unnecessary.
-  /* this->out_codec_ctx->flags |=AV_CODEC_FLAG_GLOBAL_HEADER; */
-  if (!this->out_codec_ctx) {
-    throw std::runtime_error("Could not allocate output codec context");
+CodecOptions AVTransmitter::encoder_options(AVCodecContext *codec_ctx) const {
+  CodecOptions options = profile_.options;
+  apply_threading(codec_ctx, options, profile_, threading_);
+  if (max_slice_size_ > 0) {
+    ::set_max_slice_size(profile_, options, max_slice_size_);
   }
+  return options;
 }
 
-void AVTransmitter::encode_frame(const cv::Mat &image) {
+void AVTransmitter::set_output_size(unsigned int width, unsigned int height) {
+  check_not_initialized();
+  if (width == 0 || height == 0 || width % 2 != 0 || height % 2 != 0) {
+    throw std::invalid_argument("Output size must be even and not 0");
+  }
+  output_width_ = width;
+  output_height_ = height;
+}
+
+void AVTransmitter::set_downscale(unsigned int divisor) {
+  check_not_initialized();
+  if (divisor == 0) {
+    throw std::invalid_argument("Downscale divisor must not be 0");
+  }
+  scale_divisor_ = divisor;
+}
+
+void AVTransmitter::set_threading(const EncoderThreading &threading) {
+  check_not_initialized();
+  threading_ = threading;
+}
+
+void AVTransmitter::set_max_slice_size(unsigned int bytes) {
+  check_not_initialized();
+  CodecOptions options;
+  if (bytes > 0 && !::set_max_slice_size(profile_, options, bytes)) {
+    throw std::invalid_argument(profile_.encoder +
+                                " can't limit the slice size");
+  }
+  max_slice_size_ = bytes;
+}
+
+void AVTransmitter::set_scale_filter(ScaleFilter filter) {
+  check_not_initialized();
+  scaler_.set_filter(filter);
+}
+
+void AVTransmitter::set_frame_overlay(
+    std::function<void(AVFrame *frame)> overlay) {
+  check_not_initialized();
+  overlay_ = std::move(overlay);
+}
+
+void AVTransmitter::set_fec_ratio(double ratio) {
+  check_not_initialized();
+  if (!rtp_sink_) {
+    throw std::logic_error("FEC needs the RTP output of the host/port ctor");
+  }
+  rtp_sink_->set_fec_ratio(ratio);
+}
+
+void AVTransmitter::prepare(unsigned int width, unsigned int height) {
+  accept_size(width, height);
+}
+
+void AVTransmitter::accept_size(int width, int height) {
   if (first_time_) {
-    first_time_ = false;
-    height_ = image.rows;
-    width_ = image.cols;
-    avutils::set_codec_params(this->out_codec_ctx, width_, height_, fps_,
-                              target_bitrate_, gop_size_);
-    int success = avutils::initialize_codec_stream(this->out_stream,
-                                                   out_codec_ctx, out_codec);
-    this->out_stream->time_base.num = 1;
-    this->out_stream->time_base.den = fps_;
-    avio_open(&(this->ofmt_ctx->pb), this->ofmt_ctx->filename, AVIO_FLAG_WRITE);
-
-    /* Write a file for VLC */
-    constexpr int buflen = 1024;
-    char buf[buflen] = {0};
-    AVFormatContext *ac[] = {this->ofmt_ctx};
-    av_sdp_create(ac, 1, buf, buflen);
-    this->sdp_ = std::string(buf);
-
-    if (success != 0) {
-      throw std::invalid_argument("Could not initialize codec stream " +
-                                  avutils::av_strerror2(success));
-    }
-    if (!swsctx) {
-      swsctx = avutils::initialize_sample_scaler(this->out_codec_ctx, width_,
-                                                 height_);
-    }
-    if (!swsctx) {
-      throw std::runtime_error("Could not initialize sample scaler!");
-    }
-  }
-  if (!frame_) {
-    frame_ =
-        avutils::allocate_frame_buffer(this->out_codec_ctx, width_, height_);
-    int success = avformat_write_header(this->ofmt_ctx, nullptr);
-    if (success != 0) {
-      std::runtime_error("Could not write header! " +
-                         avutils::av_strerror2(success));
-    }
-  }
-  if (imgbuf.empty()) {
-    imgbuf.resize(height_ * width_ * 3 + 16);
-    this->canvas_ =
-        cv::Mat(height_, width_, CV_8UC3, imgbuf.data(), width_ * 3);
-  }
-  image.copyTo(this->canvas_);
-  const int stride[] = {static_cast<int>(image.step[0])};
-
-  /* cv::imshow("encoded", image); */
-  /* cv::waitKey(20); */
-  sws_scale(this->swsctx, &canvas_.data, stride, 0, canvas_.rows, frame_->data,
-            frame_->linesize);
-  frame_->pts +=
-      av_rescale_q(1, out_codec_ctx->time_base, this->out_stream->time_base);
-
-  int success =
-      avutils::write_frame(this->out_codec_ctx, this->ofmt_ctx, this->frame_);
+    initialize(width, height);
+    return;
+  }
+  if (width != input_width_ || height != input_height_) {
+    // receivers and recordings keep the stream they know, the scaler
+    // reinitializes for the new input
+    std::cerr << "Input size changed from " << input_width_ << "x"
+              << input_height_ << " to " << width << "x" << height
+              << ", scaling to " << width_ << "x" << height_ << std::endl;
+    input_width_ = width;
+    input_height_ = height;
+  }
+}
+
+bool AVTransmitter::needs_conversion(const AVFrame *frame) const {
+  return frame->format != static_cast<int>(profile_.pix_fmt) ||
+         static_cast<unsigned int>(frame->width) != width_ ||
+         static_cast<unsigned int>(frame->height) != height_;
+}
+
+void AVTransmitter::encode_frame(const cv::Mat &image) {
+  // synchronous, so the image outlives the call and needs no copy
+  encode_frame(avutils::borrow_mat(image, AV_PIX_FMT_RGB24));
+}
+
+void AVTransmitter::encode_frame(avutils::BorrowedImage image) {
+  accept_size(image.width, image.height);
+  const std::int64_t captured_ns = image.captured_ns;
+  AVFrame *frame = avutils::wrap_borrowed_image(std::move(image));
+  frame_->pts = next_pts();
+  record_capture(frame_->pts, captured_ns);
+  ++frames_submitted_;
+  AVFrame *to_encode = frame_;
+  if (!needs_conversion(frame)) {
+    // no conversion needed, the encoder takes a reference to the caller's
+    // memory
+    frame->pts = frame_->pts;
+    to_encode = frame;
+  } else {
+    tracing::ScopedSpan span(tracing::Stage::Convert, trace_id(frame_->pts));
+    scaler_.scale(frame, frame_);
+    if (overlay_) {
+      overlay_(frame_);
+    }
+  }
+  int success = encode(to_encode, encoded_);
+  av_frame_free(&frame);
   if (success != 0) {
-    std::cerr << "Could not write frame: " << avutils::av_strerror2(success)
-              << ". Maybe send more input. " << std::endl;
+    std::cerr << "Could not encode frame: " << avutils::av_strerror2(success)
+              << std::endl;
   } else {
-    this->frame_ended();
+    ++frames_encoded_;
+  }
+  for (AVPacket *&pkt : encoded_) {
+    dispatch(pkt);
+    av_packet_free(&pkt);
+  }
+  encoded_.clear();
+}
+
+std::int64_t AVTransmitter::next_pts() { return pts_++; }
+
+std::int64_t AVTransmitter::trace_id(std::int64_t pts) const {
+  return av_rescale_q(pts, time_base_, AVRational{1, tracing::clock_rate});
+}
+
+void AVTransmitter::record_capture(std::int64_t pts,
+                                   std::int64_t captured_ns) const {
+  if (captured_ns > 0) {
+    tracing::record(tracing::Stage::Capture, trace_id(pts), captured_ns,
+                    tracing::now_ns());
+  }
+}
+
+void AVTransmitter::start_pipeline(unsigned int queue_size,
+                                   DropPolicy policy) {
+  if (pipelined_) {
+    throw std::logic_error("Pipeline is already running");
+  }
+  raw_frames_.reset(
+      new PipelineQueue<AVFrame>(queue_size, policy, &av_frame_free));
+  yuv_frames_.reset(
+      new PipelineQueue<AVFrame>(queue_size, policy, &av_frame_free));
+  // dropping packets would corrupt the stream until the next keyframe, so
+  // the muxer applies backpressure to the encoder instead
+  packets_.reset(new PipelineQueue<AVPacket>(4 * queue_size, DropPolicy::Block,
+                                             &av_packet_free));
+  pipelined_ = true;
+  convert_thread_ = std::thread(&AVTransmitter::convert_loop, this);
+  encode_thread_ = std::thread(&AVTransmitter::encode_loop, this);
+  mux_thread_ = std::thread(&AVTransmitter::mux_loop, this);
+}
+
+void AVTransmitter::stop_pipeline() {
+  if (!pipelined_) {
+    return;
+  }
+  // close front to back, so every stage drains what its predecessor produced
+  raw_frames_->close();
+  convert_thread_.join();
+  yuv_frames_->close();
+  encode_thread_.join();
+  packets_->close();
+  mux_thread_.join();
+  pipelined_ = false;
+}
+
+bool AVTransmitter::submit_frame(const cv::Mat &image) {
+  if (!pipelined_) {
+    throw std::logic_error("submit_frame() needs start_pipeline() first");
+  }
+  accept_size(image.cols, image.rows);
+  AVFrame *frame = av_frame_alloc();
+  frame->width = image.cols;
+  frame->height = image.rows;
+  frame->format = AV_PIX_FMT_RGB24;
+  int success = av_frame_get_buffer(frame, 0);
+  if (success < 0) {
+    av_frame_free(&frame);
+    throw std::runtime_error("Could not allocate frame: " +
+                             avutils::av_strerror2(success));
+  }
+  // the only copy in pipelined mode, after this the caller's buffer is free
+  cv::Mat wrapped(image.rows, image.cols, CV_8UC3, frame->data[0],
+                  frame->linesize[0]);
+  image.copyTo(wrapped);
+  frame->pts = next_pts();
+  ++frames_submitted_;
+  return raw_frames_->push(frame);
+}
+
+bool AVTransmitter::submit_frame(avutils::BorrowedImage image) {
+  if (!pipelined_) {
+    throw std::logic_error("submit_frame() needs start_pipeline() first");
+  }
+  accept_size(image.width, image.height);
+  const std::int64_t captured_ns = image.captured_ns;
+  AVFrame *frame = avutils::wrap_borrowed_image(std::move(image));
+  frame->pts = next_pts();
+  record_capture(frame->pts, captured_ns);
+  ++frames_submitted_;
+  return raw_frames_->push(frame);
+}
+
+void AVTransmitter::convert_loop() {
+  AVFrame *src = nullptr;
+  while (raw_frames_->pop(src)) {
+    if (!needs_conversion(src)) {
+      yuv_frames_->push(src);
+      continue;
+    }
+    tracing::ScopedSpan span(tracing::Stage::Convert, trace_id(src->pts));
+    AVFrame *dst = av_frame_alloc();
+    dst->width = width_;
+    dst->height = height_;
+    dst->format = static_cast<int>(profile_.pix_fmt);
+    int success = av_frame_get_buffer(dst, 0);
+    if (success < 0) {
+      std::cerr << "Could not allocate frame: "
+                << avutils::av_strerror2(success) << std::endl;
+      av_frame_free(&dst);
+      av_frame_free(&src);
+      continue;
+    }
+    scaler_.scale(src, dst);
+    dst->pts = src->pts;
+    av_frame_free(&src);
+    if (overlay_) {
+      overlay_(dst);
+    }
+    yuv_frames_->push(dst);
+  }
+}
+
+int AVTransmitter::encode(AVFrame *frame, std::vector<AVPacket *> &out) {
+  tracing::ScopedSpan span(tracing::Stage::Encode,
+                           frame ? trace_id(frame->pts) : tracing::no_frame);
+  if (frame) {
+    apply_rate_change(out);
+    // frames are reused, so this must be reset as well
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    if (keyframe_requested_.exchange(false)) {
+      // libx264 makes this an IDR with forced-idr, see the h264 profile
+      frame->pict_type = AV_PICTURE_TYPE_I;
+      ++keyframes_forced_;
+    }
+  }
+  int success = avcodec_send_frame(this->out_codec_ctx, frame);
+  if (success < 0) {
+    return success;
+  }
+  if (frame) {
+    ++frames_in_encoder_;
+  }
+  while (true) {
+    AVPacket *pkt = av_packet_alloc();
+    success = avcodec_receive_packet(this->out_codec_ctx, pkt);
+    if (success < 0) {
+      av_packet_free(&pkt);
+      if (success != AVERROR(EAGAIN) && success != AVERROR_EOF) {
+        return success;
+      }
+      return 0;
+    }
+    // one packet per frame, so what is still inside arrived after this one
+    if (frames_in_encoder_ > 0) {
+      --frames_in_encoder_;
+    }
+    if (frames_in_encoder_ > encoder_delay_.load()) {
+      encoder_delay_.store(frames_in_encoder_);
+    }
+    if (replaced_ && (pkt->flags & AV_PKT_FLAG_KEY)) {
+      attach_extradata(pkt);
+    }
+    out.push_back(pkt);
+  }
+}
+
+void AVTransmitter::apply_rate_change(std::vector<AVPacket *> &out) {
+  if (!rate_change_pending_.exchange(false)) {
+    return;
+  }
+  RateController::Settings settings;
+  {
+    std::lock_guard<std::mutex> lock(rate_mutex_);
+    settings = pending_rate_;
+  }
+  if (settings.bitrate == target_bitrate_.load() && settings.qmax == qmax_) {
+    return;
+  }
+  if (profile_.live_bitrate && settings.qmax == qmax_) {
+    // picked up by the encoder with the next frame
+    out_codec_ctx->bit_rate = settings.bitrate;
+  } else if (!reopen_encoder(settings, out)) {
+    return;
+  }
+  qmax_ = settings.qmax;
+  target_bitrate_.store(settings.bitrate);
+  ++bitrate_changes_;
+}
+
+bool AVTransmitter::reopen_encoder(const RateController::Settings &settings,
+                                   std::vector<AVPacket *> &out) {
+  AVCodecContext *codec_ctx = avcodec_alloc_context3(out_codec);
+  if (!codec_ctx) {
+    std::cerr << "Could not allocate output codec context" << std::endl;
+    return false;
+  }
+  if (profile_.global_header) {
+    codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+  avutils::set_codec_params(codec_ctx, width_, height_, fps_,
+                            settings.bitrate, gop_size_, profile_.pix_fmt);
+  if (settings.qmax >= 0) {
+    codec_ctx->qmax = settings.qmax;
+  }
+  int success = avutils::open_encoder(codec_ctx, out_codec,
+                                     encoder_options(codec_ctx));
+  if (success != 0) {
+    std::cerr << "Could not reopen encoder: " << avutils::av_strerror2(success)
+              << std::endl;
+    avcodec_free_context(&codec_ctx);
+    return false;
+  }
+  // whatever the old encoder still holds goes out before the new keyframe
+  success = avcodec_send_frame(out_codec_ctx, nullptr);
+  while (success >= 0) {
+    AVPacket *pkt = av_packet_alloc();
+    success = avcodec_receive_packet(out_codec_ctx, pkt);
+    if (success < 0) {
+      av_packet_free(&pkt);
+    } else {
+      out.push_back(pkt);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(encoder_mutex_);
+    std::swap(codec_ctx, out_codec_ctx);
+  }
+  frames_in_encoder_ = 0;
+  replaced_ = true;
+  // packets in flight hold references of their own, they outlive it
+  avcodec_free_context(&codec_ctx);
+  return true;
+}
+
+void AVTransmitter::attach_extradata(AVPacket *pkt) const {
+  if (out_codec_ctx->extradata_size <= 0) {
+    return;
+  }
+  std::uint8_t *data = av_packet_new_side_data(
+      pkt, AV_PKT_DATA_NEW_EXTRADATA, out_codec_ctx->extradata_size);
+  if (!data) {
+    std::cerr << "Could not attach new codec parameters" << std::endl;
+    return;
+  }
+  std::memcpy(data, out_codec_ctx->extradata, out_codec_ctx->extradata_size);
+}
+
+void AVTransmitter::dispatch(const AVPacket *pkt) {
+  tracing::ScopedSpan span(tracing::Stage::Mux, trace_id(pkt->pts));
+  bytes_sent_ += pkt->size;
+  if (pkt->flags & AV_PKT_FLAG_KEY) {
+    last_keyframe_id_.store(trace_id(pkt->pts));
+  }
+  std::lock_guard<std::mutex> lock(sinks_mutex_);
+  for (auto &entry : sinks_) {
+    if (!entry.started) {
+      // nothing before a keyframe can be decoded
+      if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+        continue;
+      }
+      entry.started = true;
+    }
+    int success = entry.sink->write(pkt);
+    if (success < 0) {
+      std::cerr << "Could not write packet to " << entry.sink->name() << ": "
+                << avutils::av_strerror2(success) << std::endl;
+    }
+  }
+  this->frame_ended();
+}
+
+void AVTransmitter::encode_loop() {
+  AVFrame *frame = nullptr;
+  std::vector<AVPacket *> encoded;
+  while (yuv_frames_->pop(frame)) {
+    int success = encode(frame, encoded);
+    av_frame_free(&frame);
+    if (success < 0) {
+      std::cerr << "Could not encode frame: " << avutils::av_strerror2(success)
+                << std::endl;
+    } else {
+      ++frames_encoded_;
+    }
+    for (AVPacket *pkt : encoded) {
+      packets_->push(pkt);
+    }
+    encoded.clear();
+  }
+}
+
+void AVTransmitter::mux_loop() {
+  AVPacket *pkt = nullptr;
+  while (packets_->pop(pkt)) {
+    dispatch(pkt);
+    av_packet_free(&pkt);
   }
 }
 
+void AVTransmitter::request_keyframe(std::int64_t frame_id) {
+  if (frame_id != tracing::no_frame && last_keyframe_id_.load() >= frame_id) {
+    return;
+  }
+  keyframe_requested_.store(true);
+}
+
+void AVTransmitter::set_bitrate(unsigned int bitrate, int qmax) {
+  std::lock_guard<std::mutex> lock(rate_mutex_);
+  pending_rate_ = RateController::Settings{bitrate, qmax};
+  rate_change_pending_.store(true);
+}
+
+void AVTransmitter::enable_rate_control(unsigned int min_bitrate,
+                                        unsigned int max_bitrate) {
+  std::lock_guard<std::mutex> lock(rate_mutex_);
+  rate_controller_.reset(new RateController(target_bitrate_.load(),
+                                            min_bitrate, max_bitrate, fps_,
+                                            profile_.max_quantizer));
+}
+
+void AVTransmitter::handle_feedback(const FeedbackMessage &message) {
+  switch (message.type) {
+  case FeedbackType::KeyframeRequest:
+    request_keyframe(message.frame_id);
+    break;
+  case FeedbackType::ReceiverReport: {
+    std::lock_guard<std::mutex> lock(rate_mutex_);
+    RateController::Settings settings;
+    if (rate_controller_ &&
+        rate_controller_->update(message.report, settings)) {
+      pending_rate_ = settings;
+      rate_change_pending_.store(true);
+    }
+    break;
+  }
+  }
+}
+
+void AVTransmitter::add_sink(std::shared_ptr<PacketSink> sink,
+                             unsigned int queue_size, DropPolicy policy) {
+  SinkEntry entry{sink, sink, false};
+  if (queue_size > 0) {
+    entry.sink = std::make_shared<AsyncSink>(sink, queue_size, policy);
+  }
+  std::unique_lock<std::mutex> lock(sinks_mutex_);
+  if (sinks_open_) {
+    // opening can take a while (files, sockets), don't hold up the others
+    lock.unlock();
+    {
+      std::lock_guard<std::mutex> encoder_lock(encoder_mutex_);
+      entry.sink->open(out_codec_ctx, profile_);
+    }
+    lock.lock();
+  }
+  sinks_.push_back(std::move(entry));
+}
+
+bool AVTransmitter::remove_sink(const std::shared_ptr<PacketSink> &sink) {
+  std::shared_ptr<PacketSink> removed;
+  {
+    std::lock_guard<std::mutex> lock(sinks_mutex_);
+    auto it = std::find_if(
+        sinks_.begin(), sinks_.end(),
+        [&sink](const SinkEntry &entry) { return entry.handle == sink; });
+    if (it == sinks_.end()) {
+      return false;
+    }
+    removed = it->sink;
+    sinks_.erase(it);
+  }
+  // after unlocking, an async sink might still be writing its queue
+  removed->close();
+  return true;
+}
+
+AVTransmitter::Stats AVTransmitter::get_stats() const {
+  Stats stats;
+  stats.frames_submitted = frames_submitted_.load();
+  stats.frames_dropped = 0;
+  if (raw_frames_) {
+    stats.frames_dropped += raw_frames_->dropped() + yuv_frames_->dropped();
+  }
+  stats.frames_encoded = frames_encoded_.load();
+  stats.bytes_sent = bytes_sent_.load();
+  stats.packets_dropped = 0;
+  stats.keyframes_forced = keyframes_forced_.load();
+  stats.target_bitrate = target_bitrate_.load();
+  stats.bitrate_changes = bitrate_changes_.load();
+  stats.encoder_delay = encoder_delay_.load();
+  std::lock_guard<std::mutex> lock(sinks_mutex_);
+  for (const auto &entry : sinks_) {
+    stats.packets_dropped += entry.sink->dropped();
+  }
+  return stats;
+}
+
+void AVTransmitter::flush() {
+  stop_pipeline();
+  if (first_time_ || flushed_) {
+    return;
+  }
+  flushed_ = true;
+  int success = encode(nullptr, encoded_);
+  if (success != 0) {
+    std::cerr << "Could not flush encoder: " << avutils::av_strerror2(success)
+              << std::endl;
+  }
+  for (AVPacket *&pkt : encoded_) {
+    dispatch(pkt);
+    av_packet_free(&pkt);
+  }
+  encoded_.clear();
+}
+
 AVTransmitter::~AVTransmitter() {
-  av_write_trailer(this->ofmt_ctx);
+  flush();
+  for (auto &entry : sinks_) {
+    entry.sink->close();
+  }
+  if (frame_) {
+    av_freep(&frame_->data[0]);
+  }
   av_frame_free(&frame_);
-  av_freep(&frame_->data[0]);
-  avcodec_close(this->out_codec_ctx);
-  avio_context_free(&(this->ofmt_ctx->pb));
-  avformat_free_context(this->ofmt_ctx);
+  avcodec_free_context(&this->out_codec_ctx);
 }
 
 void AVTransmitter::frame_ended() {
@@ -147,4 +650,8 @@ void AVTransmitter::frame_ended() {
   /*   std::cout << "Could not write AUD" << std::endl; */
   /* } */
 }
-std::string AVTransmitter::get_sdp() const { return this->sdp_; }
+AVPixelFormat AVTransmitter::pixel_format() const { return profile_.pix_fmt; }
+
+std::string AVTransmitter::get_sdp() const {
+  return rtp_sink_ ? rtp_sink_->sdp() : std::string();
+}
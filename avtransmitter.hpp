@@ -2,29 +2,58 @@
 #define AVTRANSMITTER_HPP_A9X5A3XE
 
 #include "avutils.hpp"
+#include "codec_profile.hpp"
+#include "feedback.hpp"
+#include "packet_sink.hpp"
+#include "pipeline_queue.hpp"
+#include "rate_controller.hpp"
+#include "scaler.hpp"
+#include "threading.hpp"
+#include "tracing.hpp"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <opencv2/core.hpp>
+#include <thread>
 #include <vector>
 
 /**
- * @brief   A class wrapping all encoding functionality for RTP encoding
+ * @brief   A class wrapping all encoding functionality for RTP encoding. One
+ * encoder feeds any number of outputs (\ref PacketSink), which all get
+ * references to the same packets.
  */
 class AVTransmitter {
 
-  std::vector<std::uint8_t>
-      imgbuf; ///< buffer which incoming data gets copied to
+  /**
+   * @brief Output as added by the user, and what packets are written to
+   */
+  struct SinkEntry {
+    std::shared_ptr<PacketSink> handle; ///< as passed to add_sink()
+    std::shared_ptr<PacketSink> sink;   ///< handle, or its AsyncSink
+    bool started;                       ///< got a keyframe yet
+  };
 
-  // format, codec, streams and stuff
-  AVFormatContext *ofmt_ctx = nullptr;
+  // codec and stuff
   AVCodec *out_codec = nullptr;
-  AVStream *out_stream = nullptr;
+  // only replaced by the encoding thread, see reopen_encoder()
   AVCodecContext *out_codec_ctx = nullptr;
-  SwsContext *swsctx = nullptr;
+  std::mutex encoder_mutex_; ///< held by other threads using out_codec_ctx
+  AVRational time_base_;     ///< of out_codec_ctx, for other threads
 
-  cv::Mat canvas_; ///< kinda superfluous copy of input data, backed by imgbuf
+  // colour conversion and scaling to the stream size
+  Scaler scaler_;
+  std::function<void(AVFrame *frame)> overlay_; ///< on converted frames
 
-  // image sizes, determined by first input.
+  // stream size, fixed at the first input. Inputs of other sizes are scaled.
   unsigned int height_;
   unsigned int width_;
+  unsigned int output_width_ = 0;  ///< requested size, 0 to follow the input
+  unsigned int output_height_ = 0;
+  unsigned int scale_divisor_ = 1; ///< stream size is input size divided by it
+  // last input size, to report changes
+  int input_width_ = 0;
+  int input_height_ = 0;
 
   // stream fps, might do nothing
   unsigned int fps_;
@@ -32,15 +61,181 @@ class AVTransmitter {
   // current encoded frame
   AVFrame *frame_ = nullptr;
 
-  // sdp string to give receivers
-  std::string sdp_;
+  // the rtp://host:port given at construction, to hand out its SDP
+  std::shared_ptr<RtpSink> rtp_sink_;
+
+  // outputs, written from the muxing stage and changed from anywhere
+  std::vector<SinkEntry> sinks_;
+  mutable std::mutex sinks_mutex_;
+  bool sinks_open_ = false; ///< encoder is open, new sinks are opened at once
+
+  // codec and its realtime settings
+  CodecProfile profile_;
+  EncoderThreading threading_; ///< as requested until initialize(), then
+                               ///< as resolved
+  unsigned int max_slice_size_ = 0; ///< bytes, 0 for no limit
 
   // stream params
   unsigned int gop_size_;
-  unsigned int target_bitrate_;
+  std::atomic<unsigned int> target_bitrate_;
+  int qmax_ = -1; ///< encoder's qmax, -1 for its default
+
+  // bitrate changes, applied by the encoding thread before the next frame
+  std::mutex rate_mutex_;
+  RateController::Settings pending_rate_;
+  std::atomic<bool> rate_change_pending_;
+  std::unique_ptr<RateController> rate_controller_;
 
   bool first_time_ = true;
 
+  // pipelined mode: capture -> convert -> encode -> mux, each stage on its own
+  // thread
+  bool pipelined_ = false;
+  std::unique_ptr<PipelineQueue<AVFrame>> raw_frames_; ///< rgb input frames
+  std::unique_ptr<PipelineQueue<AVFrame>> yuv_frames_; ///< converted frames
+  std::unique_ptr<PipelineQueue<AVPacket>> packets_;   ///< encoded packets
+  std::thread convert_thread_;
+  std::thread encode_thread_;
+  std::thread mux_thread_;
+  std::int64_t pts_ = 0; ///< pts of the next frame, in the codec time base
+  std::vector<AVPacket *> encoded_; ///< encoder output in synchronous mode
+
+  // stats
+  std::atomic<std::uint64_t> frames_submitted_;
+  std::atomic<std::uint64_t> frames_encoded_;
+  std::atomic<std::int64_t> bytes_sent_;
+  std::atomic<std::uint64_t> keyframes_forced_;
+  std::atomic<std::uint64_t> bitrate_changes_;
+  std::atomic<unsigned int> encoder_delay_; ///< largest seen, in frames
+  unsigned int frames_in_encoder_ = 0; ///< sent, packet not yet received.
+                                       ///< Encoding thread only.
+  bool replaced_ = false; ///< encoder was replaced, its parameters go out
+                          ///< with every keyframe. Encoding thread only.
+  bool flushed_ = false;
+
+  // keyframes on demand
+  std::atomic<bool> keyframe_requested_;
+  std::atomic<std::int64_t> last_keyframe_id_; ///< frame id of the last
+                                               ///< keyframe sent
+
+  /**
+   * @brief Set up codec and outputs once the input size is known.
+   *
+   * @param width   input width, the stream size follows from it unless it
+   * was set with set_output_size()
+   * @param height  input height
+   */
+  void initialize(unsigned int width, unsigned int height);
+
+  /**
+   * @brief Initialize with the first input, and note size changes of later
+   * ones, which are scaled to the stream size
+   */
+  void accept_size(int width, int height);
+
+  /**
+   * @brief Throw if the stream is already set up
+   */
+  void check_not_initialized() const;
+
+  /**
+   * @brief Get the options to open an encoder with: the profile's, with
+   * threading and slice size applied. Sets the context's threads.
+   */
+  CodecOptions encoder_options(AVCodecContext *codec_ctx) const;
+
+  /**
+   * @brief Get the pts for a new frame. Starts at 0, which is where the
+   * receiver's demuxer starts counting, so pts identifies frames on both ends
+   * for tracing.
+   */
+  std::int64_t next_pts();
+
+  /**
+   * @brief Get the tracing id of a frame, its pts on the 90 kHz RTP clock
+   *
+   * @param pts pts in the codec time base
+   */
+  std::int64_t trace_id(std::int64_t pts) const;
+
+  /**
+   * @brief Record the time from capture until the frame was handed over
+   *
+   * @param pts frame pts
+   * @param captured_ns capture time, nothing is recorded if 0
+   */
+  void record_capture(std::int64_t pts, std::int64_t captured_ns) const;
+
+  /**
+   * @brief Check whether an input frame can go to the encoder as it is
+   */
+  bool needs_conversion(const AVFrame *frame) const;
+
+  /**
+   * @brief Send a frame to the encoder and collect every packet it has ready,
+   * which could be zero or several.
+   *
+   * @param frame   frame to encode, nullptr to flush the encoder
+   * @param out receives the packets, owned by the caller
+   *
+   * @return    0 on success, < 0 on error
+   */
+  int encode(AVFrame *frame, std::vector<AVPacket *> &out);
+
+  /**
+   * @brief Apply a pending bitrate change before the next frame. Encoders
+   * that can't change their bitrate while open are replaced by a new one, which
+   * starts with a keyframe.
+   *
+   * @param out receives what the old encoder still had buffered
+   */
+  void apply_rate_change(std::vector<AVPacket *> &out);
+
+  /**
+   * @brief Replace the encoder by one with new rate settings. The old one is
+   * drained first. Size, codec and time base stay the same. Extradata may
+   * not, so from then on keyframes carry it as `AV_PKT_DATA_NEW_EXTRADATA`,
+   * in order with the packets, for sinks which keep codec parameters (SDP,
+   * ZeroMQ config, recording segments). A sink that dropped the first
+   * keyframe picks it up from the next.
+   *
+   * @param settings    new rate settings
+   * @param out receives what the old encoder still had buffered
+   *
+   * @return    false if the new encoder could not be opened, the old one is
+   * kept then
+   */
+  bool reopen_encoder(const RateController::Settings &settings,
+                      std::vector<AVPacket *> &out);
+
+  /**
+   * @brief Add the encoder's extradata to a packet as
+   * `AV_PKT_DATA_NEW_EXTRADATA` side data
+   */
+  void attach_extradata(AVPacket *pkt) const;
+
+  /**
+   * @brief Hand a packet to every sink
+   *
+   * @param pkt packet, still owned by the caller
+   */
+  void dispatch(const AVPacket *pkt);
+
+  /**
+   * @brief Colour conversion stage of the pipeline
+   */
+  void convert_loop();
+
+  /**
+   * @brief Encoding stage of the pipeline
+   */
+  void encode_loop();
+
+  /**
+   * @brief Muxing stage of the pipeline
+   */
+  void mux_loop();
+
   /**
    * @brief Function to invoke when a frame is fully transmitted. currently does
    * nothing, but for x264, we want to write some magic sauce here to tell
@@ -49,9 +244,145 @@ class AVTransmitter {
   void frame_ended();
 
 public:
+  /**
+   * @brief Counters for monitoring the transmitter
+   */
+  struct Stats {
+    std::uint64_t frames_submitted; ///< frames handed to the transmitter
+    std::uint64_t frames_dropped;   ///< frames discarded by the pipeline
+    std::uint64_t frames_encoded;   ///< frames sent to the encoder
+    std::int64_t bytes_sent;        ///< encoded bytes handed to the sinks
+    std::uint64_t packets_dropped;  ///< packets sinks discarded because they
+                                    ///< could not keep up
+    std::uint64_t keyframes_forced; ///< keyframes sent on request
+    unsigned int target_bitrate;    ///< current encoder bitrate
+    std::uint64_t bitrate_changes;  ///< times the encoder was reconfigured
+    unsigned int encoder_delay;     ///< most frames the encoder held back
+                                    ///< before returning a packet, 0 without
+                                    ///< lookahead or B-frames
+  };
+
+  /**
+   * @brief ctor. Streams to one receiver over RTP, more outputs can be added
+   * with add_sink().
+   *
+   * @param host    receiver address
+   * @param port    receiver port, should be even
+   * @param fps stream frame rate
+   * @param gop_size    keyframe interval
+   * @param target_bitrate  bits per second
+   * @param codec   name of a \ref CodecProfile
+   */
   AVTransmitter(const std::string &host, const unsigned int port,
                 unsigned int fps, unsigned int gop_size = 10,
-                unsigned int target_bitrate = 4e6);
+                unsigned int target_bitrate = 4e6,
+                const std::string &codec = "vp9");
+
+  /**
+   * @brief ctor without outputs, they all come from add_sink()
+   *
+   * @param fps stream frame rate
+   * @param gop_size    keyframe interval
+   * @param target_bitrate  bits per second
+   * @param codec   name of a \ref CodecProfile
+   */
+  explicit AVTransmitter(unsigned int fps, unsigned int gop_size = 10,
+                         unsigned int target_bitrate = 4e6,
+                         const std::string &codec = "vp9");
+
+  /**
+   * @brief Encode at a fixed size instead of the input's. Inputs are scaled
+   * to it. Must be called before the first frame.
+   *
+   * @param width   stream width, even
+   * @param height  stream height, even
+   */
+  void set_output_size(unsigned int width, unsigned int height);
+
+  /**
+   * @brief Encode at a fraction of the first input's size, e.g. 2 for half
+   * width and height. Must be called before the first frame.
+   *
+   * @param divisor size divisor, sizes are rounded down to even numbers
+   */
+  void set_downscale(unsigned int divisor);
+
+  /**
+   * @brief Override the threading chosen from frame size and cores, e.g. to
+   * leave cores to other streams. Must be called before the first frame.
+   *
+   * @param threading   fields left at their defaults are still chosen
+   */
+  void set_threading(const EncoderThreading &threading);
+
+  /**
+   * @brief Get the encoder's threading, resolved once the stream is set up
+   */
+  EncoderThreading threading() const { return threading_; }
+
+  /**
+   * @brief Cap the size of encoded slices, so each travels in an RTP packet
+   * of its own and receivers decode a frame while its later slices are still
+   * on the wire (see RTPReceiver's slice decoding). With sliced threads the
+   * encoder finishes all slices of a frame at about the same time, so this
+   * saves most of the decode time rather than the encode time. Must be called
+   * before the first frame.
+   *
+   * @param bytes   max slice size, below the RTP payload size (1460 bytes for
+   * UDP), 0 for no limit
+   * @throw std::invalid_argument if the codec can't cap slice sizes
+   */
+  void set_max_slice_size(unsigned int bytes);
+
+  /**
+   * @brief Choose how inputs are resampled when their size differs from the
+   * stream's. Must be called before the first frame.
+   */
+  void set_scale_filter(ScaleFilter filter);
+
+  /**
+   * @brief Draw on each frame after it was converted to the encoder's format
+   * and before it is encoded, e.g. a time stamp into the luma plane. Raw
+   * camera images can't be drawn on before, demosaicing would smear it.
+   * Only frames the transmitter converted are passed, into its own buffers;
+   * inputs already in the stream's format and size are encoded as given.
+   * Runs on the converting thread. Must be called before the first frame.
+   *
+   * @param overlay gets the converted frame, with its pts set
+   */
+  void set_frame_overlay(std::function<void(AVFrame *frame)> overlay);
+
+  /**
+   * @brief Send FEC packets along the RTP stream, so receivers can recover
+   * lost packets without waiting for a keyframe, see \ref FecEncoder. The
+   * RTP payload shrinks by 18 bytes, capped slices must fit into that. Must
+   * be called before the first frame.
+   *
+   * @param ratio   FEC packets per media packet, up to 1, 0 to disable
+   * @throw std::logic_error without the RTP output of the host/port ctor
+   * @throw std::invalid_argument for a ratio out of range
+   */
+  void set_fec_ratio(double ratio);
+
+  /**
+   * @brief Set up the stream for a given image size before the first frame,
+   * e.g. to hand out the SDP before anything is sent. Otherwise this happens
+   * with the first frame.
+   *
+   * @param width   input width
+   * @param height  input height
+   */
+  void prepare(unsigned int width, unsigned int height);
+
+  /**
+   * @brief Get the stream width, 0 before the first frame or prepare()
+   */
+  unsigned int width() const { return first_time_ ? 0 : width_; }
+
+  /**
+   * @brief Get the stream height, 0 before the first frame or prepare()
+   */
+  unsigned int height() const { return first_time_ ? 0 : height_; }
 
   /**
    * @brief Send an image to the stream
@@ -61,7 +392,143 @@ public:
   void encode_frame(const cv::Mat &image);
 
   /**
-   * @brief Get the sdp file as string
+   * @brief Send a caller-owned image to the stream without copying it. If it
+   * is already in the codec's pixel format and the stream size, it goes
+   * straight to the encoder, otherwise it is converted and scaled directly from
+   * the borrowed memory.
+   * `image.release` is invoked once the data is no longer needed.
+   *
+   * @param image
+   */
+  void encode_frame(avutils::BorrowedImage image);
+
+  /**
+   * @brief Run colour conversion, encoding and muxing on separate threads
+   * connected by bounded queues. After this, frames must be sent with
+   * submit_frame() instead of encode_frame().
+   *
+   * @param queue_size  capacity of each queue between stages
+   * @param policy  what to do with frames when conversion or encoding can't
+   * keep up. Encoded packets are never dropped.
+   */
+  void start_pipeline(unsigned int queue_size = 2,
+                      DropPolicy policy = DropPolicy::DropOldest);
+
+  /**
+   * @brief Stop the pipeline threads, after draining all queued frames
+   */
+  void stop_pipeline();
+
+  /**
+   * @brief End the stream: stop the pipeline, and send the packets the
+   * encoder still holds, e.g. lookahead frames. No frames may follow. Called
+   * by the destructor if not called before.
+   */
+  void flush();
+
+  /**
+   * @brief Hand an image to the pipeline. The image is copied, so the caller
+   * can reuse its buffer right away. Returns immediately unless the pipeline
+   * was started with DropPolicy::Block.
+   *
+   * @param image   RGB8 image of any size
+   *
+   * @return    false if the frame was dropped
+   */
+  bool submit_frame(const cv::Mat &image);
+
+  /**
+   * @brief Hand a caller-owned image to the pipeline without copying it.
+   * `image.release` is invoked once the encoder (or colour conversion) is
+   * done with the data, or the frame was dropped.
+   *
+   * @param image   image of any size and any pixel format swscale can read,
+   * or a raw 8 bit Bayer pattern
+   *
+   * @return    false if the frame was dropped
+   */
+  bool submit_frame(avutils::BorrowedImage image);
+
+  /**
+   * @brief Make the next frame a keyframe, so receivers which lost packets
+   * can resume decoding without waiting for the end of the GOP. Requests
+   * arriving before the next frame are merged into one. Thread safe.
+   *
+   * @param frame_id    first frame the receiver could not decode. If a
+   * keyframe has been sent since, it is on its way and the request is
+   * ignored. tracing::no_frame to always honour the request.
+   */
+  void request_keyframe(std::int64_t frame_id = tracing::no_frame);
+
+  /**
+   * @brief Change the encoder's bitrate while streaming. Takes effect with
+   * the next frame, without interrupting the stream; encoders that can't
+   * change it on the fly (see \ref CodecProfile) are reopened and start over
+   * with a keyframe. Thread safe.
+   *
+   * @param bitrate bits per second
+   * @param qmax    highest quantizer, -1 for the encoder's default. Changing
+   * it always reopens the encoder.
+   */
+  void set_bitrate(unsigned int bitrate, int qmax = -1);
+
+  /**
+   * @brief Adapt the bitrate to receiver reports passed to
+   * handle_feedback(), see \ref RateController. Starts from the current
+   * bitrate.
+   *
+   * @param min_bitrate lowest bitrate to go down to
+   * @param max_bitrate highest bitrate to go up to
+   */
+  void enable_rate_control(unsigned int min_bitrate,
+                           unsigned int max_bitrate);
+
+  /**
+   * @brief Act on feedback from a receiver: keyframe requests, and receiver
+   * reports if rate control is enabled. Meant as the handler of a \ref
+   * FeedbackServer. Thread safe.
+   */
+  void handle_feedback(const FeedbackMessage &message);
+
+  /**
+   * @brief Add an output. Sinks can be added at any time; one added while
+   * streaming starts with the next keyframe.
+   *
+   * @param sink    output to write to
+   * @param queue_size  packets buffered for the sink, which then writes on a
+   * thread of its own (see \ref AsyncSink) and can't stall other outputs. 0
+   * writes directly from the muxing stage, which suits sinks that never
+   * block.
+   * @param policy  what to do when the sink's queue is full
+   */
+  void add_sink(std::shared_ptr<PacketSink> sink, unsigned int queue_size = 32,
+                DropPolicy policy = DropPolicy::DropOldest);
+
+  /**
+   * @brief Remove an output and close it, after it wrote its queued packets
+   *
+   * @param sink    as passed to add_sink()
+   *
+   * @return    false if the sink was not added
+   */
+  bool remove_sink(const std::shared_ptr<PacketSink> &sink);
+
+  /**
+   * @brief Get counters
+   *
+   * @return    snapshot of current stats
+   */
+  Stats get_stats() const;
+
+  /**
+   * @brief Get the pixel format the encoder takes. Images already in this
+   * format are encoded without conversion.
+   */
+  AVPixelFormat pixel_format() const;
+
+  /**
+   * @brief Get the sdp file of the stream to the host and port given at
+   * construction as string, empty without one
    *
    * @return    SDP string
    */
@@ -1,6 +1,10 @@
 #include "avutils.hpp"
+#include "colorconv.hpp"
+#include "threading.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -31,42 +35,38 @@ int initialize_avformat_context(AVFormatContext *&fctx, AVOutputFormat *format,
 }
 
 void set_codec_params(AVCodecContext *&codec_ctx, double width, double height,
-                      int fps, int target_bitrate, int gop_size) {
+                      int fps, int target_bitrate, int gop_size,
+                      AVPixelFormat pix_fmt) {
   const AVRational dst_fps = {fps, 1};
 
   codec_ctx->codec_tag = 0;
   if (target_bitrate > 0) {
     codec_ctx->bit_rate = target_bitrate;
   }
-  codec_ctx->thread_count = 1;
-  codec_ctx->codec_id = AV_CODEC_ID_VP9;
   codec_ctx->codec_type = AVMEDIA_TYPE_VIDEO;
   codec_ctx->width = width;
   codec_ctx->height = height;
   codec_ctx->gop_size = gop_size;
-  codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  codec_ctx->pix_fmt = pix_fmt;
   codec_ctx->framerate = dst_fps;
   codec_ctx->time_base = av_inv_q(dst_fps);
-  /* codec_ctx->thread_type = FF_THREAD_SLICE; */
+  // threads are set by apply_threading()
 }
 
-int initialize_codec_stream(AVStream *&stream, AVCodecContext *&codec_ctx,
-                            AVCodec *&codec) {
+int open_encoder(AVCodecContext *codec_ctx, const AVCodec *codec,
+                 const CodecOptions &options) {
   AVDictionary *codec_options = nullptr;
-  /* av_dict_set(&codec_options, "profile", "high", 0); */
-  /* av_dict_set(&codec_options, "preset", "ultrafast", 0); */
-  /* av_dict_set(&codec_options, "tune", "zerolatency", 0); */
-  /* av_dict_set_int(&codec_options, "aud", 1, 0); */
-  av_dict_set(&codec_options, "deadline", "realtime", 0);
-  av_dict_set(&codec_options, "quality", "realtime", 0);
-  av_dict_set_int(&codec_options, "speed", 8, 0);
-  av_dict_set_int(&codec_options, "row-mt", 1, 0);
-  av_dict_set_int(&codec_options, "lag-in-frames", 0, 0);
-  av_dict_set_int(&codec_options, "tile-columns", 5, 0);
-  av_dict_set_int(&codec_options, "frame-parallel", 0, 0);
+  for (const auto &option : options) {
+    av_dict_set(&codec_options, option.first.c_str(), option.second.c_str(),
+                0);
+  }
 
   // open video encoder
   int ret = avcodec_open2(codec_ctx, codec, &codec_options);
+  if (ret < 0) {
+    av_dict_free(&codec_options);
+    return ret;
+  }
 
   if (codec_ctx->extradata_size > 0) {
     /* std::cout << "Extradata present in AVCodecContext" << std::endl; */
@@ -74,26 +74,85 @@ int initialize_codec_stream(AVStream *&stream, AVCodecContext *&codec_ctx,
     /* std::cout << "No Extradata present in AVFormatContext" << std::endl; */
   }
 
-  bool all_found = true;
+  // whatever is left was not recognized by the encoder
   AVDictionaryEntry *e = nullptr;
   while ((e = av_dict_get(codec_options, "", e, AV_DICT_IGNORE_SUFFIX))) {
-    /* std::cout << "Did not find option " << e->key << ": " << e->value */
-    /*           << std::endl; */
-    all_found = false;
+    av_log(codec_ctx, AV_LOG_WARNING, "Option %s=%s not supported by %s\n",
+           e->key, e->value, codec->name);
+  }
+  av_dict_free(&codec_options);
+  return 0;
+}
+
+AVCodecContext *initialize_decoder(const AVCodecParameters *codecpar,
+                                   bool partial_frames, int threads) {
+  const AVCodec *codec = avcodec_find_decoder(codecpar->codec_id);
+  if (!codec) {
+    throw std::invalid_argument(std::string("Could not find decoder for ") +
+                                avcodec_get_name(codecpar->codec_id));
+  }
+  AVCodecContext *dec_ctx = avcodec_alloc_context3(codec);
+  if (!dec_ctx) {
+    throw std::runtime_error("Could not allocate decoder context");
+  }
+  // picks up extradata, e.g. h264 parameter sets from the SDP
+  int ret = avcodec_parameters_to_context(dec_ctx, codecpar);
+  if (ret >= 0) {
+    // frame threading would hold back one frame per thread
+    dec_ctx->thread_type = FF_THREAD_SLICE;
+    dec_ctx->thread_count =
+        threads > 0 ? threads
+                    : decoder_threads(codecpar->width, codecpar->height);
+    dec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    dec_ctx->delay = 0;
+    if (partial_frames) {
+      dec_ctx->flags2 |= AV_CODEC_FLAG2_CHUNKS;
+    }
+    ret = avcodec_open2(dec_ctx, codec, nullptr);
   }
-  if (all_found) {
-    /* std::cout << "All codec options found." << std::endl; */
+  if (ret < 0) {
+    avcodec_free_context(&dec_ctx);
+    throw std::invalid_argument("Could not open decoder: " + av_strerror2(ret));
   }
+  return dec_ctx;
+}
 
-  ret = avcodec_parameters_from_context(stream->codecpar, codec_ctx);
-  return ret;
+std::shared_ptr<AVFrame> share_frame(const AVFrame *frame) {
+  AVFrame *clone = av_frame_clone(frame);
+  if (!clone) {
+    return nullptr;
+  }
+  return std::shared_ptr<AVFrame>(
+      clone, [](AVFrame *shared) { av_frame_free(&shared); });
 }
 
-SwsContext *initialize_sample_scaler(AVCodecContext *codec_ctx, double width,
-                                     double height) {
-  SwsContext *swsctx = sws_getContext(width, height, AV_PIX_FMT_RGB24, width,
-                                      height, codec_ctx->pix_fmt, SWS_BICUBIC,
-                                      nullptr, nullptr, nullptr);
+bool take_new_extradata(const AVPacket *pkt, std::uint8_t *&extradata,
+                        int &extradata_size) {
+  int size = 0;
+  const std::uint8_t *data =
+      av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &size);
+  if (!data || size <= 0 ||
+      (size == extradata_size && std::memcmp(data, extradata, size) == 0)) {
+    return false;
+  }
+  auto *copy = static_cast<std::uint8_t *>(
+      av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE));
+  if (!copy) {
+    return false;
+  }
+  std::memcpy(copy, data, size);
+  av_free(extradata);
+  extradata = copy;
+  extradata_size = size;
+  return true;
+}
+
+SwsContext *initialize_sample_scaler(AVPixelFormat dst_format, double width,
+                                     double height, AVPixelFormat src_format,
+                                     SwsContext *previous) {
+  SwsContext *swsctx = sws_getCachedContext(
+      previous, width, height, src_format, width, height, dst_format,
+      SWS_BICUBIC, nullptr, nullptr, nullptr);
   return swsctx;
 }
 
@@ -114,27 +173,48 @@ AVFrame *allocate_frame_buffer(AVCodecContext *codec_ctx, double width,
   return frame;
 }
 
-int write_frame(AVCodecContext *codec_ctx, AVFormatContext *fmt_ctx,
-                AVFrame *frame) {
-  AVPacket pkt = {0};
-  /* av_init_packet(&pkt); */
-
-  int ret = avcodec_send_frame(codec_ctx, frame);
-  if (ret < 0) {
-    /* std::cout << "Error sending frame to codec context!" << std::endl; */
-    return ret;
+static void release_borrowed_image(void *opaque, std::uint8_t *) {
+  auto release = static_cast<std::function<void()> *>(opaque);
+  if (*release) {
+    (*release)();
   }
+  delete release;
+}
 
-  ret = avcodec_receive_packet(codec_ctx, &pkt);
-  if (ret < 0) {
-    /* std::cout << "Error receiving packet from codec context!" << std::endl;
-     */
-    return ret;
+AVFrame *wrap_borrowed_image(BorrowedImage image) {
+  AVFrame *frame = av_frame_alloc();
+  frame->width = image.width;
+  frame->height = image.height;
+  frame->format = static_cast<int>(image.format);
+  for (int i = 0; i < 4; ++i) {
+    frame->data[i] = const_cast<std::uint8_t *>(image.data[i]);
+    frame->linesize[i] = image.linesize[i];
   }
+  // a single buffer covering the first plane carries the release callback for
+  // all planes. readonly, so nothing downstream writes into caller memory.
+  auto release = new std::function<void()>(std::move(image.release));
+  frame->buf[0] = av_buffer_create(frame->data[0],
+                                   frame->linesize[0] * frame->height,
+                                   &release_borrowed_image, release,
+                                   AV_BUFFER_FLAG_READONLY);
+  if (!frame->buf[0]) {
+    release_borrowed_image(release, nullptr);
+    av_frame_free(&frame);
+    throw std::runtime_error("Could not wrap borrowed image");
+  }
+  return frame;
+}
 
-  av_write_frame(fmt_ctx, &pkt);
-
-  return ret;
+BorrowedImage borrow_mat(const cv::Mat &image, AVPixelFormat format,
+                         std::function<void()> release) {
+  BorrowedImage borrowed;
+  borrowed.data[0] = image.data;
+  borrowed.linesize[0] = static_cast<int>(image.step[0]);
+  borrowed.width = image.cols;
+  borrowed.height = image.rows;
+  borrowed.format = format;
+  borrowed.release = std::move(release);
+  return borrowed;
 }
 
 void generatePattern(cv::Mat &image, unsigned char i) {
@@ -145,33 +225,75 @@ void generatePattern(cv::Mat &image, unsigned char i) {
   image.col(perc_width * image.cols).setTo(cv::Scalar(0, 0, 0));
 }
 
-cv::Mat avframeYUV402p2Mat(const AVFrame *frame) {
-  std::vector<int> sizes = {frame->height, frame->width};
-  std::vector<size_t> steps{static_cast<size_t>(frame->linesize[0])};
-
-  const auto height = frame->height;
-  const auto width = frame->width;
-  const auto actual_size = cv::Size(width, height);
-  void *y = frame->data[0];
-  void *u = frame->data[1];
-  void *v = frame->data[2];
-
-  cv::Mat y_mat(height, width, CV_8UC1, y, frame->linesize[0]);
-  cv::Mat u_mat(height / 2, width / 2, CV_8UC1, u, frame->linesize[1]);
-  cv::Mat v_mat(height / 2, width / 2, CV_8UC1, v, frame->linesize[2]);
-  cv::Mat u_resized, v_resized;
-  cv::resize(u_mat, u_resized, actual_size, 0, 0,
-             cv::INTER_NEAREST); // repeat u values 4 times
-  cv::resize(v_mat, v_resized, actual_size, 0, 0,
-             cv::INTER_NEAREST); // repeat v values 4 times
-
-  cv::Mat yuv;
-
-  std::vector<cv::Mat> yuv_channels = {y_mat, u_resized, v_resized};
-  cv::merge(yuv_channels, yuv);
+cv::Mat bayer_mosaic(const cv::Mat &image, AVPixelFormat pattern) {
+  // BGR channel index of the top left, top right, bottom left, bottom right
+  // sample of each 2x2 cell
+  int channels[4];
+  switch (pattern) {
+  case AV_PIX_FMT_BAYER_BGGR8:
+    channels[0] = 0, channels[1] = 1, channels[2] = 1, channels[3] = 2;
+    break;
+  case AV_PIX_FMT_BAYER_RGGB8:
+    channels[0] = 2, channels[1] = 1, channels[2] = 1, channels[3] = 0;
+    break;
+  case AV_PIX_FMT_BAYER_GBRG8:
+    channels[0] = 1, channels[1] = 0, channels[2] = 2, channels[3] = 1;
+    break;
+  case AV_PIX_FMT_BAYER_GRBG8:
+    channels[0] = 1, channels[1] = 2, channels[2] = 0, channels[3] = 1;
+    break;
+  default:
+    throw std::invalid_argument("Not an 8 bit Bayer format");
+  }
+  cv::Mat mosaic(image.rows, image.cols, CV_8UC1);
+  for (int y = 0; y < image.rows; ++y) {
+    const std::uint8_t *in = image.ptr<std::uint8_t>(y);
+    std::uint8_t *out = mosaic.ptr<std::uint8_t>(y);
+    for (int x = 0; x < image.cols; ++x) {
+      out[x] = in[3 * x + channels[2 * (y % 2) + x % 2]];
+    }
+  }
+  return mosaic;
+}
 
+void avframe_to_bgr(const AVFrame *frame, cv::Mat &image, int channels) {
+  const int width = frame->width;
+  const int height = frame->height;
+  image.create(height, width, channels == 4 ? CV_8UC4 : CV_8UC3);
+  const auto format = static_cast<AVPixelFormat>(frame->format);
+  if (!is_yuv420_format(format)) {
+    // one per decoding thread, freed when the thread exits
+    thread_local std::unique_ptr<SwsContext, SwsContextDeleter> fallback;
+    // frees the previous context if it does not fit
+    fallback.reset(sws_getCachedContext(
+        fallback.release(), width, height, format, width, height,
+        channels == 4 ? AV_PIX_FMT_BGRA : AV_PIX_FMT_BGR24, SWS_BILINEAR,
+        nullptr, nullptr, nullptr));
+    if (!fallback) {
+      return;
+    }
+    std::uint8_t *dst[] = {image.data};
+    const int dst_stride[] = {static_cast<int>(image.step[0])};
+    sws_scale(fallback.get(), frame->data, frame->linesize, 0, height, dst,
+              dst_stride);
+    return;
+  }
+  // stripes of a few dozen rows, so each thread's input and output rows stay
+  // in cache
+  constexpr int rows_per_stripe = 32;
+  cv::parallel_for_(
+      cv::Range(0, height),
+      [&](const cv::Range &rows) {
+        convert_yuv420_to_bgr(frame->data, frame->linesize, width, rows.start,
+                              rows.end, format, image.data,
+                              static_cast<int>(image.step[0]), channels);
+      },
+      std::max(1, height / rows_per_stripe));
+}
+
+cv::Mat avframeYUV402p2Mat(const AVFrame *frame) {
   cv::Mat image;
-  cv::cvtColor(yuv, image, cv::COLOR_YUV2RGB);
+  avframe_to_bgr(frame, image);
   return image;
 }
 } // namespace avutils
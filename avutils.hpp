@@ -1,6 +1,10 @@
 #ifndef AVUTILS_HPP_L0JIDQTW
 #define AVUTILS_HPP_L0JIDQTW
 
+#include "codec_profile.hpp"
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <opencv2/core.hpp>
 
 extern "C" {
@@ -15,6 +19,22 @@ constexpr int KB = 1024;
 
 namespace avutils {
 
+/**
+ * @brief   Image memory owned by the caller which can be encoded without copying
+ * it first. Up to 4 planes, e.g. one for packed RGB, three for YUV420P.
+ */
+struct BorrowedImage {
+  const std::uint8_t *data[4] = {nullptr}; ///< plane pointers
+  int linesize[4] = {0};                   ///< plane strides in bytes
+  int width = 0;
+  int height = 0;
+  AVPixelFormat format = AV_PIX_FMT_NONE;
+  /// `tracing::now_ns()` at capture, for latency tracing. 0 if unknown.
+  std::int64_t captured_ns = 0;
+  /// called exactly once, when the data is no longer accessed
+  std::function<void()> release;
+};
+
 /**
  * @brief   Get string name of ffmpeg error code
  *
@@ -47,35 +67,92 @@ int initialize_avformat_context(AVFormatContext *&fctx,
  * @param target_bitrate    desired bitrate
  * @param gop_size  group-of-picture parameter (not sure if VP9 actually uses this, but
  * h264 does)
+ * @param pix_fmt   encoder input format
  */
 void set_codec_params(AVCodecContext *&codec_ctx, double width, double height,
-                      int fps, int target_bitrate = 0, int gop_size = 12);
+                      int fps, int target_bitrate = 0, int gop_size = 12,
+                      AVPixelFormat pix_fmt = AV_PIX_FMT_YUV420P);
 
 /**
- * @brief   Initialize an input or output stream. this sets all kinds of stream
- * parameters to minimize latency
+ * @brief   Open an encoder with options that minimize latency. Options the
+ * encoder does not know are logged and ignored. Outputs take their stream
+ * parameters from the opened context.
  *
- * @param stream    usually output stream for encoding
  * @param codec_ctx codec context
  * @param codec codec used
+ * @param options   encoder options, see \ref CodecProfile
  *
  * @return error code
  */
-int initialize_codec_stream(AVStream *&stream, AVCodecContext *&codec_ctx,
-                            AVCodec *&codec);
+int open_encoder(AVCodecContext *codec_ctx, const AVCodec *codec,
+                 const CodecOptions &options = CodecOptions());
 
 /**
- * @brief   Get a software scaling context that only does RGB conversion without
- * changing size
+ * @brief   Open a decoder for a stream, e.g. as described by an SDP file, set up
+ * for low delay
  *
- * @param codec_ctx encoding/decoding context
+ * @param codecpar  stream parameters
+ * @param partial_frames    packets may hold parts of a frame, e.g. single
+ * slices, which are decoded as they come. The frame is returned once its last
+ * part was sent.
+ * @param threads   slice threads, 0 to choose from the frame size
+ *
+ * @return  opened decoding context, to be freed with `avcodec_free_context()`
+ * @throw   std::invalid_argument if no decoder is available
+ */
+AVCodecContext *initialize_decoder(const AVCodecParameters *codecpar,
+                                   bool partial_frames = false,
+                                   int threads = 0);
+
+/**
+ * @brief   Take a new reference to a frame's buffers, e.g. to hand a decoded
+ * frame to another thread without copying it
+ *
+ * @return  frame freed with the last copy of the pointer, nullptr if out of
+ * memory
+ */
+std::shared_ptr<AVFrame> share_frame(const AVFrame *frame);
+
+/**
+ * @brief   Take the codec extradata a packet carries as
+ * `AV_PKT_DATA_NEW_EXTRADATA` side data, which keyframes have once the
+ * encoder was replaced
+ *
+ * @param pkt   packet to look at
+ * @param extradata   replaced by a padded copy if it differs, e.g. that of
+ * codec parameters
+ * @param extradata_size  replaced by its size
+ *
+ * @return  true if the packet had other extradata and it was copied
+ */
+bool take_new_extradata(const AVPacket *pkt, std::uint8_t *&extradata,
+                        int &extradata_size);
+
+/**
+ * @brief   Frees a software scaling context, e.g. a `thread_local` one when
+ * its thread exits
+ */
+struct SwsContextDeleter {
+  void operator()(SwsContext *context) const { sws_freeContext(context); }
+};
+
+/**
+ * @brief   Get a software scaling context that only does colour conversion
+ * without changing size
+ *
+ * @param dst_format    output pixel format, e.g. the encoder's
  * @param width input and output width
  * @param height input and output height
+ * @param src_format    input pixel format
+ * @param previous  context to reuse if its parameters match, otherwise it is
+ * freed
  *
  * @return pointer to sws context
  */
-SwsContext *initialize_sample_scaler(AVCodecContext *codec_ctx, double width,
-                                     double height);
+SwsContext *initialize_sample_scaler(AVPixelFormat dst_format, double width,
+                                     double height,
+                                     AVPixelFormat src_format = AV_PIX_FMT_RGB24,
+                                     SwsContext *previous = nullptr);
 
 /**
  * @brief   Create a new frame and allocate the `data` field. The data pointers and the
@@ -91,16 +168,27 @@ AVFrame *allocate_frame_buffer(AVCodecContext *codec_ctx, double width,
                                double height);
 
 /**
- * @brief   Send frame to encoding context and send resulting packet to format context.
+ * @brief   Wrap caller-owned memory in a refcounted frame without copying.
+ * `image.release` runs when the last reference to the frame is dropped, e.g.
+ * once the encoder is done with it.
  *
- * @param codec_ctx encoding ctx
- * @param fmt_ctx   output format ctx
- * @param frame Frame to send
+ * @param image Borrowed image
  *
- * @return  0 on success, < 0 on error
+ * @return new frame, to be freed with `av_frame_free()`
  */
-int write_frame(AVCodecContext *codec_ctx, AVFormatContext *fmt_ctx,
-                AVFrame *frame);
+AVFrame *wrap_borrowed_image(BorrowedImage image);
+
+/**
+ * @brief   Describe an opencv Mat as borrowed image
+ *
+ * @param image Packed single-plane image
+ * @param format    Pixel format of \ref image
+ * @param release   Called when the data is no longer accessed
+ *
+ * @return  borrowed image pointing into \ref image
+ */
+BorrowedImage borrow_mat(const cv::Mat &image, AVPixelFormat format,
+                         std::function<void()> release = nullptr);
 
 /**
  * @brief   Generate dummy data in opencv mat
@@ -110,6 +198,29 @@ int write_frame(AVCodecContext *codec_ctx, AVFormatContext *fmt_ctx,
  */
 void generatePattern(cv::Mat &image, unsigned char i);
 
+/**
+ * @brief   Sample a colour image with a Bayer colour filter, to simulate raw
+ * camera output
+ *
+ * @param image BGR8 image
+ * @param pattern   One of the 8 bit `AV_PIX_FMT_BAYER_*` formats
+ *
+ * @return  Single channel Bayer image
+ */
+cv::Mat bayer_mosaic(const cv::Mat &image, AVPixelFormat pattern);
+
+/**
+ * @brief   Convert decoded frame to BGR8 or BGRA8 in a single pass, splitting
+ * the rows across opencv's thread pool. YUV420P and NV12 use the kernels in
+ * colorconv.hpp, other formats go through swscale.
+ *
+ * @param frame Input frame (decoded from stream)
+ * @param image Output, only reallocated if size or type don't match, so reusing
+ * it across frames avoids allocations
+ * @param channels  3 for BGR, 4 for BGRA
+ */
+void avframe_to_bgr(const AVFrame *frame, cv::Mat &image, int channels = 3);
+
 /**
  * @brief   Convert frame in planar yuv 402 pixel format to opencv Mat (BGR8 interleaved)
  *
@@ -0,0 +1,1185 @@
+#include "avreceiver.hpp"
+#include "avtransmitter.hpp"
+#include "avutils.hpp"
+#include "capture_service.hpp"
+#include "colorconv.hpp"
+#include "feedback.hpp"
+#include "frame_pacer.hpp"
+#include "mailbox.hpp"
+#include "recording_sink.hpp"
+#include "rtpreceiver.hpp"
+#include "simulated_source.hpp"
+#include "simulcast.hpp"
+#include "threading.hpp"
+#include "tracing.hpp"
+#include "udp_relay.hpp"
+#include "zmq_sink.hpp"
+#include <algorithm>
+#include <atomic>
+#include <boost/thread/sync_bounded_queue.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <opencv2/core.hpp>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+/**
+ * @brief   Headless loopback benchmark: synthetic frames are encoded with
+ * AVTransmitter, sent over RTP (or ZeroMQ) to localhost, received and decoded
+ * with RTPReceiver (or AVReceiver) in the same process. Reports glass-to-glass latency, achieved
+ * fps, time per stage and bytes per frame. Exits with 1 if a latency or frame
+ * loss limit given on the command line is exceeded, so it can gate
+ * regressions.
+ */
+
+namespace {
+
+struct Options {
+  int width = 1280;
+  int height = 720;
+  int fps = 30;
+  int bitrate = 4'000'000;
+  int gop = 10;
+  std::string codec = "vp9";
+  double seconds = 10;
+  int warmup = 30; ///< frames excluded from the results
+  int port = 5006;
+  int sinks = 1; ///< RTP destinations fed by the one encoder
+  int downscale = 1; ///< stream size divisor
+  int simulcast = 1; ///< layers, each half the size of the previous
+  ScaleFilter scale_filter = ScaleFilter::Area;
+  EncoderThreading threading; ///< single stream, chosen automatically
+  bool sweep = false;         ///< run once per thread count
+  int slice_size = 0; ///< H.264 slice size cap, RTP receiver decodes slices
+  std::string camera;      ///< simulated camera format, empty for none
+  double camera_jitter_ms = 0;
+  double camera_drop_pct = 0;
+  int cameras = 0; ///< simulated cameras sharing an encoder pool, 0 for none
+  int workers = 0; ///< of that pool, 0 for one per camera up to the cores
+  std::string record; ///< directory to record to as well, empty for none
+  std::string transport = "rtp"; ///< rtp, tcp or inproc
+  ZmqDelivery delivery = ZmqDelivery::Latest;
+  bool pipelined = false;
+  bool feedback = false;     ///< receiver requests keyframes after loss
+  bool adaptive = false;     ///< rate control from receiver reports
+  int min_bitrate = 0;       ///< for rate control, 0 for a tenth of the bitrate
+  double loss_pct = 0;       ///< RTP: datagrams lost on the way
+  double delay_ms = 0;       ///< RTP: one way delay
+  int rate_kbps = 0;         ///< RTP: link capacity, 0 for unlimited
+  double reorder_pct = 0;    ///< RTP: datagrams overtaken by later ones
+  double reorder_ms = 5;     ///< RTP: by how much
+  double fec_pct = 0;        ///< RTP: FEC packets per 100 media packets
+  JitterBufferConfig jitter; ///< RTP: receiver's wait for reordered packets
+  std::string trace;
+  double max_p99_ms = 0;         ///< fail if exceeded, 0 to disable
+  double max_loss_pct = 0;       ///< fail if exceeded, 0 to disable
+  int soak_frames = 0;           ///< only encode, watching memory
+  double max_rss_growth_mb = 16; ///< soak fails if memory grows more
+  bool handoff = false;          ///< only compare frame handoffs
+  double consumer_ms = 50;       ///< time the handoff consumer takes a frame
+  bool check_convert = false;    ///< only compare SIMD and scalar conversion
+};
+
+void usage(const char *name) {
+  std::cout
+      << "Usage: " << name << " [--option=value ...]\n"
+      << "  --width=1280 --height=720  frame size\n"
+      << "  --fps=30                   send rate\n"
+      << "  --bitrate=4000000          target bitrate\n"
+      << "  --gop=10                   keyframe interval\n"
+      << "  --codec=vp9                codec profile, one of";
+  for (const auto &name : codec_profile_names()) {
+    std::cout << " " << name;
+  }
+  std::cout
+      << "\n"
+      << "  --seconds=10               measured duration\n"
+      << "  --warmup=30                frames sent before measuring\n"
+      << "  --port=5006                local RTP port, must be even\n"
+      << "  --sinks=1                  RTP destinations, the extra ones go to\n"
+      << "                             the following even ports\n"
+      << "  --downscale=1              encode at 1/n of the frame size\n"
+      << "  --scale-filter=area        fast, bilinear, area or bicubic\n"
+      << "  --simulcast=1              layers, each half the size of the\n"
+      << "                             previous; the receiver gets the first\n"
+      << "  --threads=0                encoder threads, 0 for automatic\n"
+      << "  --tile-columns=-1          log2 tile columns (VP9, AV1), -1 for\n"
+      << "                             automatic; --tile-rows likewise\n"
+      << "  --sweep=false              run once per thread count up to the\n"
+      << "                             cores and compare latency and CPU\n"
+      << "  --slice-size=0             h264: max bytes per slice, the RTP\n"
+      << "                             receiver decodes slices as they come\n"
+      << "  --camera=<format>          grab frames from a simulated camera\n"
+      << "                             (bayer, rgb or mono) instead of sending\n"
+      << "                             them at the frame rate\n"
+      << "  --camera-jitter-ms=0       its frames arrive up to this late\n"
+      << "  --camera-drop-pct=0        it loses this share of frames\n"
+      << "  --cameras=0                instead, stream this many simulated\n"
+      << "                             cameras from one encoder pool\n"
+      << "  --workers=0                encoding threads of that pool, 0 for\n"
+      << "                             one per camera up to the cores\n"
+      << "  --record=<dir>             also record to this directory\n"
+      << "  --transport=rtp            rtp, or tcp/inproc for ZeroMQ\n"
+      << "  --delivery=latest          ZeroMQ: latest or reliable\n"
+      << "  --pipelined=false          use the transmitter's pipeline\n"
+      << "  --feedback=false           request keyframes after loss\n"
+      << "  --adaptive=false           adapt the bitrate to receiver reports,\n"
+      << "                             implies --feedback\n"
+      << "  --min-bitrate=<bitrate/10> lowest bitrate for --adaptive\n"
+      << "  --loss-pct=0               RTP: relay through a lossy link, drop\n"
+      << "                             this share of datagrams\n"
+      << "  --delay-ms=0               RTP: delay of that link\n"
+      << "  --rate-kbps=0              RTP: capacity of that link, 0 for\n"
+      << "                             unlimited\n"
+      << "  --reorder-pct=0            RTP: hold back this share of datagrams\n"
+      << "  --reorder-ms=5             RTP: by this long\n"
+      << "  --fec-pct=0                RTP: send this many FEC packets per\n"
+      << "                             100 media packets, at least one per\n"
+      << "                             frame\n"
+      << "  --jitter-min-ms=2          RTP: receiver waits for a missing\n"
+      << "                             packet at least this long\n"
+      << "  --jitter-max-ms=100        RTP: and at most this long\n"
+      << "  --trace=<file>             write a Chrome trace\n"
+      << "  --max-p99-ms=<ms>          fail if p99 latency is higher\n"
+      << "  --max-loss-pct=<percent>   fail if more frames are lost\n"
+      << "  --soak-frames=0            instead, encode this many frames as\n"
+      << "                             fast as possible and watch memory\n"
+      << "  --max-rss-growth-mb=16     fail the soak if memory grows more\n"
+      << "  --handoff=false            instead, compare handing frames to a\n"
+      << "                             slow consumer through a queue and a\n"
+      << "                             mailbox\n"
+      << "  --consumer-ms=50           time that consumer takes per frame\n"
+      << "  --check-convert=false      instead, check that the vectorized\n"
+      << "                             colour conversions match the scalar\n"
+      << "                             ones\n";
+}
+
+Options parse_options(int argc, char *argv[]) {
+  std::map<std::string, std::string> values;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const auto equals = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || equals == std::string::npos) {
+      throw std::invalid_argument("Malformed option " + arg);
+    }
+    values[arg.substr(2, equals - 2)] = arg.substr(equals + 1);
+  }
+  Options options;
+  const auto take_int = [&](const std::string &key, int &value) {
+    auto it = values.find(key);
+    if (it != values.end()) {
+      value = std::stoi(it->second);
+      values.erase(it);
+    }
+  };
+  const auto take_double = [&](const std::string &key, double &value) {
+    auto it = values.find(key);
+    if (it != values.end()) {
+      value = std::stod(it->second);
+      values.erase(it);
+    }
+  };
+  take_int("width", options.width);
+  take_int("height", options.height);
+  take_int("fps", options.fps);
+  take_int("bitrate", options.bitrate);
+  take_int("gop", options.gop);
+  take_double("seconds", options.seconds);
+  take_int("warmup", options.warmup);
+  take_int("port", options.port);
+  take_int("sinks", options.sinks);
+  take_int("downscale", options.downscale);
+  take_int("simulcast", options.simulcast);
+  take_int("threads", options.threading.threads);
+  take_int("tile-columns", options.threading.tile_columns);
+  take_int("tile-rows", options.threading.tile_rows);
+  take_int("slice-size", options.slice_size);
+  take_double("camera-jitter-ms", options.camera_jitter_ms);
+  take_double("camera-drop-pct", options.camera_drop_pct);
+  take_double("max-p99-ms", options.max_p99_ms);
+  take_double("max-loss-pct", options.max_loss_pct);
+  take_int("soak-frames", options.soak_frames);
+  take_int("cameras", options.cameras);
+  take_int("workers", options.workers);
+  take_double("max-rss-growth-mb", options.max_rss_growth_mb);
+  take_int("min-bitrate", options.min_bitrate);
+  take_double("loss-pct", options.loss_pct);
+  take_double("delay-ms", options.delay_ms);
+  take_int("rate-kbps", options.rate_kbps);
+  take_double("reorder-pct", options.reorder_pct);
+  take_double("reorder-ms", options.reorder_ms);
+  take_double("fec-pct", options.fec_pct);
+  double jitter_min_ms = 2;
+  double jitter_max_ms = 100;
+  take_double("jitter-min-ms", jitter_min_ms);
+  take_double("jitter-max-ms", jitter_max_ms);
+  options.jitter.min_delay =
+      std::chrono::microseconds(static_cast<long>(jitter_min_ms * 1e3));
+  options.jitter.max_delay =
+      std::chrono::microseconds(static_cast<long>(jitter_max_ms * 1e3));
+  take_double("consumer-ms", options.consumer_ms);
+  auto it = values.find("pipelined");
+  if (it != values.end()) {
+    options.pipelined = it->second == "true";
+    values.erase(it);
+  }
+  it = values.find("handoff");
+  if (it != values.end()) {
+    options.handoff = it->second == "true";
+    values.erase(it);
+  }
+  it = values.find("check-convert");
+  if (it != values.end()) {
+    options.check_convert = it->second == "true";
+    values.erase(it);
+  }
+  it = values.find("feedback");
+  if (it != values.end()) {
+    options.feedback = it->second == "true";
+    values.erase(it);
+  }
+  it = values.find("adaptive");
+  if (it != values.end()) {
+    options.adaptive = it->second == "true";
+    // reports travel over the feedback channel
+    options.feedback = options.feedback || options.adaptive;
+    values.erase(it);
+  }
+  it = values.find("sweep");
+  if (it != values.end()) {
+    options.sweep = it->second == "true";
+    values.erase(it);
+  }
+  it = values.find("scale-filter");
+  if (it != values.end()) {
+    options.scale_filter = scale_filter(it->second);
+    values.erase(it);
+  }
+  it = values.find("camera");
+  if (it != values.end()) {
+    options.camera = it->second;
+    if (options.camera != "bayer" && options.camera != "rgb" &&
+        options.camera != "mono") {
+      throw std::invalid_argument("Unknown camera format " + options.camera);
+    }
+    values.erase(it);
+  }
+  if (options.camera_drop_pct >= 100) {
+    throw std::invalid_argument("The camera must deliver some frames");
+  }
+  it = values.find("codec");
+  if (it != values.end()) {
+    options.codec = it->second;
+    values.erase(it);
+  }
+  it = values.find("transport");
+  if (it != values.end()) {
+    options.transport = it->second;
+    if (options.transport != "rtp" && options.transport != "tcp" &&
+        options.transport != "inproc") {
+      throw std::invalid_argument("Unknown transport " + options.transport);
+    }
+    values.erase(it);
+  }
+  it = values.find("delivery");
+  if (it != values.end()) {
+    if (it->second == "reliable") {
+      options.delivery = ZmqDelivery::Reliable;
+    } else if (it->second != "latest") {
+      throw std::invalid_argument("Unknown delivery " + it->second);
+    }
+    values.erase(it);
+  }
+  it = values.find("trace");
+  if (it != values.end()) {
+    options.trace = it->second;
+    values.erase(it);
+  }
+  it = values.find("record");
+  if (it != values.end()) {
+    options.record = it->second;
+    values.erase(it);
+  }
+  if (!values.empty()) {
+    throw std::invalid_argument("Unknown option --" + values.begin()->first);
+  }
+  if (options.transport != "rtp" &&
+      (options.loss_pct > 0 || options.delay_ms > 0 || options.rate_kbps > 0 ||
+       options.reorder_pct > 0)) {
+    throw std::invalid_argument("Link impairments need --transport=rtp");
+  }
+  if (options.transport != "rtp" && options.fec_pct > 0) {
+    throw std::invalid_argument("FEC needs --transport=rtp");
+  }
+  return options;
+}
+
+/**
+ * @brief   Outcome of one measurement, for comparing configurations
+ */
+struct Result {
+  bool passed; ///< no limit exceeded
+  double p50_ms;
+  double p99_ms;
+  double cpu_ms_per_frame;
+  double fps;
+  EncoderThreading threading; ///< as the encoder resolved it
+};
+
+/**
+ * @brief   Generate a frame with some texture, motion and noise, so the
+ * encoder does real work instead of coding a static image
+ *
+ * @param width
+ * @param height
+ * @param index   frame number, determines motion
+ *
+ * @return  RGB8 image
+ */
+cv::Mat synthetic_frame(int width, int height, int index) {
+  cv::Mat image(height, width, CV_8UC3);
+  for (int y = 0; y < height; ++y) {
+    auto *row = image.ptr<std::uint8_t>(y);
+    for (int x = 0; x < width; ++x) {
+      row[3 * x + 0] = static_cast<std::uint8_t>(x + 4 * index);
+      row[3 * x + 1] = static_cast<std::uint8_t>(y + 2 * index);
+      row[3 * x + 2] = static_cast<std::uint8_t>((x ^ y) + index);
+    }
+  }
+  // a moving block of noise, which is expensive to code
+  const int size = std::min(width, height) / 4;
+  const int x = (index * 8) % std::max(1, width - size);
+  const int y = (index * 4) % std::max(1, height - size);
+  cv::Mat block = image(cv::Rect(x, y, size, size));
+  cv::randu(block, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::Mat corner = image(cv::Rect(0, 0, width / 4, height / 4));
+  avutils::generatePattern(corner, static_cast<unsigned char>(index));
+  return image;
+}
+
+/**
+ * @brief   Get CPU time of the whole process in seconds
+ */
+double process_cpu_seconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * @brief   Send frames through the transmitter to a receiver and report
+ *
+ * @tparam Sender  AVTransmitter or Simulcast
+ * @tparam Receiver    RTPReceiver or AVReceiver
+ * @param sender    what frames are handed to
+ * @param transmitter   the stream the receiver gets, for stats
+ * @param camera    where frames come from, or nullptr to send the given
+ * frames at the frame rate
+ *
+ * @return  summary, not passed if a limit was exceeded
+ */
+template <typename Sender, typename Receiver>
+Result measure(const Options &options, Sender &sender,
+             AVTransmitter &transmitter, Receiver &receiver,
+             FrameSource *camera, const std::vector<cv::Mat> &frames) {
+  bool failed = false;
+  std::thread consumer([&]() {
+    while (true) {
+      auto frame = receiver.get_frame();
+      if (frame.image.empty()) {
+        break;
+      }
+      // headless, so handing the image over is the presentation
+      const std::int64_t presented = tracing::now_ns();
+      tracing::record(tracing::Stage::Present, frame.frame_id, presented,
+                      presented);
+    }
+  });
+
+  const int measured = static_cast<int>(options.seconds * options.fps);
+  const int total = options.warmup + measured;
+  // every frame is sent, so overruns show up as latency
+  FramePacer pacer(options.fps, 1, OverrunPolicy::CatchUp);
+  if (camera) {
+    camera->start();
+  }
+  double cpu_begin = 0;
+  std::chrono::steady_clock::time_point measure_begin;
+  auto stats_begin = transmitter.get_stats();
+  auto received_begin = receiver.get_stats();
+  for (int i = 0; i < total; ++i) {
+    if (i == options.warmup) {
+      tracing::reset();
+      cpu_begin = process_cpu_seconds();
+      measure_begin = std::chrono::steady_clock::now();
+      stats_begin = transmitter.get_stats();
+      received_begin = receiver.get_stats();
+      pacer.reset();
+    }
+    avutils::BorrowedImage borrowed;
+    if (camera) {
+      // the camera sets the pace, lost and incomplete frames don't count
+      while (camera->grab(std::chrono::seconds(1), borrowed) !=
+             GrabStatus::Ok) {
+      }
+    } else {
+      pacer.wait();
+      borrowed = avutils::borrow_mat(frames[i % frames.size()],
+                                     AV_PIX_FMT_RGB24);
+      borrowed.captured_ns = tracing::now_ns();
+    }
+    if (options.pipelined) {
+      sender.submit_frame(std::move(borrowed));
+    } else {
+      sender.encode_frame(std::move(borrowed));
+    }
+  }
+  const double elapsed =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                    measure_begin)
+          .count();
+  sender.stop_pipeline();
+  if (camera) {
+    camera->stop();
+  }
+  // let the last frames arrive
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  const double cpu = process_cpu_seconds() - cpu_begin;
+  const auto sent = transmitter.get_stats();
+  const auto received = receiver.get_stats();
+  receiver.setStop();
+  consumer.join();
+
+  const std::uint64_t frames_received = received.frames_decoded - received_begin.frames_decoded;
+  const std::uint64_t frames_sent =
+      sent.frames_encoded - stats_begin.frames_encoded;
+  const double bytes_per_frame =
+      frames_sent > 0
+          ? double(sent.bytes_sent - stats_begin.bytes_sent) / frames_sent
+          : 0;
+
+  // frames already in flight when measuring began have partial traces,
+  // only keep frames captured after that
+  auto spans = tracing::collect();
+  std::int64_t first_id = std::numeric_limits<std::int64_t>::max();
+  for (const auto &span : spans) {
+    if (span.stage == tracing::Stage::Capture) {
+      first_id = std::min(first_id, span.frame_id);
+    }
+  }
+  spans.erase(std::remove_if(spans.begin(), spans.end(),
+                             [&](const tracing::Span &span) {
+                               return span.frame_id < first_id;
+                             }),
+              spans.end());
+  const tracing::Report report = tracing::summarize(spans);
+
+  std::cout << options.width << "x" << options.height;
+  if (transmitter.width() != static_cast<unsigned int>(options.width)) {
+    std::cout << " -> " << transmitter.width() << "x" << transmitter.height();
+  }
+  if (options.simulcast > 1) {
+    std::cout << " (" << options.simulcast << " layers)";
+  }
+  std::cout << " @ "
+            << options.fps << " fps, " << options.bitrate / 1e6
+            << " Mbit/s, " << options.codec << ", "
+            << (options.pipelined ? "pipelined" : "sync") << ", "
+            << options.transport << ", "
+            << options.sinks << (options.sinks > 1 ? " sinks" : " sink")
+            << "\n";
+  tracing::print_report(report, std::cout);
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "sent " << frames_sent << " frames, received "
+            << frames_received << ", dropped by sender "
+            << sent.frames_dropped - stats_begin.frames_dropped
+            << ", packets dropped by sinks "
+            << sent.packets_dropped - stats_begin.packets_dropped << "\n";
+  if (options.feedback) {
+    std::cout << "keyframes requested "
+              << received.keyframe_requests - received_begin.keyframe_requests
+              << ", forced "
+              << sent.keyframes_forced - stats_begin.keyframes_forced << "\n";
+  }
+  if (options.adaptive) {
+    std::cout << "bitrate changes "
+              << sent.bitrate_changes - stats_begin.bitrate_changes
+              << ", final bitrate " << sent.target_bitrate / 1e6
+              << " Mbit/s\n";
+  }
+  const auto pacing = pacer.get_stats();
+  std::cout << "achieved fps " << frames_received / elapsed << ", "
+            << pacing.late << " frames sent late (worst "
+            << pacing.max_lateness_ns / 1e6 << " ms)\n";
+  if (camera) {
+    const auto grabbed = camera->get_stats();
+    std::cout << "camera dropped " << grabbed.dropped << " frames, "
+              << grabbed.incomplete << " incomplete\n";
+  }
+  std::cout << "bytes/frame " << bytes_per_frame << ", encoder delay "
+            << sent.encoder_delay << " frames\n";
+  std::cout << "process cpu ms/frame "
+            << (frames_sent > 0 ? 1e3 * cpu / frames_sent : 0) << "\n";
+  // wall time spent in each stage per frame, the share of a core it needs
+  for (int s = 0; s < tracing::stage_count; ++s) {
+    std::int64_t busy = 0;
+    for (const auto &span : spans) {
+      if (static_cast<int>(span.stage) == s) {
+        busy += span.end_ns - span.begin_ns;
+      }
+    }
+    if (busy > 0 && frames_sent > 0) {
+      std::cout << "  " << std::left << std::setw(14)
+                << tracing::stage_name(static_cast<tracing::Stage>(s))
+                << std::right << busy / 1e6 / frames_sent << " ms/frame\n";
+    }
+  }
+  std::cout << std::flush;
+
+  if (!options.trace.empty()) {
+    std::ofstream ofs(options.trace);
+    tracing::write_chrome_trace(spans, ofs);
+  }
+
+  const double p99_ms = report.end_to_end.percentile(99) / 1e6;
+  if (options.max_p99_ms > 0 && p99_ms > options.max_p99_ms) {
+    std::cout << "FAIL: p99 latency " << p99_ms << " ms > "
+              << options.max_p99_ms << " ms" << std::endl;
+    failed = true;
+  }
+  const double loss_pct =
+      frames_sent > 0
+          ? 100.0 * (double(frames_sent) - double(frames_received)) /
+                frames_sent
+          : 100.0;
+  if (options.max_loss_pct > 0 && loss_pct > options.max_loss_pct) {
+    std::cout << "FAIL: lost " << loss_pct << "% of frames > "
+              << options.max_loss_pct << "%" << std::endl;
+    failed = true;
+  }
+  // the pools have grown to their steady size during the warm-up
+  const std::uint64_t allocated =
+      received.allocations - received_begin.allocations;
+  if (options.warmup > 0 && allocated > 0) {
+    std::cout << "FAIL: receiver allocated " << allocated
+              << " images after warm-up" << std::endl;
+    failed = true;
+  }
+  Result result;
+  result.passed = !failed;
+  result.p50_ms = report.end_to_end.percentile(50) / 1e6;
+  result.p99_ms = p99_ms;
+  result.cpu_ms_per_frame = frames_sent > 0 ? 1e3 * cpu / frames_sent : 0;
+  result.fps = frames_received / elapsed;
+  result.threading = transmitter.threading();
+  return result;
+}
+
+/**
+ * @brief   Get the resident set size of the process in bytes
+ */
+long resident_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  long pages = 0;
+  long resident = 0;
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief   Encode frames without pacing or receiver and watch the resident
+ * size, to catch leaks that only show over millions of frames. The first
+ * sample, after 5% of the frames, is the baseline: by then buffers and pools
+ * have grown to their steady size.
+ *
+ * @return  false if memory grew by more than allowed
+ */
+bool soak(const Options &options, const std::vector<cv::Mat> &frames) {
+  AVTransmitter transmitter(options.fps, options.gop, options.bitrate,
+                            options.codec);
+  transmitter.set_threading(options.threading);
+  // nobody listens, but packetizing and sending costs the same
+  transmitter.add_sink(std::make_shared<RtpSink>("127.0.0.1", options.port),
+                       0);
+  if (options.pipelined) {
+    // blocking, so frames go through every stage instead of being dropped
+    transmitter.start_pipeline(2, DropPolicy::Block);
+  }
+  const int sample_every = std::max(1, options.soak_frames / 20);
+  long baseline = 0;
+  long peak = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < options.soak_frames; ++i) {
+    const cv::Mat &frame = frames[i % frames.size()];
+    if (options.pipelined) {
+      transmitter.submit_frame(frame);
+    } else {
+      transmitter.encode_frame(frame);
+    }
+    if ((i + 1) % sample_every == 0) {
+      const long rss = resident_bytes();
+      baseline = baseline > 0 ? baseline : rss;
+      peak = std::max(peak, rss);
+      std::cout << i + 1 << " frames, resident " << rss / 1e6 << " MB"
+                << std::endl;
+    }
+  }
+  transmitter.flush();
+  const double elapsed = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  const auto stats = transmitter.get_stats();
+  const double growth_mb = (peak - baseline) / 1e6;
+  std::cout << std::fixed << std::setprecision(2) << "encoded "
+            << stats.frames_encoded << " frames at "
+            << stats.frames_encoded / elapsed << " fps, encoder delay "
+            << stats.encoder_delay << " frames, memory grew by " << growth_mb
+            << " MB" << std::endl;
+  if (growth_mb > options.max_rss_growth_mb) {
+    std::cout << "FAIL: memory grew by more than "
+              << options.max_rss_growth_mb << " MB" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief   Stream several simulated cameras through a CaptureService, each to
+ * a port nobody listens on, and report every stream
+ *
+ * @return  false if a stream's p99 latency is over --max-p99-ms
+ */
+bool capture(const Options &options) {
+  CaptureService service(static_cast<unsigned int>(options.workers));
+  for (int i = 0; i < options.cameras; ++i) {
+    SimulatedCamera config;
+    config.width = options.width / 2 * 2;
+    config.height = options.height / 2 * 2;
+    config.fps = options.fps;
+    config.seed = static_cast<unsigned int>(i);
+    config.jitter = std::chrono::microseconds(
+        static_cast<long>(options.camera_jitter_ms * 1e3));
+    config.drop_probability = options.camera_drop_pct / 100;
+    std::unique_ptr<AVTransmitter> transmitter(new AVTransmitter(
+        options.fps, options.gop, options.bitrate, options.codec));
+    transmitter->add_sink(
+        std::make_shared<RtpSink>("127.0.0.1", options.port + 2 * i), 0);
+    service.add_stream(
+        std::unique_ptr<FrameSource>(new SimulatedSource(config)),
+        std::move(transmitter),
+        std::chrono::nanoseconds(1'000'000'000 / options.fps));
+  }
+  service.start();
+  std::this_thread::sleep_for(
+      std::chrono::duration<double>(options.seconds));
+  service.stop();
+  std::cout << "stream       fps   p50 ms   p99 ms   late  replaced\n";
+  bool passed = true;
+  double total_fps = 0;
+  for (const auto &stream : service.get_stats()) {
+    std::cout << std::fixed << std::setprecision(2) << std::setw(6)
+              << stream.name << std::setw(10) << stream.fps << std::setw(9)
+              << stream.p50_ms << std::setw(9) << stream.p99_ms
+              << std::setw(7) << stream.late << std::setw(10)
+              << stream.replaced << "\n";
+    total_fps += stream.fps;
+    if (options.max_p99_ms > 0 && stream.p99_ms > options.max_p99_ms) {
+      passed = false;
+    }
+  }
+  std::cout << "total " << total_fps << " fps" << std::endl;
+  if (!passed) {
+    std::cout << "FAIL: p99 latency over " << options.max_p99_ms << " ms"
+              << std::endl;
+  }
+  return passed;
+}
+
+/**
+ * @brief   What a consumer got handed in \ref handoff()
+ */
+struct Handoff {
+  tracing::Histogram age_ns; ///< how old a frame was when taken
+  std::uint64_t produced = 0;
+  std::uint64_t consumed = 0;
+  std::uint64_t dropped = 0;
+};
+
+/**
+ * @brief   Hand timestamps from a producer at the frame rate to a consumer
+ * taking --consumer-ms for each, like a receiver handing frames to a slow
+ * display
+ *
+ * @param put   hands over a timestamp, true if an older one was dropped
+ * @param get   takes one, waiting if needed, false once closed
+ * @param close wakes the consumer up for good
+ */
+template <typename Put, typename Get, typename Close>
+Handoff measure_handoff(const Options &options, Put put, Get get,
+                        Close close) {
+  Handoff result;
+  std::thread consumer([&]() {
+    std::int64_t stamp = 0;
+    while (get(stamp)) {
+      result.age_ns.add(tracing::now_ns() - stamp);
+      ++result.consumed;
+      std::this_thread::sleep_for(
+          std::chrono::duration<double, std::milli>(options.consumer_ms));
+    }
+  });
+  FramePacer pacer(options.fps, 1, OverrunPolicy::CatchUp);
+  const auto end = std::chrono::steady_clock::now() +
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::duration<double>(options.seconds));
+  while (std::chrono::steady_clock::now() < end) {
+    pacer.wait();
+    result.dropped += put(tracing::now_ns()) ? 1 : 0;
+    ++result.produced;
+  }
+  close();
+  consumer.join();
+  return result;
+}
+
+/**
+ * @brief   Compare the latency a slow consumer sees through the bounded queue
+ * the receivers used to hand frames over with, dropping the oldest when
+ * full, and through the \ref Mailbox they use now
+ */
+void handoff(const Options &options) {
+  boost::sync_bounded_queue<std::int64_t> queue(5);
+  const Handoff queued = measure_handoff(
+      options,
+      [&queue](std::int64_t stamp) {
+        bool dropped = false;
+        while (queue.try_push_back(stamp) == boost::queue_op_status::full) {
+          std::int64_t stale;
+          dropped = queue.try_pull_front(stale) ==
+                        boost::queue_op_status::success ||
+                    dropped;
+        }
+        return dropped;
+      },
+      [&queue](std::int64_t &stamp) {
+        return queue.wait_pull_front(stamp) ==
+               boost::queue_op_status::success;
+      },
+      [&queue]() { queue.close(); });
+
+  Mailbox<std::int64_t> mailbox;
+  const Handoff latest = measure_handoff(
+      options,
+      [&mailbox](std::int64_t stamp) {
+        const std::uint64_t before = mailbox.dropped();
+        mailbox.put(stamp);
+        return mailbox.dropped() != before;
+      },
+      [&mailbox](std::int64_t &stamp) {
+        while (!mailbox.get_latest(stamp, std::chrono::milliseconds(100))) {
+          if (mailbox.closed()) {
+            return false;
+          }
+        }
+        return true;
+      },
+      [&mailbox]() { mailbox.close(); });
+
+  std::cout << options.fps << " fps to a consumer taking "
+            << options.consumer_ms << " ms\n"
+            << "handoff   taken  dropped  p50 ms  p99 ms\n";
+  const auto print = [](const char *name, const Handoff &handoff) {
+    std::cout << std::fixed << std::setprecision(2) << std::setw(7) << name
+              << std::setw(8) << handoff.consumed << std::setw(9)
+              << handoff.dropped << std::setw(8)
+              << handoff.age_ns.percentile(50) / 1e6 << std::setw(8)
+              << handoff.age_ns.percentile(99) / 1e6 << "\n";
+  };
+  print("queue", queued);
+  print("mailbox", latest);
+  std::cout << std::flush;
+}
+
+/**
+ * @brief   Compare the vectorized colour conversions with their scalar
+ * references on random images, at widths with and without a remainder
+ * after the vector loop: raw camera frames in every Bayer order and mono
+ * (which must have even sizes) to YUV 4:2:0, and YUV 4:2:0 of any size to
+ * BGR and BGRA
+ *
+ * @return  true if all outputs are identical
+ */
+bool check_conversions() {
+  const auto same = [](const cv::Mat &a, const cv::Mat &b) {
+    for (int y = 0; y < a.rows; ++y) {
+      if (std::memcmp(a.ptr<std::uint8_t>(y), b.ptr<std::uint8_t>(y),
+                      a.cols * a.elemSize()) != 0) {
+        return false;
+      }
+    }
+    return true;
+  };
+  int mismatches = 0;
+  const AVPixelFormat raw_formats[] = {
+      AV_PIX_FMT_BAYER_BGGR8, AV_PIX_FMT_BAYER_RGGB8, AV_PIX_FMT_BAYER_GBRG8,
+      AV_PIX_FMT_BAYER_GRBG8, AV_PIX_FMT_GRAY8};
+  const AVPixelFormat yuv_formats[] = {AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12};
+  for (const int width : {2, 14, 16, 18, 30, 34, 66, 1282}) {
+    const int height = 6;
+    cv::Mat colour(height, width, CV_8UC3);
+    cv::randu(colour, cv::Scalar::all(0), cv::Scalar::all(256));
+    for (const AVPixelFormat raw_format : raw_formats) {
+      cv::Mat raw;
+      if (raw_format == AV_PIX_FMT_GRAY8) {
+        raw.create(height, width, CV_8UC1);
+        cv::randu(raw, cv::Scalar::all(0), cv::Scalar::all(256));
+      } else {
+        raw = avutils::bayer_mosaic(colour, raw_format);
+      }
+      for (const AVPixelFormat yuv_format : yuv_formats) {
+        const bool nv12 = yuv_format == AV_PIX_FMT_NV12;
+        // planes stacked, with the chroma rows of both formats fitting
+        cv::Mat vectorized(height * 2, width, CV_8UC1, cv::Scalar(0));
+        cv::Mat reference(height * 2, width, CV_8UC1, cv::Scalar(0));
+        const int strides[] = {width, nv12 ? width : width / 2, width / 2};
+        const auto planes = [&](cv::Mat &image) {
+          std::uint8_t *data = image.data;
+          return std::vector<std::uint8_t *>{
+              data, data + width * height,
+              data + width * height + width * height / 4};
+        };
+        avutils::convert_raw_to_yuv420(raw.data, width, width, height,
+                                       raw_format, yuv_format,
+                                       planes(vectorized).data(), strides);
+        avutils::convert_raw_to_yuv420_reference(
+            raw.data, width, width, height, raw_format, yuv_format,
+            planes(reference).data(), strides);
+        if (!same(vectorized, reference)) {
+          std::cout << "FAIL: " << av_get_pix_fmt_name(raw_format) << " to "
+                    << av_get_pix_fmt_name(yuv_format) << " at width "
+                    << width << std::endl;
+          ++mismatches;
+        }
+      }
+    }
+  }
+  for (const int width : {1, 15, 16, 17, 31, 33, 65, 1281}) {
+    const int height = 5;
+    const int chroma_width = (width + 1) / 2;
+    const int chroma_height = (height + 1) / 2;
+    cv::Mat luma(height, width, CV_8UC1);
+    cv::Mat chroma(chroma_height, 2 * chroma_width, CV_8UC1);
+    cv::Mat second(chroma_height, chroma_width, CV_8UC1);
+    cv::randu(luma, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::randu(chroma, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::randu(second, cv::Scalar::all(0), cv::Scalar::all(256));
+    for (const AVPixelFormat yuv_format : yuv_formats) {
+      const bool nv12 = yuv_format == AV_PIX_FMT_NV12;
+      const std::uint8_t *const planes[] = {luma.data, chroma.data,
+                                            second.data};
+      const int strides[] = {width, nv12 ? 2 * chroma_width : chroma_width,
+                             chroma_width};
+      for (const int channels : {3, 4}) {
+        const int type = channels == 3 ? CV_8UC3 : CV_8UC4;
+        cv::Mat vectorized(height, width, type);
+        cv::Mat reference(height, width, type);
+        avutils::convert_yuv420_to_bgr(planes, strides, width, 0, height,
+                                       yuv_format, vectorized.data,
+                                       static_cast<int>(vectorized.step),
+                                       channels);
+        avutils::convert_yuv420_to_bgr_reference(
+            planes, strides, width, 0, height, yuv_format, reference.data,
+            static_cast<int>(reference.step), channels);
+        if (!same(vectorized, reference)) {
+          std::cout << "FAIL: " << av_get_pix_fmt_name(yuv_format) << " to "
+                    << channels << " channels at width " << width
+                    << std::endl;
+          ++mismatches;
+        }
+      }
+    }
+  }
+  if (mismatches == 0) {
+    std::cout << "vectorized conversions match the scalar ones" << std::endl;
+  }
+  return mismatches == 0;
+}
+
+/**
+ * @brief   Set up sender and receiver as given by the options, and measure
+ */
+Result run(const Options &options, const std::vector<cv::Mat> &frames) {
+  // declared first, so it outlives the transmitters holding its frames
+  std::unique_ptr<SimulatedSource> camera;
+  if (!options.camera.empty()) {
+    SimulatedCamera config;
+    config.width = options.width / 2 * 2;
+    config.height = options.height / 2 * 2;
+    config.fps = options.fps;
+    config.format = options.camera == "rgb"    ? AV_PIX_FMT_RGB24
+                    : options.camera == "mono" ? AV_PIX_FMT_GRAY8
+                                               : AV_PIX_FMT_BAYER_RGGB8;
+    config.jitter = std::chrono::microseconds(
+        static_cast<std::int64_t>(options.camera_jitter_ms * 1000));
+    config.drop_probability = options.camera_drop_pct / 100;
+    camera.reset(new SimulatedSource(config));
+  }
+  zmq::context_t zmq_ctx(1);
+  std::string endpoint;
+  // the receiver gets the single stream, or the first simulcast layer
+  std::unique_ptr<AVTransmitter> single;
+  std::unique_ptr<Simulcast> simulcast;
+  AVTransmitter *transmitter;
+  if (options.simulcast > 1) {
+    std::vector<SimulcastLayer> layers;
+    for (int i = 0; i < options.simulcast; ++i) {
+      // a quarter of the pixels, a quarter of the bits
+      layers.push_back(SimulcastLayer{
+          static_cast<unsigned int>(options.downscale << i),
+          static_cast<unsigned int>(options.bitrate >> (2 * i))});
+    }
+    simulcast.reset(new Simulcast(options.fps, layers, options.gop,
+                                  options.codec, options.scale_filter));
+    transmitter = &simulcast->layer(0);
+  } else {
+    single.reset(new AVTransmitter(options.fps, options.gop, options.bitrate,
+                                   options.codec));
+    single->set_downscale(options.downscale);
+    single->set_scale_filter(options.scale_filter);
+    single->set_threading(options.threading);
+    transmitter = single.get();
+  }
+  if (options.slice_size > 0) {
+    if (simulcast) {
+      for (std::size_t i = 0; i < simulcast->size(); ++i) {
+        simulcast->layer(i).set_max_slice_size(options.slice_size);
+      }
+    } else {
+      transmitter->set_max_slice_size(options.slice_size);
+    }
+  }
+  std::shared_ptr<RtpSink> rtp_sink;
+  if (options.transport == "rtp") {
+    // written directly, sending UDP datagrams does not block
+    rtp_sink = std::make_shared<RtpSink>("127.0.0.1", options.port);
+    rtp_sink->set_fec_ratio(options.fec_pct / 100);
+    transmitter->add_sink(rtp_sink, 0);
+  } else {
+    endpoint = options.transport == "inproc"
+                   ? std::string("inproc://bench")
+                   : "tcp://127.0.0.1:" + std::to_string(options.port);
+    // never blocks, so written directly
+    transmitter->add_sink(
+        std::make_shared<ZmqSink>(zmq_ctx, endpoint, options.delivery), 0);
+  }
+  // nobody listens on the extra ports, but packetizing and sending costs
+  // the same
+  for (int i = 1; i < options.sinks; ++i) {
+    transmitter->add_sink(
+        std::make_shared<RtpSink>("127.0.0.1", options.port + 2 * i));
+  }
+  if (!options.record.empty()) {
+    // the disk gets a thread of its own, stalls there never reach the stream
+    RecordingConfig recording;
+    recording.directory = options.record;
+    transmitter->add_sink(std::make_shared<RecordingSink>(recording), 256);
+  }
+  // the other layers go past the relay's port, nobody listens there either
+  for (int i = 1; i < options.simulcast; ++i) {
+    simulcast->layer(i).add_sink(
+        std::make_shared<RtpSink>("127.0.0.1",
+                                  options.port + 2 * (options.sinks + i)),
+        0);
+  }
+  if (options.pipelined) {
+    if (simulcast) {
+      simulcast->start_pipeline(2, DropPolicy::DropOldest);
+    } else {
+      transmitter->start_pipeline(2, DropPolicy::DropOldest);
+    }
+  }
+  // the receiver needs the SDP and must listen before the first packet, so
+  // its frame ids match the sender's
+  if (simulcast) {
+    simulcast->prepare(options.width, options.height);
+  } else {
+    transmitter->prepare(options.width, options.height);
+  }
+  const std::string sdp_path =
+      "/tmp/bench_" + std::to_string(::getpid()) + ".sdp";
+  std::unique_ptr<UdpRelay> relay;
+  if (options.transport == "rtp") {
+    std::string sdp = rtp_sink->sdp();
+    if (options.loss_pct > 0 || options.delay_ms > 0 || options.rate_kbps > 0 ||
+        options.reorder_pct > 0) {
+      // the receiver listens behind the relay, past the extra sinks' ports
+      const int relay_port = options.port + 2 * options.sinks;
+      Impairment impairment;
+      impairment.loss = options.loss_pct / 100;
+      impairment.delay =
+          std::chrono::microseconds(static_cast<long>(options.delay_ms * 1e3));
+      impairment.rate_kbps = options.rate_kbps;
+      impairment.reorder = options.reorder_pct / 100;
+      impairment.reorder_delay = std::chrono::microseconds(
+          static_cast<long>(options.reorder_ms * 1e3));
+      relay.reset(
+          new UdpRelay(options.port, "127.0.0.1", relay_port, impairment));
+      const std::string media = "m=video " + std::to_string(options.port);
+      const auto at = sdp.find(media);
+      if (at != std::string::npos) {
+        sdp.replace(at, media.size(),
+                    "m=video " + std::to_string(relay_port));
+      }
+    }
+    std::ofstream ofs(sdp_path);
+    ofs << sdp;
+  }
+
+  const std::string feedback_endpoint = "inproc://bench-feedback";
+  std::unique_ptr<FeedbackServer> feedback;
+  if (options.feedback) {
+    if (options.adaptive) {
+      transmitter->enable_rate_control(options.min_bitrate > 0
+                                           ? options.min_bitrate
+                                           : options.bitrate / 10,
+                                       options.bitrate);
+    }
+    feedback.reset(new FeedbackServer(
+        zmq_ctx, feedback_endpoint, [&](const FeedbackMessage &message) {
+          if (message.type == FeedbackType::ReceiverReport &&
+              !options.adaptive) {
+            return;
+          }
+          transmitter->handle_feedback(message);
+        }));
+  }
+  const auto feedback_client = [&]() {
+    return std::unique_ptr<FeedbackClient>(
+        options.feedback ? new FeedbackClient(zmq_ctx, feedback_endpoint)
+                         : nullptr);
+  };
+
+  const auto measure_with = [&](auto &sender) {
+    if (options.transport == "rtp") {
+      RTPReceiver receiver(sdp_path, feedback_client(),
+                           options.slice_size > 0, DecodeSettings(),
+                           options.jitter);
+      const Result result = measure(options, sender, *transmitter, receiver,
+                                    camera.get(), frames);
+      const auto stats = receiver.get_stats();
+      const auto &packets = stats.packets;
+      std::cout << "jitter buffer: " << packets.reordered
+                << " packets reordered, " << packets.late << " late, "
+                << packets.lost << " lost, waiting " << packets.delay_ms
+                << " ms for missing ones, jitter " << packets.jitter_ms
+                << " ms" << std::endl;
+      const auto sent = rtp_sink->fec_stats();
+      if (sent.fec_packets > 0) {
+        std::cout << "FEC: " << sent.fec_packets << " packets, "
+                  << 100.0 * sent.fec_bytes / std::max<std::uint64_t>(
+                                                   1, sent.media_bytes)
+                  << "% overhead, recovered " << stats.fec.recovered
+                  << " packets, gave up on " << stats.fec.unrecoverable
+                  << " FEC packets" << std::endl;
+      }
+      return result;
+    }
+    AVReceiver receiver(zmq_ctx, endpoint, 30, feedback_client());
+    return measure(options, sender, *transmitter, receiver, camera.get(),
+                   frames);
+  };
+  Result result =
+      simulcast ? measure_with(*simulcast) : measure_with(*transmitter);
+  if (relay) {
+    const auto link = relay->get_stats();
+    std::cout << "link forwarded " << link.forwarded << " datagrams, lost "
+              << link.lost << ", dropped at the bottleneck "
+              << link.queue_dropped << ", reordered " << link.reordered
+              << std::endl;
+  }
+  std::remove(sdp_path.c_str());
+  return result;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (argc > 1 && std::string(argv[1]) == "--help") {
+    usage(argv[0]);
+    return 0;
+  }
+  try {
+    options = parse_options(argc, argv);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    usage(argv[0]);
+    return 2;
+  }
+  av_log_set_level(AV_LOG_ERROR);
+  avformat_network_init();
+
+  if (options.handoff) {
+    handoff(options);
+    return 0;
+  }
+  if (options.check_convert) {
+    return check_conversions() ? 0 : 1;
+  }
+  if (options.cameras > 0) {
+    return capture(options) ? 0 : 1;
+  }
+  // one second of distinct frames, generated up front so the generator
+  // doesn't count towards the sender's time
+  std::vector<cv::Mat> frames;
+  for (int i = 0; i < options.fps; ++i) {
+    frames.push_back(synthetic_frame(options.width, options.height, i));
+  }
+  if (options.soak_frames > 0) {
+    return soak(options, frames) ? 0 : 1;
+  }
+  if (!options.sweep) {
+    return run(options, frames).passed ? 0 : 1;
+  }
+  // every thread count up to the cores, tiles following the threads
+  std::vector<int> thread_counts;
+  const int cores = static_cast<int>(available_cores());
+  for (int threads = 1; threads < cores; threads *= 2) {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(cores);
+  std::vector<Result> results;
+  for (int threads : thread_counts) {
+    Options sweep_options = options;
+    sweep_options.threading.threads = threads;
+    results.push_back(run(sweep_options, frames));
+    std::cout << std::endl;
+  }
+  std::cout << "threads  tiles   p50 ms   p99 ms   cpu ms/frame   fps\n";
+  bool passed = true;
+  for (const auto &result : results) {
+    std::cout << std::setw(7) << result.threading.threads << std::setw(5)
+              << (1 << result.threading.tile_columns) << "x"
+              << (1 << result.threading.tile_rows) << std::setw(9)
+              << result.p50_ms << std::setw(9) << result.p99_ms
+              << std::setw(15) << result.cpu_ms_per_frame << std::setw(6)
+              << result.fps << "\n";
+    passed = passed && result.passed;
+  }
+  std::cout << std::flush;
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,197 @@
+#include "capture_service.hpp"
+#include "threading.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+CaptureService::CaptureService(unsigned int workers)
+    : workers_(workers), running_(false) {}
+
+std::size_t
+CaptureService::add_stream(std::unique_ptr<FrameSource> source,
+                           std::unique_ptr<AVTransmitter> transmitter,
+                           std::chrono::nanoseconds deadline) {
+  if (running_.load()) {
+    throw std::logic_error("Streams can only be added before start()");
+  }
+  std::unique_ptr<Stream> stream(new Stream());
+  stream->source = std::move(source);
+  stream->transmitter = std::move(transmitter);
+  stream->deadline = deadline;
+  streams_.push_back(std::move(stream));
+  return streams_.size() - 1;
+}
+
+void CaptureService::set_frame_hook(FrameHook hook) {
+  if (running_.load()) {
+    throw std::logic_error("The frame hook can only be set before start()");
+  }
+  hook_ = std::move(hook);
+}
+
+void CaptureService::start() {
+  if (streams_.empty()) {
+    throw std::logic_error("Nothing to capture");
+  }
+  if (running_.exchange(true)) {
+    return;
+  }
+  const unsigned int cores = available_cores();
+  // a stream is encoded by one worker at a time, more workers than streams
+  // would only wait
+  const unsigned int streams = static_cast<unsigned int>(streams_.size());
+  const unsigned int workers =
+      workers_ > 0 ? workers_ : std::min(cores, streams);
+  for (auto &stream : streams_) {
+    EncoderThreading threading = stream->transmitter->threading();
+    if (threading.threads == 0 && stream->transmitter->width() == 0) {
+      // the workers already keep the cores busy, each encoder gets its share
+      threading.threads = static_cast<int>(std::max(1u, cores / workers));
+      stream->transmitter->set_threading(threading);
+    }
+  }
+  started_ = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < streams_.size(); ++i) {
+    Stream &stream = *streams_[i];
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stream.encoded = 0;
+      stream.replaced = 0;
+      stream.late = 0;
+      stream.latency = tracing::Histogram();
+      stream.source_stats = FrameSource::Stats();
+    }
+    stream.source->start();
+    stream.thread = std::thread(&CaptureService::acquire, this,
+                                std::ref(stream), i);
+  }
+  for (unsigned int i = 0; i < workers; ++i) {
+    threads_.emplace_back(&CaptureService::work, this);
+  }
+}
+
+void CaptureService::acquire(Stream &stream, std::size_t index) {
+  while (running_.load()) {
+    avutils::BorrowedImage image;
+    const GrabStatus status =
+        stream.source->grab(std::chrono::milliseconds(10), image);
+    if (status != GrabStatus::Ok) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stream.source_stats = stream.source->get_stats();
+      continue;
+    }
+    if (image.captured_ns == 0) {
+      image.captured_ns = tracing::now_ns();
+    }
+    if (hook_) {
+      hook_(index, image);
+    }
+    avutils::BorrowedImage replaced;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stream.has_pending) {
+        replaced = std::move(stream.pending);
+        ++stream.replaced;
+      }
+      stream.source_stats = stream.source->get_stats();
+      stream.pending = std::move(image);
+      stream.has_pending = true;
+      stream.due_ns = stream.pending.captured_ns + stream.deadline.count();
+    }
+    // outside the lock, giving a buffer back may take the source's lock
+    if (replaced.release) {
+      replaced.release();
+    }
+    ready_cv_.notify_one();
+  }
+}
+
+CaptureService::Stream *CaptureService::earliest_due() {
+  Stream *earliest = nullptr;
+  // a handful of cameras, a scan is cheaper than keeping a heap in order
+  for (auto &stream : streams_) {
+    if (stream->has_pending && !stream->busy &&
+        (!earliest || stream->due_ns < earliest->due_ns)) {
+      earliest = stream.get();
+    }
+  }
+  return earliest;
+}
+
+void CaptureService::work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    Stream *stream = nullptr;
+    ready_cv_.wait(lock, [this, &stream]() {
+      stream = earliest_due();
+      return stream || !running_.load();
+    });
+    if (!stream) {
+      return;
+    }
+    avutils::BorrowedImage image = std::move(stream->pending);
+    stream->has_pending = false;
+    stream->busy = true;
+    const std::int64_t captured_ns = image.captured_ns;
+    const std::int64_t due_ns = stream->due_ns;
+    lock.unlock();
+    stream->transmitter->encode_frame(std::move(image));
+    const std::int64_t done_ns = tracing::now_ns();
+    lock.lock();
+    stream->busy = false;
+    ++stream->encoded;
+    stream->late += done_ns > due_ns ? 1 : 0;
+    stream->latency.add(done_ns - captured_ns);
+    if (stream->has_pending) {
+      // it arrived while we were busy, and was skipped by everyone
+      ready_cv_.notify_one();
+    }
+  }
+}
+
+void CaptureService::stop() {
+  if (!running_.exchange(false)) {
+    return;
+  }
+  for (auto &stream : streams_) {
+    stream->thread.join();
+  }
+  ready_cv_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+  threads_.clear();
+  stopped_ = std::chrono::steady_clock::now();
+  for (auto &stream : streams_) {
+    if (stream->has_pending) {
+      stream->pending.release();
+      stream->pending = avutils::BorrowedImage();
+      stream->has_pending = false;
+    }
+    stream->source->stop();
+    stream->transmitter->flush();
+  }
+}
+
+std::vector<CaptureService::StreamStats> CaptureService::get_stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto end =
+      running_.load() ? std::chrono::steady_clock::now() : stopped_;
+  const double seconds =
+      std::chrono::duration<double>(end - started_).count();
+  std::vector<StreamStats> stats;
+  for (const auto &stream : streams_) {
+    StreamStats stream_stats;
+    stream_stats.name = stream->source->name();
+    stream_stats.encoded = stream->encoded;
+    stream_stats.replaced = stream->replaced;
+    stream_stats.late = stream->late;
+    stream_stats.fps = seconds > 0 ? stream->encoded / seconds : 0;
+    stream_stats.p50_ms = stream->latency.percentile(50) / 1e6;
+    stream_stats.p99_ms = stream->latency.percentile(99) / 1e6;
+    stream_stats.source = stream->source_stats;
+    stats.push_back(stream_stats);
+  }
+  return stats;
+}
+
+CaptureService::~CaptureService() { stop(); }
@@ -0,0 +1,169 @@
+#ifndef CAPTURE_SERVICE_HPP_M8RQ4XTB
+#define CAPTURE_SERVICE_HPP_M8RQ4XTB
+
+#include "avtransmitter.hpp"
+#include "frame_source.hpp"
+#include "tracing.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief   Streams several cameras from one process. Every source has an
+ * acquisition thread of its own, which only grabs frames. Encoding happens on
+ * a pool of workers shared by all streams: each grabbed frame is due a fixed
+ * time after its capture, and a free worker always takes the frame due first
+ * (earliest deadline first). So a camera that fell behind is served before
+ * one that is on time, instead of every encoder competing for the cores.
+ *
+ * Like the sources, each stream keeps only its newest frame: a frame no
+ * worker got to before the next one arrived is released and counted as
+ * replaced. A stream is encoded by one worker at a time, in capture order.
+ */
+class CaptureService {
+public:
+  /**
+   * @brief Called on a stream's acquisition thread for each grabbed frame,
+   * before it is queued, e.g. to inspect it. Raw camera images are not
+   * demosaiced yet, draw on those with AVTransmitter::set_frame_overlay().
+   */
+  using FrameHook =
+      std::function<void(std::size_t stream, avutils::BorrowedImage &image)>;
+
+  /**
+   * @brief Counters and timings of one stream since start()
+   */
+  struct StreamStats {
+    std::string name;       ///< the source's
+    std::uint64_t encoded;  ///< frames encoded
+    std::uint64_t replaced; ///< frames dropped for a newer one before encoding
+    std::uint64_t late;     ///< frames finished after their deadline
+    double fps;             ///< encoded frames per second
+    double p50_ms;          ///< capture to encoded
+    double p99_ms;
+    FrameSource::Stats source; ///< the source's own counters
+  };
+
+private:
+  struct Stream {
+    std::unique_ptr<FrameSource> source;
+    std::unique_ptr<AVTransmitter> transmitter;
+    std::chrono::nanoseconds deadline;
+    std::thread thread;
+    // guarded by the service's mutex_
+    avutils::BorrowedImage pending;
+    bool has_pending = false;
+    std::int64_t due_ns = 0; ///< of the pending frame
+    bool busy = false;       ///< a worker is encoding it
+    std::uint64_t encoded = 0;
+    std::uint64_t replaced = 0;
+    std::uint64_t late = 0;
+    tracing::Histogram latency; ///< capture to encoded, in ns
+    /// copied after each grab, sources may only be asked from their thread
+    FrameSource::Stats source_stats;
+  };
+
+  std::vector<std::unique_ptr<Stream>> streams_;
+  unsigned int workers_;
+  std::vector<std::thread> threads_;
+  FrameHook hook_;
+  std::atomic<bool> running_;
+  std::chrono::steady_clock::time_point started_;
+  std::chrono::steady_clock::time_point stopped_;
+  mutable std::mutex mutex_;
+  std::condition_variable ready_cv_;
+
+  /**
+   * @brief Grab frames of one stream and queue them until stopped
+   */
+  void acquire(Stream &stream, std::size_t index);
+
+  /**
+   * @brief Encode the earliest due frames until stopped
+   */
+  void work();
+
+  /**
+   * @brief Find the stream whose frame is due first and not being encoded.
+   * Call with `mutex_` held.
+   *
+   * @return    nullptr if there is none
+   */
+  Stream *earliest_due();
+
+public:
+  /**
+   * @brief ctor
+   *
+   * @param workers encoding threads, 0 for one per stream up to the cores
+   */
+  explicit CaptureService(unsigned int workers = 0);
+
+  CaptureService(const CaptureService &) = delete;
+  CaptureService &operator=(const CaptureService &) = delete;
+
+  /**
+   * @brief Add a camera and the transmitter its frames go to. Only before
+   * start().
+   *
+   * @param source  not started yet
+   * @param transmitter with its sinks added. Unless chosen, its encoder
+   * threads are set in start(), so all encoders together use the cores once.
+   * @param deadline    how long after capture a frame should be encoded,
+   * e.g. one frame interval
+   *
+   * @return    index of the stream, for get_stats() and the hook
+   * @throw std::logic_error if already started
+   */
+  std::size_t add_stream(std::unique_ptr<FrameSource> source,
+                         std::unique_ptr<AVTransmitter> transmitter,
+                         std::chrono::nanoseconds deadline);
+
+  /**
+   * @brief Set a function called with every grabbed frame. Only before
+   * start().
+   */
+  void set_frame_hook(FrameHook hook);
+
+  /**
+   * @brief Get the transmitter of a stream, e.g. to handle feedback
+   */
+  AVTransmitter &transmitter(std::size_t stream) {
+    return *streams_.at(stream)->transmitter;
+  }
+
+  /**
+   * @brief Get the number of streams
+   */
+  std::size_t size() const { return streams_.size(); }
+
+  /**
+   * @brief Start the sources, their acquisition threads and the workers
+   *
+   * @throw std::logic_error if there are no streams
+   */
+  void start();
+
+  /**
+   * @brief Stop everything and flush the encoders. Frames not encoded yet
+   * are released.
+   */
+  void stop();
+
+  /**
+   * @brief Get counters and timings of every stream, in the order they were
+   * added
+   */
+  std::vector<StreamStats> get_stats() const;
+
+  ~CaptureService();
+};
+
+#endif /* end of include guard: CAPTURE_SERVICE_HPP_M8RQ4XTB */
@@ -0,0 +1,118 @@
+#include "codec_profile.hpp"
+#include <stdexcept>
+
+namespace {
+
+const std::vector<CodecProfile> &profiles() {
+  static const std::vector<CodecProfile> profiles = {
+      {"h264",
+       AV_CODEC_ID_H264,
+       "libx264",
+       AV_PIX_FMT_YUV420P,
+       {{"preset", "ultrafast"},
+        {"tune", "zerolatency"},
+        {"profile", "baseline"},
+        // spread keyframes over gop_size frames instead of sending big IDR
+        // frames, keeps packet sizes and thus latency even
+        {"intra-refresh", "1"},
+        // encoded in parallel and each slice decodable on its own
+        {"slices", "4"},
+        {"forced-idr", "1"}},
+       // with intra refresh there are no further IDR frames carrying SPS/PPS
+       true,
+       false,
+       // libavcodec reconfigures x264 when bit_rate changes
+       true,
+       51},
+      {"vp8",
+       AV_CODEC_ID_VP8,
+       "libvpx",
+       AV_PIX_FMT_YUV420P,
+       {{"deadline", "realtime"},
+        {"speed", "8"},
+        {"lag-in-frames", "0"},
+        {"error-resilient", "1"}},
+       false,
+       false,
+       false,
+       63},
+      {"vp9",
+       AV_CODEC_ID_VP9,
+       "libvpx-vp9",
+       AV_PIX_FMT_YUV420P,
+       {{"deadline", "realtime"},
+        {"quality", "realtime"},
+        {"speed", "8"},
+        {"row-mt", "1"},
+        {"lag-in-frames", "0"},
+        {"tile-columns", "5"},
+        {"frame-parallel", "0"}},
+       false,
+       true,
+       false,
+       63},
+      // AV1 over RTP needs a libavformat with an AV1 packetizer (not 4.4)
+      {"av1",
+       AV_CODEC_ID_AV1,
+       "libaom-av1",
+       AV_PIX_FMT_YUV420P,
+       {{"usage", "realtime"},
+        {"cpu-used", "8"},
+        {"lag-in-frames", "0"},
+        {"row-mt", "1"},
+        {"tiles", "2x2"}},
+       false,
+       true,
+       false,
+       63},
+      {"svtav1",
+       AV_CODEC_ID_AV1,
+       "libsvtav1",
+       AV_PIX_FMT_YUV420P,
+       {{"preset", "8"}, {"la_depth", "0"}},
+       false,
+       true,
+       false,
+       63},
+  };
+  return profiles;
+}
+
+} // namespace
+
+const CodecProfile &codec_profile(const std::string &name) {
+  for (const auto &profile : profiles()) {
+    if (profile.name == name) {
+      return profile;
+    }
+  }
+  std::string known;
+  for (const auto &profile_name : codec_profile_names()) {
+    known += " " + profile_name;
+  }
+  throw std::invalid_argument("Unknown codec " + name + ", known:" + known);
+}
+
+std::vector<std::string> codec_profile_names() {
+  std::vector<std::string> names;
+  for (const auto &profile : profiles()) {
+    names.push_back(profile.name);
+  }
+  return names;
+}
+
+bool set_max_slice_size(const CodecProfile &profile, CodecOptions &options,
+                        unsigned int bytes) {
+  if (profile.encoder != "libx264") {
+    return false;
+  }
+  const std::string param = "slice-max-size=" + std::to_string(bytes);
+  for (auto &option : options) {
+    if (option.first == "x264-params") {
+      option.second += ":" + param;
+      return true;
+    }
+  }
+  options.emplace_back("x264-params", param);
+  return true;
+}
@@ -0,0 +1,64 @@
+#ifndef CODEC_PROFILE_HPP_T2HZ6KPV
+#define CODEC_PROFILE_HPP_T2HZ6KPV
+
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixfmt.h>
+}
+
+/// encoder options as passed to `avcodec_open2()`, private and generic
+using CodecOptions = std::vector<std::pair<std::string, std::string>>;
+
+/**
+ * @brief   Everything needed to set up an encoder for low latency streaming
+ * with a particular codec, so the codec can be chosen at runtime.
+ */
+struct CodecProfile {
+  std::string name;       ///< short name for command lines, e.g. "vp9"
+  AVCodecID codec_id;     ///< also selects the RTP packetizer
+  std::string encoder;    ///< libavcodec encoder name, e.g. "libx264"
+  AVPixelFormat pix_fmt;  ///< encoder input format
+  CodecOptions options;   ///< realtime tuning
+  bool global_header;     ///< put parameter sets into the SDP, so receivers
+                          ///< can start decoding without waiting for them
+  bool experimental_rtp;  ///< RTP packetization needs
+                          ///< FF_COMPLIANCE_EXPERIMENTAL
+  bool live_bitrate;      ///< the open encoder follows changes to `bit_rate`,
+                          ///< others have to be reopened
+  int max_quantizer;      ///< highest `qmax` the encoder accepts
+};
+
+/**
+ * @brief   Get the profile for a codec
+ *
+ * @param name  one of \ref codec_profile_names
+ *
+ * @return  profile
+ * @throw   std::invalid_argument for unknown names
+ */
+const CodecProfile &codec_profile(const std::string &name);
+
+/**
+ * @brief   Get the names of all profiles
+ */
+std::vector<std::string> codec_profile_names();
+
+/**
+ * @brief   Cap the size of the encoder's slices, so each one fits into an RTP
+ * packet of its own. A receiver can then decode slices as they arrive, see
+ * RTPReceiver. Only libx264 supports this.
+ *
+ * @param profile   codec
+ * @param options   encoder options, e.g. a copy of the profile's
+ * @param bytes max slice size including NAL overhead
+ *
+ * @return  false if the encoder can't cap slice sizes, options are unchanged
+ */
+bool set_max_slice_size(const CodecProfile &profile, CodecOptions &options,
+                        unsigned int bytes);
+
+#endif /* end of include guard: CODEC_PROFILE_HPP_T2HZ6KPV */
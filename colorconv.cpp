@@ -0,0 +1,688 @@
+#include "colorconv.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define COLORCONV_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define COLORCONV_NEON 1
+#endif
+
+// x86 code paths beyond the compile-time baseline are chosen at runtime
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define COLORCONV_X86_DISPATCH 1
+#endif
+
+namespace avutils {
+
+namespace {
+
+// BT.601 limited range in 8 bit fixed point, same as swscale's default
+constexpr int kYR = 66, kYG = 129, kYB = 25;
+constexpr int kUR = -38, kUG = -74, kUB = 112;
+constexpr int kVR = 112, kVG = -94, kVB = -18;
+// mono: 0..255 -> 16..235
+constexpr int kYMono = 220;
+
+/**
+ * @brief   Position of the colour samples in a 2x2 Bayer cell, counted row-wise
+ * (0 = top left, 3 = bottom right)
+ */
+struct CellLayout {
+  int r;
+  int g0;
+  int g1;
+  int b;
+};
+
+CellLayout cell_layout(AVPixelFormat format) {
+  switch (format) {
+  case AV_PIX_FMT_BAYER_BGGR8:
+    return {3, 1, 2, 0};
+  case AV_PIX_FMT_BAYER_RGGB8:
+    return {0, 1, 2, 3};
+  case AV_PIX_FMT_BAYER_GBRG8:
+    return {2, 0, 3, 1};
+  case AV_PIX_FMT_BAYER_GRBG8:
+    return {1, 0, 3, 2};
+  default:
+    throw std::invalid_argument("Not an 8 bit Bayer format");
+  }
+}
+
+inline std::uint8_t luma(int r, int g, int b) {
+  return ((kYR * r + kYG * g + kYB * b + 128) >> 8) + 16;
+}
+
+inline std::uint8_t chroma_u(int r, int g, int b) {
+  return ((kUR * r + kUG * g + kUB * b + 128) >> 8) + 128;
+}
+
+inline std::uint8_t chroma_v(int r, int g, int b) {
+  return ((kVR * r + kVG * g + kVB * b + 128) >> 8) + 128;
+}
+
+inline std::uint8_t luma_mono(int v) { return ((kYMono * v + 128) >> 8) + 16; }
+
+void mono_row_scalar(const std::uint8_t *row, int width, std::uint8_t *y) {
+  for (int x = 0; x < width; ++x) {
+    y[x] = luma_mono(row[x]);
+  }
+}
+
+/**
+ * @brief   Convert cells [x, width) of a row pair, one cell at a time. Also the
+ * reference for the vectorized versions, which must produce identical output.
+ */
+void bayer_cells_scalar(const std::uint8_t *row0, const std::uint8_t *row1,
+                        int x, int width, const CellLayout &l, std::uint8_t *y0,
+                        std::uint8_t *y1, std::uint8_t *u, std::uint8_t *v,
+                        std::uint8_t *uv) {
+  for (; x < width; x += 2) {
+    const int p[4] = {row0[x], row0[x + 1], row1[x], row1[x + 1]};
+    const int r = p[l.r];
+    const int b = p[l.b];
+    const int g = (p[l.g0] + p[l.g1] + 1) >> 1;
+    // R and B sites carry the cell's luma, G sites add their own detail
+    std::uint8_t y[4];
+    y[l.r] = y[l.b] = luma(r, g, b);
+    y[l.g0] = luma(r, p[l.g0], b);
+    y[l.g1] = luma(r, p[l.g1], b);
+    y0[x] = y[0];
+    y0[x + 1] = y[1];
+    y1[x] = y[2];
+    y1[x + 1] = y[3];
+    if (uv) {
+      uv[x] = chroma_u(r, g, b);
+      uv[x + 1] = chroma_v(r, g, b);
+    } else {
+      u[x / 2] = chroma_u(r, g, b);
+      v[x / 2] = chroma_v(r, g, b);
+    }
+  }
+}
+
+#if defined(COLORCONV_SSE2)
+
+void bayer_rows(const std::uint8_t *row0, const std::uint8_t *row1, int width,
+                const CellLayout &l, std::uint8_t *y0, std::uint8_t *y1,
+                std::uint8_t *u, std::uint8_t *v, std::uint8_t *uv) {
+  const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+  const __m128i round = _mm_set1_epi16(128);
+  const __m128i y_offset = _mm_set1_epi16(16);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const __m128i a =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x));
+    const __m128i c =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x));
+    // 8 cells, one 16 bit lane per cell and site
+    const __m128i p[4] = {_mm_and_si128(a, low_bytes), _mm_srli_epi16(a, 8),
+                          _mm_and_si128(c, low_bytes), _mm_srli_epi16(c, 8)};
+    const __m128i r = p[l.r];
+    const __m128i b = p[l.b];
+    const __m128i g = _mm_avg_epu16(p[l.g0], p[l.g1]);
+
+    // luma stays below 2^16, so unsigned 16 bit lanes suffice
+    const __m128i rb =
+        _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kYR)),
+                                    _mm_mullo_epi16(b, _mm_set1_epi16(kYB))),
+                      round);
+    const __m128i yg = _mm_set1_epi16(kYG);
+    __m128i y[4];
+    y[l.r] = y[l.b] = _mm_add_epi16(
+        _mm_srli_epi16(_mm_add_epi16(rb, _mm_mullo_epi16(g, yg)), 8),
+        y_offset);
+    y[l.g0] = _mm_add_epi16(
+        _mm_srli_epi16(_mm_add_epi16(rb, _mm_mullo_epi16(p[l.g0], yg)), 8),
+        y_offset);
+    y[l.g1] = _mm_add_epi16(
+        _mm_srli_epi16(_mm_add_epi16(rb, _mm_mullo_epi16(p[l.g1], yg)), 8),
+        y_offset);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(y0 + x),
+                     _mm_or_si128(y[0], _mm_slli_epi16(y[1], 8)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(y1 + x),
+                     _mm_or_si128(y[2], _mm_slli_epi16(y[3], 8)));
+
+    // chroma fits signed 16 bit lanes
+    __m128i cu = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kUR)),
+                      _mm_mullo_epi16(g, _mm_set1_epi16(kUG))),
+        _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(kUB)), round));
+    __m128i cv = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kVR)),
+                      _mm_mullo_epi16(g, _mm_set1_epi16(kVG))),
+        _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(kVB)), round));
+    cu = _mm_add_epi16(_mm_srai_epi16(cu, 8), round);
+    cv = _mm_add_epi16(_mm_srai_epi16(cv, 8), round);
+    if (uv) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(uv + x),
+                       _mm_or_si128(cu, _mm_slli_epi16(cv, 8)));
+    } else {
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(u + x / 2),
+                       _mm_packus_epi16(cu, cu));
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(v + x / 2),
+                       _mm_packus_epi16(cv, cv));
+    }
+  }
+  bayer_cells_scalar(row0, row1, x, width, l, y0, y1, u, v, uv);
+}
+
+void mono_row(const std::uint8_t *row, int width, std::uint8_t *y) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i scale = _mm_set1_epi16(kYMono);
+  const __m128i round = _mm_set1_epi16(128);
+  const __m128i y_offset = _mm_set1_epi16(16);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const __m128i a =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+    __m128i lo = _mm_unpacklo_epi8(a, zero);
+    __m128i hi = _mm_unpackhi_epi8(a, zero);
+    lo = _mm_add_epi16(
+        _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(lo, scale), round), 8),
+        y_offset);
+    hi = _mm_add_epi16(
+        _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(hi, scale), round), 8),
+        y_offset);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(y + x),
+                     _mm_packus_epi16(lo, hi));
+  }
+  for (; x < width; ++x) {
+    y[x] = luma_mono(row[x]);
+  }
+}
+
+#elif defined(COLORCONV_NEON)
+
+void bayer_rows(const std::uint8_t *row0, const std::uint8_t *row1, int width,
+                const CellLayout &l, std::uint8_t *y0, std::uint8_t *y1,
+                std::uint8_t *u, std::uint8_t *v, std::uint8_t *uv) {
+  const uint16x8_t round = vdupq_n_u16(128);
+  const uint16x8_t y_offset = vdupq_n_u16(16);
+  const int16x8_t c_offset = vdupq_n_s16(128);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    // deinterleaving load: val[0] even columns, val[1] odd columns
+    const uint8x8x2_t a = vld2_u8(row0 + x);
+    const uint8x8x2_t c = vld2_u8(row1 + x);
+    const uint16x8_t p[4] = {vmovl_u8(a.val[0]), vmovl_u8(a.val[1]),
+                             vmovl_u8(c.val[0]), vmovl_u8(c.val[1])};
+    const uint16x8_t r = p[l.r];
+    const uint16x8_t b = p[l.b];
+    const uint16x8_t g = vrhaddq_u16(p[l.g0], p[l.g1]);
+
+    const uint16x8_t rb = vmlaq_n_u16(vmlaq_n_u16(round, r, kYR), b, kYB);
+    uint16x8_t y[4];
+    y[l.r] = y[l.b] =
+        vaddq_u16(vshrq_n_u16(vmlaq_n_u16(rb, g, kYG), 8), y_offset);
+    y[l.g0] = vaddq_u16(vshrq_n_u16(vmlaq_n_u16(rb, p[l.g0], kYG), 8), y_offset);
+    y[l.g1] = vaddq_u16(vshrq_n_u16(vmlaq_n_u16(rb, p[l.g1], kYG), 8), y_offset);
+    const uint8x8x2_t out0 = {{vmovn_u16(y[0]), vmovn_u16(y[1])}};
+    const uint8x8x2_t out1 = {{vmovn_u16(y[2]), vmovn_u16(y[3])}};
+    vst2_u8(y0 + x, out0);
+    vst2_u8(y1 + x, out1);
+
+    const int16x8_t rs = vreinterpretq_s16_u16(r);
+    const int16x8_t gs = vreinterpretq_s16_u16(g);
+    const int16x8_t bs = vreinterpretq_s16_u16(b);
+    int16x8_t cu = vmlaq_n_s16(
+        vmlaq_n_s16(vmlaq_n_s16(c_offset, rs, kUR), gs, kUG), bs, kUB);
+    int16x8_t cv = vmlaq_n_s16(
+        vmlaq_n_s16(vmlaq_n_s16(c_offset, rs, kVR), gs, kVG), bs, kVB);
+    const uint8x8_t u8 = vqmovun_s16(vaddq_s16(vshrq_n_s16(cu, 8), c_offset));
+    const uint8x8_t v8 = vqmovun_s16(vaddq_s16(vshrq_n_s16(cv, 8), c_offset));
+    if (uv) {
+      const uint8x8x2_t chroma = {{u8, v8}};
+      vst2_u8(uv + x, chroma);
+    } else {
+      vst1_u8(u + x / 2, u8);
+      vst1_u8(v + x / 2, v8);
+    }
+  }
+  bayer_cells_scalar(row0, row1, x, width, l, y0, y1, u, v, uv);
+}
+
+void mono_row(const std::uint8_t *row, int width, std::uint8_t *y) {
+  const uint16x8_t round = vdupq_n_u16(128);
+  const uint16x8_t y_offset = vdupq_n_u16(16);
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    const uint16x8_t a = vmovl_u8(vld1_u8(row + x));
+    vst1_u8(y + x, vmovn_u16(vaddq_u16(
+                       vshrq_n_u16(vmlaq_n_u16(round, a, kYMono), 8), y_offset)));
+  }
+  for (; x < width; ++x) {
+    y[x] = luma_mono(row[x]);
+  }
+}
+
+#else
+
+void bayer_rows(const std::uint8_t *row0, const std::uint8_t *row1, int width,
+                const CellLayout &l, std::uint8_t *y0, std::uint8_t *y1,
+                std::uint8_t *u, std::uint8_t *v, std::uint8_t *uv) {
+  bayer_cells_scalar(row0, row1, 0, width, l, y0, y1, u, v, uv);
+}
+
+void mono_row(const std::uint8_t *row, int width, std::uint8_t *y) {
+  mono_row_scalar(row, width, y);
+}
+
+#endif
+
+// YUV -> BGR, BT.601 limited range in 6 bit fixed point. Luma is scaled in 7
+// bit and halved, since 1.164 is too coarse in 6 bit (white would end up at
+// 253). Intermediate values fit signed 16 bit lanes except for saturated blues,
+// which clamp to 255 either way.
+constexpr int kY = 149;  // 1.164 * 2
+constexpr int kRV = 102; // 1.596
+constexpr int kGU = 25;  // 0.391
+constexpr int kGV = 52;  // 0.813
+constexpr int kBU = 129; // 2.018
+
+/// converts pixels [0, width) of one row, chroma from u/v or interleaved uv
+using YuvRowFunction = void (*)(const std::uint8_t *y, const std::uint8_t *u,
+                                const std::uint8_t *v, const std::uint8_t *uv,
+                                int width, std::uint8_t *dst, int channels);
+
+inline std::uint8_t clamp_u8(int v) {
+  return v < 0 ? 0 : (v > 255 ? 255 : static_cast<std::uint8_t>(v));
+}
+
+/**
+ * @brief   Convert pixels [x, width) of a row. Reference for the vectorized
+ * versions, which must produce identical output.
+ */
+void yuv_pixels_scalar(const std::uint8_t *y, const std::uint8_t *u,
+                       const std::uint8_t *v, const std::uint8_t *uv, int x,
+                       int width, std::uint8_t *dst, int channels) {
+  for (; x < width; ++x) {
+    const int c = x >> 1;
+    const int cu = (uv ? uv[2 * c] : u[c]) - 128;
+    const int cv = (uv ? uv[2 * c + 1] : v[c]) - 128;
+    const int yy = ((y[x] > 16 ? y[x] - 16 : 0) * kY >> 1) + 32;
+    std::uint8_t *px = dst + x * channels;
+    px[0] = clamp_u8((yy + kBU * cu) >> 6);
+    px[1] = clamp_u8((yy - kGU * cu - kGV * cv) >> 6);
+    px[2] = clamp_u8((yy + kRV * cv) >> 6);
+    if (channels == 4) {
+      px[3] = 255;
+    }
+  }
+}
+
+void yuv_row_scalar(const std::uint8_t *y, const std::uint8_t *u,
+                    const std::uint8_t *v, const std::uint8_t *uv, int width,
+                    std::uint8_t *dst, int channels) {
+  yuv_pixels_scalar(y, u, v, uv, 0, width, dst, channels);
+}
+
+#if defined(COLORCONV_X86_DISPATCH)
+
+// pshufb masks scattering 16 B, G and R bytes into 3 vectors of packed BGR
+alignas(16) const std::uint8_t kBgrShuffle[3][3][16] = {
+    {{0, 0x80, 0x80, 1, 0x80, 0x80, 2, 0x80, 0x80, 3, 0x80, 0x80, 4, 0x80,
+      0x80, 5},
+     {0x80, 0, 0x80, 0x80, 1, 0x80, 0x80, 2, 0x80, 0x80, 3, 0x80, 0x80, 4,
+      0x80, 0x80},
+     {0x80, 0x80, 0, 0x80, 0x80, 1, 0x80, 0x80, 2, 0x80, 0x80, 3, 0x80, 0x80,
+      4, 0x80}},
+    {{0x80, 0x80, 6, 0x80, 0x80, 7, 0x80, 0x80, 8, 0x80, 0x80, 9, 0x80, 0x80,
+      10, 0x80},
+     {5, 0x80, 0x80, 6, 0x80, 0x80, 7, 0x80, 0x80, 8, 0x80, 0x80, 9, 0x80,
+      0x80, 10},
+     {0x80, 5, 0x80, 0x80, 6, 0x80, 0x80, 7, 0x80, 0x80, 8, 0x80, 0x80, 9,
+      0x80, 0x80}},
+    {{0x80, 11, 0x80, 0x80, 12, 0x80, 0x80, 13, 0x80, 0x80, 14, 0x80, 0x80,
+      15, 0x80, 0x80},
+     {0x80, 0x80, 11, 0x80, 0x80, 12, 0x80, 0x80, 13, 0x80, 0x80, 14, 0x80,
+      0x80, 15, 0x80},
+     {10, 0x80, 0x80, 11, 0x80, 0x80, 12, 0x80, 0x80, 13, 0x80, 0x80, 14,
+      0x80, 0x80, 15}}};
+
+/**
+ * @brief   Load the chroma of 16 pixels as 8 signed 16 bit lanes, centred on 0
+ */
+__attribute__((target("ssse3"))) inline void
+load_chroma_16(const std::uint8_t *u, const std::uint8_t *v,
+               const std::uint8_t *uv, int x, __m128i &cu, __m128i &cv) {
+  const __m128i zero = _mm_setzero_si128();
+  if (uv) {
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(uv + x));
+    cu = _mm_and_si128(c, _mm_set1_epi16(0x00ff));
+    cv = _mm_srli_epi16(c, 8);
+  } else {
+    cu = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(u + x / 2)), zero);
+    cv = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(v + x / 2)), zero);
+  }
+  cu = _mm_sub_epi16(cu, _mm_set1_epi16(128));
+  cv = _mm_sub_epi16(cv, _mm_set1_epi16(128));
+}
+
+/**
+ * @brief   Interleave 16 B, G, R bytes into packed BGR or BGRA and store them
+ */
+__attribute__((target("ssse3"))) inline void
+store_bgr_16(__m128i b, __m128i g, __m128i r, std::uint8_t *dst,
+             int channels) {
+  __m128i *out = reinterpret_cast<__m128i *>(dst);
+  if (channels == 4) {
+    const __m128i alpha = _mm_set1_epi8(-1);
+    const __m128i bg_lo = _mm_unpacklo_epi8(b, g);
+    const __m128i bg_hi = _mm_unpackhi_epi8(b, g);
+    const __m128i ra_lo = _mm_unpacklo_epi8(r, alpha);
+    const __m128i ra_hi = _mm_unpackhi_epi8(r, alpha);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(bg_lo, ra_lo));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bg_lo, ra_lo));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bg_hi, ra_hi));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bg_hi, ra_hi));
+  } else {
+    for (int j = 0; j < 3; ++j) {
+      const __m128i *mask = reinterpret_cast<const __m128i *>(kBgrShuffle[j]);
+      _mm_storeu_si128(
+          out + j,
+          _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b, _mm_load_si128(mask)),
+                                    _mm_shuffle_epi8(g, _mm_load_si128(mask + 1))),
+                       _mm_shuffle_epi8(r, _mm_load_si128(mask + 2))));
+    }
+  }
+}
+
+/**
+ * @brief   Colour math for 8 pixels in 16 bit lanes, luma already reduced by 16
+ */
+__attribute__((target("ssse3"))) inline void
+yuv_to_bgr_8(__m128i y, __m128i cu, __m128i cv, __m128i &b, __m128i &g,
+             __m128i &r) {
+  const __m128i yy = _mm_add_epi16(
+      _mm_srli_epi16(_mm_mullo_epi16(y, _mm_set1_epi16(kY)), 1),
+      _mm_set1_epi16(32));
+  b = _mm_srai_epi16(
+      _mm_adds_epi16(yy, _mm_mullo_epi16(cu, _mm_set1_epi16(kBU))), 6);
+  g = _mm_srai_epi16(
+      _mm_subs_epi16(
+          _mm_subs_epi16(yy, _mm_mullo_epi16(cu, _mm_set1_epi16(kGU))),
+          _mm_mullo_epi16(cv, _mm_set1_epi16(kGV))),
+      6);
+  r = _mm_srai_epi16(
+      _mm_adds_epi16(yy, _mm_mullo_epi16(cv, _mm_set1_epi16(kRV))), 6);
+}
+
+__attribute__((target("ssse3"))) void
+yuv_row_ssse3(const std::uint8_t *y, const std::uint8_t *u,
+              const std::uint8_t *v, const std::uint8_t *uv, int width,
+              std::uint8_t *dst, int channels) {
+  const __m128i zero = _mm_setzero_si128();
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const __m128i yv = _mm_subs_epu8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x)),
+        _mm_set1_epi8(16));
+    __m128i cu, cv;
+    load_chroma_16(u, v, uv, x, cu, cv);
+    // each chroma sample covers two neighbouring pixels
+    __m128i b_lo, g_lo, r_lo, b_hi, g_hi, r_hi;
+    yuv_to_bgr_8(_mm_unpacklo_epi8(yv, zero), _mm_unpacklo_epi16(cu, cu),
+                 _mm_unpacklo_epi16(cv, cv), b_lo, g_lo, r_lo);
+    yuv_to_bgr_8(_mm_unpackhi_epi8(yv, zero), _mm_unpackhi_epi16(cu, cu),
+                 _mm_unpackhi_epi16(cv, cv), b_hi, g_hi, r_hi);
+    store_bgr_16(_mm_packus_epi16(b_lo, b_hi), _mm_packus_epi16(g_lo, g_hi),
+                 _mm_packus_epi16(r_lo, r_hi), dst + x * channels, channels);
+  }
+  yuv_pixels_scalar(y, u, v, uv, x, width, dst, channels);
+}
+
+__attribute__((target("avx2"))) inline __m128i pack_u8(__m256i v) {
+  return _mm_packus_epi16(_mm256_castsi256_si128(v),
+                          _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2"))) inline __m256i duplicate_lanes(__m128i c) {
+  return _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_unpacklo_epi16(c, c)),
+      _mm_unpackhi_epi16(c, c), 1);
+}
+
+__attribute__((target("avx2"))) void
+yuv_row_avx2(const std::uint8_t *y, const std::uint8_t *u,
+             const std::uint8_t *v, const std::uint8_t *uv, int width,
+             std::uint8_t *dst, int channels) {
+  const __m256i round = _mm256_set1_epi16(32);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    // all 16 pixels in one register for the colour math
+    const __m256i y16 = _mm256_cvtepu8_epi16(_mm_subs_epu8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x)),
+        _mm_set1_epi8(16)));
+    __m128i cu8, cv8;
+    load_chroma_16(u, v, uv, x, cu8, cv8);
+    const __m256i cu = duplicate_lanes(cu8);
+    const __m256i cv = duplicate_lanes(cv8);
+    const __m256i yy = _mm256_add_epi16(
+        _mm256_srli_epi16(_mm256_mullo_epi16(y16, _mm256_set1_epi16(kY)), 1),
+        round);
+    const __m256i b = _mm256_srai_epi16(
+        _mm256_adds_epi16(yy, _mm256_mullo_epi16(cu, _mm256_set1_epi16(kBU))),
+        6);
+    const __m256i g = _mm256_srai_epi16(
+        _mm256_subs_epi16(
+            _mm256_subs_epi16(yy,
+                              _mm256_mullo_epi16(cu, _mm256_set1_epi16(kGU))),
+            _mm256_mullo_epi16(cv, _mm256_set1_epi16(kGV))),
+        6);
+    const __m256i r = _mm256_srai_epi16(
+        _mm256_adds_epi16(yy, _mm256_mullo_epi16(cv, _mm256_set1_epi16(kRV))),
+        6);
+    store_bgr_16(pack_u8(b), pack_u8(g), pack_u8(r), dst + x * channels,
+                 channels);
+  }
+  yuv_pixels_scalar(y, u, v, uv, x, width, dst, channels);
+}
+
+#elif defined(COLORCONV_NEON)
+
+inline void yuv_to_bgr_8(uint16x8_t y, int16x8_t cu, int16x8_t cv, uint8x8_t &b,
+                         uint8x8_t &g, uint8x8_t &r) {
+  const int16x8_t yy = vaddq_s16(
+      vreinterpretq_s16_u16(vshrq_n_u16(vmulq_n_u16(y, kY), 1)),
+      vdupq_n_s16(32));
+  b = vqmovun_s16(vshrq_n_s16(vqaddq_s16(yy, vmulq_n_s16(cu, kBU)), 6));
+  g = vqmovun_s16(vshrq_n_s16(
+      vqsubq_s16(vqsubq_s16(yy, vmulq_n_s16(cu, kGU)), vmulq_n_s16(cv, kGV)),
+      6));
+  r = vqmovun_s16(vshrq_n_s16(vqaddq_s16(yy, vmulq_n_s16(cv, kRV)), 6));
+}
+
+void yuv_row_neon(const std::uint8_t *y, const std::uint8_t *u,
+                  const std::uint8_t *v, const std::uint8_t *uv, int width,
+                  std::uint8_t *dst, int channels) {
+  const int16x8_t c128 = vdupq_n_s16(128);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const uint8x16_t yv = vqsubq_u8(vld1q_u8(y + x), vdupq_n_u8(16));
+    uint8x8_t u8, v8;
+    if (uv) {
+      const uint8x8x2_t c = vld2_u8(uv + x);
+      u8 = c.val[0];
+      v8 = c.val[1];
+    } else {
+      u8 = vld1_u8(u + x / 2);
+      v8 = vld1_u8(v + x / 2);
+    }
+    // each chroma sample covers two neighbouring pixels
+    const int16x8x2_t cu =
+        vzipq_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), c128),
+                  vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), c128));
+    const int16x8x2_t cv =
+        vzipq_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), c128),
+                  vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), c128));
+    uint8x8_t b_lo, g_lo, r_lo, b_hi, g_hi, r_hi;
+    yuv_to_bgr_8(vmovl_u8(vget_low_u8(yv)), cu.val[0],
+                 cv.val[0], b_lo, g_lo, r_lo);
+    yuv_to_bgr_8(vmovl_u8(vget_high_u8(yv)), cu.val[1],
+                 cv.val[1], b_hi, g_hi, r_hi);
+    if (channels == 4) {
+      const uint8x16x4_t px = {{vcombine_u8(b_lo, b_hi), vcombine_u8(g_lo, g_hi),
+                                vcombine_u8(r_lo, r_hi), vdupq_n_u8(255)}};
+      vst4q_u8(dst + x * 4, px);
+    } else {
+      const uint8x16x3_t px = {{vcombine_u8(b_lo, b_hi), vcombine_u8(g_lo, g_hi),
+                                vcombine_u8(r_lo, r_hi)}};
+      vst3q_u8(dst + x * 3, px);
+    }
+  }
+  yuv_pixels_scalar(y, u, v, uv, x, width, dst, channels);
+}
+
+#endif
+
+YuvRowFunction select_yuv_row() {
+#if defined(COLORCONV_X86_DISPATCH)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return &yuv_row_avx2;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return &yuv_row_ssse3;
+  }
+#elif defined(COLORCONV_NEON)
+  return &yuv_row_neon;
+#endif
+  return &yuv_row_scalar;
+}
+
+} // namespace
+
+bool is_raw_camera_format(AVPixelFormat format) {
+  switch (format) {
+  case AV_PIX_FMT_BAYER_BGGR8:
+  case AV_PIX_FMT_BAYER_RGGB8:
+  case AV_PIX_FMT_BAYER_GBRG8:
+  case AV_PIX_FMT_BAYER_GRBG8:
+  case AV_PIX_FMT_GRAY8:
+    return true;
+  default:
+    return false;
+  }
+}
+
+namespace {
+
+void convert_raw(const std::uint8_t *src, int src_stride, int width,
+                 int height, AVPixelFormat src_format, AVPixelFormat dst_format,
+                 std::uint8_t *const dst[], const int dst_stride[],
+                 bool vectorized) {
+  if (width % 2 != 0 || height % 2 != 0) {
+    throw std::invalid_argument("Raw conversion needs even image dimensions");
+  }
+  if (dst_format != AV_PIX_FMT_YUV420P && dst_format != AV_PIX_FMT_NV12) {
+    throw std::invalid_argument("Raw conversion only outputs YUV420P or NV12");
+  }
+  const bool mono = src_format == AV_PIX_FMT_GRAY8;
+  const CellLayout layout = mono ? CellLayout{0, 0, 0, 0} : cell_layout(src_format);
+  const bool nv12 = dst_format == AV_PIX_FMT_NV12;
+
+  for (int row = 0; row < height; row += 2) {
+    const std::uint8_t *row0 = src + static_cast<std::ptrdiff_t>(row) * src_stride;
+    const std::uint8_t *row1 = row0 + src_stride;
+    std::uint8_t *y0 = dst[0] + static_cast<std::ptrdiff_t>(row) * dst_stride[0];
+    std::uint8_t *y1 = y0 + dst_stride[0];
+    std::uint8_t *u =
+        dst[1] + static_cast<std::ptrdiff_t>(row / 2) * dst_stride[1];
+    std::uint8_t *v =
+        nv12 ? nullptr
+             : dst[2] + static_cast<std::ptrdiff_t>(row / 2) * dst_stride[2];
+    if (mono) {
+      const auto row_function = vectorized ? &mono_row : &mono_row_scalar;
+      row_function(row0, width, y0);
+      row_function(row1, width, y1);
+      std::memset(u, 128, nv12 ? width : width / 2);
+      if (!nv12) {
+        std::memset(v, 128, width / 2);
+      }
+    } else if (!vectorized) {
+      bayer_cells_scalar(row0, row1, 0, width, layout, y0, y1,
+                         nv12 ? nullptr : u, v, nv12 ? u : nullptr);
+    } else if (nv12) {
+      bayer_rows(row0, row1, width, layout, y0, y1, nullptr, nullptr, u);
+    } else {
+      bayer_rows(row0, row1, width, layout, y0, y1, u, v, nullptr);
+    }
+  }
+}
+
+void convert_yuv420(const std::uint8_t *const src[], const int src_stride[],
+                    int width, int row_begin, int row_end,
+                    AVPixelFormat src_format, std::uint8_t *dst, int dst_stride,
+                    int dst_channels, YuvRowFunction convert_row) {
+  if (!is_yuv420_format(src_format)) {
+    throw std::invalid_argument("Not a YUV 4:2:0 format");
+  }
+  if (dst_channels != 3 && dst_channels != 4) {
+    throw std::invalid_argument("Output must have 3 or 4 channels");
+  }
+  const bool nv12 = src_format == AV_PIX_FMT_NV12;
+  for (int row = row_begin; row < row_end; ++row) {
+    const std::ptrdiff_t chroma_row = row / 2;
+    const std::uint8_t *y = src[0] + static_cast<std::ptrdiff_t>(row) * src_stride[0];
+    const std::uint8_t *u = src[1] + chroma_row * src_stride[1];
+    const std::uint8_t *v = nv12 ? nullptr : src[2] + chroma_row * src_stride[2];
+    convert_row(y, nv12 ? nullptr : u, v, nv12 ? u : nullptr, width,
+                dst + static_cast<std::ptrdiff_t>(row) * dst_stride,
+                dst_channels);
+  }
+}
+
+} // namespace
+
+void convert_raw_to_yuv420(const std::uint8_t *src, int src_stride, int width,
+                           int height, AVPixelFormat src_format,
+                           AVPixelFormat dst_format, std::uint8_t *const dst[],
+                           const int dst_stride[]) {
+  convert_raw(src, src_stride, width, height, src_format, dst_format, dst,
+              dst_stride, true);
+}
+
+void convert_raw_to_yuv420_reference(const std::uint8_t *src, int src_stride,
+                                     int width, int height,
+                                     AVPixelFormat src_format,
+                                     AVPixelFormat dst_format,
+                                     std::uint8_t *const dst[],
+                                     const int dst_stride[]) {
+  convert_raw(src, src_stride, width, height, src_format, dst_format, dst,
+              dst_stride, false);
+}
+
+bool is_yuv420_format(AVPixelFormat format) {
+  return format == AV_PIX_FMT_YUV420P || format == AV_PIX_FMT_NV12;
+}
+
+void convert_yuv420_to_bgr(const std::uint8_t *const src[],
+                           const int src_stride[], int width, int row_begin,
+                           int row_end, AVPixelFormat src_format,
+                           std::uint8_t *dst, int dst_stride,
+                           int dst_channels) {
+  static const YuvRowFunction convert_row = select_yuv_row();
+  convert_yuv420(src, src_stride, width, row_begin, row_end, src_format, dst,
+                 dst_stride, dst_channels, convert_row);
+}
+
+void convert_yuv420_to_bgr_reference(const std::uint8_t *const src[],
+                                     const int src_stride[], int width,
+                                     int row_begin, int row_end,
+                                     AVPixelFormat src_format,
+                                     std::uint8_t *dst, int dst_stride,
+                                     int dst_channels) {
+  convert_yuv420(src, src_stride, width, row_begin, row_end, src_format, dst,
+                 dst_stride, dst_channels, &yuv_row_scalar);
+}
+
+} // namespace avutils
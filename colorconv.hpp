@@ -0,0 +1,100 @@
+#ifndef COLORCONV_HPP_7RWM2KDA
+#define COLORCONV_HPP_7RWM2KDA
+
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+}
+
+namespace avutils {
+
+/**
+ * @brief   Check whether \ref convert_raw_to_yuv420 can handle a raw camera format
+ *
+ * @param format    input pixel format
+ *
+ * @return  true for 8 bit Bayer patterns and GRAY8
+ */
+bool is_raw_camera_format(AVPixelFormat format);
+
+/**
+ * @brief   Convert a raw 8 bit Bayer or mono image to YUV 4:2:0 (BT.601, limited
+ * range, same as swscale) in a single pass.
+ *
+ * Demosaicing is fused with chroma subsampling: each 2x2 Bayer cell yields
+ * exactly one chroma sample, computed from the cell's R, B and averaged G. Luma
+ * is computed per pixel from the pixel's own sample plus the cell's values
+ * for the other two channels, so no full resolution RGB image is ever formed.
+ * Runs 16 pixels at a time with SSE2 or NEON where available.
+ *
+ * @param src   first pixel
+ * @param src_stride    bytes per input row
+ * @param width image width, must be even
+ * @param height    image height, must be even
+ * @param src_format    one of the formats accepted by \ref is_raw_camera_format
+ * @param dst_format    AV_PIX_FMT_YUV420P or AV_PIX_FMT_NV12
+ * @param dst   output planes (3 for YUV420P, 2 for NV12)
+ * @param dst_stride    output plane strides
+ */
+void convert_raw_to_yuv420(const std::uint8_t *src, int src_stride, int width,
+                           int height, AVPixelFormat src_format,
+                           AVPixelFormat dst_format, std::uint8_t *const dst[],
+                           const int dst_stride[]);
+
+/**
+ * @brief   Same as \ref convert_raw_to_yuv420 with the scalar code only, which
+ * the vectorized code must match byte for byte. For checking it.
+ */
+void convert_raw_to_yuv420_reference(const std::uint8_t *src, int src_stride,
+                                     int width, int height,
+                                     AVPixelFormat src_format,
+                                     AVPixelFormat dst_format,
+                                     std::uint8_t *const dst[],
+                                     const int dst_stride[]);
+
+/**
+ * @brief   Check whether \ref convert_yuv420_to_bgr can read a pixel format
+ *
+ * @param format    decoded frame format
+ *
+ * @return  true for YUV420P and NV12
+ */
+bool is_yuv420_format(AVPixelFormat format);
+
+/**
+ * @brief   Convert rows of a YUV 4:2:0 image (BT.601, limited range) to packed
+ * BGR or BGRA in a single pass, without upsampling chroma into an intermediate
+ * buffer. Picks AVX2, SSSE3 or NEON code at runtime, scalar code otherwise.
+ * Only touches rows [row_begin, row_end), so callers can split an image into
+ * stripes and convert them in parallel.
+ *
+ * @param src   input planes (3 for YUV420P, 2 for NV12)
+ * @param src_stride    input plane strides
+ * @param width image width
+ * @param row_begin first row to convert
+ * @param row_end   one past the last row to convert
+ * @param src_format    one of the formats accepted by \ref is_yuv420_format
+ * @param dst   first row of the output image (not of the range)
+ * @param dst_stride    bytes per output row
+ * @param dst_channels  3 for BGR, 4 for BGRA (alpha is set to 255)
+ */
+void convert_yuv420_to_bgr(const std::uint8_t *const src[],
+                           const int src_stride[], int width, int row_begin,
+                           int row_end, AVPixelFormat src_format,
+                           std::uint8_t *dst, int dst_stride, int dst_channels);
+
+/**
+ * @brief   Same as \ref convert_yuv420_to_bgr with the scalar code only, which
+ * the vectorized code must match byte for byte. For checking it.
+ */
+void convert_yuv420_to_bgr_reference(const std::uint8_t *const src[],
+                                     const int src_stride[], int width,
+                                     int row_begin, int row_end,
+                                     AVPixelFormat src_format,
+                                     std::uint8_t *dst, int dst_stride,
+                                     int dst_channels);
+
+} // namespace avutils
+
+#endif /* end of include guard: COLORCONV_HPP_7RWM2KDA */
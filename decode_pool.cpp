@@ -0,0 +1,69 @@
+#include "decode_pool.hpp"
+#include "threading.hpp"
+#include <algorithm>
+
+DecodePool::DecodePool(unsigned int threads) {
+  const unsigned int count = threads > 0 ? threads : available_cores();
+  for (unsigned int i = 0; i < count; ++i) {
+    threads_.emplace_back(&DecodePool::work, this);
+  }
+}
+
+std::size_t DecodePool::post(Strand &strand, std::function<void()> task) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  strand.tasks_.push_back(std::move(task));
+  if (!strand.queued_) {
+    strand.queued_ = true;
+    ready_.push_back(&strand);
+    ready_cv_.notify_one();
+  }
+  return strand.tasks_.size();
+}
+
+void DecodePool::cancel(Strand &strand) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  strand.tasks_.clear();
+  if (strand.queued_ && !strand.running_) {
+    ready_.erase(std::remove(ready_.begin(), ready_.end(), &strand),
+                 ready_.end());
+    strand.queued_ = false;
+  }
+  idle_cv_.wait(lock, [&strand]() { return !strand.running_; });
+}
+
+void DecodePool::work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    ready_cv_.wait(lock, [this]() { return !ready_.empty() || stop_; });
+    if (ready_.empty()) {
+      return;
+    }
+    Strand *strand = ready_.front();
+    ready_.pop_front();
+    std::function<void()> task = std::move(strand->tasks_.front());
+    strand->tasks_.pop_front();
+    strand->running_ = true;
+    lock.unlock();
+    task();
+    lock.lock();
+    strand->running_ = false;
+    if (strand->tasks_.empty()) {
+      strand->queued_ = false;
+    } else {
+      ready_.push_back(strand);
+      ready_cv_.notify_one();
+    }
+    idle_cv_.notify_all();
+  }
+}
+
+DecodePool::~DecodePool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  ready_cv_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
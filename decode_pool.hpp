@@ -0,0 +1,98 @@
+#ifndef DECODE_POOL_HPP_T2WN6FJK
+#define DECODE_POOL_HPP_T2WN6FJK
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief   Threads shared by the decoders of many streams, so receiving nine
+ * streams doesn't take nine decoding threads each with its own slice threads.
+ * Work is posted to a stream's \ref Strand: tasks of one strand run in the
+ * order they were posted and never at the same time, tasks of different
+ * strands run in parallel. A strand whose task finished goes behind the other
+ * waiting strands, so one busy stream can't starve the rest.
+ *
+ * Receivers take one with \ref DecodeSettings. The pool must outlive them.
+ */
+class DecodePool {
+public:
+  /**
+   * @brief Tasks of one stream. Owned by whoever posts to it, and cancelled
+   * with cancel() before it is destroyed.
+   */
+  class Strand {
+    friend class DecodePool;
+    std::deque<std::function<void()>> tasks_;
+    bool queued_ = false;  ///< waiting for a thread, or running
+    bool running_ = false; ///< a task is running
+  };
+
+private:
+  std::vector<std::thread> threads_;
+  std::deque<Strand *> ready_; ///< strands with tasks, none running
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable ready_cv_;
+  std::condition_variable idle_cv_; ///< a task finished
+
+  /**
+   * @brief Run tasks until stopped
+   */
+  void work();
+
+public:
+  /**
+   * @brief ctor. Starts the threads.
+   *
+   * @param threads 0 for one per core
+   */
+  explicit DecodePool(unsigned int threads = 0);
+
+  DecodePool(const DecodePool &) = delete;
+  DecodePool &operator=(const DecodePool &) = delete;
+
+  /**
+   * @brief Queue a task. Never blocks. Tasks must not throw.
+   *
+   * @return    tasks of the strand waiting, including this one, so the
+   * caller can tell it is falling behind
+   */
+  std::size_t post(Strand &strand, std::function<void()> task);
+
+  /**
+   * @brief Drop the tasks of a strand which did not start yet, and wait for
+   * the running one to finish
+   */
+  void cancel(Strand &strand);
+
+  /**
+   * @brief Get the number of threads
+   */
+  std::size_t size() const { return threads_.size(); }
+
+  /**
+   * @brief dtor. Runs the tasks still queued, then stops the threads.
+   */
+  ~DecodePool();
+};
+
+/**
+ * @brief   How a receiver decodes
+ */
+struct DecodeSettings {
+  /// decode on shared threads instead of the receiving thread, nullptr for
+  /// the latter
+  DecodePool *pool = nullptr;
+  /// hand out the decoded frames as they are, in the `yuv` of the receiver's
+  /// `DecodedFrame`, instead of converting them to BGRA. For consumers
+  /// converting straight into their own buffers.
+  bool yuv = false;
+  int threads = 0; ///< decoder slice threads, 0 to choose from frame size
+};
+
+#endif /* end of include guard: DECODE_POOL_HPP_T2WN6FJK */
@@ -1,9 +1,48 @@
 #include "avreceiver.hpp"
+#include "tracing.hpp"
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <opencv2/highgui.hpp>
+
+static volatile bool stop_receiving = false;
+
+void shutdown_receiver(int signal) { stop_receiving = true; }
+
 int main(int argc, char *argv[]) {
-  const std::string host = argc > 1 ? argv[1] : "localhost";
-  AVReceiver receiver(host, 15001);
-  while (true) {
-    receiver.receive();
+  std::signal(SIGINT, shutdown_receiver);
+  const std::string endpoint =
+      argc > 1 ? argv[1] : "tcp://localhost:15001";
+  const std::string trace_path = argc > 2 ? argv[2] : "";
+  std::unique_ptr<FeedbackClient> feedback;
+  if (argc > 3) {
+    // sender's feedback endpoint, to request keyframes after loss
+    feedback.reset(new FeedbackClient(argv[3]));
+  }
+  {
+    AVReceiver receiver(endpoint, 30, std::move(feedback));
+    std::cout << "Connected to " << endpoint << std::endl;
+    const std::string win_name = "decoded";
+    cv::namedWindow(win_name, cv::WindowFlags::WINDOW_NORMAL);
+    while (!stop_receiving) {
+      AVReceiver::DecodedFrame frame = receiver.get_frame();
+      if (!frame.image.empty()) {
+        tracing::ScopedSpan span(tracing::Stage::Present, frame.frame_id);
+        cv::imshow(win_name, frame.image);
+        cv::waitKey(1);
+      }
+    }
+    const auto stats = receiver.get_stats();
+    std::cout << "Decoded " << stats.frames_decoded << " frames, lost "
+              << stats.packets_lost << " packets, received "
+              << stats.bytes_received / KB << " KB" << std::endl;
+  }
+  const auto spans = tracing::collect();
+  tracing::print_report(tracing::summarize(spans), std::cout);
+  if (!trace_path.empty()) {
+    std::ofstream ofs(trace_path);
+    tracing::write_chrome_trace(spans, ofs);
   }
   return 0;
 }
@@ -0,0 +1,85 @@
+#include "stream_wall.hpp"
+#include "tracing.hpp"
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <iostream>
+#include <opencv2/highgui.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+static volatile bool stop_receiving = false;
+
+void shutdown_receiver(int signal) { stop_receiving = true; }
+
+int main(int argc, char **argv) {
+  av_log_set_level(AV_LOG_ERROR);
+  std::signal(SIGINT, shutdown_receiver);
+  bool headless = false;
+  double seconds = 0;
+  WallLayout layout;
+  std::vector<std::string> sources;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--headless") {
+      headless = true;
+    } else if (arg.compare(0, 10, "--seconds=") == 0) {
+      seconds = std::stod(arg.substr(10));
+    } else if (arg.compare(0, 6, "--fps=") == 0) {
+      layout.fps = static_cast<unsigned int>(std::stoi(arg.substr(6)));
+    } else {
+      sources.push_back(arg);
+    }
+  }
+  if (sources.empty()) {
+    std::cout << "Usage: " << argv[0]
+              << " [--headless] [--seconds=<run time>] [--fps=60]"
+                 " <SDP file or ZeroMQ endpoint>..."
+              << std::endl;
+    return 1;
+  }
+  // the smallest square grid holding every stream
+  const int count = static_cast<int>(sources.size());
+  layout.columns = static_cast<int>(std::ceil(std::sqrt(count)));
+  layout.rows = (count + layout.columns - 1) / layout.columns;
+
+  const std::string win_name = "Wall";
+  WallPresenter presenter;
+  if (!headless) {
+    // called on the compositing thread, the only one using highgui
+    presenter = [&win_name](const cv::Mat &canvas) {
+      cv::imshow(win_name, canvas);
+      cv::waitKey(1);
+    };
+  }
+  {
+    StreamWall wall(layout, presenter);
+    for (const auto &source : sources) {
+      if (source.find("://") != std::string::npos) {
+        wall.add_zmq(source);
+      } else {
+        wall.add_rtp(source);
+      }
+    }
+    wall.start();
+    const auto started = std::chrono::steady_clock::now();
+    while (!stop_receiving &&
+           (seconds <= 0 || std::chrono::steady_clock::now() - started <
+                                std::chrono::duration<double>(seconds))) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    wall.stop();
+    const auto stats = wall.get_stats();
+    std::cout << "Rendered " << stats.renders << " canvases, skipped "
+              << stats.skipped << ", compositing p50 "
+              << stats.composite_p50_ms << " ms, p99 "
+              << stats.composite_p99_ms << " ms" << std::endl;
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+      std::cout << sources[i] << ": decoded " << stats.decoded[i]
+                << ", shown " << stats.shown[i] << std::endl;
+    }
+  }
+  tracing::print_report(tracing::summarize(tracing::collect()), std::cout);
+  return 0;
+}
@@ -1,140 +1,109 @@
-#include "avreceiver.hpp"
 #include "avtransmitter.hpp"
 #include "avutils.hpp"
+#include "capture_service.hpp"
+#include "colorconv.hpp"
+#include "feedback.hpp"
+#include "frame_source.hpp"
+#include "simulated_source.hpp"
+#include "spinnaker_source.hpp"
 #include <chrono>
 #include <csignal>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iomanip>
+#include <memory>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
 #include "time_functions.hpp"
+#include "tracing.hpp"
+#include "zmq_sink.hpp"
 
-#include "SpinGenApi/SpinnakerGenApi.h"
-#include "Spinnaker.h"
-
-using std::string;
-using namespace Spinnaker::GenApi;
 using namespace std::chrono;
 
-static Spinnaker::SystemPtr spinnaker_system = nullptr;
-static Spinnaker::CameraPtr camera = nullptr;
-static Spinnaker::CameraList camList;
-static Spinnaker::ImagePtr currentFrame = nullptr;
-
 static volatile bool stop = false;
 
 void shutdown_camera(int signal) { stop = true; }
 
-int setCameraSetting(const string &node, const string &value) {
-  INodeMap &nodeMap = camera->GetNodeMap();
-
-  // Retrieve enumeration node from nodemap
-  CEnumerationPtr ptr = nodeMap.GetNode(node.c_str());
-  if (!IsAvailable(ptr)) {
-    return -1;
-  }
-  if (!IsWritable(ptr)) {
-    return -1;
-  }
-  // Retrieve entry node from enumeration node
-  CEnumEntryPtr ptrValue = ptr->GetEntryByName(value.c_str());
-  if (!IsAvailable(ptrValue)) {
-    return -1;
-  }
-  if (!IsReadable(ptrValue)) {
-    return -1;
-  }
-  // retrieve value from entry node
-  const int64_t valueToSet = ptrValue->GetValue();
-
-  // Set value from entry node as new value of enumeration node
-  ptr->SetIntValue(valueToSet);
-
-  return 0;
+/**
+ * @brief   Open a camera by serial number, or a simulated one for "simulated"
+ */
+std::unique_ptr<FrameSource> open_source(const std::string &serial,
+                                         unsigned int fps,
+                                         unsigned int seed = 0) {
+  if (serial == "simulated") {
+    // no camera needed, e.g. for profiling on any machine
+    SimulatedCamera config;
+    config.fps = fps;
+    config.seed = seed;
+    return std::unique_ptr<FrameSource>(new SimulatedSource(config));
+  }
+  return std::unique_ptr<FrameSource>(new SpinnakerSource(serial, fps));
 }
 
-int setCameraSetting(const string &node, int val) {
-  INodeMap &nodeMap = camera->GetNodeMap();
-
-  CIntegerPtr ptr = nodeMap.GetNode(node.c_str());
-  if (!IsAvailable(ptr)) {
-    return -1;
-  }
-  if (!IsWritable(ptr)) {
-    return -1;
-  }
-  ptr->SetValue(val);
-  return 0;
+/**
+ * @brief   Stamp the time into a frame the transmitter converted, luma only,
+ * which is enough for white text. Raw camera images are only stamped once
+ * demosaiced.
+ */
+void stamp_frame(AVFrame *frame) {
+  if (!avutils::is_yuv420_format(static_cast<AVPixelFormat>(frame->format))) {
+    return;
+  }
+  cv::Mat luma(frame->height, frame->width, CV_8UC1, frame->data[0],
+               frame->linesize[0]);
+  stamp_image(luma, system_clock::now(), 0.1);
 }
-int setCameraSetting(const string &node, float val) {
-  INodeMap &nodeMap = camera->GetNodeMap();
-  CFloatPtr ptr = nodeMap.GetNode(node.c_str());
-  if (!IsAvailable(ptr)) {
-    return -1;
-  }
-  if (!IsWritable(ptr)) {
-    return -1;
-  }
-  ptr->SetValue(val);
 
-  return 0;
-}
-int setCameraSetting(const string &node, bool val) {
-  INodeMap &nodeMap = camera->GetNodeMap();
-
-  CBooleanPtr ptr = nodeMap.GetNode(node.c_str());
-  if (!IsAvailable(ptr)) {
-    return -1;
+void print_stats(const std::vector<CaptureService::StreamStats> &stats) {
+  std::cout << std::fixed << std::setprecision(1);
+  for (const auto &stream : stats) {
+    std::cout << stream.name << ": " << stream.fps << " fps, p50 "
+              << stream.p50_ms << " ms, p99 " << stream.p99_ms << " ms, "
+              << stream.late << " late, " << stream.replaced
+              << " replaced, " << stream.source.dropped
+              << " dropped by the camera" << std::endl;
   }
-  if (!IsWritable(ptr)) {
-    return -1;
-  }
-  ptr->SetValue(val);
-
-  return 0;
 }
 
-int setPixFmt() {
-  try {
-    return setCameraSetting("PixelFormat", string("BayerBG8"));
-  } catch (const std::exception &) {
-  }
-  try {
-    return setCameraSetting("PixelFormat", string("BayerRG8"));
-  } catch (const std::exception &) {
+/**
+ * @brief   Stream several cameras from this process, sharing the encoding
+ * threads. Camera i streams to port + 2i.
+ */
+int stream_cameras(const std::vector<std::string> &serials,
+                   const std::string &host, unsigned int port,
+                   const std::string &codec, unsigned int fps) {
+  CaptureService service;
+  for (std::size_t i = 0; i < serials.size(); ++i) {
+    std::unique_ptr<AVTransmitter> transmitter(new AVTransmitter(
+        host, port + 2 * static_cast<unsigned int>(i), fps, 10, 5'000'000,
+        codec));
+    transmitter->set_frame_overlay(&stamp_frame);
+    // each frame should be out before the camera's next one
+    service.add_stream(open_source(serials[i], fps, i), std::move(transmitter),
+                       std::chrono::nanoseconds(1'000'000'000 / fps));
+  }
+  service.start();
+  std::cout << "Beginning capture of " << serials.size() << " cameras."
+            << std::endl;
+  auto next_report = steady_clock::now() + seconds(5);
+  while (!stop) {
+    std::this_thread::sleep_for(milliseconds(100));
+    if (steady_clock::now() >= next_report) {
+      print_stats(service.get_stats());
+      next_report += seconds(5);
+    }
   }
-  return -1;
-}
-
-void resetUserSet() {
-  std::this_thread::sleep_for(std::chrono::seconds(1));
-  camera->UserSetSelector.SetValue(
-      Spinnaker::UserSetSelectorEnums::UserSetSelector_Default);
-
-  camera->UserSetLoad.Execute();
-  std::this_thread::sleep_for(std::chrono::seconds(1));
-}
-
-int setExposureTime(float exposure_time) {
-  return setCameraSetting("ExposureTime", exposure_time);
-}
-
-int setExposureAuto(const string &mode) {
-  return setCameraSetting("ExposureAuto", mode);
-}
-
-int setGainAutoDisable() { return setCameraSetting("GainAuto", string("Off")); }
-
-int setSharpeningDisable() {
-  return setCameraSetting("SharpeningEnable", false);
-}
-
-int setWhiteBalanceAuto() {
-  return setCameraSetting("BalanceWhiteAuto", string("Continuous"));
+  std::cout << "Shutting down cameras." << std::endl;
+  service.stop();
+  print_stats(service.get_stats());
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -144,159 +113,106 @@ int main(int argc, char *argv[]) {
   std::string serial;
   std::string rtp_rcv_host;
   unsigned int rtp_rcv_port;
+  bool pipelined = false;
+  std::string codec;
+  std::string trace_path;
+  std::string zmq_endpoint;
+  std::string feedback_endpoint;
 
   if (argc > 3) {
     serial = argv[1];
     rtp_rcv_host = argv[2];
     rtp_rcv_port = std::atoi(argv[3]);
+    pipelined = argc > 4 && std::string(argv[4]) == std::string("true");
+    codec = argc > 5 ? argv[5] : "vp9";
+    trace_path = argc > 6 ? argv[6] : "";
+    zmq_endpoint = argc > 7 ? argv[7] : "";
+    feedback_endpoint = argc > 8 ? argv[8] : "";
   } else {
-    std::cout << "Usage: " << argv[0] << " <serial> <host> <port>" << std::endl;
+    std::cout << "Usage: " << argv[0]
+              << " <serial or 'simulated'>[,<serial>...] <host> <port>"
+                 " [<pipelined true/false>]"
+                 " [<codec>] [<trace.json>] [<zmq endpoint>]"
+                 " [<feedback endpoint>]"
+              << std::endl;
     return 1;
   }
   constexpr int fps = 30;
-  AVTransmitter transmitter(rtp_rcv_host, rtp_rcv_port, fps, 10, 5'000'000);
-
-  spinnaker_system = Spinnaker::System::GetInstance();
-
-  // Retrieve list of cameras from the spinnaker_system
-  camList = spinnaker_system->GetCameras();
-
-  camera = camList.GetBySerial(serial);
-
-  if (!camera) {
-    std::cout << "Camera could not be gotten." << std::endl;
-    return 2;
+  std::vector<std::string> serials;
+  std::istringstream serial_list(serial);
+  for (std::string item; std::getline(serial_list, item, ',');) {
+    serials.push_back(item);
+  }
+  if (serials.size() > 1) {
+    if (pipelined || !zmq_endpoint.empty() || !feedback_endpoint.empty()) {
+      std::cout << "Several cameras only stream over RTP, without pipeline "
+                   "or feedback"
+                << std::endl;
+      return 1;
+    }
+    return stream_cameras(serials, rtp_rcv_host, rtp_rcv_port, codec, fps);
   }
-
-  camList.Clear();
-
-  // Initialize camera
-  std::cout << "Init camera" << std::endl;
-  camera->Init();
-
-  INodeMap& snodeMap = camera->GetTLStreamNodeMap();
-
-  CEnumerationPtr ptrStreamBufferHandling =
-      snodeMap.GetNode("StreamBufferHandlingMode");
-  if (!IsAvailable(ptrStreamBufferHandling) ||
-      !IsWritable(ptrStreamBufferHandling)) {
-    throw std::invalid_argument(
-        "Node StreamBufferHandlingMode not available or writeable");
+  AVTransmitter transmitter(rtp_rcv_host, rtp_rcv_port, fps, 10, 5'000'000,
+                            codec);
+  transmitter.set_frame_overlay(&stamp_frame);
+  if (!zmq_endpoint.empty()) {
+    // for decode_video_zmq, e.g. over links too lossy for RTP
+    transmitter.add_sink(std::make_shared<ZmqSink>(zmq_endpoint));
   }
-  // Retrieve entry node from enumeration node
-  CEnumEntryPtr ptrStreamBufferHandlingModeNewestOnly =
-      ptrStreamBufferHandling->GetEntryByName("NewestOnly");
-  if (!IsAvailable(ptrStreamBufferHandlingModeNewestOnly) ||
-      !IsReadable(ptrStreamBufferHandlingModeNewestOnly)) {
-    throw std::invalid_argument("Unable to read node 'NewestOnly'");
+  std::unique_ptr<FeedbackServer> feedback;
+  if (!feedback_endpoint.empty()) {
+    // receivers ask for keyframes after loss, and their reports steer the
+    // bitrate between a tenth of the configured one and the configured one
+    transmitter.enable_rate_control(5'000'000 / 10, 5'000'000);
+    feedback.reset(new FeedbackServer(
+        feedback_endpoint, [&transmitter](const FeedbackMessage &message) {
+          transmitter.handle_feedback(message);
+        }));
   }
-
-  int64_t streamBufferHandlingModeNewestOnly =
-      ptrStreamBufferHandlingModeNewestOnly->GetValue();
-  ptrStreamBufferHandling->SetIntValue(streamBufferHandlingModeNewestOnly);
-
-  /* resetUserSet(); */
-
-  std::cout << "Setting params" << std::endl;
-  // Set acquisition mode to continuous
-  if (setCameraSetting("AcquisitionMode", string("Continuous")) == -1) {
-    throw std::runtime_error("Could not set AcquisitionMode");
-  }
-
-  setCameraSetting("AcquisitionFrameRateEnabled", true);
-  setCameraSetting("AcquisitionFrameRateEnable", true);
-  setCameraSetting("AcquisitionFrameRateAuto", std::string("Off"));
-  setCameraSetting("AcquisitionFrameRate", fps);
-
-  // Important, otherwise we don't get frames at all
-  if (setPixFmt() == -1) {
-    std::cout << "Could not set pixel format" << std::endl;
+  if (pipelined) {
+    // keep only the newest frame, same as the camera's NewestOnly buffering
+    transmitter.start_pipeline(1, DropPolicy::DropOldest);
   }
 
-  setCameraSetting("ExposureAuto", string("On"));
-
-  std::cout << "Beginning acquisition" << std::endl;
-  camera->BeginAcquisition();
-
-  // wait a bit for camera to start streaming
-  std::this_thread::sleep_for(std::chrono::seconds(1));
+  std::unique_ptr<FrameSource> source = open_source(serial, fps);
+  source->start();
 
   std::cout << "Beginning capture." << std::endl;
 
   while (!stop) {
-    /* std::cout << "Gettin frame" << std::endl; */
-    try {
-      currentFrame = camera->GetNextImage(10);
-      if (currentFrame->IsIncomplete()) {
-        std::cout << "Incomplete" << std::endl;
-        currentFrame->Release();
-        currentFrame = nullptr;
-      } else if (currentFrame->GetImageStatus() != Spinnaker::IMAGE_NO_ERROR) {
-        std::cout << "Image Error" << std::endl;
-        currentFrame->Release();
-        currentFrame = nullptr;
-      }
-    } catch (const Spinnaker::Exception &e) {
-      std::cout << "Exception: " << e.what() << std::endl;
+    avutils::BorrowedImage borrowed;
+    const GrabStatus status = source->grab(milliseconds(10), borrowed);
+    if (status == GrabStatus::Incomplete) {
+      std::cout << "Incomplete" << std::endl;
     }
-
-    if (currentFrame) {
-      /* std::cout << "Convert" << std::endl; */
-      Spinnaker::ImagePtr convertedImage;
-
-      convertedImage = currentFrame->Convert(Spinnaker::PixelFormat_RGB8,
-                                             Spinnaker::NEAREST_NEIGHBOR);
-      currentFrame->Release();
-      currentFrame = convertedImage;
-
-      cv::Mat image(currentFrame->GetHeight() + currentFrame->GetYPadding(),
-                    currentFrame->GetWidth() + currentFrame->GetXPadding(),
-                    CV_8UC3, currentFrame->GetData(),
-                    currentFrame->GetStride());
-
-      std::cout << "Begin encode " << std::setprecision(5) << std::fixed
-                << duration_cast<milliseconds>(
-                       system_clock::now().time_since_epoch())
-                           .count() /
-                       1000.0
-                << std::endl;
-      stamp_image(image, system_clock::now(), 0.1);
-      auto tic = current_millis();
-      transmitter.encode_frame(image);
-      std::cout << "Took " << 1000*(current_millis() - tic )<< std::endl;
-      std::cout << "Encoded at " << std::setprecision(5) << std::fixed
-                << duration_cast<milliseconds>(
-                       system_clock::now().time_since_epoch())
-                           .count() /
-                       1000.0
-                << std::endl;
-      currentFrame = nullptr;
+    if (status != GrabStatus::Ok) {
+      continue;
+    }
+    // no copy in either mode, the transmitter releases the image when done
+    if (pipelined) {
+      transmitter.submit_frame(std::move(borrowed));
+    } else {
+      transmitter.encode_frame(std::move(borrowed));
     }
   }
 
   std::cout << "Shitting down cameras." << std::endl;
-
-  if (currentFrame) {
-    try {
-      std::cout << "Release current frame" << std::endl;
-      currentFrame->Release();
-    } catch (Spinnaker::Exception &e) {
-      std::cout << "Caught error " << e.what() << std::endl;
-    }
-    currentFrame = nullptr;
-  }
-  std::cout << "End acquisition" << std::endl;
-  camera->EndAcquisition();
-  std::cout << "Deinit camera" << std::endl;
-  camera->DeInit();
-  // when spinnaker_system  is released in same scope, camera ptr must be
-  // cleaned up before
-  camera = nullptr;
-  std::cout << "Clear camera list" << std::endl;
-  camList.Clear();
-  std::cout << "Release system" << std::endl;
-  spinnaker_system->ReleaseInstance();
-  spinnaker_system = nullptr;
+  transmitter.stop_pipeline();
+  const auto stats = transmitter.get_stats();
+  std::cout << "Submitted " << stats.frames_submitted << " frames, dropped "
+            << stats.frames_dropped << std::endl;
+  const auto spans = tracing::collect();
+  tracing::print_report(tracing::summarize(spans), std::cout);
+  if (!trace_path.empty()) {
+    std::ofstream ofs(trace_path);
+    tracing::write_chrome_trace(spans, ofs);
+  }
+
+  const auto captured = source->get_stats();
+  std::cout << "Grabbed " << captured.grabbed << " frames, "
+            << captured.incomplete << " incomplete, " << captured.dropped
+            << " dropped by " << source->name() << std::endl;
+  source.reset();
 
   return 0;
 }
@@ -1,10 +1,17 @@
-#include "avreceiver.hpp"
 #include "avtransmitter.hpp"
 #include "avutils.hpp"
+#include "colorconv.hpp"
+#include "feedback.hpp"
+#include "frame_pacer.hpp"
+#include "image_loader.hpp"
 #include "time_functions.hpp"
+#include "tracing.hpp"
+#include "zmq_sink.hpp"
 #include <chrono>
+#include <csignal>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -14,6 +21,10 @@
 
 using namespace std;
 
+static volatile bool stop = false;
+
+void shutdown_encoder(int signal) { stop = true; }
+
 int main(int argc, char *argv[]) {
   /* av_log_set_level(AV_LOG_TRACE); */
 
@@ -24,89 +35,121 @@ int main(int argc, char *argv[]) {
   std::string rtp_rcv_host;
   unsigned int rtp_rcv_port;
   bool loop;
+  std::string codec;
+  std::string trace_path;
+  std::string zmq_endpoint;
+  std::string feedback_endpoint;
 
-  if (argc > 4) {
+  if (argc > 5) {
     directory = argv[1];
     ext = argv[2];
     rtp_rcv_host = argv[3];
     rtp_rcv_port = std::atoi(argv[4]);
     loop = std::string(argv[5]) == std::string("true");
+    codec = argc > 6 ? argv[6] : "vp9";
+    trace_path = argc > 7 ? argv[7] : "";
+    zmq_endpoint = argc > 8 ? argv[8] : "";
+    feedback_endpoint = argc > 9 ? argv[9] : "";
   } else {
     std::cout << "Usage: " << argv[0]
-              << " <directory> <ext> <host> <port> <true/false>" << std::endl;
+              << " <directory> <ext> <host> <port> <true/false> [<codec>]"
+                 " [<trace.json>] [<zmq endpoint>] [<feedback endpoint>]"
+              << std::endl;
     return 1;
   }
+  std::signal(SIGINT, shutdown_encoder);
   constexpr int fps = 30;
-  constexpr int budget_ms = 1000.0 / fps;
-  AVTransmitter transmitter(rtp_rcv_host, rtp_rcv_port, fps, 6, 5e6);
+  // two seconds of decoded frames ahead of the encoder
+  constexpr unsigned int lookahead = 2 * fps;
 
   const string glob_expr = directory + "*." + ext;
   std::cout << "Globbing: " << glob_expr << std::endl;
   vector<string> filenames;
   cv::glob(glob_expr, filenames);
-  std::cout << "Found " << filenames.size()
-            << " images (will read all before encoding)" << std::endl;
+  std::cout << "Found " << filenames.size() << " images" << std::endl;
   sort(filenames.begin(), filenames.end());
-  const int n_frames = filenames.size();
 
-  vector<cv::Mat> images;
-  for (int i = 0; i < n_frames; ++i) {
-    images.push_back(cv::imread(filenames[i]));
+  // declared first, so it outlives the images the transmitter still holds
+  std::unique_ptr<ImageLoader> loader;
+  AVTransmitter transmitter(rtp_rcv_host, rtp_rcv_port, fps, 6, 5e6, codec);
+  if (!zmq_endpoint.empty()) {
+    // for decode_video_zmq, e.g. over links too lossy for RTP
+    transmitter.add_sink(std::make_shared<ZmqSink>(zmq_endpoint));
+  }
+  std::unique_ptr<FeedbackServer> feedback;
+  if (!feedback_endpoint.empty()) {
+    // receivers ask for keyframes after loss, and their reports steer the
+    // bitrate between a tenth of the configured one and the configured one
+    transmitter.enable_rate_control(5e6 / 10, 5e6);
+    feedback.reset(new FeedbackServer(
+        feedback_endpoint, [&transmitter](const FeedbackMessage &message) {
+          transmitter.handle_feedback(message);
+        }));
+  }
+  // decoded straight to the encoder's format, so the transmitter doesn't
+  // convert
+  loader.reset(new ImageLoader(filenames, transmitter.pixel_format(),
+                               lookahead, 0, loop));
+  if (loader->resident()) {
+    std::cout << "Images fit into look-ahead, decoding only once and "
+                 "without timestamps"
+              << std::endl;
   }
 
-  constexpr bool put_text = true;
-  constexpr bool print_timings = true;
+  // resident images are shared by every pass over the directory and must
+  // stay as decoded, so stamping is left out for them
+  const bool put_text = !loader->resident();
   bool has_sdp = false;
 
-  std::cout << std::setprecision(5) << std::fixed;
-  int ms = 0;
-  const auto begin = chrono::system_clock::now();
-  int n_runs = 0;
-  for (int i = 0; i < n_frames || loop; ++i) {
-    if (i == n_frames) {
-      ++n_runs;
-      i = 0;
+  // when encoding overruns, drop images to keep the stream's timing instead
+  // of sending a burst
+  FramePacer pacer(fps, 1, OverrunPolicy::Skip);
+  const auto begin = chrono::steady_clock::now();
+  avutils::BorrowedImage image;
+  while (!stop && loader->next(image)) {
+    bool more = true;
+    for (std::uint64_t skipped = pacer.wait(); skipped > 0 && more;
+         --skipped) {
+      if (image.release) {
+        image.release();
+      }
+      more = loader->next(image);
+    }
+    if (!more) {
+      break;
     }
     auto tic = chrono::system_clock::now();
-    auto desired_end_time =
-        begin + milliseconds(budget_ms * (i + 1 + (n_frames * n_runs)));
-    cv::Mat &image = images[i];
-    if (put_text) {
-      stamp_image(image, tic, 0.1);
+    // taking it from the loader is the capture here
+    const std::int64_t captured_ns = tracing::now_ns();
+    if (put_text && avutils::is_yuv420_format(image.format)) {
+      // decoded for this frame alone, the slot is decoded into again after
+      // release; luma only, which is enough for white text
+      cv::Mat luma(image.height, image.width, CV_8UC1,
+                   const_cast<std::uint8_t *>(image.data[0]),
+                   image.linesize[0]);
+      stamp_image(luma, tic, 0.1);
     }
-    std::cout << "Begin encode at "
-              << format_timepoint_iso8601(system_clock::now()) << std::endl;
-    transmitter.encode_frame(image);
-    std::cout << "Finish encode at "
-              << format_timepoint_iso8601(system_clock::now()) << std::endl;
+    image.captured_ns = captured_ns;
+    transmitter.encode_frame(std::move(image));
     if (!has_sdp) {
       has_sdp = true;
       std::ofstream ofs("test.sdp");
       ofs << transmitter.get_sdp();
     }
-    const auto toc = chrono::system_clock::now();
-
-    const auto remaining = desired_end_time - toc;
-    const auto elapsed_encoding =
-        chrono::duration_cast<chrono::milliseconds>(toc - tic).count();
-    if (remaining.count() > 0) {
-      int sleep = duration_cast<milliseconds>(remaining).count();
-      if (print_timings) {
-        std::cout << "Elapsed for encoding " << elapsed_encoding << std::endl;
-        std::cout << "Sleep for " << sleep << std::endl;
-      }
-      std::this_thread::sleep_for(milliseconds(sleep));
-    }
-    const auto toc2 = chrono::system_clock::now();
-    const auto actually_slept =
-        chrono::duration_cast<chrono::milliseconds>(toc2 - toc).count();
-    if (print_timings) {
-      std::cout << "actually slept " << actually_slept << std::endl;
-      const auto elapsed_total =
-          chrono::duration_cast<chrono::milliseconds>(toc2 - tic).count();
-      ms += elapsed_total;
-      cout << "fps = " << (i + 1 + (n_runs * n_frames)) * 1000.0 / ms << endl;
-    }
+  }
+  const auto elapsed_s =
+      chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+  const auto stats = transmitter.get_stats();
+  const auto pacing = pacer.get_stats();
+  std::cout << "Encoded " << stats.frames_encoded << " frames at "
+            << stats.frames_encoded / elapsed_s << " fps, " << pacing.late
+            << " late, " << pacing.skipped << " skipped (worst overrun "
+            << pacing.max_lateness_ns / 1e6 << " ms)" << std::endl;
+  const auto spans = tracing::collect();
+  tracing::print_report(tracing::summarize(spans), std::cout);
+  if (!trace_path.empty()) {
+    std::ofstream ofs(trace_path);
+    tracing::write_chrome_trace(spans, ofs);
   }
   return 0;
 }
@@ -0,0 +1,294 @@
+#include "fec.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+/// FEC packets waiting for their media packets at most
+constexpr std::size_t max_pending = 64;
+
+std::uint16_t read16(const std::uint8_t *bytes) {
+  return static_cast<std::uint16_t>(bytes[0] << 8 | bytes[1]);
+}
+
+std::uint32_t read32(const std::uint8_t *bytes) {
+  return static_cast<std::uint32_t>(bytes[0]) << 24 |
+         static_cast<std::uint32_t>(bytes[1]) << 16 |
+         static_cast<std::uint32_t>(bytes[2]) << 8 | bytes[3];
+}
+
+void write16(std::uint8_t *bytes, std::uint16_t value) {
+  bytes[0] = static_cast<std::uint8_t>(value >> 8);
+  bytes[1] = static_cast<std::uint8_t>(value);
+}
+
+void write32(std::uint8_t *bytes, std::uint32_t value) {
+  write16(bytes, static_cast<std::uint16_t>(value >> 16));
+  write16(bytes + 2, static_cast<std::uint16_t>(value));
+}
+
+} // namespace
+
+FecEncoder::FecEncoder(double ratio, std::uint8_t payload_type,
+                       PacketHandler send)
+    : ratio_(ratio), payload_type_(payload_type), send_(std::move(send)),
+      block_(fec_max_protected), media_packets_(0), media_bytes_(0),
+      fec_packets_(0), fec_bytes_(0) {
+  if (!(ratio > 0 && ratio <= 1)) {
+    throw std::invalid_argument("FEC ratio must be above 0 and at most 1");
+  }
+}
+
+void FecEncoder::add(const std::uint8_t *packet, std::size_t size) {
+  if (size < 12 || (packet[0] >> 6) != 2) {
+    return;
+  }
+  ++media_packets_;
+  media_bytes_ += size;
+  if (count_ > 0) {
+    // the sender did not mark the end of the previous frame, or started over
+    const std::uint8_t *last = block_[count_ - 1].data.data();
+    const auto next = static_cast<std::uint16_t>(read16(last + 2) + 1);
+    if (read32(last + 4) != read32(packet + 4) ||
+        read32(last + 8) != read32(packet + 8) || next != read16(packet + 2)) {
+      flush();
+    }
+  }
+  Protected &entry = block_[count_++];
+  entry.data.assign(packet, packet + size);
+  entry.size = size;
+  if ((packet[1] & 0x80) || count_ == fec_max_protected) {
+    flush();
+  }
+}
+
+void FecEncoder::flush() {
+  if (count_ == 0) {
+    return;
+  }
+  const std::size_t groups = std::min(
+      count_, static_cast<std::size_t>(std::ceil(count_ * ratio_)));
+  const std::uint8_t *first = block_[0].data.data();
+  const std::uint8_t *last = block_[count_ - 1].data.data();
+  for (std::size_t group = 0; group < groups; ++group) {
+    // everything after the RTP header is protected, CSRCs and padding too
+    std::size_t length = 0;
+    for (std::size_t i = group; i < count_; i += groups) {
+      length = std::max(length, block_[i].size - 12);
+    }
+    fec_.assign(12 + fec_overhead + length, 0);
+    std::uint8_t *header = fec_.data() + 12;
+    std::uint8_t *parity = header + fec_overhead;
+    std::uint16_t length_recovery = 0;
+    std::uint64_t mask = 0;
+    for (std::size_t i = group; i < count_; i += groups) {
+      const std::uint8_t *data = block_[i].data.data();
+      const std::size_t size = block_[i].size;
+      // P, X, CC, M, PT and the timestamp
+      header[0] ^= data[0];
+      header[1] ^= data[1];
+      for (std::size_t b = 4; b < 8; ++b) {
+        header[b] ^= data[b];
+      }
+      length_recovery ^= static_cast<std::uint16_t>(size - 12);
+      for (std::size_t b = 12; b < size; ++b) {
+        parity[b - 12] ^= data[b];
+      }
+      mask |= std::uint64_t(1) << (47 - i);
+    }
+    // E clear, L set for the 48 bit mask
+    header[0] = 0x40 | (header[0] & 0x3f);
+    write16(header + 2, read16(first + 2));
+    write16(header + 8, length_recovery);
+    // level 0 covers the whole payload
+    write16(header + 10, static_cast<std::uint16_t>(length));
+    for (std::size_t b = 0; b < 6; ++b) {
+      header[12 + b] = static_cast<std::uint8_t>(mask >> (40 - 8 * b));
+    }
+    fec_[0] = 0x80;
+    fec_[1] = payload_type_;
+    write16(fec_.data() + 2, sequence_++);
+    std::memcpy(fec_.data() + 4, last + 4, 4);
+    // a stream of its own, next to the media's
+    write32(fec_.data() + 8, read32(first + 8) + 1);
+    send_(fec_.data(), fec_.size());
+    ++fec_packets_;
+    fec_bytes_ += fec_.size();
+  }
+  count_ = 0;
+}
+
+FecEncoder::Stats FecEncoder::get_stats() const {
+  return Stats{media_packets_.load(), media_bytes_.load(),
+               fec_packets_.load(), fec_bytes_.load()};
+}
+
+FecDecoder::FecDecoder(PacketHandler recovered, std::size_t history)
+    : recovered_handler_(std::move(recovered)), history_(history),
+      fec_packets_(0), recovered_count_(0), unrecoverable_(0) {
+  if (history < 2 * fec_max_protected || (history & (history - 1)) != 0) {
+    throw std::invalid_argument(
+        "FEC history must be a power of 2 of at least 96 packets");
+  }
+}
+
+const FecDecoder::Media *FecDecoder::find(std::uint16_t sequence) {
+  const Media &media = slot(sequence);
+  return media.sequence == sequence ? &media : nullptr;
+}
+
+void FecDecoder::remember(const std::uint8_t *data, std::size_t size,
+                          std::uint16_t sequence) {
+  Media &media = slot(sequence);
+  media.data.assign(data, data + size);
+  media.size = size;
+  media.sequence = sequence;
+  if (static_cast<std::int16_t>(
+          static_cast<std::uint16_t>(sequence - highest_)) > 0) {
+    highest_ = sequence;
+  }
+}
+
+void FecDecoder::reset(std::uint32_t ssrc) {
+  for (auto &media : history_) {
+    media.sequence = -1;
+  }
+  pending_.clear();
+  ssrc_ = ssrc;
+  have_ssrc_ = true;
+}
+
+void FecDecoder::add_media(const RtpPacket &packet) {
+  if (!have_ssrc_ || packet.ssrc != ssrc_) {
+    reset(packet.ssrc);
+    highest_ = packet.sequence;
+  }
+  remember(packet.data.data(), packet.size, packet.sequence);
+  if (!pending_.empty()) {
+    // a reordered packet may complete an FEC packet which came before it
+    try_recover(packet.arrival_ns);
+  }
+}
+
+void FecDecoder::add_fec(const RtpPacket &packet) {
+  ++fec_packets_;
+  const std::uint8_t *payload = packet.payload();
+  if (!have_ssrc_ || packet.payload_size < 14) {
+    return;
+  }
+  Fec fec;
+  fec.base = read16(payload + 2);
+  const bool long_mask = payload[0] & 0x40;
+  if (long_mask && packet.payload_size < 18) {
+    return;
+  }
+  fec.mask = static_cast<std::uint64_t>(read16(payload + 12)) << 32;
+  if (long_mask) {
+    fec.mask |= read32(payload + 14);
+  }
+  fec.data.assign(payload, payload + packet.payload_size);
+  pending_.push_back(std::move(fec));
+  if (pending_.size() > max_pending) {
+    pending_.pop_front();
+    ++unrecoverable_;
+  }
+  try_recover(packet.arrival_ns);
+}
+
+bool FecDecoder::recover(const Fec &fec, std::uint16_t missing,
+                         std::int64_t arrival_ns) {
+  const std::uint8_t *header = fec.data.data();
+  const std::size_t parity_offset = 10 + ((header[0] & 0x40) ? 8 : 4);
+  const std::size_t length = read16(header + 10);
+  if (fec.data.size() < parity_offset + length) {
+    return false;
+  }
+  std::uint8_t first = header[0];
+  std::uint8_t second = header[1];
+  std::uint32_t timestamp = read32(header + 4);
+  std::uint16_t size = read16(header + 8);
+  parity_.assign(header + parity_offset, header + parity_offset + length);
+  for (std::size_t i = 0; i < fec_max_protected; ++i) {
+    const auto sequence = static_cast<std::uint16_t>(fec.base + i);
+    if (!((fec.mask >> (47 - i)) & 1) || sequence == missing) {
+      continue;
+    }
+    const Media *media = find(sequence);
+    const std::uint8_t *data = media->data.data();
+    first ^= data[0];
+    second ^= data[1];
+    timestamp ^= read32(data + 4);
+    size ^= static_cast<std::uint16_t>(media->size - 12);
+    const std::size_t protected_size = std::min(media->size - 12, length);
+    for (std::size_t b = 0; b < protected_size; ++b) {
+      parity_[b] ^= data[12 + b];
+    }
+  }
+  if (size > length) {
+    return false;
+  }
+  RtpPacket &packet = recovered_;
+  if (packet.data.size() < 12u + size) {
+    // the jitter buffer hands back empty buffers at first
+    packet.data.resize(12u + size);
+  }
+  std::uint8_t *data = packet.data.data();
+  data[0] = 0x80 | (first & 0x3f);
+  data[1] = second;
+  write16(data + 2, missing);
+  write32(data + 4, timestamp);
+  write32(data + 8, ssrc_);
+  std::memcpy(data + 12, parity_.data(), size);
+  packet.size = 12u + size;
+  if (!packet.parse()) {
+    return false;
+  }
+  packet.arrival_ns = arrival_ns;
+  remember(data, packet.size, missing);
+  ++recovered_count_;
+  recovered_handler_(packet);
+  return true;
+}
+
+void FecDecoder::try_recover(std::int64_t arrival_ns) {
+  const auto oldest = static_cast<std::int16_t>(history_.size() -
+                                                fec_max_protected);
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (auto it = pending_.begin(); it != pending_.end();) {
+      if (static_cast<std::int16_t>(static_cast<std::uint16_t>(
+              highest_ - it->base)) >= oldest) {
+        // its packets are leaving the history
+        ++unrecoverable_;
+        it = pending_.erase(it);
+        continue;
+      }
+      std::size_t missing_count = 0;
+      std::uint16_t missing = 0;
+      for (std::size_t i = 0; i < fec_max_protected; ++i) {
+        const auto sequence = static_cast<std::uint16_t>(it->base + i);
+        if (((it->mask >> (47 - i)) & 1) && !find(sequence)) {
+          ++missing_count;
+          missing = sequence;
+        }
+      }
+      if (missing_count > 1) {
+        ++it;
+        continue;
+      }
+      // the recovered packet may be the last one missing for another
+      if (missing_count == 1 && recover(*it, missing, arrival_ns)) {
+        progress = true;
+      }
+      it = pending_.erase(it);
+    }
+  }
+}
+
+FecDecoder::Stats FecDecoder::get_stats() const {
+  return Stats{fec_packets_.load(), recovered_count_.load(),
+               unrecoverable_.load()};
+}
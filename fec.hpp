@@ -0,0 +1,239 @@
+#ifndef FEC_HPP_T5RW2JXE
+#define FEC_HPP_T5RW2JXE
+
+#include "jitter_buffer.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+/**
+ * @brief   Bytes an FEC packet adds to the largest media packet it protects:
+ * the FEC header and a level 0 header with a 48 bit mask, as in RFC 5109.
+ * Media packets must leave that much room below the MTU.
+ */
+constexpr std::size_t fec_overhead = 10 + 8;
+
+/// consecutive media packets one FEC packet can protect at most
+constexpr std::size_t fec_max_protected = 48;
+
+/**
+ * @brief   Generates XOR parity packets for an RTP stream, in the format of
+ * RFC 5109 (ULPFEC) with only level 0, sent as a stream of their own with
+ * another payload type and SSRC.
+ *
+ * Packets are protected per frame: once the packet with the marker bit was
+ * added, or 48 packets without one, `ceil(n * ratio)` FEC packets are
+ * generated for those n packets and sent right after them. Packet i goes
+ * into FEC packet `i % k`, so consecutive packets are in different ones and
+ * a burst of up to k lost packets can be recovered. Every frame gets at
+ * least one FEC packet, which makes small frames cost more than the ratio.
+ *
+ * Not thread safe, except for get_stats().
+ */
+class FecEncoder {
+public:
+  /**
+   * @brief Counters since construction
+   */
+  struct Stats {
+    std::uint64_t media_packets;
+    std::uint64_t media_bytes; ///< of the datagrams
+    std::uint64_t fec_packets;
+    std::uint64_t fec_bytes; ///< of the datagrams
+  };
+
+  /**
+   * @brief Sends a datagram
+   */
+  using PacketHandler =
+      std::function<void(const std::uint8_t *data, std::size_t size)>;
+
+private:
+  struct Protected {
+    std::vector<std::uint8_t> data;
+    std::size_t size = 0;
+  };
+
+  double ratio_;
+  std::uint8_t payload_type_;
+  PacketHandler send_;
+  std::vector<Protected> block_; ///< packets since the last FEC, reused
+  std::size_t count_ = 0;        ///< of them in `block_`
+  std::uint16_t sequence_ = 0;   ///< of the next FEC packet
+  std::vector<std::uint8_t> fec_; ///< scratch for building one
+
+  std::atomic<std::uint64_t> media_packets_;
+  std::atomic<std::uint64_t> media_bytes_;
+  std::atomic<std::uint64_t> fec_packets_;
+  std::atomic<std::uint64_t> fec_bytes_;
+
+public:
+  /**
+   * @brief ctor
+   *
+   * @param ratio   FEC packets per media packet, more than 0 and at most 1
+   * @param payload_type    of the FEC packets
+   * @param send    sends the FEC packets
+   * @throw std::invalid_argument for a ratio out of range
+   */
+  FecEncoder(double ratio, std::uint8_t payload_type, PacketHandler send);
+
+  FecEncoder(const FecEncoder &) = delete;
+  FecEncoder &operator=(const FecEncoder &) = delete;
+
+  /**
+   * @brief Protect a media packet which was just sent, and send the FEC
+   * packets when it completes a block
+   *
+   * @param packet  RTP datagram, ignored if it is not one
+   * @param size    of the datagram, at most the MTU less \ref fec_overhead
+   */
+  void add(const std::uint8_t *packet, std::size_t size);
+
+  /**
+   * @brief Send the FEC packets for what was added so far
+   */
+  void flush();
+
+  /**
+   * @brief Get counters. Thread safe.
+   */
+  Stats get_stats() const;
+};
+
+/**
+ * @brief   Recovers lost RTP packets from the FEC packets of an
+ * \ref FecEncoder. Keeps copies of the recent media packets, and every FEC
+ * packet until all packets it protects are there. When only one of them is
+ * missing, the XOR of the FEC packet and the others is that packet. A
+ * recovered packet can complete another FEC packet in turn.
+ *
+ * Recovery happens before the \ref JitterBuffer, which takes recovered
+ * packets like reordered ones. If they come after the missing ones were
+ * given up, the buffer learns to wait for them.
+ *
+ * Not thread safe, except for get_stats().
+ */
+class FecDecoder {
+public:
+  /**
+   * @brief Counters since construction
+   */
+  struct Stats {
+    std::uint64_t fec_packets;   ///< received
+    std::uint64_t recovered;     ///< media packets
+    std::uint64_t unrecoverable; ///< FEC packets given up with more than
+                                 ///< one of their packets missing
+  };
+
+  /**
+   * @brief Gets each recovered packet, parsed, which it may swap buffers
+   * with
+   */
+  using PacketHandler = std::function<void(RtpPacket &packet)>;
+
+private:
+  struct Media {
+    std::vector<std::uint8_t> data;
+    std::size_t size = 0;
+    std::int32_t sequence = -1; ///< -1 if empty
+  };
+
+  struct Fec {
+    std::vector<std::uint8_t> data; ///< FEC header, level header and parity
+    std::uint16_t base;             ///< sequence number of the first packet
+    std::uint64_t mask;             ///< bit 47 for the first packet
+  };
+
+  PacketHandler recovered_handler_;
+  std::vector<Media> history_;
+  std::deque<Fec> pending_;
+  std::uint32_t ssrc_ = 0;
+  bool have_ssrc_ = false;
+  std::uint16_t highest_ = 0; ///< of the media packets
+  RtpPacket recovered_;       ///< handed out
+  std::vector<std::uint8_t> parity_; ///< scratch for recovering one
+
+  std::atomic<std::uint64_t> fec_packets_;
+  std::atomic<std::uint64_t> recovered_count_;
+  std::atomic<std::uint64_t> unrecoverable_;
+
+  Media &slot(std::uint16_t sequence) {
+    return history_[sequence & (history_.size() - 1)];
+  }
+
+  /**
+   * @brief Get a media packet if it is in the history
+   *
+   * @return    nullptr if it is missing
+   */
+  const Media *find(std::uint16_t sequence);
+
+  /**
+   * @brief Copy a media packet into the history
+   */
+  void remember(const std::uint8_t *data, std::size_t size,
+                std::uint16_t sequence);
+
+  /**
+   * @brief Forget everything, e.g. for a new sender
+   */
+  void reset(std::uint32_t ssrc);
+
+  /**
+   * @brief Rebuild a missing packet from an FEC packet and the others it
+   * protects
+   *
+   * @return    false if the FEC packet is malformed
+   */
+  bool recover(const Fec &fec, std::uint16_t missing,
+               std::int64_t arrival_ns);
+
+  /**
+   * @brief Recover what the pending FEC packets allow, and drop those which
+   * are done with or too old
+   *
+   * @param arrival_ns  of the packet which made it possible
+   */
+  void try_recover(std::int64_t arrival_ns);
+
+public:
+  /**
+   * @brief ctor
+   *
+   * @param recovered   gets the recovered packets
+   * @param history media packets kept, a power of two well above the
+   * packets that can be in flight before their FEC packets arrive
+   * @throw std::invalid_argument if the history is not a power of two or
+   * too short for one block of packets
+   */
+  explicit FecDecoder(PacketHandler recovered, std::size_t history = 512);
+
+  FecDecoder(const FecDecoder &) = delete;
+  FecDecoder &operator=(const FecDecoder &) = delete;
+
+  /**
+   * @brief Keep a received media packet, before it goes to the jitter
+   * buffer
+   *
+   * @param packet  parsed
+   */
+  void add_media(const RtpPacket &packet);
+
+  /**
+   * @brief Take a received FEC packet
+   *
+   * @param packet  parsed
+   */
+  void add_fec(const RtpPacket &packet);
+
+  /**
+   * @brief Get counters. Thread safe.
+   */
+  Stats get_stats() const;
+};
+
+#endif /* end of include guard: FEC_HPP_T5RW2JXE */
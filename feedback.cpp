@@ -0,0 +1,159 @@
+#include "feedback.hpp"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+FeedbackServer::FeedbackServer(zmq::context_t &ctx,
+                               const std::string &endpoint, Handler handler)
+    : handler_(std::move(handler)), stop_(false) {
+  start(ctx, endpoint);
+}
+
+FeedbackServer::FeedbackServer(const std::string &endpoint, Handler handler)
+    : own_ctx_(new zmq::context_t(1)), handler_(std::move(handler)),
+      stop_(false) {
+  start(*own_ctx_, endpoint);
+}
+
+void FeedbackServer::start(zmq::context_t &ctx, const std::string &endpoint) {
+  socket_ = zmq::socket_t(ctx, zmq::socket_type::pull);
+  // wake up regularly to check for stop
+  socket_.set(zmq::sockopt::rcvtimeo, 100);
+  socket_.set(zmq::sockopt::linger, 0);
+  socket_.bind(endpoint);
+  thread_ = std::thread(&FeedbackServer::run, this);
+}
+
+void FeedbackServer::run() {
+  zmq::message_t incoming;
+  while (!stop_.load()) {
+    if (!socket_.recv(incoming)) {
+      continue; // timed out
+    }
+    FeedbackMessage message;
+    if (incoming.size() < sizeof(message)) {
+      std::cerr << "Malformed feedback" << std::endl;
+      continue;
+    }
+    std::memcpy(&message, incoming.data(), sizeof(message));
+    if (message.magic != feedback_magic) {
+      std::cerr << "Not a feedback message" << std::endl;
+      continue;
+    }
+    handler_(message);
+  }
+}
+
+FeedbackServer::~FeedbackServer() {
+  stop_.store(true);
+  thread_.join();
+  socket_.close();
+}
+
+FeedbackClient::FeedbackClient(zmq::context_t &ctx,
+                               const std::string &endpoint,
+                               std::chrono::milliseconds retry,
+                               std::chrono::milliseconds report_interval)
+    : retry_(retry), report_interval_(report_interval),
+      last_report_(Clock::now()), last_frame_id_(tracing::no_frame) {
+  connect(ctx, endpoint);
+}
+
+FeedbackClient::FeedbackClient(const std::string &endpoint,
+                               std::chrono::milliseconds retry,
+                               std::chrono::milliseconds report_interval)
+    : own_ctx_(new zmq::context_t(1)), retry_(retry),
+      report_interval_(report_interval), last_report_(Clock::now()),
+      last_frame_id_(tracing::no_frame) {
+  connect(*own_ctx_, endpoint);
+}
+
+void FeedbackClient::connect(zmq::context_t &ctx,
+                             const std::string &endpoint) {
+  socket_ = zmq::socket_t(ctx, zmq::socket_type::push);
+  // stale feedback is worthless, keep only a few
+  socket_.set(zmq::sockopt::sndhwm, 4);
+  socket_.set(zmq::sockopt::linger, 0);
+  socket_.connect(endpoint);
+}
+
+bool FeedbackClient::send(const FeedbackMessage &message) {
+  return static_cast<bool>(socket_.send(zmq::buffer(&message, sizeof(message)),
+                                        zmq::send_flags::dontwait));
+}
+
+void FeedbackClient::request_keyframe(std::int64_t frame_id) {
+  const auto now = Clock::now();
+  if (keyframe_requests_ > 0 && now - last_request_ < retry_) {
+    return;
+  }
+  FeedbackMessage message;
+  std::memset(&message, 0, sizeof(message));
+  message.magic = feedback_magic;
+  message.type = FeedbackType::KeyframeRequest;
+  message.frame_id = frame_id;
+  if (send(message)) {
+    last_request_ = now;
+    ++keyframe_requests_;
+  }
+}
+
+void FeedbackClient::record_arrival(std::int64_t frame_id,
+                                    std::int64_t arrival_ns) {
+  // one sample per frame, the packets of a frame arrive in a burst
+  if (frame_id == last_frame_id_) {
+    return;
+  }
+  if (last_frame_id_ != tracing::no_frame) {
+    const std::int64_t transit_delta =
+        (arrival_ns - last_arrival_ns_) -
+        (frame_id - last_frame_id_) * 1000000000LL / tracing::clock_rate;
+    jitter_ns_ += (std::abs(static_cast<double>(transit_delta)) - jitter_ns_) /
+                  16.0; // RFC 3550, A.8
+  }
+  last_frame_id_ = frame_id;
+  last_arrival_ns_ = arrival_ns;
+}
+
+void FeedbackClient::record_received(std::uint64_t count) {
+  received_ += count;
+}
+
+void FeedbackClient::record_loss(std::uint64_t count) { lost_ += count; }
+
+void FeedbackClient::record_decode(std::int64_t duration_ns) {
+  decode_ns_ += duration_ns;
+  ++decoded_;
+}
+
+void FeedbackClient::report(std::uint64_t frames_replaced) {
+  const auto now = Clock::now();
+  if (now - last_report_ < report_interval_) {
+    return;
+  }
+  FeedbackMessage message;
+  std::memset(&message, 0, sizeof(message));
+  message.magic = feedback_magic;
+  message.type = FeedbackType::ReceiverReport;
+  message.frame_id = last_frame_id_;
+  ReceiverReport &report = message.report;
+  const std::uint64_t expected = received_ + lost_;
+  report.loss_fraction =
+      expected > 0 ? static_cast<float>(lost_) / expected : 0.f;
+  report.jitter_ms = static_cast<float>(jitter_ns_ / 1e6);
+  report.decode_ms =
+      decoded_ > 0 ? static_cast<float>(decode_ns_ / 1e6 / decoded_) : 0.f;
+  report.frames_replaced =
+      static_cast<std::uint32_t>(frames_replaced - replaced_);
+  report.received = received_;
+  // a report that could not be sent is still the end of the interval, the
+  // next one would only be averaged over a longer time
+  send(message);
+  last_report_ = now;
+  received_ = 0;
+  lost_ = 0;
+  decode_ns_ = 0;
+  decoded_ = 0;
+  replaced_ = frames_replaced;
+}
@@ -0,0 +1,208 @@
+#ifndef FEEDBACK_HPP_W8ZC4LMA
+#define FEEDBACK_HPP_W8ZC4LMA
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include "tracing.hpp"
+#include <zmq.hpp>
+
+/**
+ * @brief   Kinds of feedback messages
+ */
+enum class FeedbackType : std::uint32_t {
+  KeyframeRequest = 1, ///< the receiver lost packets and waits for a keyframe
+  ReceiverReport = 2   ///< periodic reception quality, see \ref ReceiverReport
+};
+
+/**
+ * @brief   How well a receiver is doing since its previous report
+ */
+struct ReceiverReport {
+  float loss_fraction; ///< share of packets lost, 0 to 1
+  float jitter_ms;     ///< interarrival jitter as in RFC 3550
+  float decode_ms;     ///< mean time to decode a packet
+  std::uint32_t frames_replaced; ///< decoded frames the next one replaced
+                                 ///< before the consumer took them
+  std::uint64_t received;    ///< packets since last report
+};
+
+/**
+ * @brief   Every feedback message, sent in host byte order
+ */
+struct FeedbackMessage {
+  std::uint32_t magic; ///< \ref feedback_magic
+  FeedbackType type;
+  std::int64_t frame_id; ///< KeyframeRequest: first frame that could not be
+                         ///< decoded, or tracing::no_frame if the receiver's
+                         ///< ids don't match the sender's (RTP)
+  ReceiverReport report; ///< ReceiverReport only
+};
+
+static_assert(sizeof(FeedbackMessage) == 40, "Layout is the protocol");
+
+constexpr std::uint32_t feedback_magic = 0x41564642; // "AVFB"
+
+/**
+ * @brief   Collects feedback from receivers on the sender. ffmpeg's RTP muxer
+ * does not read RTCP, so PLI/FIR can't reach the encoder that way; instead
+ * every receiver, RTP or ZeroMQ, pushes feedback over ZeroMQ. Binds a PULL
+ * socket, any number of receivers can connect.
+ */
+class FeedbackServer {
+public:
+  using Handler = std::function<void(const FeedbackMessage &)>;
+
+private:
+  std::unique_ptr<zmq::context_t> own_ctx_; ///< when not given one
+  zmq::socket_t socket_;
+  Handler handler_;
+  std::atomic<bool> stop_;
+  std::thread thread_;
+
+  /**
+   * @brief Bind and start receiving
+   */
+  void start(zmq::context_t &ctx, const std::string &endpoint);
+
+  /**
+   * @brief Receive messages and pass them to the handler until stopped
+   */
+  void run();
+
+public:
+  /**
+   * @brief ctor. Binds right away.
+   *
+   * @param ctx context, must outlive the server
+   * @param endpoint    e.g. `tcp://0.0.0.0:15002`
+   * @param handler called for each message on the server's thread
+   */
+  FeedbackServer(zmq::context_t &ctx, const std::string &endpoint,
+                 Handler handler);
+
+  /**
+   * @brief ctor with a context of its own
+   */
+  FeedbackServer(const std::string &endpoint, Handler handler);
+
+  FeedbackServer(const FeedbackServer &) = delete;
+  FeedbackServer &operator=(const FeedbackServer &) = delete;
+
+  ~FeedbackServer();
+};
+
+/**
+ * @brief   Sends feedback from a receiver: keyframe requests when asked, and
+ * reports on reception quality gathered from what the receiver records.
+ * Never blocks, feedback that can't be sent right away is dropped.
+ * @warning Not thread safe, meant to be used by one receiving thread
+ */
+class FeedbackClient {
+  using Clock = std::chrono::steady_clock;
+
+  std::unique_ptr<zmq::context_t> own_ctx_; ///< when not given one
+  zmq::socket_t socket_;
+  Clock::duration retry_;
+  Clock::time_point last_request_;
+  std::uint64_t keyframe_requests_ = 0;
+
+  // reception since the last report
+  Clock::duration report_interval_;
+  Clock::time_point last_report_;
+  std::uint64_t received_ = 0;
+  std::uint64_t lost_ = 0;
+  std::int64_t decode_ns_ = 0;
+  std::uint64_t decoded_ = 0;
+  std::uint64_t replaced_ = 0; ///< total at the last report
+  // jitter, kept across reports
+  std::int64_t last_frame_id_;
+  std::int64_t last_arrival_ns_ = 0;
+  double jitter_ns_ = 0;
+
+  void connect(zmq::context_t &ctx, const std::string &endpoint);
+
+  /**
+   * @brief Send a message without waiting
+   *
+   * @return    false if it could not be sent
+   */
+  bool send(const FeedbackMessage &message);
+
+public:
+  /**
+   * @brief ctor
+   *
+   * @param ctx context, must outlive the client
+   * @param endpoint    where the sender's \ref FeedbackServer is bound
+   * @param retry   interval in which keyframe requests are repeated while
+   * still waiting, in case one got lost or the keyframe did
+   * @param report_interval   interval of receiver reports
+   */
+  FeedbackClient(
+      zmq::context_t &ctx, const std::string &endpoint,
+      std::chrono::milliseconds retry = std::chrono::milliseconds(200),
+      std::chrono::milliseconds report_interval =
+          std::chrono::milliseconds(500));
+
+  /**
+   * @brief ctor with a context of its own
+   */
+  FeedbackClient(
+      const std::string &endpoint,
+      std::chrono::milliseconds retry = std::chrono::milliseconds(200),
+      std::chrono::milliseconds report_interval =
+          std::chrono::milliseconds(500));
+
+  /**
+   * @brief Ask for a keyframe. Can be called for every packet while waiting,
+   * requests are only sent once per retry interval.
+   *
+   * @param frame_id    first frame that could not be decoded, see
+   * \ref FeedbackMessage
+   */
+  void request_keyframe(std::int64_t frame_id);
+
+  /**
+   * @brief Record when a frame arrived, for the jitter. Can be called for
+   * every packet of a frame, only the first counts.
+   *
+   * @param frame_id    the frame's id, 90 kHz like RTP timestamps
+   * @param arrival_ns  tracing::now_ns() on arrival
+   */
+  void record_arrival(std::int64_t frame_id, std::int64_t arrival_ns);
+
+  /**
+   * @brief Record packets that arrived, in the unit of record_loss()
+   */
+  void record_received(std::uint64_t count = 1);
+
+  /**
+   * @brief Record packets that never arrived
+   */
+  void record_loss(std::uint64_t count);
+
+  /**
+   * @brief Record how long decoding a packet took
+   */
+  void record_decode(std::int64_t duration_ns);
+
+  /**
+   * @brief Send a receiver report if one is due, and start the next interval
+   *
+   * @param frames_replaced   decoded frames replaced before the consumer
+   * took them, in total since the start, e.g. Mailbox::dropped()
+   */
+  void report(std::uint64_t frames_replaced);
+
+  /**
+   * @brief Get the number of keyframe requests sent
+   */
+  std::uint64_t keyframe_requests() const { return keyframe_requests_; }
+};
+
+#endif /* end of include guard: FEEDBACK_HPP_W8ZC4LMA */
@@ -0,0 +1,80 @@
+#include "frame_pacer.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+FramePacer::FramePacer(unsigned int fps_num, unsigned int fps_den,
+                       OverrunPolicy policy, Clock::duration spin)
+    : rate_num_(fps_num), rate_den_(fps_den), policy_(policy), spin_(spin) {
+  if (fps_num == 0 || fps_den == 0) {
+    throw std::invalid_argument("Frame rate must be positive");
+  }
+  reset();
+}
+
+FramePacer::Clock::time_point FramePacer::deadline(std::uint64_t slot) const {
+  // exact for any slot, instead of summing a rounded period. Whole seconds
+  // worth of slots first, so long runs don't overflow.
+  const std::int64_t s = static_cast<std::int64_t>(slot);
+  const std::int64_t ns =
+      s / rate_num_ * 1'000'000'000 * rate_den_ +
+      s % rate_num_ * 1'000'000'000 * rate_den_ / rate_num_;
+  return start_ + std::chrono::duration_cast<Clock::duration>(
+                      std::chrono::nanoseconds(ns));
+}
+
+std::uint64_t FramePacer::wait() {
+  ++stats_.frames;
+  if (!started_) {
+    started_ = true;
+    start_ = Clock::now();
+    slot_ = 1;
+    return 0;
+  }
+  Clock::time_point due = deadline(slot_);
+  auto now = Clock::now();
+  std::uint64_t skipped = 0;
+  if (now > due) {
+    ++stats_.late;
+    stats_.max_lateness_ns = std::max<std::int64_t>(
+        stats_.max_lateness_ns,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now - due)
+            .count());
+    if (policy_ == OverrunPolicy::CatchUp) {
+      ++slot_;
+      return 0;
+    }
+    // first slot that is still in the future. Split at whole periods of
+    // rate_den_ seconds like deadline(), so long runs don't overflow.
+    const std::int64_t elapsed_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_)
+            .count();
+    const std::int64_t period_ns = 1'000'000'000 * rate_den_;
+    const std::uint64_t next = static_cast<std::uint64_t>(
+        elapsed_ns / period_ns * rate_num_ +
+        elapsed_ns % period_ns * rate_num_ / period_ns + 1);
+    skipped = next - slot_;
+    stats_.skipped += skipped;
+    slot_ = next;
+    due = deadline(slot_);
+  }
+  // the scheduler wakes up late by tens of microseconds or more, so sleep
+  // only until shortly before and spin the rest
+  if (due - now > spin_) {
+    std::this_thread::sleep_until(due - spin_);
+  }
+  while ((now = Clock::now()) < due) {
+    std::this_thread::yield();
+  }
+  stats_.max_wakeup_error_ns = std::max<std::int64_t>(
+      stats_.max_wakeup_error_ns,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now - due).count());
+  ++slot_;
+  return skipped;
+}
+
+void FramePacer::reset() {
+  started_ = false;
+  slot_ = 0;
+  stats_ = Stats{0, 0, 0, 0, 0};
+}
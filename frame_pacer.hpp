@@ -0,0 +1,97 @@
+#ifndef FRAME_PACER_HPP_R7CB3YHD
+#define FRAME_PACER_HPP_R7CB3YHD
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * @brief   What a \ref FramePacer does when the caller misses deadlines
+ */
+enum class OverrunPolicy {
+  CatchUp, ///< keep the schedule, following frames go out without waiting
+           ///< until it is met again. Every frame is sent.
+  Skip     ///< give up the missed slots and continue at the next one in the
+           ///< future. The caller should drop the corresponding frames.
+};
+
+/**
+ * @brief   Releases frames at a fixed rate. Deadlines are computed from the
+ * start time and frame number in nanoseconds on `steady_clock`, so neither
+ * rounding nor late wake-ups accumulate into drift. Waits by sleeping until
+ * shortly before the deadline and spinning for the rest, which is accurate to
+ * a few microseconds instead of the scheduler's wake-up latency.
+ * @warning Not thread safe, meant to be driven by one sending loop
+ */
+class FramePacer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /**
+   * @brief Counters since construction or reset()
+   */
+  struct Stats {
+    std::uint64_t frames;          ///< calls to wait()
+    std::uint64_t late;            ///< wait() called after its deadline
+    std::uint64_t skipped;         ///< slots given up with OverrunPolicy::Skip
+    std::int64_t max_lateness_ns;  ///< worst overrun of a deadline
+    std::int64_t max_wakeup_error_ns; ///< worst wake-up after a deadline that
+                                      ///< was waited for
+  };
+
+private:
+  std::int64_t rate_num_;
+  std::int64_t rate_den_;
+  OverrunPolicy policy_;
+  Clock::duration spin_;
+  Clock::time_point start_;
+  bool started_ = false;
+  std::uint64_t slot_ = 0; ///< slot of the next frame
+  Stats stats_;
+
+public:
+  /**
+   * @brief ctor
+   *
+   * @param fps_num frame rate numerator
+   * @param fps_den frame rate denominator, e.g. 1001 for 29.97 fps
+   * @param policy  what to do when frames can't be produced in time
+   * @param spin    how long before a deadline to stop sleeping and start
+   * spinning. Larger is more precise but burns more CPU.
+   */
+  FramePacer(unsigned int fps_num, unsigned int fps_den = 1,
+             OverrunPolicy policy = OverrunPolicy::CatchUp,
+             Clock::duration spin = std::chrono::microseconds(200));
+
+  /**
+   * @brief Wait until the next frame is due. The first call returns right
+   * away and starts the schedule.
+   *
+   * @return    number of slots skipped before this frame, always 0 with
+   * OverrunPolicy::CatchUp
+   */
+  std::uint64_t wait();
+
+  /**
+   * @brief Get the time a slot is due
+   *
+   * @param slot    frame number since start
+   */
+  Clock::time_point deadline(std::uint64_t slot) const;
+
+  /**
+   * @brief Get the number of slots since start, including skipped ones
+   */
+  std::uint64_t slot() const { return slot_; }
+
+  /**
+   * @brief Start a new schedule at the next wait() and clear counters
+   */
+  void reset();
+
+  /**
+   * @brief Get counters
+   */
+  Stats get_stats() const { return stats_; }
+};
+
+#endif /* end of include guard: FRAME_PACER_HPP_R7CB3YHD */
@@ -0,0 +1,89 @@
+#ifndef FRAME_POOL_HPP_8ZVJ2NQE
+#define FRAME_POOL_HPP_8ZVJ2NQE
+
+#include <atomic>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+/**
+ * @brief   A fixed set of preallocated images which are handed out as ordinary
+ * `cv::Mat`s and recycled once every consumer has dropped its reference. A slot
+ * is free again when the pool holds the only reference to its data, so
+ * consumers need no special release call.
+ * @warning acquire() must only be called from a single thread
+ */
+class FramePool {
+  std::vector<cv::Mat> frames_;
+  std::size_t next_ = 0; ///< where to start looking for a free slot
+  int rows_ = 0;
+  int cols_ = 0;
+  int type_ = -1;
+  std::atomic<std::uint64_t> allocations_;
+
+  /**
+   * @brief Check whether anybody besides the pool references a frame
+   */
+  static bool is_free(const cv::Mat &frame) {
+    // the refcount is modified atomically by whichever thread drops a Mat
+    return __atomic_load_n(&frame.u->refcount, __ATOMIC_ACQUIRE) == 1;
+  }
+
+  void allocate(std::size_t index) {
+    frames_[index].create(rows_, cols_, type_);
+    ++allocations_;
+  }
+
+public:
+  /**
+   * @brief ctor. No memory is allocated until the first acquire()
+   *
+   * @param size    number of frames in the pool. Must cover all frames that
+   * can be in flight at once (queued, displayed, being written), otherwise the
+   * pool grows.
+   */
+  explicit FramePool(std::size_t size) : frames_(size), allocations_(0) {}
+
+  /**
+   * @brief Get an image nobody else references. Only allocates on the first
+   * call, when the requested format changes, or when all frames are in use.
+   *
+   * @param rows
+   * @param cols
+   * @param type    opencv type, e.g. CV_8UC4
+   *
+   * @return    image with undefined contents
+   */
+  cv::Mat acquire(int rows, int cols, int type) {
+    if (rows != rows_ || cols != cols_ || type != type_) {
+      rows_ = rows;
+      cols_ = cols;
+      type_ = type;
+      for (std::size_t i = 0; i < frames_.size(); ++i) {
+        // frames still held by consumers stay valid, they just leave the pool
+        frames_[i] = cv::Mat();
+        allocate(i);
+      }
+    }
+    for (std::size_t i = 0; i < frames_.size(); ++i) {
+      const std::size_t index = (next_ + i) % frames_.size();
+      if (is_free(frames_[index])) {
+        next_ = index + 1;
+        return frames_[index];
+      }
+    }
+    // everything in flight, grow instead of blocking the producer
+    frames_.emplace_back();
+    allocate(frames_.size() - 1);
+    next_ = 0;
+    return frames_.back();
+  }
+
+  /**
+   * @brief Get the number of image buffers allocated so far. Constant in
+   * steady state.
+   */
+  std::uint64_t allocations() const { return allocations_.load(); }
+};
+
+#endif /* end of include guard: FRAME_POOL_HPP_8ZVJ2NQE */
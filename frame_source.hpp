@@ -0,0 +1,80 @@
+#ifndef FRAME_SOURCE_HPP_W3DQ8LZA
+#define FRAME_SOURCE_HPP_W3DQ8LZA
+
+#include "avutils.hpp"
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief   Outcome of FrameSource::grab()
+ */
+enum class GrabStatus {
+  Ok,         ///< the image holds a frame
+  Timeout,    ///< no frame arrived in time
+  Incomplete, ///< a frame arrived with missing data, e.g. lost packets
+              ///< between camera and host. Its buffer is already returned.
+  Error       ///< the frame or the source failed, see the message on stderr
+};
+
+/**
+ * @brief   Camera, or anything else delivering frames at its own pace, in the
+ * way the Spinnaker acquisition loop expects them: frames are grabbed with a
+ * timeout, may come incomplete, and their buffers go back to the source once
+ * released. Sources keep only the newest frame (Spinnaker's NewestOnly
+ * buffer handling), so a slow consumer gets the latest frame instead of a
+ * backlog, and frames it was too slow for count as dropped.
+ */
+class FrameSource {
+public:
+  /**
+   * @brief Counters since start()
+   */
+  struct Stats {
+    std::uint64_t grabbed;    ///< frames handed out by grab()
+    std::uint64_t incomplete; ///< frames grab() reported incomplete
+    std::uint64_t errors;     ///< grab() calls that failed
+    std::uint64_t timeouts;   ///< grab() calls that timed out
+    std::uint64_t dropped;    ///< frames never handed out, overwritten by a
+                              ///< newer one or lost for lack of buffers
+  };
+
+  virtual ~FrameSource() = default;
+
+  /**
+   * @brief Begin acquisition
+   */
+  virtual void start() = 0;
+
+  /**
+   * @brief End acquisition. Frames already grabbed stay valid until they are
+   * released.
+   */
+  virtual void stop() = 0;
+
+  /**
+   * @brief Wait for the next frame
+   *
+   * @param timeout how long to wait at most
+   * @param image   set to the frame if GrabStatus::Ok. Its `release` gives
+   * the buffer back to the source and must be called before too many frames
+   * are held, or the source runs out of buffers and drops frames. Its
+   * `captured_ns` is when the frame was captured.
+   *
+   * @return    whether a frame was grabbed
+   */
+  virtual GrabStatus grab(std::chrono::milliseconds timeout,
+                          avutils::BorrowedImage &image) = 0;
+
+  /**
+   * @brief Get counters
+   */
+  virtual Stats get_stats() const = 0;
+
+  /**
+   * @brief Get a name for messages, e.g. the camera's serial number
+   */
+  virtual std::string name() const = 0;
+};
+
+#endif /* end of include guard: FRAME_SOURCE_HPP_W3DQ8LZA */
@@ -0,0 +1,158 @@
+#include "image_loader.hpp"
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <opencv2/imgcodecs.hpp>
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+ImageLoader::ImageLoader(std::vector<std::string> filenames,
+                         AVPixelFormat format, unsigned int depth,
+                         unsigned int threads, bool loop)
+    : filenames_(std::move(filenames)), format_(format), loop_(loop) {
+  if (depth == 0) {
+    throw std::invalid_argument("Look-ahead depth must be at least 1");
+  }
+  resident_ = loop_ && filenames_.size() <= depth;
+  // when resident, each file gets a slot of its own and is decoded once
+  slots_.resize(resident_ ? std::max<std::size_t>(filenames_.size(), 1)
+                          : depth);
+  for (auto &slot : slots_) {
+    slot.frame = av_frame_alloc();
+  }
+  total_ = loop_ && !resident_ ? std::numeric_limits<std::uint64_t>::max()
+                               : filenames_.size();
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+  }
+  for (unsigned int i = 0; i < threads; ++i) {
+    workers_.emplace_back(&ImageLoader::work, this);
+  }
+}
+
+void ImageLoader::work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    changed_.wait(lock, [this]() {
+      return stopped_ || next_load_ >= total_ ||
+             slots_[next_load_ % slots_.size()].state == SlotState::Free;
+    });
+    if (stopped_ || next_load_ >= total_) {
+      return;
+    }
+    const std::uint64_t sequence = next_load_++;
+    Slot &slot = slots_[sequence % slots_.size()];
+    slot.sequence = sequence;
+    slot.state = SlotState::Loading;
+    // the slot is ours until marked ready, so decode without the lock
+    lock.unlock();
+    const bool loaded =
+        load(filenames_[sequence % filenames_.size()], slot.frame);
+    lock.lock();
+    slot.state = loaded ? SlotState::Ready : SlotState::Failed;
+    changed_.notify_all();
+  }
+}
+
+bool ImageLoader::load(const std::string &filename, AVFrame *frame) const {
+  cv::Mat image = cv::imread(filename, cv::IMREAD_COLOR);
+  if (image.empty()) {
+    return false;
+  }
+  if (frame->width != image.cols || frame->height != image.rows ||
+      frame->format != static_cast<int>(format_)) {
+    av_frame_unref(frame);
+    frame->width = image.cols;
+    frame->height = image.rows;
+    frame->format = static_cast<int>(format_);
+    if (av_frame_get_buffer(frame, 0) < 0) {
+      av_frame_unref(frame);
+      return false;
+    }
+  }
+  // one scaler per decoding thread, freed when the thread exits
+  thread_local std::unique_ptr<SwsContext, avutils::SwsContextDeleter> scaler;
+  scaler.reset(sws_getCachedContext(scaler.release(), image.cols, image.rows,
+                                    AV_PIX_FMT_BGR24, image.cols, image.rows,
+                                    format_, SWS_BICUBIC, nullptr, nullptr,
+                                    nullptr));
+  if (!scaler) {
+    return false;
+  }
+  const std::uint8_t *src[] = {image.data};
+  const int src_stride[] = {static_cast<int>(image.step[0])};
+  sws_scale(scaler.get(), src, src_stride, 0, image.rows, frame->data,
+            frame->linesize);
+  return true;
+}
+
+bool ImageLoader::next(avutils::BorrowedImage &image) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::size_t failures = 0;
+  while (true) {
+    if (stopped_ || failures >= filenames_.size() ||
+        (!loop_ && next_output_ >= filenames_.size())) {
+      return false;
+    }
+    const std::uint64_t sequence =
+        resident_ ? next_output_ % filenames_.size() : next_output_;
+    const std::size_t index = sequence % slots_.size();
+    Slot &slot = slots_[index];
+    changed_.wait(lock, [&]() {
+      return stopped_ ||
+             (slot.sequence == sequence && (slot.state == SlotState::Ready ||
+                                            slot.state == SlotState::Failed));
+    });
+    if (stopped_) {
+      return false;
+    }
+    ++next_output_;
+    if (slot.state == SlotState::Failed) {
+      ++failures;
+      if (!resident_) {
+        slot.state = SlotState::Free;
+        changed_.notify_all();
+      }
+      continue;
+    }
+    const AVFrame *frame = slot.frame;
+    image = avutils::BorrowedImage();
+    for (int i = 0; i < 4; ++i) {
+      image.data[i] = frame->data[i];
+      image.linesize[i] = frame->linesize[i];
+    }
+    image.width = frame->width;
+    image.height = frame->height;
+    image.format = format_;
+    if (!resident_) {
+      // resident slots stay ready for the next round
+      slot.state = SlotState::InUse;
+      image.release = [this, index]() { release(index); };
+    }
+    return true;
+  }
+}
+
+void ImageLoader::release(std::size_t slot) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  slots_[slot].state = SlotState::Free;
+  changed_.notify_all();
+}
+
+void ImageLoader::stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stopped_ = true;
+  changed_.notify_all();
+}
+
+ImageLoader::~ImageLoader() {
+  stop();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+  for (auto &slot : slots_) {
+    av_frame_free(&slot.frame);
+  }
+}
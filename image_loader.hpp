@@ -0,0 +1,109 @@
+#ifndef IMAGE_LOADER_HPP_E6PN1WKQ
+#define IMAGE_LOADER_HPP_E6PN1WKQ
+
+#include "avutils.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief   Reads image files on a pool of threads into a bounded ring of
+ * look-ahead frames, converted to the encoder's pixel format, and hands them
+ * out in file order. Memory use is bounded by the ring depth, not the number
+ * of files, and the first image is available as soon as it is decoded.
+ *
+ * When looping over a dataset that fits into the ring, every file is decoded
+ * only once and the ring is replayed.
+ * @warning Images handed out by next() reference the ring, so the loader must
+ * outlive whoever releases them (e.g. the transmitter)
+ */
+class ImageLoader {
+  enum class SlotState { Free, Loading, Ready, Failed, InUse };
+
+  struct Slot {
+    AVFrame *frame = nullptr; ///< reused across files
+    std::uint64_t sequence = 0;
+    SlotState state = SlotState::Free;
+  };
+
+  std::vector<std::string> filenames_;
+  AVPixelFormat format_;
+  bool loop_;
+  bool resident_; ///< everything fits into the ring, decode only once
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::vector<Slot> slots_;
+  std::uint64_t next_load_ = 0;    ///< next sequence number to decode
+  std::uint64_t next_output_ = 0;  ///< next sequence number to hand out
+  std::uint64_t total_;            ///< sequence numbers to decode
+  bool stopped_ = false;
+  std::vector<std::thread> workers_;
+
+  /**
+   * @brief Decode files until stopped or done
+   */
+  void work();
+
+  /**
+   * @brief Read a file and convert it into a frame
+   *
+   * @param filename
+   * @param frame   output, reallocated if size or format don't match
+   *
+   * @return    false if the file could not be read
+   */
+  bool load(const std::string &filename, AVFrame *frame) const;
+
+  /**
+   * @brief Give a slot back for decoding the next file
+   */
+  void release(std::size_t slot);
+
+public:
+  /**
+   * @brief ctor. Starts decoding right away.
+   *
+   * @param filenames   files in playback order
+   * @param format  pixel format to convert to, usually the encoder's
+   * @param depth   number of decoded frames to keep ahead
+   * @param threads number of decoding threads, 0 for half the cores
+   * @param loop    whether to start over after the last file
+   */
+  ImageLoader(std::vector<std::string> filenames, AVPixelFormat format,
+              unsigned int depth = 16, unsigned int threads = 0,
+              bool loop = false);
+
+  ImageLoader(const ImageLoader &) = delete;
+  ImageLoader &operator=(const ImageLoader &) = delete;
+
+  /**
+   * @brief Wait for the next image in file order. Files which can't be read
+   * are skipped.
+   *
+   * @param image   receives the image. Its data stays valid until
+   * `image.release` is called, after which the memory is reused.
+   *
+   * @return    false after the last file (when not looping), if no file can
+   * be read, or once stopped
+   */
+  bool next(avutils::BorrowedImage &image);
+
+  /**
+   * @brief Stop decoding and make next() return false
+   */
+  void stop();
+
+  /**
+   * @brief Check whether all files were decoded once and are replayed from
+   * memory
+   */
+  bool resident() const { return resident_; }
+
+  ~ImageLoader();
+};
+
+#endif /* end of include guard: IMAGE_LOADER_HPP_E6PN1WKQ */
@@ -0,0 +1,246 @@
+#include "jitter_buffer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+/// reordering samples kept at most, within the history
+constexpr std::size_t max_samples = 128;
+
+} // namespace
+
+bool RtpPacket::parse() {
+  if (size < 12 || size > data.size()) {
+    return false;
+  }
+  const std::uint8_t *bytes = data.data();
+  if ((bytes[0] >> 6) != 2) {
+    return false;
+  }
+  const bool padding = bytes[0] & 0x20;
+  const bool extension = bytes[0] & 0x10;
+  const std::size_t csrc_count = bytes[0] & 0x0f;
+  marker = bytes[1] & 0x80;
+  payload_type = bytes[1] & 0x7f;
+  sequence = static_cast<std::uint16_t>(bytes[2] << 8 | bytes[3]);
+  timestamp = static_cast<std::uint32_t>(bytes[4]) << 24 |
+              static_cast<std::uint32_t>(bytes[5]) << 16 |
+              static_cast<std::uint32_t>(bytes[6]) << 8 | bytes[7];
+  ssrc = static_cast<std::uint32_t>(bytes[8]) << 24 |
+         static_cast<std::uint32_t>(bytes[9]) << 16 |
+         static_cast<std::uint32_t>(bytes[10]) << 8 | bytes[11];
+  std::size_t offset = 12 + 4 * csrc_count;
+  if (extension) {
+    if (offset + 4 > size) {
+      return false;
+    }
+    offset += 4 + 4 * static_cast<std::size_t>(bytes[offset + 2] << 8 |
+                                               bytes[offset + 3]);
+  }
+  std::size_t end = size;
+  if (padding) {
+    const std::size_t padding_size = bytes[size - 1];
+    if (padding_size == 0 || padding_size > end) {
+      return false;
+    }
+    end -= padding_size;
+  }
+  if (offset > end) {
+    return false;
+  }
+  payload_offset = offset;
+  payload_size = end - offset;
+  return true;
+}
+
+JitterBuffer::JitterBuffer(const JitterBufferConfig &config,
+                           unsigned int clock_rate)
+    : config_(config), clock_rate_(clock_rate), slots_(config.capacity),
+      delay_ns_(std::chrono::nanoseconds(config.min_delay).count()),
+      received_(0), reordered_(0), late_(0), duplicates_(0), lost_(0),
+      delay_stat_ns_(delay_ns_), jitter_stat_ns_(0) {
+  if (config_.capacity < 2 ||
+      (config_.capacity & (config_.capacity - 1)) != 0) {
+    throw std::invalid_argument("Jitter buffer capacity must be a power of 2");
+  }
+  if (config_.max_delay < config_.min_delay) {
+    throw std::invalid_argument("Jitter buffer delay range is empty");
+  }
+}
+
+std::int64_t JitterBuffer::first_buffered() const {
+  for (std::int64_t sequence = next_ + 1; sequence <= highest_; ++sequence) {
+    if (slot(sequence).sequence == sequence) {
+      return sequence;
+    }
+  }
+  return -1;
+}
+
+void JitterBuffer::restart(const RtpPacket &packet) {
+  if (next_ >= 0) {
+    // whatever the old sender still had in flight is gone
+    ++pending_lost_;
+  }
+  for (auto &entry : slots_) {
+    entry.sequence = -1;
+  }
+  buffered_ = 0;
+  ssrc_ = packet.ssrc;
+  next_ = packet.sequence;
+  highest_ = next_ - 1;
+  skipped_begin_ = skipped_end_ = 0;
+  last_arrival_ns_ = 0;
+}
+
+void JitterBuffer::add_sample(std::int64_t arrival_ns,
+                              std::int64_t lateness_ns) {
+  samples_.push_back(Sample{arrival_ns, lateness_ns});
+  if (samples_.size() > max_samples) {
+    samples_.pop_front();
+  }
+  update_delay(arrival_ns);
+}
+
+void JitterBuffer::update_delay(std::int64_t now_ns) {
+  const std::int64_t history =
+      std::chrono::nanoseconds(config_.history).count();
+  while (!samples_.empty() && now_ns - samples_.front().arrival_ns > history) {
+    samples_.pop_front();
+  }
+  const std::int64_t min_delay =
+      std::chrono::nanoseconds(config_.min_delay).count();
+  const std::int64_t max_delay =
+      std::chrono::nanoseconds(config_.max_delay).count();
+  if (samples_.empty()) {
+    delay_ns_ = min_delay;
+  } else {
+    sorted_.clear();
+    for (const auto &sample : samples_) {
+      sorted_.push_back(sample.lateness_ns);
+    }
+    const auto rank = static_cast<std::size_t>(
+        std::lround(config_.percentile / 100 * (sorted_.size() - 1)));
+    const auto at = sorted_.begin() + std::min(rank, sorted_.size() - 1);
+    std::nth_element(sorted_.begin(), at, sorted_.end());
+    delay_ns_ = std::max(min_delay, std::min(max_delay, *at));
+  }
+  delay_stat_ns_.store(delay_ns_);
+}
+
+void JitterBuffer::insert(RtpPacket &packet) {
+  if (next_ < 0 || packet.ssrc != ssrc_) {
+    restart(packet);
+  }
+  if (last_arrival_ns_ != 0) {
+    // difference in transit time to the previous packet, in clock ticks
+    const double difference =
+        (packet.arrival_ns - last_arrival_ns_) * clock_rate_ / 1e9 -
+        static_cast<std::int32_t>(packet.timestamp - last_timestamp_);
+    jitter_ += (std::abs(difference) - jitter_) / 16;
+    jitter_stat_ns_.store(
+        static_cast<std::int64_t>(jitter_ / clock_rate_ * 1e9));
+  }
+  last_arrival_ns_ = packet.arrival_ns;
+  last_timestamp_ = packet.timestamp;
+
+  // sequence numbers wrap, the packet is taken to be the closest one to the
+  // highest so far
+  const std::int64_t sequence =
+      highest_ + static_cast<std::int16_t>(static_cast<std::uint16_t>(
+                     packet.sequence - static_cast<std::uint16_t>(highest_)));
+  if (sequence < next_) {
+    ++late_;
+    if (sequence >= skipped_begin_ && sequence < skipped_end_) {
+      add_sample(packet.arrival_ns, packet.arrival_ns - skipped_since_ns_);
+    }
+    return;
+  }
+  const auto capacity = static_cast<std::int64_t>(slots_.size());
+  if (sequence - next_ >= capacity) {
+    // too far ahead to keep waiting for the packets before it
+    const std::int64_t keep_from = sequence - capacity + 1;
+    for (std::int64_t dropped = next_; dropped < keep_from && buffered_ > 0;
+         ++dropped) {
+      if (slot(dropped).sequence == dropped) {
+        slot(dropped).sequence = -1;
+        --buffered_;
+      }
+    }
+    lost_ += static_cast<std::uint64_t>(keep_from - next_);
+    pending_lost_ += static_cast<std::uint64_t>(keep_from - next_);
+    next_ = keep_from;
+  }
+  Slot &target = slot(sequence);
+  if (target.sequence == sequence) {
+    ++duplicates_;
+    return;
+  }
+  std::swap(target.packet, packet);
+  target.sequence = sequence;
+  ++buffered_;
+  ++received_;
+  if (sequence > highest_) {
+    highest_ = sequence;
+    return;
+  }
+  // it filled a hole, in time: how much later than the packet after it did
+  // it arrive
+  ++reordered_;
+  for (std::int64_t after = sequence + 1; after <= highest_; ++after) {
+    if (slot(after).sequence == after) {
+      add_sample(target.packet.arrival_ns,
+                 target.packet.arrival_ns - slot(after).packet.arrival_ns);
+      break;
+    }
+  }
+}
+
+bool JitterBuffer::pop(RtpPacket &packet, std::uint64_t &lost,
+                       std::int64_t now_ns) {
+  lost = 0;
+  if (buffered_ == 0) {
+    return false;
+  }
+  if (slot(next_).sequence != next_) {
+    // the wait for the missing ones starts when the packet after them came
+    const std::int64_t first = first_buffered();
+    const std::int64_t since = slot(first).packet.arrival_ns;
+    update_delay(now_ns);
+    if (now_ns < since + delay_ns_) {
+      return false;
+    }
+    skipped_begin_ = next_;
+    skipped_end_ = first;
+    skipped_since_ns_ = since;
+    lost_ += static_cast<std::uint64_t>(first - next_);
+    pending_lost_ += static_cast<std::uint64_t>(first - next_);
+    next_ = first;
+  }
+  Slot &released = slot(next_);
+  std::swap(packet, released.packet);
+  released.sequence = -1;
+  --buffered_;
+  ++next_;
+  lost = pending_lost_;
+  pending_lost_ = 0;
+  return true;
+}
+
+std::int64_t JitterBuffer::next_release_ns() const {
+  if (buffered_ == 0) {
+    return -1;
+  }
+  if (slot(next_).sequence == next_) {
+    return 0;
+  }
+  return slot(first_buffered()).packet.arrival_ns + delay_ns_;
+}
+
+JitterBuffer::Stats JitterBuffer::get_stats() const {
+  return Stats{received_.load(),     reordered_.load(),
+               late_.load(),         duplicates_.load(),
+               lost_.load(),         delay_stat_ns_.load() / 1e6,
+               jitter_stat_ns_.load() / 1e6};
+}
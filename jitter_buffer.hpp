@@ -0,0 +1,208 @@
+#ifndef JITTER_BUFFER_HPP_F9QK3MRD
+#define JITTER_BUFFER_HPP_F9QK3MRD
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief   An RTP datagram in a buffer of its own, which is swapped rather
+ * than copied on its way through the \ref JitterBuffer
+ */
+struct RtpPacket {
+  std::vector<std::uint8_t> data; ///< the datagram, possibly followed by slack
+  std::size_t size = 0;           ///< of the datagram
+  std::size_t payload_offset = 0; ///< after header, CSRCs and extension
+  std::size_t payload_size = 0;   ///< without padding
+  std::uint16_t sequence = 0;
+  std::uint32_t timestamp = 0;
+  std::uint32_t ssrc = 0;
+  std::uint8_t payload_type = 0;
+  bool marker = false;
+  std::int64_t arrival_ns = 0; ///< tracing::now_ns() when received
+
+  const std::uint8_t *payload() const { return data.data() + payload_offset; }
+
+  /**
+   * @brief Parse the header of the datagram in the first `size` bytes of
+   * `data`
+   *
+   * @return    false if it is not RTP version 2 or is truncated
+   */
+  bool parse();
+};
+
+/**
+ * @brief   How long a \ref JitterBuffer waits for missing packets
+ */
+struct JitterBufferConfig {
+  /// shortest wait before a missing packet is given up as lost
+  std::chrono::microseconds min_delay{2000};
+  /// longest wait, i.e. the latency reordering may add at most. The wait in
+  /// between follows how late reordered packets arrive on the link.
+  std::chrono::microseconds max_delay{100000};
+  /// share of late packets the wait is chosen to still catch, in percent
+  double percentile = 95;
+  /// how long a late packet keeps the wait up
+  std::chrono::milliseconds history{10000};
+  /// packets held at most, a power of two above the packets of a keyframe
+  std::size_t capacity = 1024;
+};
+
+/**
+ * @brief   Puts RTP packets back into sequence order. A packet is released as
+ * soon as all packets before it were, so an orderly link adds no latency. A
+ * missing packet holds back the ones after it until the packet arrives, or
+ * until the first one after it has waited for the current delay, when the
+ * missing ones are given up as lost.
+ *
+ * The delay adapts to the link: it is the given percentile of how much later
+ * than their successors the recent reordered packets arrived, including
+ * those which arrived too late, clamped to the configured range. A link that
+ * never reorders gives up lost packets after the minimum delay.
+ *
+ * Not thread safe, except for get_stats().
+ */
+class JitterBuffer {
+public:
+  /**
+   * @brief Counters since construction
+   */
+  struct Stats {
+    std::uint64_t received;   ///< packets buffered, without duplicates
+    std::uint64_t reordered;  ///< arrived after a later one, still in time
+    std::uint64_t late;       ///< arrived after they were given up, dropped
+    std::uint64_t duplicates; ///< dropped
+    std::uint64_t lost;       ///< given up
+    double delay_ms;          ///< current wait for missing packets
+    double jitter_ms;         ///< interarrival jitter as in RFC 3550
+  };
+
+private:
+  struct Slot {
+    RtpPacket packet;
+    std::int64_t sequence = -1; ///< extended, -1 if empty
+  };
+
+  /// how much later than its successor a packet arrived, and when
+  struct Sample {
+    std::int64_t arrival_ns;
+    std::int64_t lateness_ns;
+  };
+
+  JitterBufferConfig config_;
+  double clock_rate_;
+  std::vector<Slot> slots_;
+  std::size_t buffered_ = 0;
+  std::uint32_t ssrc_ = 0;
+  std::int64_t next_ = -1;    ///< extended sequence number released next
+  std::int64_t highest_ = -1; ///< highest extended sequence number buffered
+  std::uint64_t pending_lost_ = 0; ///< given up since the last release
+
+  // packets given up last, to measure how late they are if they turn up
+  std::int64_t skipped_begin_ = 0;
+  std::int64_t skipped_end_ = 0;
+  std::int64_t skipped_since_ns_ = 0; ///< when the first packet after arrived
+
+  std::deque<Sample> samples_;
+  std::vector<std::int64_t> sorted_; ///< scratch for the percentile
+  std::int64_t delay_ns_;
+
+  // for the RFC 3550 jitter
+  std::int64_t last_arrival_ns_ = 0;
+  std::uint32_t last_timestamp_ = 0;
+  double jitter_ = 0; ///< in clock ticks
+
+  std::atomic<std::uint64_t> received_;
+  std::atomic<std::uint64_t> reordered_;
+  std::atomic<std::uint64_t> late_;
+  std::atomic<std::uint64_t> duplicates_;
+  std::atomic<std::uint64_t> lost_;
+  std::atomic<std::int64_t> delay_stat_ns_;
+  std::atomic<std::int64_t> jitter_stat_ns_;
+
+  Slot &slot(std::int64_t sequence) {
+    return slots_[static_cast<std::size_t>(sequence) & (slots_.size() - 1)];
+  }
+  const Slot &slot(std::int64_t sequence) const {
+    return slots_[static_cast<std::size_t>(sequence) & (slots_.size() - 1)];
+  }
+
+  /**
+   * @brief Get the first buffered packet after the next one to release
+   *
+   * @return    extended sequence number, -1 if there is none
+   */
+  std::int64_t first_buffered() const;
+
+  /**
+   * @brief Drop everything and continue with the given packet
+   */
+  void restart(const RtpPacket &packet);
+
+  /**
+   * @brief Remember how late a packet arrived, and adapt the delay
+   */
+  void add_sample(std::int64_t arrival_ns, std::int64_t lateness_ns);
+
+  /**
+   * @brief Choose the delay from the samples not older than the history
+   */
+  void update_delay(std::int64_t now_ns);
+
+public:
+  /**
+   * @brief ctor
+   *
+   * @param config  delay range and capacity
+   * @param clock_rate  of the RTP timestamps, for the jitter
+   * @throw std::invalid_argument if the capacity is not a power of two or
+   * the delay range is empty
+   */
+  explicit JitterBuffer(const JitterBufferConfig &config = JitterBufferConfig(),
+                        unsigned int clock_rate = 90000);
+
+  JitterBuffer(const JitterBuffer &) = delete;
+  JitterBuffer &operator=(const JitterBuffer &) = delete;
+
+  /**
+   * @brief Buffer a packet. Its buffer is swapped with a free one, so once
+   * every slot was used the caller receives into recycled buffers. Those
+   * start out empty.
+   *
+   * @param packet  parsed, with its arrival time
+   */
+  void insert(RtpPacket &packet);
+
+  /**
+   * @brief Take the next packet in sequence order, if it is there or the
+   * packets missing before it were waited for long enough
+   *
+   * @param packet  swapped with the released one
+   * @param lost    packets given up right before it, a new sender counts as
+   * one
+   * @param now_ns  tracing::now_ns()
+   *
+   * @return    false if there is nothing to release yet
+   */
+  bool pop(RtpPacket &packet, std::uint64_t &lost, std::int64_t now_ns);
+
+  /**
+   * @brief Get when pop() will release the next packet at the latest, to
+   * wait for more packets until then
+   *
+   * @return    tracing::now_ns() time, -1 if nothing is buffered
+   */
+  std::int64_t next_release_ns() const;
+
+  /**
+   * @brief Get counters. Thread safe.
+   */
+  Stats get_stats() const;
+};
+
+#endif /* end of include guard: JITTER_BUFFER_HPP_F9QK3MRD */
@@ -0,0 +1,127 @@
+#ifndef MAILBOX_HPP_R4JX8NWC
+#define MAILBOX_HPP_R4JX8NWC
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * @brief   Hands the newest value from one producer thread to one consumer
+ * thread, e.g. decoded frames to the display. A triple buffer: the producer
+ * fills its slot and swaps it with the middle one, the consumer swaps the
+ * middle one with its own when it holds something new. Neither side ever
+ * waits for the other, a value the consumer did not take before the next one
+ * arrived is dropped and counted.
+ *
+ * put() and try_get() are lock-free. get_latest() sleeps on a condition
+ * variable, which the producer only locks when somebody sleeps on it.
+ *
+ * @tparam T    default constructible and movable, e.g. a `cv::Mat` or a
+ * struct holding one
+ */
+template <typename T> class Mailbox {
+  static constexpr unsigned int fresh = 4; ///< flag on the middle slot's index
+
+  T slots_[3];
+  unsigned int back_ = 0;            ///< the producer's slot
+  std::atomic<unsigned int> middle_; ///< slot index, with `fresh` if unread
+  unsigned int front_ = 2;           ///< the consumer's slot
+  std::atomic<std::uint64_t> dropped_;
+  std::atomic<bool> closed_;
+  std::atomic<int> waiting_; ///< consumers in get_latest()
+  std::mutex mutex_;
+  std::condition_variable cv_;
+
+public:
+  Mailbox() : middle_(1), dropped_(0), closed_(false), waiting_(0) {}
+
+  Mailbox(const Mailbox &) = delete;
+  Mailbox &operator=(const Mailbox &) = delete;
+
+  /**
+   * @brief Publish a value, replacing the previous one if it was not taken
+   * yet. Producer only.
+   */
+  void put(T value) {
+    slots_[back_] = std::move(value);
+    const unsigned int previous = middle_.exchange(back_ | fresh);
+    back_ = previous & ~fresh;
+    if (previous & fresh) {
+      ++dropped_;
+      // don't hold on to it until the next put(), it may be a pooled buffer
+      slots_[back_] = T();
+    }
+    if (waiting_.load() > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_all();
+    }
+  }
+
+  /**
+   * @brief Take the newest value if there is one not taken yet. Consumer
+   * only.
+   *
+   * @return    false if there is none
+   */
+  bool try_get(T &value) {
+    if (!(middle_.load() & fresh)) {
+      return false;
+    }
+    front_ = middle_.exchange(front_) & ~fresh;
+    value = std::move(slots_[front_]);
+    slots_[front_] = T();
+    return true;
+  }
+
+  /**
+   * @brief Take the newest value, waiting for one if there is none yet.
+   * Consumer only.
+   *
+   * @param timeout how long to wait at most
+   *
+   * @return    false on timeout or if closed
+   */
+  template <typename Rep, typename Period>
+  bool get_latest(T &value, std::chrono::duration<Rep, Period> timeout) {
+    if (try_get(value)) {
+      return true;
+    }
+    ++waiting_;
+    {
+      // the producer checks `waiting_` after publishing, so either it sees
+      // us waiting or we see what it published
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait_for(lock, timeout, [this]() {
+        return (middle_.load() & fresh) || closed_.load();
+      });
+    }
+    --waiting_;
+    return try_get(value);
+  }
+
+  /**
+   * @brief Check whether there is a value not taken yet
+   */
+  bool has_new() const { return middle_.load() & fresh; }
+
+  /**
+   * @brief Wake up consumers waiting in get_latest(), for shutdown. Values
+   * can still be taken.
+   */
+  void close() {
+    closed_.store(true);
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_all();
+  }
+
+  bool closed() const { return closed_.load(); }
+
+  /**
+   * @brief Get the number of values replaced before they were taken
+   */
+  std::uint64_t dropped() const { return dropped_.load(); }
+};
+
+#endif /* end of include guard: MAILBOX_HPP_R4JX8NWC */
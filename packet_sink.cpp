@@ -0,0 +1,290 @@
+#include "packet_sink.hpp"
+#include "avutils.hpp"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <unistd.h>
+
+MuxerSink::MuxerSink(std::string url, std::string format_name)
+    : url_(std::move(url)), format_name_(std::move(format_name)),
+      pkt_(av_packet_alloc()) {}
+
+void MuxerSink::open(const AVCodecContext *codec_ctx,
+                     const CodecProfile &profile) {
+  int success = avformat_alloc_output_context2(
+      &fmt_ctx_, nullptr,
+      format_name_.empty() ? nullptr : format_name_.c_str(), url_.c_str());
+  if (success < 0) {
+    throw std::runtime_error("Could not allocate output context for " + url_ +
+                             ": " + avutils::av_strerror2(success));
+  }
+  configure(profile);
+  stream_ = avformat_new_stream(fmt_ctx_, nullptr);
+  if (!stream_) {
+    throw std::runtime_error("Could not create stream for " + url_);
+  }
+  success = avcodec_parameters_from_context(stream_->codecpar, codec_ctx);
+  if (success < 0) {
+    throw std::runtime_error("Could not copy codec parameters: " +
+                             avutils::av_strerror2(success));
+  }
+  // only a hint, the muxer picks its own time base when writing the header
+  codec_time_base_ = codec_ctx->time_base;
+  stream_->time_base = codec_time_base_;
+  if (!(fmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
+    open_output();
+  }
+  success = avformat_write_header(fmt_ctx_, nullptr);
+  if (success < 0) {
+    throw std::runtime_error("Could not write header! " +
+                             avutils::av_strerror2(success));
+  }
+  header_written_ = true;
+}
+
+void MuxerSink::open_output() {
+  int success = avio_open(&fmt_ctx_->pb, url_.c_str(), AVIO_FLAG_WRITE);
+  if (success < 0) {
+    throw std::runtime_error("Could not open " + url_ + ": " +
+                             avutils::av_strerror2(success));
+  }
+}
+
+void MuxerSink::close_output() { avio_closep(&fmt_ctx_->pb); }
+
+int MuxerSink::write(const AVPacket *pkt) {
+  // a new reference shares the payload, only the timestamps are ours
+  int success = av_packet_ref(pkt_, pkt);
+  if (success < 0) {
+    return success;
+  }
+  av_packet_rescale_ts(pkt_, codec_time_base_, stream_->time_base);
+  pkt_->stream_index = stream_->index;
+  success = av_write_frame(fmt_ctx_, pkt_);
+  av_packet_unref(pkt_);
+  return success;
+}
+
+void MuxerSink::close() {
+  if (!fmt_ctx_) {
+    return;
+  }
+  if (header_written_) {
+    av_write_trailer(fmt_ctx_);
+    header_written_ = false;
+  }
+  if (!(fmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
+    close_output();
+  }
+  avformat_free_context(fmt_ctx_);
+  fmt_ctx_ = nullptr;
+  stream_ = nullptr;
+}
+
+MuxerSink::~MuxerSink() {
+  close();
+  av_packet_free(&pkt_);
+}
+
+RtpSink::RtpSink(const std::string &host, unsigned int port)
+    : MuxerSink("rtp://" + host + ":" + std::to_string(port), "rtp"),
+      host_(host), port_(port) {}
+
+void RtpSink::set_fec_ratio(double ratio) {
+  if (ratio < 0 || ratio > 1) {
+    throw std::invalid_argument("FEC ratio must be between 0 and 1");
+  }
+  fec_ratio_ = ratio;
+}
+
+void RtpSink::configure(const CodecProfile &profile) {
+  fmt_ctx_->strict_std_compliance = profile.experimental_rtp
+                                        ? FF_COMPLIANCE_EXPERIMENTAL
+                                        : FF_COMPLIANCE_NORMAL;
+  fmt_ctx_->flags = AVFMT_FLAG_NOBUFFER | AVFMT_FLAG_FLUSH_PACKETS;
+}
+
+void RtpSink::open(const AVCodecContext *codec_ctx,
+                   const CodecProfile &profile) {
+  MuxerSink::open(codec_ctx, profile);
+  create_sdp();
+}
+
+void RtpSink::create_sdp() {
+  /* Write a file for VLC */
+  constexpr int buflen = 1024;
+  char buf[buflen] = {0};
+  AVFormatContext *ac[] = {fmt_ctx_};
+  av_sdp_create(ac, 1, buf, buflen);
+  std::string sdp(buf);
+  if (fec_) {
+    // the FEC packets share the video's port, told apart by payload type
+    const auto media = sdp.find("m=video");
+    if (media != std::string::npos) {
+      sdp.insert(sdp.find_first_of("\r\n", media),
+                 " " + std::to_string(fec_payload_type));
+      sdp += "a=rtpmap:" + std::to_string(fec_payload_type) +
+             " ulpfec/90000\r\n";
+    }
+  }
+  std::lock_guard<std::mutex> lock(sdp_mutex_);
+  sdp_ = std::move(sdp);
+}
+
+int RtpSink::write(const AVPacket *pkt) {
+  AVCodecParameters *codecpar = stream_->codecpar;
+  if (avutils::take_new_extradata(pkt, codecpar->extradata,
+                                  codecpar->extradata_size)) {
+    // sprop-parameter-sets and the like, for receivers that start now
+    create_sdp();
+  }
+  return MuxerSink::write(pkt);
+}
+
+void RtpSink::open_output() {
+  if (fec_ratio_ <= 0) {
+    MuxerSink::open_output();
+    return;
+  }
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo *found = nullptr;
+  if (::getaddrinfo(host_.c_str(), std::to_string(port_).c_str(), &hints,
+                    &found) != 0) {
+    throw std::runtime_error("Could not resolve " + host_);
+  }
+  std::memcpy(&rtp_address_, found->ai_addr, found->ai_addrlen);
+  address_size_ = found->ai_addrlen;
+  const int family = found->ai_family;
+  ::freeaddrinfo(found);
+  // RTCP goes to the next port, as with rtp://
+  rtcp_address_ = rtp_address_;
+  const auto rtcp_port = htons(static_cast<std::uint16_t>(port_ + 1));
+  if (family == AF_INET6) {
+    reinterpret_cast<sockaddr_in6 *>(&rtcp_address_)->sin6_port = rtcp_port;
+  } else {
+    reinterpret_cast<sockaddr_in *>(&rtcp_address_)->sin_port = rtcp_port;
+  }
+  socket_ = ::socket(family, SOCK_DGRAM, 0);
+  if (socket_ < 0) {
+    throw std::runtime_error(std::string("Could not create socket: ") +
+                             std::strerror(errno));
+  }
+  fec_.reset(new FecEncoder(
+      fec_ratio_, fec_payload_type,
+      [this](const std::uint8_t *data, std::size_t size) {
+        ::sendto(socket_, data, size, 0,
+                 reinterpret_cast<const sockaddr *>(&rtp_address_),
+                 address_size_);
+      }));
+  // the muxer sizes its packets after this, so the FEC packets still fit
+  // into the MTU libavformat assumes for UDP
+  constexpr int packet_size = 1472 - static_cast<int>(fec_overhead);
+  auto *buffer = static_cast<unsigned char *>(av_malloc(packet_size));
+  fmt_ctx_->pb = buffer ? avio_alloc_context(buffer, packet_size, 1, this,
+                                             nullptr, &write_packet, nullptr)
+                        : nullptr;
+  if (!fmt_ctx_->pb) {
+    av_free(buffer);
+    ::close(socket_);
+    socket_ = -1;
+    throw std::runtime_error("Could not allocate I/O context for " + host_);
+  }
+  fmt_ctx_->pb->max_packet_size = packet_size;
+}
+
+void RtpSink::close_output() {
+  if (socket_ < 0) {
+    MuxerSink::close_output();
+    return;
+  }
+  avio_flush(fmt_ctx_->pb);
+  fec_->flush();
+  av_freep(&fmt_ctx_->pb->buffer);
+  avio_context_free(&fmt_ctx_->pb);
+  ::close(socket_);
+  socket_ = -1;
+}
+
+int RtpSink::write_packet(void *opaque, std::uint8_t *buf, int size) {
+  auto *sink = static_cast<RtpSink *>(opaque);
+  // the muxer flushes after every packet, so this is one datagram. RTCP
+  // sender reports come through here as well.
+  const bool rtcp = size >= 2 && buf[1] >= 200 && buf[1] <= 204;
+  const auto &address = rtcp ? sink->rtcp_address_ : sink->rtp_address_;
+  ::sendto(sink->socket_, buf, static_cast<std::size_t>(size), 0,
+           reinterpret_cast<const sockaddr *>(&address), sink->address_size_);
+  if (!rtcp) {
+    sink->fec_->add(buf, static_cast<std::size_t>(size));
+  }
+  // a lost datagram is not an error of the stream
+  return size;
+}
+
+FecEncoder::Stats RtpSink::fec_stats() const {
+  return fec_ ? fec_->get_stats() : FecEncoder::Stats{0, 0, 0, 0};
+}
+
+AsyncSink::AsyncSink(std::shared_ptr<PacketSink> sink, unsigned int capacity,
+                     DropPolicy policy)
+    : sink_(std::move(sink)), queue_(capacity, policy, &av_packet_free),
+      skipped_(0) {}
+
+void AsyncSink::open(const AVCodecContext *codec_ctx,
+                     const CodecProfile &profile) {
+  sink_->open(codec_ctx, profile);
+  thread_ = std::thread(&AsyncSink::run, this);
+}
+
+int AsyncSink::write(const AVPacket *pkt) {
+  AVPacket *ref = av_packet_clone(pkt);
+  if (!ref) {
+    return AVERROR(ENOMEM);
+  }
+  queue_.push(ref);
+  return 0;
+}
+
+void AsyncSink::run() {
+  AVPacket *pkt = nullptr;
+  std::uint64_t drops_seen = 0;
+  bool waiting_for_keyframe = false;
+  while (queue_.pop(pkt)) {
+    const std::uint64_t drops = queue_.dropped();
+    if (drops != drops_seen) {
+      drops_seen = drops;
+      waiting_for_keyframe = true;
+    }
+    if (waiting_for_keyframe && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+      ++skipped_;
+      av_packet_free(&pkt);
+      continue;
+    }
+    waiting_for_keyframe = false;
+    int success = sink_->write(pkt);
+    av_packet_free(&pkt);
+    if (success < 0) {
+      std::cerr << "Could not write to " << sink_->name() << ": "
+                << avutils::av_strerror2(success) << std::endl;
+    }
+  }
+}
+
+void AsyncSink::close() {
+  queue_.close();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  sink_->close();
+}
+
+std::uint64_t AsyncSink::dropped() const {
+  return queue_.dropped() + skipped_.load() + sink_->dropped();
+}
+
+AsyncSink::~AsyncSink() { close(); }
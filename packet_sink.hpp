@@ -0,0 +1,247 @@
+#ifndef PACKET_SINK_HPP_J2VW8NQE
+#define PACKET_SINK_HPP_J2VW8NQE
+
+#include "codec_profile.hpp"
+#include "fec.hpp"
+#include "pipeline_queue.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+/**
+ * @brief   Destination for encoded packets. One encoder can feed any number of
+ * sinks, see AVTransmitter::add_sink().
+ */
+class PacketSink {
+public:
+  virtual ~PacketSink() = default;
+
+  /**
+   * @brief Prepare for writing once the encoder is open, e.g. write a
+   * container header. Called exactly once before the first write().
+   *
+   * @param codec_ctx   the opened encoder, for codec parameters and time base
+   * @param profile the encoder's profile
+   */
+  virtual void open(const AVCodecContext *codec_ctx,
+                    const CodecProfile &profile) = 0;
+
+  /**
+   * @brief Write a packet. The packet is shared with other sinks and must not
+   * be modified; take a reference with `av_packet_ref()` to keep it, which
+   * does not copy the payload. Once the encoder was replaced, keyframes
+   * carry its extradata as `AV_PKT_DATA_NEW_EXTRADATA` side data, for sinks
+   * that keep codec parameters.
+   *
+   * @param pkt packet with timestamps in the encoder's time base
+   *
+   * @return    0 on success, < 0 on error
+   */
+  virtual int write(const AVPacket *pkt) = 0;
+
+  /**
+   * @brief Finish writing, e.g. write a container trailer. No write() may
+   * follow. Must be safe to call more than once.
+   */
+  virtual void close() = 0;
+
+  /**
+   * @brief Get a name for messages
+   */
+  virtual std::string name() const = 0;
+
+  /**
+   * @brief Get the number of packets the sink discarded because it could not
+   * keep up
+   */
+  virtual std::uint64_t dropped() const { return 0; }
+};
+
+/**
+ * @brief   Sink writing to any libavformat output, e.g. a recording file
+ * whose container is guessed from the extension
+ */
+class MuxerSink : public PacketSink {
+  std::string url_;
+  std::string format_name_;
+  AVRational codec_time_base_;
+  AVPacket *pkt_; ///< reference to the shared packet, rescaled for our stream
+  bool header_written_ = false;
+
+protected:
+  AVFormatContext *fmt_ctx_ = nullptr;
+  AVStream *stream_ = nullptr;
+
+  /**
+   * @brief Hook for setting muxer options after the output was allocated and
+   * before the header is written
+   */
+  virtual void configure(const CodecProfile &profile) {}
+
+  /**
+   * @brief Hook for opening `fmt_ctx_->pb`, by default with `avio_open()`.
+   * Only called for formats writing to a file.
+   */
+  virtual void open_output();
+
+  /**
+   * @brief Hook for closing what open_output() opened. Subclasses overriding
+   * it must call close() in their destructor.
+   */
+  virtual void close_output();
+
+public:
+  /**
+   * @brief ctor. The output is only opened in open().
+   *
+   * @param url output file or URL
+   * @param format_name container name, empty to guess it from the url
+   */
+  MuxerSink(std::string url, std::string format_name = "");
+
+  MuxerSink(const MuxerSink &) = delete;
+  MuxerSink &operator=(const MuxerSink &) = delete;
+
+  void open(const AVCodecContext *codec_ctx,
+            const CodecProfile &profile) override;
+  int write(const AVPacket *pkt) override;
+  void close() override;
+  std::string name() const override { return url_; }
+
+  ~MuxerSink() override;
+};
+
+/**
+ * @brief   Sink sending a unicast RTP stream, with the SDP a receiver needs.
+ * Optionally sends XOR parity packets along, see \ref FecEncoder.
+ */
+class RtpSink : public MuxerSink {
+  std::string host_;
+  unsigned int port_;
+  mutable std::mutex sdp_mutex_; ///< rebuilt by the writing thread
+  std::string sdp_;
+  double fec_ratio_ = 0;
+  std::unique_ptr<FecEncoder> fec_;
+  int socket_ = -1;
+  sockaddr_storage rtp_address_;
+  sockaddr_storage rtcp_address_;
+  socklen_t address_size_ = 0;
+
+  static int write_packet(void *opaque, std::uint8_t *buf, int size);
+
+  /**
+   * @brief Describe the stream as it is configured now
+   */
+  void create_sdp();
+
+protected:
+  void configure(const CodecProfile &profile) override;
+  /**
+   * @brief Send through a socket of our own with FEC, libavformat's `rtp://`
+   * otherwise
+   */
+  void open_output() override;
+  void close_output() override;
+
+public:
+  /// payload type of the FEC packets, the media's is chosen by libavformat
+  static constexpr int fec_payload_type = 127;
+
+  /**
+   * @brief ctor
+   *
+   * @param host    receiver address
+   * @param port    receiver port, should be even
+   */
+  RtpSink(const std::string &host, unsigned int port);
+
+  /**
+   * @brief Protect the stream with FEC packets. Must be called before
+   * open().
+   *
+   * @param ratio   FEC packets per media packet, up to 1, 0 to disable
+   * @throw std::invalid_argument for a ratio out of range
+   */
+  void set_fec_ratio(double ratio);
+
+  void open(const AVCodecContext *codec_ctx,
+            const CodecProfile &profile) override;
+
+  /**
+   * @brief Write a packet, and update the SDP if it carries new codec
+   * parameters
+   */
+  int write(const AVPacket *pkt) override;
+
+  /**
+   * @brief Get the SDP describing the stream, available after open(). It
+   * changes if a replaced encoder has new parameter sets. Thread safe.
+   */
+  std::string sdp() const {
+    std::lock_guard<std::mutex> lock(sdp_mutex_);
+    return sdp_;
+  }
+
+  /**
+   * @brief Get what FEC costs, all zero without it. Thread safe once open.
+   */
+  FecEncoder::Stats fec_stats() const;
+
+  ~RtpSink() override { close(); }
+};
+
+/**
+ * @brief   Decouples a sink from the encoder with a bounded queue and a
+ * thread of its own, so a sink that blocks (slow disk, full socket buffer)
+ * only loses its own packets instead of stalling everybody else. Queued
+ * packets are references to the encoder's, no payload is copied.
+ *
+ * After packets were dropped, the sink skips ahead to the next keyframe,
+ * since everything in between could not be decoded anyway.
+ */
+class AsyncSink : public PacketSink {
+  std::shared_ptr<PacketSink> sink_;
+  PipelineQueue<AVPacket> queue_;
+  std::thread thread_;
+  std::atomic<std::uint64_t> skipped_; ///< discarded waiting for a keyframe
+
+  /**
+   * @brief Write queued packets until closed
+   */
+  void run();
+
+public:
+  /**
+   * @brief ctor
+   *
+   * @param sink    sink to write from the background thread
+   * @param capacity    max number of queued packets
+   * @param policy  what to do when the queue is full. DropPolicy::Block
+   * brings back the backpressure on the encoder.
+   */
+  AsyncSink(std::shared_ptr<PacketSink> sink, unsigned int capacity = 32,
+            DropPolicy policy = DropPolicy::DropOldest);
+
+  void open(const AVCodecContext *codec_ctx,
+            const CodecProfile &profile) override;
+  int write(const AVPacket *pkt) override;
+  /**
+   * @brief Write everything still queued, then close the wrapped sink
+   */
+  void close() override;
+  std::string name() const override { return sink_->name(); }
+  std::uint64_t dropped() const override;
+
+  ~AsyncSink() override;
+};
+
+#endif /* end of include guard: PACKET_SINK_HPP_J2VW8NQE */
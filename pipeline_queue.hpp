@@ -0,0 +1,146 @@
+#ifndef PIPELINE_QUEUE_HPP_Q3KX7MZT
+#define PIPELINE_QUEUE_HPP_Q3KX7MZT
+
+#include <atomic>
+#include <boost/lockfree/queue.hpp>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+/**
+ * @brief   What to do when a pipeline stage wants to push into a full queue
+ */
+enum class DropPolicy {
+  DropOldest, ///< discard the oldest queued item to make room (lowest latency)
+  DropNewest, ///< discard the item being pushed
+  Block       ///< wait until the consumer made room
+};
+
+/**
+ * @brief   Bounded lock-free queue of owning pointers connecting two pipeline
+ * stages. Items which get dropped are released with the deleter given at
+ * construction, so this can hold `AVFrame *` and `AVPacket *` alike.
+ *
+ * @tparam T    pointee type
+ */
+template <typename T> class PipelineQueue {
+public:
+  using Deleter = void (*)(T **);
+
+private:
+  // fixed_sized: never allocates after construction, push fails when full
+  boost::lockfree::queue<T *, boost::lockfree::fixed_sized<true>> queue_;
+  DropPolicy policy_;
+  Deleter deleter_;
+  std::atomic<bool> closed_;
+  std::atomic<std::uint64_t> dropped_;
+
+  /**
+   * @brief Back off while waiting on the other end of the queue. Spins
+   * briefly since stages usually hand over within microseconds, then sleeps
+   * to not burn a core while idle.
+   *
+   * @param iteration   number of unsuccessful attempts so far
+   */
+  static void backoff(unsigned int iteration) {
+    if (iteration < 64) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+
+public:
+  /**
+   * @brief ctor
+   *
+   * @param capacity    max number of queued items
+   * @param policy  what to do when full
+   * @param deleter function releasing dropped items
+   */
+  PipelineQueue(unsigned int capacity, DropPolicy policy, Deleter deleter)
+      : queue_(capacity), policy_(policy), deleter_(deleter), closed_(false),
+        dropped_(0) {}
+
+  PipelineQueue(const PipelineQueue &) = delete;
+  PipelineQueue &operator=(const PipelineQueue &) = delete;
+
+  ~PipelineQueue() { clear(); }
+
+  /**
+   * @brief Enqueue an item, taking ownership. Only blocks with
+   * DropPolicy::Block.
+   *
+   * @param item    item to push
+   *
+   * @return    true if the item was queued, false if it was dropped
+   */
+  bool push(T *item) {
+    unsigned int iteration = 0;
+    while (!queue_.bounded_push(item)) {
+      if (closed_.load()) {
+        deleter_(&item);
+        return false;
+      }
+      switch (policy_) {
+      case DropPolicy::DropNewest:
+        deleter_(&item);
+        ++dropped_;
+        return false;
+      case DropPolicy::DropOldest: {
+        T *oldest = nullptr;
+        if (queue_.pop(oldest)) {
+          deleter_(&oldest);
+          ++dropped_;
+        }
+        break;
+      }
+      case DropPolicy::Block:
+        backoff(iteration++);
+        break;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief Dequeue an item, waiting until one is available or the queue is
+   * closed.
+   *
+   * @param item    receives the item, ownership passes to caller
+   *
+   * @return    false if the queue was closed
+   */
+  bool pop(T *&item) {
+    unsigned int iteration = 0;
+    while (!queue_.pop(item)) {
+      if (closed_.load()) {
+        return false;
+      }
+      backoff(iteration++);
+    }
+    return true;
+  }
+
+  /**
+   * @brief Wake up all waiting producers and consumers and make them return.
+   */
+  void close() { closed_.store(true); }
+
+  /**
+   * @brief Release all queued items
+   */
+  void clear() {
+    T *item = nullptr;
+    while (queue_.pop(item)) {
+      deleter_(&item);
+    }
+  }
+
+  /**
+   * @brief Get number of items discarded due to the drop policy
+   */
+  std::uint64_t dropped() const { return dropped_.load(); }
+};
+
+#endif /* end of include guard: PIPELINE_QUEUE_HPP_Q3KX7MZT */
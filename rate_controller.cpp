@@ -0,0 +1,90 @@
+#include "rate_controller.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+// above this, losses are more than the occasional one and the link is full
+constexpr double loss_high = 0.1;
+// below this, there is room to probe upwards
+constexpr double loss_low = 0.02;
+// backoff when receivers are behind without losing packets
+constexpr double backoff_behind = 0.85;
+// growth per increase
+constexpr double increase = 1.08;
+// decoded frames a receiver's consumer missed in one report interval
+// before it counts as behind
+constexpr std::uint32_t replaced_behind = 3;
+// no increase for this long after any receiver had trouble
+constexpr auto hold = std::chrono::seconds(2);
+// and at most one per interval, so the reports can catch up
+constexpr auto increase_interval = std::chrono::seconds(1);
+// smaller changes are not worth reconfiguring the encoder for
+constexpr double min_change = 0.05;
+
+} // namespace
+
+RateController::RateController(unsigned int start_bitrate,
+                               unsigned int min_bitrate,
+                               unsigned int max_bitrate, unsigned int fps,
+                               int max_quantizer)
+    : start_bitrate_(start_bitrate), min_bitrate_(min_bitrate),
+      max_bitrate_(max_bitrate), frame_ms_(1000.0 / fps),
+      max_quantizer_(max_quantizer),
+      bitrate_(std::min(std::max(start_bitrate, min_bitrate), max_bitrate)),
+      settings_{static_cast<unsigned int>(bitrate_), -1},
+      last_decrease_(Clock::now()), last_increase_(Clock::now()) {
+  if (min_bitrate == 0 || min_bitrate > max_bitrate) {
+    throw std::invalid_argument(
+        "Minimum bitrate must be > 0 and at most the maximum");
+  }
+}
+
+double RateController::backoff(const ReceiverReport &report) const {
+  double factor = 1;
+  if (report.loss_fraction > loss_high) {
+    // as in Google congestion control, proportional to the loss
+    factor = std::min(factor, 1 - 0.5 * report.loss_fraction);
+  }
+  // jitter beyond a frame interval means queues are growing somewhere on
+  // the way; decoding slower than the frame rate or decoded frames replaced
+  // before the consumer got to them mean the receiver itself is behind
+  if (report.jitter_ms > frame_ms_ || report.decode_ms > frame_ms_ ||
+      report.frames_replaced >= replaced_behind) {
+    factor = std::min(factor, backoff_behind);
+  }
+  return factor;
+}
+
+bool RateController::update(const ReceiverReport &report,
+                            Settings &settings) {
+  const auto now = Clock::now();
+  const double factor = backoff(report);
+  if (factor < 1) {
+    bitrate_ = std::max<double>(min_bitrate_, bitrate_ * factor);
+    last_decrease_ = now;
+  } else if (report.received > 0 && report.loss_fraction < loss_low &&
+             now - last_decrease_ >= hold &&
+             now - last_increase_ >= increase_interval) {
+    bitrate_ = std::min<double>(max_bitrate_, bitrate_ * increase);
+    last_increase_ = now;
+  }
+
+  Settings next;
+  next.bitrate = static_cast<unsigned int>(bitrate_);
+  next.qmax = 2 * bitrate_ < start_bitrate_ ? max_quantizer_ : -1;
+  const double change =
+      std::abs(static_cast<double>(next.bitrate) - settings_.bitrate) /
+      settings_.bitrate;
+  // the bounds are always reached exactly, however small the last step
+  const bool at_bound = next.bitrate != settings_.bitrate &&
+                        (next.bitrate == min_bitrate_ ||
+                         next.bitrate == max_bitrate_);
+  if (change < min_change && !at_bound && next.qmax == settings_.qmax) {
+    return false;
+  }
+  settings_ = next;
+  settings = next;
+  return true;
+}
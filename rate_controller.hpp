@@ -0,0 +1,81 @@
+#ifndef RATE_CONTROLLER_HPP_Q4NM7WZE
+#define RATE_CONTROLLER_HPP_Q4NM7WZE
+
+#include "feedback.hpp"
+#include <chrono>
+#include <cstdint>
+
+/**
+ * @brief   Picks the encoder's target bitrate from receiver reports. Backs off
+ * multiplicatively when a receiver loses packets, sees growing jitter (queues
+ * building up on the way), or can't keep up decoding; probes upwards slowly
+ * once no receiver had trouble for a while. Since all receivers share one
+ * encoder, the stream follows the worst of them.
+ *
+ * Below half the start bitrate, the quantizer range is opened up to the codec's
+ * maximum, so rate control can actually meet the target instead of
+ * overshooting it with a capped quantizer.
+ * @warning Not thread safe
+ */
+class RateController {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /**
+   * @brief What the encoder should be set to
+   */
+  struct Settings {
+    unsigned int bitrate; ///< bits per second
+    int qmax;             ///< -1 for the encoder's default
+  };
+
+private:
+  unsigned int start_bitrate_;
+  unsigned int min_bitrate_;
+  unsigned int max_bitrate_;
+  double frame_ms_;
+  int max_quantizer_;
+  double bitrate_;   ///< current estimate, applied only on large enough change
+  Settings settings_; ///< last settings handed out
+  Clock::time_point last_decrease_;
+  Clock::time_point last_increase_;
+
+  /**
+   * @brief Get the factor to scale the bitrate by for a report, < 1 if the
+   * receiver is in trouble
+   */
+  double backoff(const ReceiverReport &report) const;
+
+public:
+  /**
+   * @brief ctor
+   *
+   * @param start_bitrate   bitrate the encoder was opened with
+   * @param min_bitrate lowest bitrate to go down to
+   * @param max_bitrate highest bitrate to probe up to
+   * @param fps stream frame rate, receivers taking longer than a frame
+   * interval to decode are behind
+   * @param max_quantizer   the codec's highest quantizer, see \ref
+   * CodecProfile
+   */
+  RateController(unsigned int start_bitrate, unsigned int min_bitrate,
+                 unsigned int max_bitrate, unsigned int fps,
+                 int max_quantizer);
+
+  /**
+   * @brief Take a receiver report into account
+   *
+   * @param report  report from any receiver
+   * @param settings    receives the new settings if they changed
+   *
+   * @return    true if the encoder should be reconfigured
+   */
+  bool update(const ReceiverReport &report, Settings &settings);
+
+  /**
+   * @brief Get the settings last handed out
+   */
+  Settings settings() const { return settings_; }
+};
+
+#endif /* end of include guard: RATE_CONTROLLER_HPP_Q4NM7WZE */
@@ -0,0 +1,308 @@
+#include "recording_sink.hpp"
+#include "avutils.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+
+extern "C" {
+#include <libavutil/opt.h>
+}
+
+/**
+ * @brief   One file of a recording, written through a large buffer into disk
+ * space reserved up front
+ */
+class SegmentFile : public MuxerSink {
+  std::string path_;
+  std::uint64_t preallocate_;
+  int buffer_size_;
+  int fd_ = -1;
+  std::int64_t position_ = 0;
+  std::int64_t size_ = 0; ///< bytes written so far
+
+  static int write_packet(void *opaque, std::uint8_t *buf, int size);
+  static std::int64_t seek(void *opaque, std::int64_t offset, int whence);
+
+protected:
+  void configure(const CodecProfile &profile) override;
+  void open_output() override;
+  void close_output() override;
+
+public:
+  SegmentFile(const std::string &path, std::uint64_t preallocate,
+              int buffer_size)
+      : MuxerSink(path), path_(path), preallocate_(preallocate),
+        buffer_size_(buffer_size) {}
+
+  ~SegmentFile() override { close(); }
+};
+
+void SegmentFile::configure(const CodecProfile &profile) {
+  if (std::strcmp(fmt_ctx_->oformat->name, "mp4") == 0) {
+    // the index goes with each fragment instead of at the end, so the file
+    // stays playable if we never get to write the end
+    av_opt_set(fmt_ctx_->priv_data, "movflags",
+               "frag_keyframe+empty_moov+default_base_moof", 0);
+  }
+}
+
+void SegmentFile::open_output() {
+  fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("Could not open " + path_ + ": " +
+                             std::strerror(errno));
+  }
+#ifdef __linux__
+  if (preallocate_ > 0) {
+    // reserves blocks without changing the size, so a crash leaves no
+    // garbage at the end. Not every file system supports it, it's only a
+    // hint anyway.
+    fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0,
+              static_cast<off_t>(preallocate_));
+  }
+#endif
+  auto *buffer = static_cast<unsigned char *>(av_malloc(buffer_size_));
+  fmt_ctx_->pb = buffer ? avio_alloc_context(buffer, buffer_size_, 1, this,
+                                             nullptr, &write_packet, &seek)
+                        : nullptr;
+  if (!fmt_ctx_->pb) {
+    av_free(buffer);
+    ::close(fd_);
+    fd_ = -1;
+    throw std::runtime_error("Could not allocate I/O context for " + path_);
+  }
+}
+
+void SegmentFile::close_output() {
+  avio_flush(fmt_ctx_->pb);
+  av_freep(&fmt_ctx_->pb->buffer);
+  avio_context_free(&fmt_ctx_->pb);
+  // gives back the reserved blocks that were not used
+  if (::ftruncate(fd_, size_) != 0) {
+    std::cerr << "Could not truncate " << path_ << ": " << std::strerror(errno)
+              << std::endl;
+  }
+  ::close(fd_);
+  fd_ = -1;
+}
+
+int SegmentFile::write_packet(void *opaque, std::uint8_t *buf, int size) {
+  auto *file = static_cast<SegmentFile *>(opaque);
+  int written = 0;
+  while (written < size) {
+    const ssize_t n =
+        ::pwrite(file->fd_, buf + written, size - written, file->position_);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return AVERROR(errno);
+    }
+    written += static_cast<int>(n);
+    file->position_ += n;
+  }
+  file->size_ = std::max(file->size_, file->position_);
+  return size;
+}
+
+std::int64_t SegmentFile::seek(void *opaque, std::int64_t offset,
+                               int whence) {
+  auto *file = static_cast<SegmentFile *>(opaque);
+  if (whence == AVSEEK_SIZE) {
+    return file->size_;
+  }
+  switch (whence & ~AVSEEK_FORCE) {
+  case SEEK_SET:
+    file->position_ = offset;
+    break;
+  case SEEK_CUR:
+    file->position_ += offset;
+    break;
+  case SEEK_END:
+    file->position_ = file->size_ + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+  return file->position_;
+}
+
+RecordingSink::RecordingSink(RecordingConfig config)
+    : config_(std::move(config)), pkt_(av_packet_alloc()) {}
+
+std::string RecordingSink::name() const {
+  return config_.directory + "/" + config_.prefix;
+}
+
+std::string RecordingSink::index_path() const { return name() + ".index"; }
+
+void RecordingSink::open(const AVCodecContext *codec_ctx,
+                         const CodecProfile &profile) {
+  const AVOutputFormat *format =
+      av_guess_format(nullptr, ("x." + config_.format).c_str(), nullptr);
+  if (!format) {
+    throw std::invalid_argument("Unknown recording format " + config_.format);
+  }
+  if (avformat_query_codec(format, codec_ctx->codec_id,
+                           FF_COMPLIANCE_NORMAL) != 1) {
+    throw std::invalid_argument(std::string(format->name) + " can't hold " +
+                                avcodec_get_name(codec_ctx->codec_id));
+  }
+  profile_ = profile;
+  // segments are opened long after this, when the encoder might have been
+  // replaced, so keep what the muxer needs
+  codec_ctx_ = avcodec_alloc_context3(nullptr);
+  AVCodecParameters *params = avcodec_parameters_alloc();
+  int success = codec_ctx_ && params
+                    ? avcodec_parameters_from_context(params, codec_ctx)
+                    : AVERROR(ENOMEM);
+  if (success >= 0) {
+    success = avcodec_parameters_to_context(codec_ctx_, params);
+  }
+  avcodec_parameters_free(&params);
+  if (success < 0) {
+    avcodec_free_context(&codec_ctx_);
+    throw std::runtime_error("Could not copy codec parameters: " +
+                             avutils::av_strerror2(success));
+  }
+  codec_ctx_->time_base = codec_ctx->time_base;
+  index_.open(index_path(), std::ios::app);
+  if (!index_) {
+    avcodec_free_context(&codec_ctx_);
+    throw std::runtime_error("Could not open " + index_path());
+  }
+}
+
+void RecordingSink::start_segment(const AVPacket *pkt) {
+  end_segment();
+  const std::int64_t unix_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+  segment_name_ =
+      config_.prefix + "-" + std::to_string(unix_ms) + "." + config_.format;
+  std::uint64_t preallocate = config_.preallocate;
+  if (preallocate == 0 && config_.segment_duration.count() > 0) {
+    // a quarter more than the bitrate needs
+    preallocate = static_cast<std::uint64_t>(codec_ctx_->bit_rate) / 8 *
+                  config_.segment_duration.count() * 5 / 4;
+  }
+  if (config_.segment_bytes > 0) {
+    preallocate = std::min(preallocate, config_.segment_bytes);
+  }
+  segment_.reset(new SegmentFile(config_.directory + "/" + segment_name_,
+                                 preallocate, config_.buffer_size));
+  segment_->open(codec_ctx_, profile_);
+  // segments start at 0, which is what players expect
+  segment_start_pts_ = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+  segment_bytes_ = 0;
+  ++segments_;
+}
+
+void RecordingSink::end_segment() {
+  if (!segment_) {
+    return;
+  }
+  segment_->close();
+  segment_.reset();
+  // a crash loses at most the current segment's entries
+  index_.flush();
+}
+
+int RecordingSink::write(const AVPacket *pkt) {
+  const bool keyframe = pkt->flags & AV_PKT_FLAG_KEY;
+  if (!segment_ && !keyframe) {
+    // e.g. after a failed segment, the next one starts with a keyframe
+    return 0;
+  }
+  const std::int64_t elapsed_s =
+      segment_ ? av_rescale_q(pkt->pts - segment_start_pts_,
+                              codec_ctx_->time_base, AVRational{1, 1})
+               : 0;
+  // a replaced encoder's parameters only go into segment headers, so they
+  // start a new one
+  const bool changed = avutils::take_new_extradata(
+      pkt, codec_ctx_->extradata, codec_ctx_->extradata_size);
+  const bool full =
+      changed ||
+      (config_.segment_duration.count() > 0 &&
+       elapsed_s >= config_.segment_duration.count()) ||
+      (config_.segment_bytes > 0 && segment_bytes_ >= config_.segment_bytes);
+  if (!segment_ || (keyframe && full)) {
+    try {
+      start_segment(pkt);
+    } catch (const std::exception &e) {
+      std::cerr << "Could not start recording segment: " << e.what()
+                << std::endl;
+      segment_.reset();
+      return AVERROR(EIO);
+    }
+  }
+  int success = av_packet_ref(pkt_, pkt);
+  if (success < 0) {
+    return success;
+  }
+  pkt_->pts -= segment_start_pts_;
+  if (pkt_->dts != AV_NOPTS_VALUE) {
+    pkt_->dts -= segment_start_pts_;
+  }
+  const std::int64_t offset_ms =
+      av_rescale_q(pkt_->pts, codec_ctx_->time_base, AVRational{1, 1000});
+  success = segment_->write(pkt_);
+  av_packet_unref(pkt_);
+  segment_bytes_ += pkt->size;
+  if (success >= 0 && keyframe) {
+    const std::int64_t unix_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    index_ << unix_ms << ' ' << segment_name_ << ' ' << offset_ms << '\n';
+  }
+  return success;
+}
+
+void RecordingSink::close() {
+  end_segment();
+  if (index_.is_open()) {
+    index_.close();
+  }
+  avcodec_free_context(&codec_ctx_);
+}
+
+RecordingSink::~RecordingSink() {
+  close();
+  av_packet_free(&pkt_);
+}
+
+std::vector<RecordingIndexEntry>
+read_recording_index(const std::string &path) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    throw std::runtime_error("Could not read " + path);
+  }
+  std::vector<RecordingIndexEntry> entries;
+  RecordingIndexEntry entry;
+  while (ifs >> entry.unix_ms >> entry.segment >> entry.offset_ms) {
+    entries.push_back(entry);
+  }
+  return entries;
+}
+
+bool find_recording_keyframe(const std::vector<RecordingIndexEntry> &entries,
+                             std::int64_t unix_ms,
+                             RecordingIndexEntry &entry) {
+  auto it = std::upper_bound(
+      entries.begin(), entries.end(), unix_ms,
+      [](std::int64_t time, const RecordingIndexEntry &candidate) {
+        return time < candidate.unix_ms;
+      });
+  if (it == entries.begin()) {
+    return false;
+  }
+  entry = *(it - 1);
+  return true;
+}
@@ -0,0 +1,130 @@
+#ifndef RECORDING_SINK_HPP_H5ZC2QEN
+#define RECORDING_SINK_HPP_H5ZC2QEN
+
+#include "packet_sink.hpp"
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @brief   Where and how a \ref RecordingSink writes
+ */
+struct RecordingConfig {
+  std::string directory = ".";
+  std::string prefix = "recording"; ///< segment and index file names
+  std::string format = "mkv";       ///< extension: mkv, webm or mp4
+  std::chrono::seconds segment_duration{60}; ///< 0 for no limit
+  std::uint64_t segment_bytes = 0;           ///< 0 for no limit
+  /// disk space reserved per segment up front, so the file system doesn't
+  /// fragment it and writes don't wait for allocation. 0 to estimate it from
+  /// bitrate and duration.
+  std::uint64_t preallocate = 0;
+  int buffer_size = 1 << 20; ///< bytes collected before each write
+};
+
+class SegmentFile;
+
+/**
+ * @brief   Records the encoded stream to disk without encoding it again:
+ * packets are remuxed into a series of files, each starting with a keyframe
+ * and closed once its duration or size limit is reached. Next to them, an
+ * index file lists every keyframe by wall-clock time, so a time can be found
+ * without opening the segments (see read_recording_index()).
+ *
+ * Writing to disk can stall for a long time, so add it with a queue to give it
+ * a thread of its own, e.g. `transmitter.add_sink(recording, 256)`. If the
+ * disk can't keep up, the recording loses packets until the next keyframe,
+ * the live outputs nothing.
+ */
+class RecordingSink : public PacketSink {
+  RecordingConfig config_;
+  CodecProfile profile_;
+  AVCodecContext *codec_ctx_ = nullptr; ///< the encoder's parameters, which
+                                        ///< may be gone by the next segment
+  AVPacket *pkt_;                       ///< shifted to the segment's start
+  std::unique_ptr<SegmentFile> segment_;
+  std::string segment_name_;
+  std::int64_t segment_start_pts_ = 0;
+  std::uint64_t segment_bytes_ = 0;
+  std::uint64_t segments_ = 0;
+  std::ofstream index_;
+
+  /**
+   * @brief Close the current segment, if any, and start a new one
+   *
+   * @param pkt keyframe starting it
+   */
+  void start_segment(const AVPacket *pkt);
+
+  /**
+   * @brief Finish the current segment, if any
+   */
+  void end_segment();
+
+public:
+  /**
+   * @brief ctor. Files are only created once the stream starts.
+   */
+  explicit RecordingSink(RecordingConfig config);
+
+  RecordingSink(const RecordingSink &) = delete;
+  RecordingSink &operator=(const RecordingSink &) = delete;
+
+  /**
+   * @throw std::invalid_argument if the format can't hold the codec
+   * @throw std::runtime_error if the index can't be opened
+   */
+  void open(const AVCodecContext *codec_ctx,
+            const CodecProfile &profile) override;
+  int write(const AVPacket *pkt) override;
+  void close() override;
+  std::string name() const override;
+
+  /**
+   * @brief Get the path of the index file
+   */
+  std::string index_path() const;
+
+  /**
+   * @brief Get the number of segments started so far
+   */
+  std::uint64_t segments() const { return segments_; }
+
+  ~RecordingSink() override;
+};
+
+/**
+ * @brief   Keyframe of a recording, as listed in its index
+ */
+struct RecordingIndexEntry {
+  std::int64_t unix_ms;   ///< wall-clock time it was written
+  std::string segment;    ///< file name, relative to the index
+  std::int64_t offset_ms; ///< timestamp within the segment
+};
+
+/**
+ * @brief   Read a recording's index
+ *
+ * @param path  as given by RecordingSink::index_path()
+ *
+ * @return  entries in the order they were written, i.e. by time
+ * @throw   std::runtime_error if the file can't be read
+ */
+std::vector<RecordingIndexEntry> read_recording_index(const std::string &path);
+
+/**
+ * @brief   Find where to start playing a recording to show a point in time
+ *
+ * @param entries   from read_recording_index()
+ * @param unix_ms   wall-clock time
+ * @param entry set to the last keyframe at or before the time
+ *
+ * @return  false if the recording starts later
+ */
+bool find_recording_keyframe(const std::vector<RecordingIndexEntry> &entries,
+                             std::int64_t unix_ms, RecordingIndexEntry &entry);
+
+#endif /* end of include guard: RECORDING_SINK_HPP_H5ZC2QEN */
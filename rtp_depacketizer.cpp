@@ -0,0 +1,288 @@
+#include "rtp_depacketizer.hpp"
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+/**
+ * @brief   H.264 as in RFC 6184: single NAL units, STAP-A and FU-A, which is
+ * what libavformat sends in packetization mode 1
+ */
+class H264Depacketizer : public Depacketizer {
+  bool slices_;
+  bool fragment_ = false; ///< inside an FU-A
+
+  void start_code() {
+    static const std::uint8_t code[] = {0, 0, 0, 1};
+    append(code, sizeof(code));
+  }
+
+  void nal_unit_done() {
+    if (slices_) {
+      emit();
+    }
+  }
+
+  void nal_unit(const std::uint8_t *data, std::size_t size) {
+    start_code();
+    append(data, size);
+    nal_unit_done();
+  }
+
+protected:
+  void depacketize(const RtpPacket &packet) override {
+    if (skipping_ && packet.timestamp == skipped_timestamp_) {
+      // the rest of a broken frame. Packets don't tell where a frame starts,
+      // so this may also be a frame whose packets all arrived after those of
+      // the previous one were lost.
+      return;
+    }
+    if (assembling_ && packet.timestamp != frame_.timestamp) {
+      // the sender did not mark the end of the previous frame
+      finish();
+    }
+    if (!assembling_) {
+      begin(packet);
+      fragment_ = false;
+    }
+    const std::uint8_t *payload = packet.payload();
+    const std::size_t size = packet.payload_size;
+    const int type = size > 0 ? payload[0] & 0x1f : 0;
+    if (type >= 1 && type <= 23) {
+      nal_unit(payload, size);
+    } else if (type == 24) {
+      // STAP-A: NAL units each behind a 16 bit size
+      std::size_t offset = 1;
+      while (offset + 2 <= size) {
+        const std::size_t nal_size = payload[offset] << 8 | payload[offset + 1];
+        offset += 2;
+        if (nal_size == 0 || offset + nal_size > size) {
+          drop(packet.timestamp);
+          return;
+        }
+        nal_unit(payload + offset, nal_size);
+        offset += nal_size;
+      }
+    } else if (type == 28 && size >= 2) {
+      // FU-A: the NAL header is split between indicator and FU header
+      const std::uint8_t fu_header = payload[1];
+      if (fu_header & 0x80) {
+        start_code();
+        const std::uint8_t nal_header =
+            (payload[0] & 0xe0) | (fu_header & 0x1f);
+        append(&nal_header, 1);
+        fragment_ = true;
+      } else if (!fragment_) {
+        drop(packet.timestamp);
+        return;
+      }
+      append(payload + 2, size - 2);
+      if (fu_header & 0x40) {
+        fragment_ = false;
+        nal_unit_done();
+      }
+    } else {
+      // empty, or a mode libavformat does not send
+      drop(packet.timestamp);
+      return;
+    }
+    frame_.last_arrival_ns = packet.arrival_ns;
+    if (packet.marker && !slices_) {
+      finish();
+    }
+  }
+
+public:
+  H264Depacketizer(bool slices, FrameHandler handler)
+      : Depacketizer(std::move(handler)), slices_(slices) {}
+};
+
+/**
+ * @brief   VP8 and VP9, whose payload descriptors mark where frames start
+ */
+class VpxDepacketizer : public Depacketizer {
+  bool vp9_;
+
+  /**
+   * @brief Get the size of the payload descriptor
+   *
+   * @param start   set if the payload starts a frame
+   * @param end set if it ends one, as far as the descriptor tells
+   *
+   * @return    0 if the descriptor is malformed
+   */
+  std::size_t descriptor(const std::uint8_t *payload, std::size_t size,
+                         bool &start, bool &end) const {
+    if (size < 1) {
+      return 0;
+    }
+    const std::uint8_t first = payload[0];
+    std::size_t offset = 1;
+    if (!vp9_) {
+      // X|R|N|S|R|PID, a frame starts with S set in partition 0
+      start = (first & 0x10) && (first & 0x07) == 0;
+      end = false;
+      if (first & 0x80) {
+        if (size < 2) {
+          return 0;
+        }
+        // I|L|T|K: picture id, TL0PICIDX, TID/KEYIDX
+        const std::uint8_t extensions = payload[1];
+        offset = 2;
+        if (extensions & 0x80) {
+          if (offset >= size) {
+            return 0;
+          }
+          offset += (payload[offset] & 0x80) ? 2 : 1;
+        }
+        offset += (extensions & 0x40) ? 1 : 0;
+        offset += (extensions & 0x30) ? 1 : 0;
+      }
+      return offset <= size ? offset : 0;
+    }
+    // I|P|L|F|B|E|V|Z
+    start = first & 0x08;
+    end = first & 0x04;
+    if (first & 0x80) {
+      // picture id, 7 or 15 bits
+      if (offset >= size) {
+        return 0;
+      }
+      offset += (payload[offset] & 0x80) ? 2 : 1;
+    }
+    if (first & 0x20) {
+      // layer indices, with TL0PICIDX in non-flexible mode
+      offset += (first & 0x10) ? 1 : 2;
+    }
+    if ((first & 0x10) && (first & 0x40)) {
+      // up to three reference indices, each flagging another one
+      for (int i = 0; i < 3; ++i) {
+        if (offset >= size) {
+          return 0;
+        }
+        if (!(payload[offset++] & 0x01)) {
+          break;
+        }
+      }
+    }
+    if (first & 0x02) {
+      // scalability structure
+      if (offset >= size) {
+        return 0;
+      }
+      const std::uint8_t structure = payload[offset++];
+      const std::size_t layers = (structure >> 5) + 1;
+      if (structure & 0x10) {
+        offset += 4 * layers; // resolutions
+      }
+      if (structure & 0x08) {
+        if (offset >= size) {
+          return 0;
+        }
+        const std::size_t pictures = payload[offset++];
+        for (std::size_t i = 0; i < pictures; ++i) {
+          if (offset >= size) {
+            return 0;
+          }
+          offset += 1 + ((payload[offset] >> 2) & 0x03);
+        }
+      }
+    }
+    return offset <= size ? offset : 0;
+  }
+
+protected:
+  void depacketize(const RtpPacket &packet) override {
+    bool start = false;
+    bool end = false;
+    const std::size_t offset =
+        descriptor(packet.payload(), packet.payload_size, start, end);
+    if (offset == 0) {
+      drop(packet.timestamp);
+      return;
+    }
+    if (start) {
+      begin(packet);
+    } else if (!assembling_ || packet.timestamp != frame_.timestamp) {
+      // its frame's start is missing
+      return;
+    }
+    append(packet.payload() + offset, packet.payload_size - offset);
+    frame_.last_arrival_ns = packet.arrival_ns;
+    if (end || packet.marker) {
+      finish();
+    }
+  }
+
+public:
+  VpxDepacketizer(bool vp9, FrameHandler handler)
+      : Depacketizer(std::move(handler)), vp9_(vp9) {}
+};
+
+} // namespace
+
+void Depacketizer::begin(const RtpPacket &packet) {
+  if (assembling_) {
+    // the sender did not mark the end of the previous frame
+    finish();
+  }
+  frame_.data.clear();
+  frame_.timestamp = packet.timestamp;
+  frame_.first_arrival_ns = packet.arrival_ns;
+  frame_.last_arrival_ns = packet.arrival_ns;
+  frame_.gap = gap_;
+  gap_ = false;
+  assembling_ = true;
+  skipping_ = false;
+}
+
+void Depacketizer::emit() {
+  if (frame_.data.empty()) {
+    return;
+  }
+  handler_(frame_);
+  frame_.data.clear();
+  frame_.gap = false;
+}
+
+void Depacketizer::finish() {
+  emit();
+  // an empty frame keeps the gap for the next one
+  gap_ = gap_ || frame_.gap;
+  assembling_ = false;
+}
+
+void Depacketizer::drop(std::uint32_t timestamp) {
+  frame_.data.clear();
+  assembling_ = false;
+  gap_ = true;
+  skipping_ = true;
+  skipped_timestamp_ = timestamp;
+}
+
+void Depacketizer::push(const RtpPacket &packet, std::uint64_t lost) {
+  if (lost > 0) {
+    drop(packet.timestamp);
+  }
+  depacketize(packet);
+}
+
+std::unique_ptr<Depacketizer> Depacketizer::create(AVCodecID codec_id,
+                                                   bool slices,
+                                                   FrameHandler handler) {
+  if (slices && codec_id != AV_CODEC_ID_H264) {
+    throw std::invalid_argument("Slice output needs H.264");
+  }
+  switch (codec_id) {
+  case AV_CODEC_ID_H264:
+    return std::unique_ptr<Depacketizer>(
+        new H264Depacketizer(slices, std::move(handler)));
+  case AV_CODEC_ID_VP8:
+  case AV_CODEC_ID_VP9:
+    return std::unique_ptr<Depacketizer>(
+        new VpxDepacketizer(codec_id == AV_CODEC_ID_VP9, std::move(handler)));
+  default:
+    throw std::invalid_argument(std::string("Can't depacketize ") +
+                                avcodec_get_name(codec_id));
+  }
+}
@@ -0,0 +1,113 @@
+#ifndef RTP_DEPACKETIZER_HPP_B8LC5TXN
+#define RTP_DEPACKETIZER_HPP_B8LC5TXN
+
+#include "jitter_buffer.hpp"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+/**
+ * @brief   Reassembles encoded frames from RTP payloads in sequence order,
+ * for the codecs \ref RtpSink sends: H.264 (RFC 6184), VP8 (RFC 7741) and
+ * VP9 (its payload draft, as libavformat packetizes it). When packets were
+ * lost, the frame they belonged to is dropped, and output resumes with the
+ * next frame arriving from its start, flagged so the decoder knows that
+ * references may be missing.
+ */
+class Depacketizer {
+public:
+  /**
+   * @brief An encoded frame, or a NAL unit with slice output
+   */
+  struct Frame {
+    std::vector<std::uint8_t> data; ///< as the decoder takes it, Annex B
+                                    ///< for H.264
+    std::uint32_t timestamp = 0;
+    std::int64_t first_arrival_ns = 0; ///< of its first packet
+    std::int64_t last_arrival_ns = 0;  ///< of its last packet
+    bool gap = false; ///< packets were lost since the frame before
+  };
+
+  /**
+   * @brief Gets each frame as it is complete. The frame is reused
+   * afterwards.
+   */
+  using FrameHandler = std::function<void(const Frame &frame)>;
+
+protected:
+  FrameHandler handler_;
+  Frame frame_;
+  bool assembling_ = false; ///< `frame_` holds the start of a frame
+  bool gap_ = false;        ///< for the next frame
+  bool skipping_ = false;   ///< dropping packets until a frame starts
+  std::uint32_t skipped_timestamp_ = 0; ///< H.264: of the broken frame
+
+  /**
+   * @brief Start a frame with the given packet
+   */
+  void begin(const RtpPacket &packet);
+
+  /**
+   * @brief Add to the frame
+   */
+  void append(const std::uint8_t *data, std::size_t size) {
+    frame_.data.insert(frame_.data.end(), data, data + size);
+  }
+
+  /**
+   * @brief Hand out what the frame holds so far, if anything
+   */
+  void emit();
+
+  /**
+   * @brief Hand the frame out and start over
+   */
+  void finish();
+
+  /**
+   * @brief Drop the frame, it is missing packets
+   *
+   * @param timestamp   of the packet it broke at
+   */
+  void drop(std::uint32_t timestamp);
+
+  /**
+   * @brief Reassemble the payload of one packet, codec specific
+   */
+  virtual void depacketize(const RtpPacket &packet) = 0;
+
+public:
+  explicit Depacketizer(FrameHandler handler) : handler_(std::move(handler)) {}
+
+  Depacketizer(const Depacketizer &) = delete;
+  Depacketizer &operator=(const Depacketizer &) = delete;
+
+  /**
+   * @brief Get the depacketizer for a codec
+   *
+   * @param codec_id    H.264, VP8 or VP9
+   * @param slices  H.264: hand out every NAL unit on its own as it is
+   * complete, for decoders taking partial frames
+   * @param handler gets the frames
+   * @throw std::invalid_argument for other codecs, or slices of them
+   */
+  static std::unique_ptr<Depacketizer> create(AVCodecID codec_id, bool slices,
+                                              FrameHandler handler);
+
+  /**
+   * @brief Add the next packet in sequence order
+   *
+   * @param packet  with its payload
+   * @param lost    packets missing right before it
+   */
+  void push(const RtpPacket &packet, std::uint64_t lost);
+
+  virtual ~Depacketizer() = default;
+};
+
+#endif /* end of include guard: RTP_DEPACKETIZER_HPP_B8LC5TXN */
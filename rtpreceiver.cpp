@@ -0,0 +1,316 @@
+#include "rtpreceiver.hpp"
+#include "tracing.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+namespace {
+
+/// larger than any datagram libavformat's RTP muxer sends
+constexpr std::size_t max_datagram = 2048;
+
+} // namespace
+
+RTPReceiver::RTPReceiver(const std::string &sdp_path,
+                         std::unique_ptr<FeedbackClient> feedback,
+                         bool slice_decoding, const DecodeSettings &decode,
+                         const JitterBufferConfig &jitter_config)
+    : sdp(read_sdp(sdp_path)), jitter(jitter_config, sdp.clock_rate),
+      pool(4), feedback(std::move(feedback)), decode_settings(decode),
+      // a task is a frame, or a slice with slice decoding. A few frames
+      // queued means decoding can't keep up, a tile of the wall then lags.
+      max_backlog(slice_decoding ? 64 : 8), frames_decoded(0), frames_discarded(0), keyframe_requests(0) {
+  if (decode_settings.pool && this->feedback) {
+    // the client is not thread safe, and would be used by both threads
+    throw std::invalid_argument("Feedback needs decoding on the receiver");
+  }
+  stop.store(false);
+  pause.store(false);
+
+  // the codec comes from the SDP's rtpmap, so this follows the sender's
+  // choice
+  AVCodecParameters *codecpar = sdp_codec_parameters(sdp);
+  try {
+    // with slice decoding, packets are single NAL units and the decoder
+    // finishes the frame with its last slice
+    depacketizer = Depacketizer::create(
+        codecpar->codec_id, slice_decoding,
+        [this](const Depacketizer::Frame &frame) { handle_frame(frame); });
+    dec_ctx = avutils::initialize_decoder(codecpar, slice_decoding,
+                                          decode_settings.threads);
+  } catch (...) {
+    avcodec_parameters_free(&codecpar);
+    throw;
+  }
+  avcodec_parameters_free(&codecpar);
+  if (sdp.fec_payload_type >= 0) {
+    // recovered packets go where received ones do
+    fec.reset(
+        new FecDecoder([this](RtpPacket &packet) { jitter.insert(packet); }));
+  }
+
+  udp_socket = ::socket(AF_INET, SOCK_DGRAM, 0);
+  // a keyframe arrives as a burst of packets, which must not overflow the
+  // socket while decoding. The kernel caps this at net.core.rmem_max.
+  const int buffer_size = 4 << 20;
+  ::setsockopt(udp_socket, SOL_SOCKET, SO_RCVBUF, &buffer_size,
+               sizeof(buffer_size));
+  sockaddr_in local;
+  std::memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = htons(static_cast<std::uint16_t>(sdp.port));
+  if (udp_socket < 0 || ::bind(udp_socket, reinterpret_cast<sockaddr *>(&local),
+                               sizeof(local)) < 0) {
+    const std::string error = std::strerror(errno);
+    ::close(udp_socket);
+    avcodec_free_context(&dec_ctx);
+    throw std::runtime_error("Could not listen on port " +
+                             std::to_string(sdp.port) + ": " + error);
+  }
+
+  // reused for every frame decoded on the receiving thread
+  current_packet = av_packet_alloc();
+  current_frame = av_frame_alloc();
+
+  runner = std::thread(&RTPReceiver::run, this);
+}
+
+std::int64_t RTPReceiver::frame_id(std::int64_t pts) {
+  return pts == AV_NOPTS_VALUE ? tracing::no_frame : pts;
+}
+
+void RTPReceiver::decode_packet(AVPacket *packet,
+                                std::int64_t packet_received, bool gap) {
+  waiting_for_keyframe = waiting_for_keyframe || gap;
+  tracing::ScopedSpan decode_span(tracing::Stage::Decode);
+  int success = avcodec_send_packet(dec_ctx, packet);
+  av_packet_unref(packet);
+  if (success != 0) {
+    std::cout << "Could not send packet: " << avutils::av_strerror2(success)
+              << std::endl;
+    waiting_for_keyframe = true;
+  } else {
+    success = avcodec_receive_frame(dec_ctx, current_frame);
+  }
+  if (feedback) {
+    if (success == 0) {
+      // with slice decoding most packets are only part of a frame
+      feedback->record_decode(tracing::now_ns() - packet_received);
+    }
+    feedback->report(mailbox.dropped());
+  }
+  if (success == 0 && waiting_for_keyframe) {
+    if (current_frame->key_frame &&
+        !(current_frame->flags & AV_FRAME_FLAG_CORRUPT)) {
+      waiting_for_keyframe = false;
+    } else {
+      // references are missing, this would only show garbage
+      ++frames_discarded;
+      av_frame_unref(current_frame);
+      success = AVERROR(EAGAIN);
+    }
+  }
+  if (waiting_for_keyframe && feedback) {
+    // ids are relative to this receiver's first packet, the sender can't
+    // compare them to its own
+    feedback->request_keyframe(tracing::no_frame);
+    keyframe_requests.store(feedback->keyframe_requests());
+  }
+  if (success == 0) {
+    DecodedFrame decoded;
+    decoded.frame_id = frame_id(current_frame->pts);
+    decode_span.set_frame_id(decoded.frame_id);
+    if (decode_settings.yuv) {
+      // the consumer converts, the decoder's buffer is shared until then
+      decoded.yuv = avutils::share_frame(current_frame);
+    } else {
+      tracing::ScopedSpan span(tracing::Stage::ColorConvert, decoded.frame_id);
+      // consumers hold on to the image, it returns to the pool once they
+      // drop it
+      decoded.image = pool.acquire(current_frame->height, current_frame->width,
+                                   CV_8UC4);
+      avutils::avframe_to_bgr(current_frame, decoded.image, 4);
+    }
+    av_frame_unref(current_frame);
+    mailbox.put(std::move(decoded));
+    ++frames_decoded;
+  } else if (success != AVERROR(EAGAIN)) {
+    std::cout << "Did not get frame " << avutils::av_strerror2(success)
+              << std::endl;
+  }
+}
+
+bool RTPReceiver::receive_datagram() {
+  if (received.data.size() < max_datagram) {
+    // the jitter buffer hands back empty buffers at first
+    received.data.resize(max_datagram);
+  }
+  const ssize_t size = ::recv(udp_socket, received.data.data(),
+                              received.data.size(), MSG_DONTWAIT | MSG_TRUNC);
+  if (size < 0) {
+    return false;
+  }
+  received.arrival_ns = tracing::now_ns();
+  received.size = static_cast<std::size_t>(size);
+  // truncated, or somebody else's
+  if (!received.parse()) {
+    return true;
+  }
+  if (received.payload_type == sdp.payload_type) {
+    if (fec) {
+      // before the jitter buffer takes the buffer
+      fec->add_media(received);
+    }
+    jitter.insert(received);
+  } else if (fec && received.payload_type == sdp.fec_payload_type) {
+    fec->add_fec(received);
+  }
+  return true;
+}
+
+void RTPReceiver::handle_frame(const Depacketizer::Frame &frame) {
+  if (have_timestamp) {
+    pts += static_cast<std::int32_t>(frame.timestamp - last_timestamp);
+  }
+  have_timestamp = true;
+  last_timestamp = frame.timestamp;
+  // relative to the first frame, i.e. the sender's frame id. The time the
+  // frame waited after its last packet arrived is spent reordering.
+  const std::int64_t id = frame_id(pts);
+  tracing::record(tracing::Stage::Receive, id, frame.last_arrival_ns,
+                  tracing::now_ns());
+  if (feedback) {
+    feedback->record_arrival(pts, frame.last_arrival_ns);
+  }
+  const int size = static_cast<int>(frame.data.size());
+  if (!decode_settings.pool) {
+    if (av_new_packet(current_packet, size) < 0) {
+      return;
+    }
+    std::memcpy(current_packet->data, frame.data.data(), frame.data.size());
+    current_packet->pts = current_packet->dts = pts;
+    decode_packet(current_packet, frame.last_arrival_ns, frame.gap);
+    return;
+  }
+  // the frame is reused, the task gets a copy
+  std::shared_ptr<AVPacket> packet(
+      av_packet_alloc(), [](AVPacket *unused) { av_packet_free(&unused); });
+  if (!packet || av_new_packet(packet.get(), size) < 0) {
+    return;
+  }
+  std::memcpy(packet->data, frame.data.data(), frame.data.size());
+  packet->pts = packet->dts = pts;
+  const std::int64_t packet_received = frame.last_arrival_ns;
+  const bool gap = frame.gap;
+  const std::size_t backlog = decode_settings.pool->post(
+      strand, [this, packet, packet_received, gap]() {
+        decode_packet(packet.get(), packet_received, gap);
+      });
+  if (backlog > max_backlog) {
+    // skipping packets breaks the references, so start over at the next
+    // keyframe
+    decode_settings.pool->cancel(strand);
+    decode_settings.pool->post(strand, [this]() {
+      waiting_for_keyframe = true;
+      avcodec_flush_buffers(dec_ctx);
+    });
+  }
+}
+
+void RTPReceiver::run() {
+  // datagrams queued in the socket at once, before releasing packets
+  constexpr int max_burst = 64;
+  std::uint64_t lost = 0;
+  while (!stop.load()) {
+    if (pause.load()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    // wait for a datagram, but not past giving up a missing packet, and
+    // wake up regularly to check for stop
+    int timeout_ms = 100;
+    const std::int64_t release = jitter.next_release_ns();
+    if (release >= 0) {
+      const std::int64_t remaining_ms =
+          (release - tracing::now_ns() + 999'999) / 1'000'000;
+      timeout_ms = static_cast<int>(std::max<std::int64_t>(
+          0, std::min<std::int64_t>(timeout_ms, remaining_ms)));
+    }
+    pollfd readable{udp_socket, POLLIN, 0};
+    if (::poll(&readable, 1, timeout_ms) > 0) {
+      for (int i = 0; i < max_burst && receive_datagram(); ++i) {
+      }
+    }
+    while (jitter.pop(released, lost, tracing::now_ns())) {
+      if (feedback) {
+        // both in RTP packets, the loss fraction compares them
+        feedback->record_received();
+        if (lost > 0) {
+          feedback->record_loss(lost);
+        }
+      }
+      depacketizer->push(released, lost);
+    }
+  }
+}
+
+cv::Mat RTPReceiver::get() { return get_frame().image; }
+
+RTPReceiver::DecodedFrame RTPReceiver::get_frame() {
+  DecodedFrame frame{tracing::no_frame, cv::Mat(), nullptr};
+  while (!mailbox.get_latest(frame, std::chrono::milliseconds(100)) &&
+         !mailbox.closed()) {
+  }
+  return frame;
+}
+
+bool RTPReceiver::try_get_frame(DecodedFrame &frame) {
+  return mailbox.try_get(frame);
+}
+
+bool RTPReceiver::get_latest_frame(DecodedFrame &frame,
+                             std::chrono::milliseconds timeout) {
+  return mailbox.get_latest(frame, timeout);
+}
+
+RTPReceiver::Stats RTPReceiver::get_stats() const {
+  return Stats{frames_decoded.load(), pool.allocations(),
+               frames_discarded.load(), mailbox.dropped(),
+               keyframe_requests.load(), jitter.get_stats(),
+               fec ? fec->get_stats() : FecDecoder::Stats{0, 0, 0}};
+}
+
+void RTPReceiver::setStop() {
+  stop.store(true);
+  mailbox.close();
+}
+
+void RTPReceiver::setPause() { pause.store(true); }
+
+void RTPReceiver::setUnPause() { pause.store(false); }
+
+RTPReceiver::~RTPReceiver() {
+  pause.store(true);
+  stop.store(true);
+  // wakes up consumers waiting for a frame
+  mailbox.close();
+  runner.join();
+  if (decode_settings.pool) {
+    decode_settings.pool->cancel(strand);
+  }
+  ::close(udp_socket);
+  avcodec_free_context(&dec_ctx);
+  av_frame_free(&current_frame);
+  av_packet_free(&current_packet);
+}
@@ -0,0 +1,187 @@
+#ifndef RTPRECEIVER_HPP_M4TX9CWB
+#define RTPRECEIVER_HPP_M4TX9CWB
+
+#include "avutils.hpp"
+#include "decode_pool.hpp"
+#include "fec.hpp"
+#include "feedback.hpp"
+#include "frame_pool.hpp"
+#include "jitter_buffer.hpp"
+#include "mailbox.hpp"
+#include "rtp_depacketizer.hpp"
+#include "sdp.hpp"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <opencv2/core.hpp>
+#include <thread>
+
+/**
+ * @brief   A class which receives an RTP stream described by an SDP file and
+ * decodes it to BGRA images on a background thread. Packets go through a
+ * \ref JitterBuffer, which puts them back in order and waits for late ones
+ * within a latency budget, and a \ref Depacketizer. If the sender adds FEC,
+ * lost packets are recovered before the jitter buffer. When frames are lost,
+ * nothing is output until the next keyframe, which is requested from the
+ * sender if there is a feedback channel.
+ */
+class RTPReceiver {
+public:
+  /**
+   * @brief Decoded image with the id of the frame it came from
+   */
+  struct DecodedFrame {
+    std::int64_t frame_id;
+    cv::Mat image;
+    /// with DecodeSettings::yuv, instead of the image
+    std::shared_ptr<AVFrame> yuv;
+  };
+
+  /**
+   * @brief Counters since construction
+   */
+  struct Stats {
+    std::uint64_t frames_decoded;
+    std::uint64_t allocations; ///< output images allocated, constant once
+                               ///< the pool is warm
+    std::uint64_t frames_discarded; ///< decoded while waiting for a keyframe
+    std::uint64_t frames_dropped;   ///< replaced before the consumer took them
+    std::uint64_t keyframe_requests;
+    JitterBuffer::Stats packets; ///< reordering and loss on the link
+    FecDecoder::Stats fec;       ///< all zero if the sender sends no FEC
+  };
+
+private:
+  SdpStream sdp;
+  int udp_socket = -1;
+  JitterBuffer jitter;
+  std::unique_ptr<FecDecoder> fec; ///< if the SDP has FEC packets
+  std::unique_ptr<Depacketizer> depacketizer;
+  RtpPacket received; ///< datagram being received
+  RtpPacket released; ///< packet leaving the jitter buffer
+  bool have_timestamp = false;
+  std::uint32_t last_timestamp = 0;
+  std::int64_t pts = 0; ///< RTP timestamp since the first frame, unwrapped
+  AVCodecContext *dec_ctx;
+  AVFrame *current_frame;
+  AVPacket *current_packet;
+  Mailbox<DecodedFrame> mailbox; ///< decoding never waits for the consumer
+  // the one in the mailbox, the one being decoded into and a couple held by
+  // the consumer
+  FramePool pool;
+  std::unique_ptr<FeedbackClient> feedback;
+  DecodeSettings decode_settings;
+  DecodePool::Strand strand; ///< decoding on the pool, if any
+  std::size_t max_backlog;   ///< tasks queued on the strand before decoding
+                             ///< starts over at the next keyframe
+  bool waiting_for_keyframe = true; ///< only touched by decoding
+  std::atomic<std::uint64_t> frames_decoded;
+  std::atomic<std::uint64_t> frames_discarded;
+  std::atomic<std::uint64_t> keyframe_requests;
+
+  std::atomic<bool> stop;
+  std::atomic<bool> pause;
+  std::thread runner;
+
+  /**
+   * @brief Get the tracing id of a frame with given pts
+   */
+  static std::int64_t frame_id(std::int64_t pts);
+
+  /**
+   * @brief Receive a datagram waiting on the socket into the jitter buffer
+   *
+   * @return    false if there was none
+   */
+  bool receive_datagram();
+
+  /**
+   * @brief Decode a frame the depacketizer completed, or hand it to the pool
+   */
+  void handle_frame(const Depacketizer::Frame &frame);
+
+  /**
+   * @brief Decode a packet and deliver the frame it completes. Runs on the
+   * receiving thread, or on the decode pool.
+   *
+   * @param packet  unreferenced when done
+   * @param packet_received when it arrived
+   * @param gap frames were lost right before it
+   */
+  void decode_packet(AVPacket *packet, std::int64_t packet_received,
+                     bool gap);
+
+  /**
+   * @brief Receive until stopped, decoding or handing frames to the pool
+   */
+  void run();
+
+public:
+  /**
+   * @brief ctor. Opens the stream and starts receiving.
+   *
+   * @param sdp_path    SDP file describing the stream
+   * @param feedback    channel to request keyframes after loss, optional
+   * @param slice_decoding  decode H.264 slices as their packets arrive
+   * instead of waiting for the whole frame. Needs a sender whose slices each
+   * fit into a packet, see AVTransmitter::set_max_slice_size().
+   * @param decode  where to decode and what to output
+   * @param jitter_config   how long to wait for reordered packets
+   * @throw std::invalid_argument if the SDP can't be read or describes a
+   * codec there is no depacketizer for, for slice decoding of other codecs,
+   * or for feedback with a decode pool
+   * @throw std::runtime_error if the stream's port can't be bound
+   */
+  RTPReceiver(const std::string &sdp_path,
+              std::unique_ptr<FeedbackClient> feedback = nullptr,
+              bool slice_decoding = false,
+              const DecodeSettings &decode = DecodeSettings(),
+              const JitterBufferConfig &jitter_config = JitterBufferConfig());
+
+  /**
+   * @brief Wait for the next decoded image
+   *
+   * @return    empty image if the receiver was stopped
+   */
+  cv::Mat get();
+
+  /**
+   * @brief Wait for the next decoded frame
+   *
+   * @return    frame with empty image if the receiver was stopped
+   */
+  DecodedFrame get_frame();
+
+  /**
+   * @brief Get the newest decoded frame without waiting
+   *
+   * @return    false if there is no frame the consumer hasn't seen
+   */
+  bool try_get_frame(DecodedFrame &frame);
+
+  /**
+   * @brief Get the newest decoded frame, waiting for one for a while
+   *
+   * @return    false on timeout or if the receiver was stopped
+   */
+  bool get_latest_frame(DecodedFrame &frame,
+                        std::chrono::milliseconds timeout);
+
+  /**
+   * @brief Get counters
+   *
+   * @return    snapshot of current stats
+   */
+  Stats get_stats() const;
+
+  /**
+   * @brief Stop receiving and wake up consumers waiting in get_frame()
+   */
+  void setStop();
+  void setPause();
+  void setUnPause();
+
+  ~RTPReceiver();
+};
+
+#endif /* end of include guard: RTPRECEIVER_HPP_M4TX9CWB */
@@ -0,0 +1,99 @@
+#include "scaler.hpp"
+#include "avutils.hpp"
+#include "colorconv.hpp"
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+int sws_flags(ScaleFilter filter) {
+  switch (filter) {
+  case ScaleFilter::FastBilinear:
+    return SWS_FAST_BILINEAR;
+  case ScaleFilter::Bilinear:
+    return SWS_BILINEAR;
+  case ScaleFilter::Area:
+    return SWS_AREA;
+  case ScaleFilter::Bicubic:
+    return SWS_BICUBIC;
+  }
+  return SWS_AREA;
+}
+
+} // namespace
+
+ScaleFilter scale_filter(const std::string &name) {
+  if (name == "fast") {
+    return ScaleFilter::FastBilinear;
+  }
+  if (name == "bilinear") {
+    return ScaleFilter::Bilinear;
+  }
+  if (name == "area") {
+    return ScaleFilter::Area;
+  }
+  if (name == "bicubic") {
+    return ScaleFilter::Bicubic;
+  }
+  throw std::invalid_argument("Unknown scale filter " + name +
+                              ", known: fast bilinear area bicubic");
+}
+
+Scaler::Scaler(ScaleFilter filter) : filter_(filter) {}
+
+void Scaler::set_filter(ScaleFilter filter) { filter_ = filter; }
+
+AVFrame *Scaler::intermediate(int width, int height, AVPixelFormat format) {
+  if (intermediate_ && intermediate_->width == width &&
+      intermediate_->height == height &&
+      intermediate_->format == static_cast<int>(format)) {
+    return intermediate_;
+  }
+  av_frame_free(&intermediate_);
+  intermediate_ = av_frame_alloc();
+  intermediate_->width = width;
+  intermediate_->height = height;
+  intermediate_->format = static_cast<int>(format);
+  int success = av_frame_get_buffer(intermediate_, 0);
+  if (success < 0) {
+    av_frame_free(&intermediate_);
+    throw std::runtime_error("Could not allocate frame: " +
+                             avutils::av_strerror2(success));
+  }
+  return intermediate_;
+}
+
+void Scaler::scale(const AVFrame *src, AVFrame *dst) {
+  const auto src_format = static_cast<AVPixelFormat>(src->format);
+  const auto dst_format = static_cast<AVPixelFormat>(dst->format);
+  const AVFrame *input = src;
+  if (avutils::is_raw_camera_format(src_format) &&
+      (dst_format == AV_PIX_FMT_YUV420P || dst_format == AV_PIX_FMT_NV12)) {
+    const bool same_size =
+        src->width == dst->width && src->height == dst->height;
+    // demosaic at the input size, swscale only resamples the result
+    AVFrame *converted =
+        same_size ? dst : intermediate(src->width, src->height, dst_format);
+    avutils::convert_raw_to_yuv420(src->data[0], src->linesize[0], src->width,
+                                   src->height, src_format, dst_format,
+                                   converted->data, converted->linesize);
+    if (same_size) {
+      return;
+    }
+    input = converted;
+  }
+  sws_ = sws_getCachedContext(
+      sws_, input->width, input->height,
+      static_cast<AVPixelFormat>(input->format), dst->width, dst->height,
+      dst_format, sws_flags(filter_), nullptr, nullptr, nullptr);
+  if (!sws_) {
+    throw std::runtime_error("Could not initialize sample scaler!");
+  }
+  sws_scale(sws_, input->data, input->linesize, 0, input->height, dst->data,
+            dst->linesize);
+}
+
+Scaler::~Scaler() {
+  sws_freeContext(sws_);
+  av_frame_free(&intermediate_);
+}
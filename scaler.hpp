@@ -0,0 +1,81 @@
+#ifndef SCALER_HPP_F6TB9QJN
+#define SCALER_HPP_F6TB9QJN
+
+#include <string>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+}
+
+/**
+ * @brief   Resampling filter of a \ref Scaler, fastest first. All of them run
+ * on swscale's SIMD paths.
+ */
+enum class ScaleFilter {
+  FastBilinear, ///< bilinear with low precision, for large frames on weak CPUs
+  Bilinear,
+  Area, ///< averages the covered input pixels, sharp and alias free when
+        ///< downscaling by integer factors
+  Bicubic
+};
+
+/**
+ * @brief   Get a filter by name for command lines
+ *
+ * @param name  "fast", "bilinear", "area" or "bicubic"
+ *
+ * @throw   std::invalid_argument for unknown names
+ */
+ScaleFilter scale_filter(const std::string &name);
+
+/**
+ * @brief   Converts frames to another pixel format and size in one pass.
+ * Contexts are cached, so frames whose size or format changes from one call
+ * to the next just cost a reinitialization. Raw Bayer and mono frames take the
+ * direct path in colorconv.hpp, and are only resampled by swscale if the size
+ * differs.
+ * @warning Not thread safe, meant for one stage of a pipeline
+ */
+class Scaler {
+  ScaleFilter filter_;
+  SwsContext *sws_ = nullptr;
+  AVFrame *intermediate_ = nullptr; ///< raw input converted at its own size
+
+  /**
+   * @brief Get a frame for raw input converted to the output format at the
+   * input's size, reallocated if the size changed
+   */
+  AVFrame *intermediate(int width, int height, AVPixelFormat format);
+
+public:
+  /**
+   * @brief ctor
+   *
+   * @param filter  resampling filter, only matters when the size changes
+   */
+  explicit Scaler(ScaleFilter filter = ScaleFilter::Area);
+
+  Scaler(const Scaler &) = delete;
+  Scaler &operator=(const Scaler &) = delete;
+
+  /**
+   * @brief Change the resampling filter for following frames
+   */
+  void set_filter(ScaleFilter filter);
+
+  /**
+   * @brief Convert a frame
+   *
+   * @param src input frame of any size and any format swscale reads
+   * @param dst output frame with buffers, its width, height and format say
+   * what to convert to
+   * @throw std::runtime_error if the conversion is not supported
+   */
+  void scale(const AVFrame *src, AVFrame *dst);
+
+  ~Scaler();
+};
+
+#endif /* end of include guard: SCALER_HPP_F6TB9QJN */
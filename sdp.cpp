@@ -0,0 +1,187 @@
+#include "sdp.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+extern "C" {
+#include <libavutil/base64.h>
+#include <libavutil/mem.h>
+}
+
+namespace {
+
+std::string trim(const std::string &text) {
+  const auto begin = text.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  return text.substr(begin, text.find_last_not_of(" \t\r") - begin + 1);
+}
+
+std::string upper(std::string text) {
+  std::transform(text.begin(), text.end(), text.begin(),
+                 [](unsigned char c) { return std::toupper(c); });
+  return text;
+}
+
+/**
+ * @brief   Split `<payload type> <rest>` of an rtpmap or fmtp attribute
+ *
+ * @return  -1 if there is no payload type
+ */
+int payload_type_of(const std::string &value, std::string &rest) {
+  const auto space = value.find(' ');
+  try {
+    const int payload_type = std::stoi(value.substr(0, space));
+    rest = space == std::string::npos ? std::string()
+                                      : trim(value.substr(space + 1));
+    return payload_type;
+  } catch (const std::exception &) {
+    return -1;
+  }
+}
+
+} // namespace
+
+SdpStream parse_sdp(const std::string &sdp) {
+  SdpStream stream;
+  bool in_video = false;
+  bool found = false;
+  std::vector<int> other_payload_types; // of the video stream
+  std::istringstream lines(sdp);
+  std::string line;
+  while (std::getline(lines, line)) {
+    line = trim(line);
+    if (line.compare(0, 2, "m=") == 0) {
+      if (found) {
+        break; // attributes of the next stream
+      }
+      // m=video <port> RTP/AVP <payload type> ...
+      std::istringstream media(line.substr(2));
+      std::string type, protocol;
+      int payload_type = -1;
+      media >> type >> stream.port >> protocol >> payload_type;
+      in_video = type == "video" && media;
+      found = in_video;
+      stream.payload_type = payload_type;
+      other_payload_types.clear();
+      while (media >> payload_type) {
+        other_payload_types.push_back(payload_type);
+      }
+      continue;
+    }
+    if (!in_video || line.compare(0, 2, "a=") != 0) {
+      continue;
+    }
+    const auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    const std::string name = line.substr(2, colon - 2);
+    std::string rest;
+    const int payload_type = payload_type_of(line.substr(colon + 1), rest);
+    // <encoding>/<clock rate>[/<channels>]
+    const auto slash = rest.find('/');
+    if (payload_type != stream.payload_type) {
+      if (name == "rtpmap" &&
+          std::find(other_payload_types.begin(), other_payload_types.end(),
+                    payload_type) != other_payload_types.end() &&
+          upper(rest.substr(0, slash)) == "ULPFEC") {
+        stream.fec_payload_type = payload_type;
+      }
+      continue;
+    }
+    if (name == "rtpmap") {
+      stream.encoding = upper(rest.substr(0, slash));
+      if (slash != std::string::npos) {
+        stream.clock_rate =
+            static_cast<unsigned int>(std::stoul(rest.substr(slash + 1)));
+      }
+    } else if (name == "fmtp") {
+      std::istringstream parameters(rest);
+      std::string parameter;
+      while (std::getline(parameters, parameter, ';')) {
+        const auto equals = parameter.find('=');
+        if (equals != std::string::npos) {
+          stream.format_parameters[trim(parameter.substr(0, equals))] =
+              trim(parameter.substr(equals + 1));
+        }
+      }
+    }
+  }
+  if (!found || stream.port == 0 || stream.payload_type < 0) {
+    throw std::invalid_argument("No video stream in SDP");
+  }
+  if (stream.encoding.empty() && stream.payload_type >= 96) {
+    throw std::invalid_argument("No rtpmap for dynamic payload type " +
+                                std::to_string(stream.payload_type));
+  }
+  return stream;
+}
+
+SdpStream read_sdp(const std::string &path) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    throw std::invalid_argument("Could not open SDP path " + path);
+  }
+  std::stringstream text;
+  text << ifs.rdbuf();
+  return parse_sdp(text.str());
+}
+
+AVCodecParameters *sdp_codec_parameters(const SdpStream &stream) {
+  AVCodecID codec_id;
+  if (stream.encoding == "H264") {
+    codec_id = AV_CODEC_ID_H264;
+  } else if (stream.encoding == "VP8") {
+    codec_id = AV_CODEC_ID_VP8;
+  } else if (stream.encoding == "VP9") {
+    codec_id = AV_CODEC_ID_VP9;
+  } else {
+    throw std::invalid_argument("Can't depacketize " +
+                                (stream.encoding.empty()
+                                     ? "payload type " +
+                                           std::to_string(stream.payload_type)
+                                     : stream.encoding));
+  }
+  // the parameter sets in Annex B, as the decoder takes them
+  std::vector<std::uint8_t> extradata;
+  const auto sprop = stream.format_parameters.find("sprop-parameter-sets");
+  if (codec_id == AV_CODEC_ID_H264 &&
+      sprop != stream.format_parameters.end()) {
+    std::istringstream sets(sprop->second);
+    std::string set;
+    while (std::getline(sets, set, ',')) {
+      std::vector<std::uint8_t> nal(set.size());
+      const int size = av_base64_decode(nal.data(), set.c_str(),
+                                        static_cast<int>(nal.size()));
+      if (size <= 0) {
+        continue;
+      }
+      extradata.insert(extradata.end(), {0, 0, 0, 1});
+      extradata.insert(extradata.end(), nal.begin(), nal.begin() + size);
+    }
+  }
+  AVCodecParameters *codecpar = avcodec_parameters_alloc();
+  if (!codecpar) {
+    throw std::runtime_error("Could not allocate codec parameters");
+  }
+  codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+  codecpar->codec_id = codec_id;
+  if (!extradata.empty()) {
+    codecpar->extradata = static_cast<std::uint8_t *>(
+        av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+    if (!codecpar->extradata) {
+      avcodec_parameters_free(&codecpar);
+      throw std::runtime_error("Could not allocate extradata");
+    }
+    std::memcpy(codecpar->extradata, extradata.data(), extradata.size());
+    codecpar->extradata_size = static_cast<int>(extradata.size());
+  }
+  return codecpar;
+}
@@ -0,0 +1,57 @@
+#ifndef SDP_HPP_W6HN2QZT
+#define SDP_HPP_W6HN2QZT
+
+#include <map>
+#include <string>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+/**
+ * @brief   The video stream of a session description, as far as a receiver
+ * needs it. The SDPs \ref RtpSink writes describe exactly one.
+ */
+struct SdpStream {
+  unsigned int port = 0; ///< where the RTP packets arrive
+  int payload_type = -1;
+  std::string encoding; ///< from the rtpmap, upper case, e.g. "H264"
+  unsigned int clock_rate = 90000;
+  /// from the fmtp line, e.g. `sprop-parameter-sets`
+  std::map<std::string, std::string> format_parameters;
+  /// of FEC packets on the same port, see \ref FecDecoder, -1 for none
+  int fec_payload_type = -1;
+};
+
+/**
+ * @brief   Find the first video stream in a session description. Its first
+ * payload type is the video, a further one mapped to `ulpfec` carries FEC.
+ *
+ * @param sdp   text of the description
+ *
+ * @return  the stream
+ * @throw std::invalid_argument if there is no video stream, or it has no
+ * port or payload type
+ */
+SdpStream parse_sdp(const std::string &sdp);
+
+/**
+ * @brief   Find the first video stream in an SDP file
+ *
+ * @throw std::invalid_argument if the file can't be read or parsed
+ */
+SdpStream read_sdp(const std::string &path);
+
+/**
+ * @brief   Describe the stream to a decoder: the codec follows the encoding
+ * name, and H.264 parameter sets from `sprop-parameter-sets` become the
+ * extradata, so decoding can start before the sender repeats them
+ *
+ * @return  allocated with `avcodec_parameters_alloc()`, to be freed by the
+ * caller
+ * @throw std::invalid_argument for encodings there is no depacketizer for,
+ * see \ref Depacketizer
+ */
+AVCodecParameters *sdp_codec_parameters(const SdpStream &stream);
+
+#endif /* end of include guard: SDP_HPP_W6HN2QZT */
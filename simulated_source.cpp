@@ -0,0 +1,176 @@
+#include "simulated_source.hpp"
+#include "frame_pacer.hpp"
+#include "tracing.hpp"
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+#include <random>
+#include <stdexcept>
+
+SimulatedSource::SimulatedSource(const SimulatedCamera &config)
+    : config_(config), stats_(), running_(false) {
+  if (config_.width < 2 || config_.height < 2 || config_.width % 2 != 0 ||
+      config_.height % 2 != 0) {
+    throw std::invalid_argument("Simulated frames must have an even size");
+  }
+  if (config_.fps == 0 || config_.buffers == 0 || config_.patterns == 0) {
+    throw std::invalid_argument(
+        "Simulated camera needs a frame rate, buffers and patterns");
+  }
+  for (unsigned int i = 0; i < config_.patterns; ++i) {
+    patterns_.push_back(render(i));
+  }
+  for (unsigned int i = 0; i < config_.buffers; ++i) {
+    buffers_.push_back(patterns_[0].clone());
+    buffer_free_.push_back(true);
+  }
+}
+
+cv::Mat SimulatedSource::render(unsigned int index) const {
+  cv::Mat image(config_.height, config_.width, CV_8UC3);
+  image.setTo(cv::Scalar(255, 255, 255));
+  // a moving noisy block keeps the encoder busy like a real scene would
+  const int size = std::max(2, std::min(config_.width, config_.height) / 4);
+  const int x =
+      static_cast<int>(index * 8) % std::max(1, config_.width - size);
+  const int y =
+      static_cast<int>(index * 4) % std::max(1, config_.height - size);
+  cv::Mat block = image(cv::Rect(x, y, size, size));
+  cv::randu(block, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::Mat corner =
+      image(cv::Rect(0, 0, config_.width / 4, config_.height / 4));
+  avutils::generatePattern(corner, static_cast<unsigned char>(index));
+  switch (config_.format) {
+  case AV_PIX_FMT_RGB24: {
+    cv::Mat rgb;
+    cv::cvtColor(image, rgb, cv::COLOR_BGR2RGB);
+    return rgb;
+  }
+  case AV_PIX_FMT_GRAY8: {
+    cv::Mat gray;
+    cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    return gray;
+  }
+  default:
+    // throws for anything but the 8 bit Bayer formats
+    return avutils::bayer_mosaic(image, config_.format);
+  }
+}
+
+void SimulatedSource::start() {
+  if (running_.exchange(true)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_ = Stats();
+  }
+  thread_ = std::thread(&SimulatedSource::run, this);
+}
+
+void SimulatedSource::stop() {
+  if (!running_.exchange(false)) {
+    return;
+  }
+  ready_cv_.notify_all();
+  thread_.join();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (ready_ >= 0) {
+    buffer_free_[ready_] = true;
+    ready_ = -1;
+  }
+}
+
+void SimulatedSource::run() {
+  // a late frame is late, the camera doesn't catch up on the ones it missed
+  FramePacer pacer(config_.fps, 1, OverrunPolicy::Skip);
+  std::mt19937 rng(config_.seed);
+  std::uniform_real_distribution<double> chance(0, 1);
+  std::uniform_int_distribution<std::int64_t> delay_us(0,
+                                                       config_.jitter.count());
+  std::uint64_t index = 0;
+  while (running_.load()) {
+    const std::uint64_t skipped = pacer.wait();
+    // exposure ends now, arrival is later by the transfer jitter
+    const std::int64_t captured_ns = tracing::now_ns();
+    const cv::Mat &pattern = patterns_[index++ % patterns_.size()];
+    if (config_.jitter.count() > 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(delay_us(rng)));
+    }
+    const bool lost = chance(rng) < config_.drop_probability;
+    const bool incomplete = chance(rng) < config_.incomplete_probability;
+    int buffer = -1;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.dropped += skipped;
+      if (lost) {
+        ++stats_.dropped;
+        continue;
+      }
+      for (std::size_t i = 0; i < buffer_free_.size(); ++i) {
+        if (buffer_free_[i]) {
+          buffer = static_cast<int>(i);
+          buffer_free_[i] = false;
+          break;
+        }
+      }
+      if (buffer < 0) {
+        // the consumer holds all of them
+        ++stats_.dropped;
+        continue;
+      }
+    }
+    // outside the lock, the buffer is ours until it is made ready
+    pattern.copyTo(buffers_[buffer]);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (ready_ >= 0) {
+        // NewestOnly: the older frame was never grabbed
+        buffer_free_[ready_] = true;
+        ++stats_.dropped;
+      }
+      ready_ = buffer;
+      ready_incomplete_ = incomplete;
+      ready_captured_ns_ = captured_ns;
+    }
+    ready_cv_.notify_one();
+  }
+}
+
+GrabStatus SimulatedSource::grab(std::chrono::milliseconds timeout,
+                                 avutils::BorrowedImage &image) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ready_cv_.wait_for(lock, timeout,
+                     [this]() { return ready_ >= 0 || !running_.load(); });
+  if (ready_ < 0) {
+    ++stats_.timeouts;
+    return GrabStatus::Timeout;
+  }
+  const int buffer = ready_;
+  ready_ = -1;
+  if (ready_incomplete_) {
+    buffer_free_[buffer] = true;
+    ++stats_.incomplete;
+    return GrabStatus::Incomplete;
+  }
+  ++stats_.grabbed;
+  const cv::Mat &data = buffers_[buffer];
+  image = avutils::BorrowedImage();
+  image.data[0] = data.data;
+  image.linesize[0] = static_cast<int>(data.step);
+  image.width = data.cols;
+  image.height = data.rows;
+  image.format = config_.format;
+  image.captured_ns = ready_captured_ns_;
+  image.release = [this, buffer]() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffer_free_[buffer] = true;
+  };
+  return GrabStatus::Ok;
+}
+
+FrameSource::Stats SimulatedSource::get_stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+SimulatedSource::~SimulatedSource() { stop(); }
@@ -0,0 +1,92 @@
+#ifndef SIMULATED_SOURCE_HPP_K4NB7RXE
+#define SIMULATED_SOURCE_HPP_K4NB7RXE
+
+#include "frame_source.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+}
+
+/**
+ * @brief   What a \ref SimulatedSource delivers, and how badly
+ */
+struct SimulatedCamera {
+  int width = 1920;
+  int height = 1080;
+  unsigned int fps = 30;
+  /// AV_PIX_FMT_RGB24, AV_PIX_FMT_GRAY8 or an 8 bit Bayer format
+  AVPixelFormat format = AV_PIX_FMT_BAYER_RGGB8;
+  /// frames arrive up to this long after capture, uniformly distributed
+  std::chrono::microseconds jitter{0};
+  double drop_probability = 0;       ///< frames lost on the way to the host
+  double incomplete_probability = 0; ///< frames arriving incomplete
+  unsigned int buffers = 4;          ///< host buffers, as the driver has
+  unsigned int patterns = 30; ///< distinct frames, rendered up front so that
+                              ///< delivering one only costs a copy
+  std::uint32_t seed = 42;    ///< for reproducible jitter and drops
+};
+
+/**
+ * @brief   Camera simulated in software, so the capture loop, encoding and
+ * sending can be run and profiled without a FLIR camera. A thread of its own
+ * delivers frames at the configured rate into a fixed set of buffers, with
+ * the camera's NewestOnly semantics: a frame not grabbed before the next one
+ * arrives is dropped, as are frames arriving while the consumer holds all
+ * buffers.
+ * @warning Images must be released before the source is destroyed
+ */
+class SimulatedSource : public FrameSource {
+  SimulatedCamera config_;
+  std::vector<cv::Mat> patterns_; ///< in the delivered format
+  std::vector<cv::Mat> buffers_;
+  std::vector<bool> buffer_free_;
+  int ready_ = -1; ///< buffer of the newest frame not grabbed yet
+  bool ready_incomplete_ = false;
+  std::int64_t ready_captured_ns_ = 0;
+  Stats stats_;
+  mutable std::mutex mutex_; ///< guards everything above but the patterns
+  std::condition_variable ready_cv_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+
+  /**
+   * @brief Deliver frames until stopped
+   */
+  void run();
+
+  /**
+   * @brief Render a test frame in the delivered format
+   */
+  cv::Mat render(unsigned int index) const;
+
+public:
+  /**
+   * @brief ctor. Renders the patterns, acquisition starts with start().
+   *
+   * @throw std::invalid_argument for unsupported formats or sizes
+   */
+  explicit SimulatedSource(const SimulatedCamera &config);
+
+  SimulatedSource(const SimulatedSource &) = delete;
+  SimulatedSource &operator=(const SimulatedSource &) = delete;
+
+  void start() override;
+  void stop() override;
+  GrabStatus grab(std::chrono::milliseconds timeout,
+                  avutils::BorrowedImage &image) override;
+  Stats get_stats() const override;
+  std::string name() const override { return "simulated"; }
+
+  ~SimulatedSource() override;
+};
+
+#endif /* end of include guard: SIMULATED_SOURCE_HPP_K4NB7RXE */
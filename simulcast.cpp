@@ -0,0 +1,128 @@
+#include "simulcast.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+Simulcast::Simulcast(unsigned int fps,
+                     const std::vector<SimulcastLayer> &layers,
+                     unsigned int gop_size, const std::string &codec,
+                     ScaleFilter filter)
+    : pix_fmt_(codec_profile(codec).pix_fmt) {
+  if (layers.empty()) {
+    throw std::invalid_argument("Simulcast needs at least one layer");
+  }
+  // the cores are shared by pixel count, a half size layer has a quarter
+  double pixels = 0;
+  for (const auto &config : layers) {
+    pixels += 1.0 / (config.divisor * config.divisor);
+  }
+  const unsigned int cores = available_cores();
+  for (const auto &config : layers) {
+    std::unique_ptr<AVTransmitter> layer(
+        new AVTransmitter(fps, gop_size, config.bitrate, codec));
+    layer->set_downscale(config.divisor);
+    layer->set_scale_filter(filter);
+    EncoderThreading threading;
+    threading.threads = std::max(
+        1, static_cast<int>(std::lround(
+               cores / (config.divisor * config.divisor * pixels))));
+    layer->set_threading(threading);
+    layers_.push_back(std::move(layer));
+  }
+}
+
+AVFrame *Simulcast::to_codec_format(avutils::BorrowedImage image) {
+  AVFrame *input = avutils::wrap_borrowed_image(std::move(image));
+  if (input->format == static_cast<int>(pix_fmt_)) {
+    return input;
+  }
+  AVFrame *converted = av_frame_alloc();
+  converted->width = input->width;
+  converted->height = input->height;
+  converted->format = static_cast<int>(pix_fmt_);
+  int success = av_frame_get_buffer(converted, 0);
+  if (success < 0) {
+    av_frame_free(&converted);
+    av_frame_free(&input);
+    throw std::runtime_error("Could not allocate frame: " +
+                             avutils::av_strerror2(success));
+  }
+  converter_.scale(input, converted);
+  av_frame_free(&input);
+  return converted;
+}
+
+avutils::BorrowedImage Simulcast::lend(const AVFrame *frame,
+                                       std::int64_t captured_ns) {
+  AVFrame *ref = av_frame_clone(frame);
+  if (!ref) {
+    throw std::runtime_error("Could not reference frame");
+  }
+  avutils::BorrowedImage image;
+  for (int i = 0; i < 4; ++i) {
+    image.data[i] = ref->data[i];
+    image.linesize[i] = ref->linesize[i];
+  }
+  image.width = ref->width;
+  image.height = ref->height;
+  image.format = static_cast<AVPixelFormat>(ref->format);
+  image.captured_ns = captured_ns;
+  image.release = [ref]() mutable { av_frame_free(&ref); };
+  return image;
+}
+
+void Simulcast::prepare(unsigned int width, unsigned int height) {
+  for (auto &layer : layers_) {
+    layer->prepare(width, height);
+  }
+}
+
+void Simulcast::encode_frame(const cv::Mat &image) {
+  // synchronous, so the image outlives the call and needs no copy
+  encode_frame(avutils::borrow_mat(image, AV_PIX_FMT_RGB24));
+}
+
+void Simulcast::encode_frame(avutils::BorrowedImage image) {
+  const std::int64_t captured_ns = image.captured_ns;
+  AVFrame *frame = to_codec_format(std::move(image));
+  for (auto &layer : layers_) {
+    layer->encode_frame(lend(frame, captured_ns));
+  }
+  av_frame_free(&frame);
+}
+
+void Simulcast::start_pipeline(unsigned int queue_size, DropPolicy policy) {
+  for (auto &layer : layers_) {
+    layer->start_pipeline(queue_size, policy);
+  }
+  pipelined_ = true;
+}
+
+void Simulcast::stop_pipeline() {
+  for (auto &layer : layers_) {
+    layer->stop_pipeline();
+  }
+  pipelined_ = false;
+}
+
+bool Simulcast::submit_frame(const cv::Mat &image) {
+  // never in the codec's pixel format, so it is converted into a frame of our
+  // own before this returns and needs no copy
+  return submit_frame(avutils::borrow_mat(image, AV_PIX_FMT_RGB24));
+}
+
+bool Simulcast::submit_frame(avutils::BorrowedImage image) {
+  if (!pipelined_) {
+    throw std::logic_error("submit_frame() needs start_pipeline() first");
+  }
+  const std::int64_t captured_ns = image.captured_ns;
+  AVFrame *frame = to_codec_format(std::move(image));
+  bool queued = true;
+  for (auto &layer : layers_) {
+    queued = layer->submit_frame(lend(frame, captured_ns)) && queued;
+  }
+  av_frame_free(&frame);
+  return queued;
+}
+
+Simulcast::~Simulcast() { stop_pipeline(); }
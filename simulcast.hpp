@@ -0,0 +1,138 @@
+#ifndef SIMULCAST_HPP_N8XR2GUB
+#define SIMULCAST_HPP_N8XR2GUB
+
+#include "avtransmitter.hpp"
+#include "avutils.hpp"
+#include "pipeline_queue.hpp"
+#include "scaler.hpp"
+#include <memory>
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+/**
+ * @brief   One stream of a \ref Simulcast
+ */
+struct SimulcastLayer {
+  unsigned int divisor; ///< size relative to the input, e.g. 2 for half width
+                        ///< and height
+  unsigned int bitrate; ///< bits per second
+};
+
+/**
+ * @brief   Encodes one input at several resolutions, e.g. full, half and
+ * quarter size, so viewers on thin links can take a low resolution stream
+ * without another camera or process. Each layer is an \ref AVTransmitter with
+ * outputs, keyframe requests and rate control of its own. Colour conversion
+ * is done once at the input size and shared by all layers, which then only
+ * resample (or, at full size, take the converted frame as it is).
+ */
+class Simulcast {
+  AVPixelFormat pix_fmt_;
+  std::vector<std::unique_ptr<AVTransmitter>> layers_;
+  Scaler converter_; ///< to the codec's pixel format, at the input size
+  bool pipelined_ = false;
+
+  /**
+   * @brief Get the input in the codec's pixel format, converted if needed
+   *
+   * @param image   input, released once converted or no longer referenced
+   *
+   * @return    frame at the input size, to be freed with `av_frame_free()`
+   */
+  AVFrame *to_codec_format(avutils::BorrowedImage image);
+
+  /**
+   * @brief Lend a frame to a layer. The image holds a reference to the
+   * frame's buffers, which is dropped when the layer releases it.
+   */
+  static avutils::BorrowedImage lend(const AVFrame *frame,
+                                     std::int64_t captured_ns);
+
+public:
+  /**
+   * @brief ctor. The layers have no outputs yet, add them to each with
+   * layer(i).add_sink().
+   *
+   * @param fps stream frame rate
+   * @param layers  sizes and bitrates, the first one is usually full size
+   * @param gop_size    keyframe interval
+   * @param codec   name of a \ref CodecProfile, the same for all layers
+   * @param filter  resampling filter for the smaller layers
+   */
+  Simulcast(unsigned int fps, const std::vector<SimulcastLayer> &layers,
+            unsigned int gop_size = 10, const std::string &codec = "vp9",
+            ScaleFilter filter = ScaleFilter::Area);
+
+  Simulcast(const Simulcast &) = delete;
+  Simulcast &operator=(const Simulcast &) = delete;
+
+  /**
+   * @brief Get the number of layers
+   */
+  std::size_t size() const { return layers_.size(); }
+
+  /**
+   * @brief Get a layer, to add outputs, request keyframes or read stats
+   *
+   * @param index   in the order given at construction
+   */
+  AVTransmitter &layer(std::size_t index) { return *layers_.at(index); }
+
+  /**
+   * @brief Set up all layers for a given input size before the first frame,
+   * see AVTransmitter::prepare()
+   */
+  void prepare(unsigned int width, unsigned int height);
+
+  /**
+   * @brief Send an image to all layers
+   *
+   * @param image   RGB8 image
+   */
+  void encode_frame(const cv::Mat &image);
+
+  /**
+   * @brief Send a caller-owned image to all layers. `image.release` is
+   * invoked once it is converted, or once all layers are done with it if it
+   * already is in the codec's pixel format.
+   */
+  void encode_frame(avutils::BorrowedImage image);
+
+  /**
+   * @brief Run each layer's pipeline, so layers resample and encode in
+   * parallel. Colour conversion stays on the submitting thread. After this,
+   * frames must be sent with submit_frame().
+   *
+   * @param queue_size  capacity of each queue between stages
+   * @param policy  what to do with frames when a layer can't keep up
+   */
+  void start_pipeline(unsigned int queue_size = 2,
+                      DropPolicy policy = DropPolicy::DropOldest);
+
+  /**
+   * @brief Stop all layers' pipelines, after draining all queued frames
+   */
+  void stop_pipeline();
+
+  /**
+   * @brief Hand an image to all layers' pipelines. The image is converted
+   * before this returns, so the caller can reuse its buffer right away.
+   *
+   * @param image   RGB8 image
+   *
+   * @return    false if any layer dropped the frame
+   */
+  bool submit_frame(const cv::Mat &image);
+
+  /**
+   * @brief Hand a caller-owned image to all layers' pipelines
+   *
+   * @return    false if any layer dropped the frame
+   */
+  bool submit_frame(avutils::BorrowedImage image);
+
+  ~Simulcast();
+};
+
+#endif /* end of include guard: SIMULCAST_HPP_N8XR2GUB */
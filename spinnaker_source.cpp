@@ -0,0 +1,220 @@
+#include "spinnaker_source.hpp"
+#include "tracing.hpp"
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include "SpinGenApi/SpinnakerGenApi.h"
+
+using namespace Spinnaker::GenApi;
+
+SpinnakerSource::SpinnakerSource(const std::string &serial, unsigned int fps)
+    : serial_(serial), stats_() {
+  system_ = Spinnaker::System::GetInstance();
+  Spinnaker::CameraList cameras = system_->GetCameras();
+  camera_ = cameras.GetBySerial(serial);
+  cameras.Clear();
+  if (!camera_) {
+    system_->ReleaseInstance();
+    throw std::invalid_argument("No camera with serial " + serial);
+  }
+
+  std::cout << "Init camera" << std::endl;
+  camera_->Init();
+
+  INodeMap &stream_nodes = camera_->GetTLStreamNodeMap();
+  CEnumerationPtr buffer_handling =
+      stream_nodes.GetNode("StreamBufferHandlingMode");
+  if (!IsAvailable(buffer_handling) || !IsWritable(buffer_handling)) {
+    throw std::runtime_error(
+        "Node StreamBufferHandlingMode not available or writeable");
+  }
+  CEnumEntryPtr newest_only = buffer_handling->GetEntryByName("NewestOnly");
+  if (!IsAvailable(newest_only) || !IsReadable(newest_only)) {
+    throw std::runtime_error("Unable to read node 'NewestOnly'");
+  }
+  buffer_handling->SetIntValue(newest_only->GetValue());
+
+  std::cout << "Setting params" << std::endl;
+  if (set_node("AcquisitionMode", std::string("Continuous")) == -1) {
+    throw std::runtime_error("Could not set AcquisitionMode");
+  }
+  // the node names differ between camera models
+  set_node("AcquisitionFrameRateEnabled", true);
+  set_node("AcquisitionFrameRateEnable", true);
+  set_node("AcquisitionFrameRateAuto", std::string("Off"));
+  set_node("AcquisitionFrameRate", static_cast<int>(fps));
+
+  // Important, otherwise we don't get frames at all
+  if (set_raw_pixel_format() == -1) {
+    std::cout << "Could not set pixel format" << std::endl;
+  }
+  set_node("ExposureAuto", std::string("On"));
+}
+
+int SpinnakerSource::set_node(const std::string &node,
+                              const std::string &value) {
+  INodeMap &nodes = camera_->GetNodeMap();
+  CEnumerationPtr ptr = nodes.GetNode(node.c_str());
+  if (!IsAvailable(ptr) || !IsWritable(ptr)) {
+    return -1;
+  }
+  CEnumEntryPtr entry = ptr->GetEntryByName(value.c_str());
+  if (!IsAvailable(entry) || !IsReadable(entry)) {
+    return -1;
+  }
+  ptr->SetIntValue(entry->GetValue());
+  return 0;
+}
+
+int SpinnakerSource::set_node(const std::string &node, int value) {
+  CIntegerPtr ptr = camera_->GetNodeMap().GetNode(node.c_str());
+  if (!IsAvailable(ptr) || !IsWritable(ptr)) {
+    return -1;
+  }
+  ptr->SetValue(value);
+  return 0;
+}
+
+int SpinnakerSource::set_node(const std::string &node, float value) {
+  CFloatPtr ptr = camera_->GetNodeMap().GetNode(node.c_str());
+  if (!IsAvailable(ptr) || !IsWritable(ptr)) {
+    return -1;
+  }
+  ptr->SetValue(value);
+  return 0;
+}
+
+int SpinnakerSource::set_node(const std::string &node, bool value) {
+  CBooleanPtr ptr = camera_->GetNodeMap().GetNode(node.c_str());
+  if (!IsAvailable(ptr) || !IsWritable(ptr)) {
+    return -1;
+  }
+  ptr->SetValue(value);
+  return 0;
+}
+
+AVPixelFormat
+SpinnakerSource::raw_pixel_format(Spinnaker::PixelFormatEnums format) {
+  switch (format) {
+  case Spinnaker::PixelFormat_BayerBG8:
+    return AV_PIX_FMT_BAYER_BGGR8;
+  case Spinnaker::PixelFormat_BayerRG8:
+    return AV_PIX_FMT_BAYER_RGGB8;
+  case Spinnaker::PixelFormat_BayerGB8:
+    return AV_PIX_FMT_BAYER_GBRG8;
+  case Spinnaker::PixelFormat_BayerGR8:
+    return AV_PIX_FMT_BAYER_GRBG8;
+  case Spinnaker::PixelFormat_Mono8:
+    return AV_PIX_FMT_GRAY8;
+  default:
+    return AV_PIX_FMT_NONE;
+  }
+}
+
+int SpinnakerSource::set_raw_pixel_format() {
+  try {
+    return set_node("PixelFormat", std::string("BayerBG8"));
+  } catch (const std::exception &) {
+  }
+  try {
+    return set_node("PixelFormat", std::string("BayerRG8"));
+  } catch (const std::exception &) {
+  }
+  return -1;
+}
+
+void SpinnakerSource::start() {
+  if (acquiring_) {
+    return;
+  }
+  stats_ = Stats();
+  std::cout << "Beginning acquisition" << std::endl;
+  camera_->BeginAcquisition();
+  acquiring_ = true;
+  // wait a bit for camera to start streaming
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+}
+
+void SpinnakerSource::stop() {
+  if (!acquiring_) {
+    return;
+  }
+  std::cout << "End acquisition" << std::endl;
+  camera_->EndAcquisition();
+  acquiring_ = false;
+}
+
+GrabStatus SpinnakerSource::grab(std::chrono::milliseconds timeout,
+                                 avutils::BorrowedImage &image) {
+  Spinnaker::ImagePtr frame;
+  std::int64_t captured_ns = 0;
+  try {
+    frame = camera_->GetNextImage(timeout.count());
+    captured_ns = tracing::now_ns();
+    const std::uint64_t frame_id = frame->GetFrameID();
+    if (stats_.grabbed + stats_.incomplete + stats_.errors > 0 &&
+        frame_id > next_frame_id_) {
+      stats_.dropped += frame_id - next_frame_id_;
+    }
+    next_frame_id_ = frame_id + 1;
+    if (frame->IsIncomplete()) {
+      frame->Release();
+      ++stats_.incomplete;
+      return GrabStatus::Incomplete;
+    }
+    if (frame->GetImageStatus() != Spinnaker::IMAGE_NO_ERROR) {
+      std::cout << "Image Error" << std::endl;
+      frame->Release();
+      ++stats_.errors;
+      return GrabStatus::Error;
+    }
+  } catch (const Spinnaker::Exception &e) {
+    if (e.GetError() == Spinnaker::SPINNAKER_ERR_TIMEOUT) {
+      ++stats_.timeouts;
+      return GrabStatus::Timeout;
+    }
+    std::cout << "Exception: " << e.what() << std::endl;
+    ++stats_.errors;
+    return GrabStatus::Error;
+  }
+
+  AVPixelFormat format = raw_pixel_format(frame->GetPixelFormat());
+  if (format == AV_PIX_FMT_NONE) {
+    Spinnaker::ImagePtr converted = frame->Convert(
+        Spinnaker::PixelFormat_RGB8, Spinnaker::NEAREST_NEIGHBOR);
+    frame->Release();
+    frame = converted;
+    format = AV_PIX_FMT_RGB24;
+    // a converted image belongs to us, it is freed with its last reference
+    image.release = [frame]() mutable { frame = nullptr; };
+  } else {
+    // raw frames go to the encoder as is, the buffer is given back to the
+    // driver once it has been converted
+    image.release = [frame]() { frame->Release(); };
+  }
+  image.data[0] = static_cast<const std::uint8_t *>(frame->GetData());
+  image.linesize[0] = static_cast<int>(frame->GetStride());
+  image.width = static_cast<int>(frame->GetWidth());
+  image.height = static_cast<int>(frame->GetHeight());
+  image.format = format;
+  image.captured_ns = captured_ns;
+  ++stats_.grabbed;
+  return GrabStatus::Ok;
+}
+
+SpinnakerSource::~SpinnakerSource() {
+  try {
+    stop();
+    std::cout << "Deinit camera" << std::endl;
+    camera_->DeInit();
+  } catch (const Spinnaker::Exception &e) {
+    std::cout << "Caught error " << e.what() << std::endl;
+  }
+  // when the system is released in the same scope, the camera must be
+  // cleaned up before
+  camera_ = nullptr;
+  std::cout << "Release system" << std::endl;
+  system_->ReleaseInstance();
+  system_ = nullptr;
+}
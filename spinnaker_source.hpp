@@ -0,0 +1,78 @@
+#ifndef SPINNAKER_SOURCE_HPP_P6HT3CMV
+#define SPINNAKER_SOURCE_HPP_P6HT3CMV
+
+#include "frame_source.hpp"
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "Spinnaker.h"
+
+/**
+ * @brief   FLIR camera, driven through Spinnaker. Raw Bayer and Mono8 frames
+ * are handed out as they come from the driver, anything else is converted to
+ * RGB8 by Spinnaker first.
+ * @warning grab() and get_stats() must be called from the same thread
+ */
+class SpinnakerSource : public FrameSource {
+  Spinnaker::SystemPtr system_;
+  Spinnaker::CameraPtr camera_;
+  std::string serial_;
+  bool acquiring_ = false;
+  Stats stats_;
+  std::uint64_t next_frame_id_ = 0; ///< camera's frame counter, gaps are
+                                    ///< frames we never got
+
+  /**
+   * @brief Get the ffmpeg equivalent of a raw camera pixel format
+   *
+   * @return    AV_PIX_FMT_NONE if the transmitter can't take this format
+   * directly
+   */
+  static AVPixelFormat raw_pixel_format(Spinnaker::PixelFormatEnums format);
+
+  /**
+   * @brief Switch to a raw Bayer format, which the transmitter converts
+   * faster than Spinnaker
+   *
+   * @return    0 on success, -1 if the camera has none of them
+   */
+  int set_raw_pixel_format();
+
+public:
+  /**
+   * @brief ctor. Opens the camera and sets it up for streaming: continuous
+   * acquisition at a fixed frame rate, NewestOnly buffering and automatic
+   * exposure. Acquisition starts with start().
+   *
+   * @param serial  camera serial number
+   * @param fps frame rate
+   * @throw std::invalid_argument if there is no such camera
+   * @throw std::runtime_error if it can't be set up
+   */
+  SpinnakerSource(const std::string &serial, unsigned int fps);
+
+  SpinnakerSource(const SpinnakerSource &) = delete;
+  SpinnakerSource &operator=(const SpinnakerSource &) = delete;
+
+  /**
+   * @brief Set an enumeration node, e.g. "ExposureAuto" to "Continuous"
+   *
+   * @return    0 on success, -1 if the node is not available or writable
+   */
+  int set_node(const std::string &node, const std::string &value);
+  int set_node(const std::string &node, int value);
+  int set_node(const std::string &node, float value);
+  int set_node(const std::string &node, bool value);
+
+  void start() override;
+  void stop() override;
+  GrabStatus grab(std::chrono::milliseconds timeout,
+                  avutils::BorrowedImage &image) override;
+  Stats get_stats() const override { return stats_; }
+  std::string name() const override { return serial_; }
+
+  ~SpinnakerSource() override;
+};
+
+#endif /* end of include guard: SPINNAKER_SOURCE_HPP_P6HT3CMV */
@@ -0,0 +1,183 @@
+#include "stream_wall.hpp"
+#include "colorconv.hpp"
+#include "frame_pacer.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+StreamWall::Tile::Tile() : target(av_frame_alloc()) {}
+
+StreamWall::Tile::~Tile() {
+  // receivers first, they may still deliver frames
+  rtp.reset();
+  zmq.reset();
+  av_frame_free(&target);
+}
+
+StreamWall::StreamWall(const WallLayout &layout, WallPresenter presenter,
+                       unsigned int decode_threads)
+    : layout_(layout), presenter_(std::move(presenter)),
+      pool_(decode_threads), running_(false), composite_ns_() {
+  if (layout_.columns < 1 || layout_.rows < 1 ||
+      layout_.width < 2 * layout_.columns ||
+      layout_.height < 2 * layout_.rows || layout_.fps == 0) {
+    throw std::invalid_argument("Invalid wall layout");
+  }
+  // allocated once, tiles are views into it
+  canvas_ = cv::Mat::zeros(layout_.height, layout_.width, CV_8UC3);
+}
+
+StreamWall::Tile &StreamWall::next_tile() {
+  if (running_.load()) {
+    throw std::logic_error("Streams can only be added before start()");
+  }
+  const int index = static_cast<int>(tiles_.size());
+  if (index >= layout_.columns * layout_.rows) {
+    throw std::logic_error("The wall is full");
+  }
+  const int tile_width = layout_.width / layout_.columns;
+  const int tile_height = layout_.height / layout_.rows;
+  std::unique_ptr<Tile> tile(new Tile());
+  tile->view = canvas_(cv::Rect((index % layout_.columns) * tile_width,
+                                (index / layout_.columns) * tile_height,
+                                tile_width, tile_height));
+  tiles_.push_back(std::move(tile));
+  return *tiles_.back();
+}
+
+std::size_t StreamWall::add_rtp(const std::string &sdp_path) {
+  Tile &tile = next_tile();
+  DecodeSettings decode;
+  decode.pool = &pool_;
+  decode.yuv = true;
+  // the pool already spreads the streams over the cores
+  decode.threads = 1;
+  try {
+    tile.rtp.reset(new RTPReceiver(sdp_path, nullptr, false, decode));
+  } catch (...) {
+    tiles_.pop_back();
+    throw;
+  }
+  return tiles_.size() - 1;
+}
+
+std::size_t StreamWall::add_zmq(const std::string &endpoint) {
+  Tile &tile = next_tile();
+  DecodeSettings decode;
+  decode.pool = &pool_;
+  decode.yuv = true;
+  decode.threads = 1;
+  try {
+    tile.zmq.reset(new AVReceiver(endpoint, 30, nullptr, decode));
+  } catch (...) {
+    tiles_.pop_back();
+    throw;
+  }
+  return tiles_.size() - 1;
+}
+
+void StreamWall::draw(Tile &tile, const AVFrame *frame) {
+  if (frame->width != tile.stream_width ||
+      frame->height != tile.stream_height) {
+    // largest size with the stream's aspect ratio, centered
+    const double scale =
+        std::min(static_cast<double>(tile.view.cols) / frame->width,
+                 static_cast<double>(tile.view.rows) / frame->height);
+    const int width = std::max(1, static_cast<int>(frame->width * scale));
+    const int height = std::max(1, static_cast<int>(frame->height * scale));
+    tile.view.setTo(cv::Scalar::all(0));
+    tile.fitted = tile.view(cv::Rect((tile.view.cols - width) / 2,
+                                     (tile.view.rows - height) / 2, width,
+                                     height));
+    tile.target->data[0] = tile.fitted.data;
+    tile.target->linesize[0] = static_cast<int>(tile.fitted.step[0]);
+    tile.target->width = width;
+    tile.target->height = height;
+    tile.target->format = AV_PIX_FMT_BGR24;
+    tile.stream_width = frame->width;
+    tile.stream_height = frame->height;
+  }
+  const auto format = static_cast<AVPixelFormat>(frame->format);
+  if (tile.fitted.cols == frame->width && tile.fitted.rows == frame->height &&
+      avutils::is_yuv420_format(format)) {
+    // sizes match, our kernels write into the canvas directly
+    avutils::avframe_to_bgr(frame, tile.fitted, 3);
+  } else {
+    // scaled and converted in one pass, into the canvas as well
+    tile.scaler.scale(frame, tile.target);
+  }
+  ++tile.shown;
+}
+
+void StreamWall::run() {
+  // a late canvas is late, the display doesn't catch up on missed refreshes
+  FramePacer pacer(layout_.fps, 1, OverrunPolicy::Skip);
+  while (running_.load()) {
+    const std::uint64_t skipped = pacer.wait();
+    const std::int64_t begin = tracing::now_ns();
+    for (auto &tile : tiles_) {
+      RTPReceiver::DecodedFrame rtp_frame;
+      AVReceiver::DecodedFrame zmq_frame;
+      std::shared_ptr<AVFrame> frame;
+      if (tile->rtp && tile->rtp->try_get_frame(rtp_frame)) {
+        frame = rtp_frame.yuv;
+      } else if (tile->zmq && tile->zmq->try_get_frame(zmq_frame)) {
+        frame = zmq_frame.yuv;
+      }
+      if (frame) {
+        draw(*tile, frame.get());
+      }
+    }
+    const std::int64_t composited = tracing::now_ns();
+    if (presenter_) {
+      tracing::ScopedSpan span(tracing::Stage::Present);
+      presenter_(canvas_);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++renders_;
+    skipped_ += skipped;
+    composite_ns_.add(composited - begin);
+  }
+}
+
+void StreamWall::start() {
+  if (running_.exchange(true)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    renders_ = 0;
+    skipped_ = 0;
+    composite_ns_ = tracing::Histogram();
+  }
+  thread_ = std::thread(&StreamWall::run, this);
+}
+
+void StreamWall::stop() {
+  if (!running_.exchange(false)) {
+    return;
+  }
+  thread_.join();
+}
+
+StreamWall::Stats StreamWall::get_stats() const {
+  Stats stats;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats.renders = renders_;
+    stats.skipped = skipped_;
+    stats.composite_p50_ms = composite_ns_.percentile(50) / 1e6;
+    stats.composite_p99_ms = composite_ns_.percentile(99) / 1e6;
+  }
+  for (const auto &tile : tiles_) {
+    stats.shown.push_back(tile->shown.load());
+    stats.decoded.push_back(tile->rtp ? tile->rtp->get_stats().frames_decoded
+                                      : tile->zmq->get_stats().frames_decoded);
+  }
+  return stats;
+}
+
+StreamWall::~StreamWall() {
+  stop();
+  // the receivers hand their packets to the pool, so they go first
+  tiles_.clear();
+}
@@ -0,0 +1,161 @@
+#ifndef STREAM_WALL_HPP_K7PD3VXE
+#define STREAM_WALL_HPP_K7PD3VXE
+
+#include "avreceiver.hpp"
+#include "decode_pool.hpp"
+#include "rtpreceiver.hpp"
+#include "scaler.hpp"
+#include "tracing.hpp"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief   Grid and display of a \ref StreamWall
+ */
+struct WallLayout {
+  int columns = 3;
+  int rows = 3;
+  int width = 1920; ///< canvas size
+  int height = 1080;
+  unsigned int fps = 60; ///< display rate, independent of the streams'
+};
+
+/**
+ * @brief   Shows the canvas, e.g. with `cv::imshow()`. Called on the
+ * compositing thread at the display rate, the canvas only changes between
+ * calls.
+ */
+using WallPresenter = std::function<void(const cv::Mat &canvas)>;
+
+/**
+ * @brief   Receives many streams and shows them side by side on one canvas.
+ * All streams are decoded on one \ref DecodePool, and each receiver only
+ * keeps its newest frame. A single compositing thread wakes at the display
+ * rate, converts each stream's newest frame straight from YUV into its tile
+ * of the BGR canvas, scaled to fit with the aspect ratio kept, and hands the
+ * canvas to the presenter. Streams slower than the display keep their last
+ * frame up, faster ones skip frames.
+ */
+class StreamWall {
+public:
+  /**
+   * @brief Counters since start()
+   */
+  struct Stats {
+    std::uint64_t renders;   ///< canvases presented
+    std::uint64_t skipped;   ///< display slots missed, compositing overran
+    double composite_p50_ms; ///< compositing a canvas, without presenting
+    double composite_p99_ms;
+    std::vector<std::uint64_t> shown;   ///< frames composited, per tile
+    std::vector<std::uint64_t> decoded; ///< frames decoded, per tile
+  };
+
+private:
+  struct Tile {
+    std::unique_ptr<RTPReceiver> rtp;
+    std::unique_ptr<AVReceiver> zmq;
+    cv::Mat view;         ///< its part of the canvas
+    cv::Mat fitted;       ///< part of the view the stream fills
+    int stream_width = 0; ///< size the view was laid out for
+    int stream_height = 0;
+    Scaler scaler;
+    AVFrame *target; ///< header over `fitted`, for the scaler
+    std::atomic<std::uint64_t> shown{0};
+
+    Tile();
+    Tile(const Tile &) = delete;
+    Tile &operator=(const Tile &) = delete;
+    ~Tile();
+  };
+
+  WallLayout layout_;
+  WallPresenter presenter_;
+  cv::Mat canvas_;
+  DecodePool pool_; ///< declared before the tiles, whose receivers use it
+  std::vector<std::unique_ptr<Tile>> tiles_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+  mutable std::mutex mutex_; ///< guards the counters
+  std::uint64_t renders_ = 0;
+  std::uint64_t skipped_ = 0;
+  tracing::Histogram composite_ns_;
+
+  /**
+   * @brief Get a tile for the next stream
+   *
+   * @throw std::logic_error if the wall is running or full
+   */
+  Tile &next_tile();
+
+  /**
+   * @brief Convert a frame into its tile, laying the tile out again if the
+   * stream's size changed
+   */
+  void draw(Tile &tile, const AVFrame *frame);
+
+  /**
+   * @brief Composite and present at the display rate until stopped
+   */
+  void run();
+
+public:
+  /**
+   * @brief ctor. Allocates the canvas.
+   *
+   * @param layout  grid and display
+   * @param presenter   nullptr to run headless, e.g. for benchmarks
+   * @param decode_threads  0 for one per core
+   * @throw std::invalid_argument if the canvas can't be split into the grid
+   */
+  explicit StreamWall(const WallLayout &layout,
+                      WallPresenter presenter = nullptr,
+                      unsigned int decode_threads = 0);
+
+  StreamWall(const StreamWall &) = delete;
+  StreamWall &operator=(const StreamWall &) = delete;
+
+  /**
+   * @brief Add an RTP stream in the next free tile. Only before start().
+   *
+   * @param sdp_path    SDP file describing the stream
+   * @return    index of the tile
+   * @throw std::invalid_argument if the stream can't be opened
+   * @throw std::logic_error if the wall is running or full
+   */
+  std::size_t add_rtp(const std::string &sdp_path);
+
+  /**
+   * @brief Add a \ref ZmqSink publisher in the next free tile. Only before
+   * start().
+   *
+   * @param endpoint    e.g. `tcp://camera-host:15001`
+   * @return    index of the tile
+   * @throw std::logic_error if the wall is running or full
+   */
+  std::size_t add_zmq(const std::string &endpoint);
+
+  /**
+   * @brief Start compositing
+   */
+  void start();
+
+  /**
+   * @brief Stop compositing. Streams keep being received until destruction.
+   */
+  void stop();
+
+  /**
+   * @brief Get counters
+   */
+  Stats get_stats() const;
+
+  ~StreamWall();
+};
+
+#endif /* end of include guard: STREAM_WALL_HPP_K7PD3VXE */
@@ -0,0 +1,150 @@
+#include "threading.hpp"
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace {
+
+// beyond this, synchronization eats what more threads would gain
+constexpr int max_threads = 16;
+// the encoders' limit on log2 tile columns
+constexpr int max_tile_columns_log2 = 6;
+// narrowest tile VP9 and AV1 allow
+constexpr int min_tile_width = 256;
+// x264 slices shorter than this cost more bits than their thread saves
+constexpr int min_slice_mb_rows = 4;
+
+int floor_log2(int value) {
+  int log2 = 0;
+  while (value > 1) {
+    value >>= 1;
+    ++log2;
+  }
+  return log2;
+}
+
+int ceil_log2(int value) {
+  int log2 = 0;
+  while ((1 << log2) < value) {
+    ++log2;
+  }
+  return log2;
+}
+
+bool has_option(const CodecOptions &options, const std::string &key,
+                const std::string &value) {
+  return std::find(options.begin(), options.end(),
+                   std::make_pair(key, value)) != options.end();
+}
+
+void set_option(CodecOptions &options, const std::string &key,
+                const std::string &value) {
+  options.erase(std::remove_if(options.begin(), options.end(),
+                               [&key](const CodecOptions::value_type &option) {
+                                 return option.first == key;
+                               }),
+                options.end());
+  options.emplace_back(key, value);
+}
+
+bool uses_tiles(const CodecProfile &profile) {
+  return profile.codec_id == AV_CODEC_ID_VP9 ||
+         profile.codec_id == AV_CODEC_ID_AV1;
+}
+
+} // namespace
+
+unsigned int available_cores() {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    return std::max(1, CPU_COUNT(&set));
+  }
+#endif
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+EncoderThreading resolve_threading(const CodecProfile &profile, int width,
+                                   int height,
+                                   const EncoderThreading &requested,
+                                   unsigned int cores) {
+  EncoderThreading resolved = requested;
+  const int max_columns_log2 = std::min(
+      max_tile_columns_log2, floor_log2(std::max(1, width / min_tile_width)));
+  if (resolved.threads <= 0) {
+    int pieces;
+    if (uses_tiles(profile)) {
+      // with row-mt, rows within a tile run in parallel as well
+      pieces = has_option(profile.options, "row-mt", "1")
+                   ? max_threads
+                   : 1 << max_columns_log2;
+    } else {
+      const int mb_rows = (height + 15) / 16;
+      pieces = std::max(1, mb_rows / min_slice_mb_rows);
+    }
+    resolved.threads = std::min(
+        {static_cast<int>(std::max(1u, cores)), max_threads, pieces});
+  }
+  if (!uses_tiles(profile)) {
+    resolved.tile_columns = 0;
+    resolved.tile_rows = 0;
+    return resolved;
+  }
+  if (resolved.tile_columns < 0) {
+    resolved.tile_columns =
+        std::min(max_columns_log2, ceil_log2(resolved.threads));
+  }
+  if (resolved.tile_rows < 0) {
+    // VP9 tile rows depend on each other and only cost bits. AV1 tile rows
+    // are independent and take the threads columns can't.
+    resolved.tile_rows = 0;
+    if (profile.codec_id == AV_CODEC_ID_AV1) {
+      const int columns = 1 << resolved.tile_columns;
+      const int max_rows_log2 = floor_log2(std::max(1, height / min_tile_width));
+      resolved.tile_rows = std::min(
+          max_rows_log2, ceil_log2((resolved.threads + columns - 1) / columns));
+    }
+  }
+  return resolved;
+}
+
+void apply_threading(AVCodecContext *codec_ctx, CodecOptions &options,
+                     const CodecProfile &profile,
+                     const EncoderThreading &threading) {
+  codec_ctx->thread_count = threading.threads;
+  // for libx264 this means sliced threads; the others only take the count
+  codec_ctx->thread_type = FF_THREAD_SLICE;
+  const std::string columns = std::to_string(threading.tile_columns);
+  const std::string rows = std::to_string(threading.tile_rows);
+  if (profile.encoder == "libvpx-vp9") {
+    set_option(options, "tile-columns", columns);
+    set_option(options, "tile-rows", rows);
+  } else if (profile.encoder == "libaom-av1") {
+    // "tiles" would override the log2 options
+    options.erase(std::remove_if(options.begin(), options.end(),
+                                 [](const CodecOptions::value_type &option) {
+                                   return option.first == "tiles";
+                                 }),
+                  options.end());
+    set_option(options, "tile-columns", columns);
+    set_option(options, "tile-rows", rows);
+  } else if (profile.encoder == "libsvtav1") {
+    set_option(options, "tile_columns", columns);
+    set_option(options, "tile_rows", rows);
+  }
+}
+
+int decoder_threads(int width, int height) {
+  const int cores = static_cast<int>(available_cores());
+  if (width <= 0 || height <= 0) {
+    // not known before the first frame, e.g. from an SDP
+    return std::min(cores, 4);
+  }
+  const int mb_rows = (height + 15) / 16;
+  return std::min({cores, 8, std::max(1, mb_rows / min_slice_mb_rows)});
+}
@@ -0,0 +1,68 @@
+#ifndef THREADING_HPP_V5GK2PWT
+#define THREADING_HPP_V5GK2PWT
+
+#include "codec_profile.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+/**
+ * @brief   How an encoder spreads one frame over threads. Only slice and tile
+ * parallelism is used: frame threading buffers one frame per thread, which
+ * is exactly the latency this library avoids.
+ */
+struct EncoderThreading {
+  int threads = 0;       ///< 0 to choose from frame size and cores
+  int tile_columns = -1; ///< log2 of the tile columns (VP9, AV1), -1 to choose
+  int tile_rows = -1;    ///< log2 of the tile rows (VP9, AV1), -1 to choose
+};
+
+/**
+ * @brief   Get the number of cores this process may run on, which in a
+ * container or with `taskset` is less than the machine has
+ */
+unsigned int available_cores();
+
+/**
+ * @brief   Fill in what was left to choose. Threads are bounded by the cores
+ * and by how many pieces the frame can be cut into (x264 slices of at least
+ * four macroblock rows, VP9/AV1 tiles at least 256 pixels wide). Tile columns
+ * are as many as the threads can work on at once.
+ *
+ * @param profile   codec
+ * @param width stream width
+ * @param height    stream height
+ * @param requested explicit choices, kept as they are
+ * @param cores cores to use at most
+ *
+ * @return  threading with every field set
+ */
+EncoderThreading resolve_threading(const CodecProfile &profile, int width,
+                                   int height,
+                                   const EncoderThreading &requested = {},
+                                   unsigned int cores = available_cores());
+
+/**
+ * @brief   Configure an encoder context and its options for a threading
+ * layout, before it is opened. Replaces the profile's tile options.
+ *
+ * @param codec_ctx encoder context
+ * @param options   encoder options, e.g. a copy of the profile's
+ * @param profile   codec
+ * @param threading as returned by resolve_threading()
+ */
+void apply_threading(AVCodecContext *codec_ctx, CodecOptions &options,
+                     const CodecProfile &profile,
+                     const EncoderThreading &threading);
+
+/**
+ * @brief   Get the thread count for a decoder. Decoders use slice threading,
+ * which only helps as far as the sender cut frames into slices or tiles.
+ *
+ * @param width frame width, 0 if not known yet
+ * @param height    frame height, 0 if not known yet
+ */
+int decoder_threads(int width, int height);
+
+#endif /* end of include guard: THREADING_HPP_V5GK2PWT */
@@ -0,0 +1,291 @@
+#include "tracing.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+
+namespace tracing {
+
+namespace {
+
+// 1.3 MB per thread, a few minutes of history at 30 fps
+constexpr std::uint64_t ring_capacity = 1 << 15;
+
+/**
+ * @brief   A span in a ring, read while its thread may be overwriting it.
+ * A sequence lock: `sequence` is 0 while the fields are written and the
+ * span's index + 1 once they are complete, so a reader sees whether the span
+ * it copied stayed the same. The fields are atomics so that racing reads
+ * are defined; their release stores and acquire loads are plain moves on
+ * x86.
+ */
+struct Slot {
+  std::atomic<std::uint64_t> sequence{0};
+  std::atomic<std::int64_t> frame_id{0};
+  std::atomic<std::int64_t> begin_ns{0};
+  std::atomic<std::int64_t> end_ns{0};
+  std::atomic<Stage> stage{Stage::Capture};
+};
+
+/**
+ * @brief   Single-writer ring of spans, owned by one recording thread
+ */
+struct Ring {
+  explicit Ring(std::uint32_t thread)
+      : spans(ring_capacity), head(0), floor(0), thread(thread) {}
+  std::vector<Slot> spans;
+  std::atomic<std::uint64_t> head;  ///< number of spans ever written
+  std::atomic<std::uint64_t> floor; ///< spans before this were reset
+  const std::uint32_t thread;
+};
+
+/**
+ * @brief   All rings ever created. Rings outlive their threads, so spans of
+ * finished threads can still be exported.
+ */
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<Ring>> rings;
+};
+
+Registry &registry() {
+  static Registry registry;
+  return registry;
+}
+
+std::atomic<bool> tracing_enabled(true);
+
+Ring &local_ring() {
+  // only locks once per thread
+  thread_local std::shared_ptr<Ring> ring;
+  if (!ring) {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    ring = std::make_shared<Ring>(static_cast<std::uint32_t>(reg.rings.size()));
+    reg.rings.push_back(ring);
+  }
+  return *ring;
+}
+
+constexpr int sub_bucket_bits = 6;
+constexpr int exact_values = 2 << sub_bucket_bits;
+constexpr int bucket_count = (1 << sub_bucket_bits) * (63 - sub_bucket_bits) +
+                             (1 << sub_bucket_bits);
+
+int msb(std::uint64_t value) { return 63 - __builtin_clzll(value); }
+
+int bucket_index(std::int64_t value) {
+  if (value < exact_values) {
+    return static_cast<int>(value);
+  }
+  const int shift = msb(static_cast<std::uint64_t>(value)) - sub_bucket_bits;
+  return (shift << sub_bucket_bits) + static_cast<int>(value >> shift);
+}
+
+/**
+ * @brief   Get the value in the middle of a bucket
+ */
+std::int64_t bucket_value(int index) {
+  if (index < exact_values) {
+    return index;
+  }
+  const int shift = (index >> sub_bucket_bits) - 1;
+  const std::int64_t mantissa = index - (shift << sub_bucket_bits);
+  return (mantissa << shift) + ((std::int64_t(1) << shift) >> 1);
+}
+
+} // namespace
+
+const char *stage_name(Stage stage) {
+  switch (stage) {
+  case Stage::Capture:
+    return "capture";
+  case Stage::Convert:
+    return "convert";
+  case Stage::Encode:
+    return "encode";
+  case Stage::Mux:
+    return "mux";
+  case Stage::Receive:
+    return "receive";
+  case Stage::Decode:
+    return "decode";
+  case Stage::ColorConvert:
+    return "color_convert";
+  case Stage::Present:
+    return "present";
+  }
+  return "unknown";
+}
+
+std::int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void record(Stage stage, std::int64_t frame_id, std::int64_t begin_ns,
+            std::int64_t end_ns) {
+  if (!tracing_enabled.load(std::memory_order_relaxed)) {
+    return;
+  }
+  Ring &ring = local_ring();
+  const std::uint64_t index = ring.head.load(std::memory_order_relaxed);
+  Slot &slot = ring.spans[index % ring_capacity];
+  // invalidate the slot first: a reader that sees any of the new fields sees
+  // this too
+  slot.sequence.store(0, std::memory_order_relaxed);
+  slot.frame_id.store(frame_id, std::memory_order_release);
+  slot.begin_ns.store(begin_ns, std::memory_order_release);
+  slot.end_ns.store(end_ns, std::memory_order_release);
+  slot.stage.store(stage, std::memory_order_release);
+  // publishes the span to collect()
+  slot.sequence.store(index + 1, std::memory_order_release);
+  ring.head.store(index + 1, std::memory_order_release);
+}
+
+void set_enabled(bool enabled) { tracing_enabled.store(enabled); }
+
+std::vector<Span> collect() {
+  std::vector<std::shared_ptr<Ring>> rings;
+  {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    rings = reg.rings;
+  }
+  std::vector<Span> spans;
+  for (const auto &ring : rings) {
+    const std::uint64_t head = ring->head.load(std::memory_order_acquire);
+    const std::uint64_t floor = ring->floor.load();
+    std::uint64_t first = head > ring_capacity ? head - ring_capacity : 0;
+    first = std::max(first, floor);
+    for (std::uint64_t i = first; i < head; ++i) {
+      const Slot &slot = ring->spans[i % ring_capacity];
+      if (slot.sequence.load(std::memory_order_acquire) != i + 1) {
+        continue; // the writer lapped us
+      }
+      Span span;
+      span.frame_id = slot.frame_id.load(std::memory_order_acquire);
+      span.begin_ns = slot.begin_ns.load(std::memory_order_acquire);
+      span.end_ns = slot.end_ns.load(std::memory_order_acquire);
+      span.stage = slot.stage.load(std::memory_order_acquire);
+      span.thread = ring->thread;
+      // keep it only if it was not overwritten while copying
+      if (slot.sequence.load(std::memory_order_relaxed) == i + 1) {
+        spans.push_back(span);
+      }
+    }
+  }
+  return spans;
+}
+
+void reset() {
+  Registry &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  for (const auto &ring : reg.rings) {
+    ring->floor.store(ring->head.load());
+  }
+}
+
+Histogram::Histogram() : counts_(bucket_count, 0) {}
+
+void Histogram::add(std::int64_t value) {
+  value = std::max<std::int64_t>(value, 0);
+  ++counts_[bucket_index(value)];
+  ++total_;
+  max_ = std::max(max_, value);
+}
+
+std::int64_t Histogram::percentile(double percentile) const {
+  if (total_ == 0) {
+    return 0;
+  }
+  const double clamped = std::min(std::max(percentile, 0.0), 100.0);
+  const std::uint64_t rank = std::max<std::uint64_t>(
+      1, static_cast<std::uint64_t>(clamped / 100.0 * total_ + 0.5));
+  std::uint64_t seen = 0;
+  for (int i = 0; i < bucket_count; ++i) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      return std::min(bucket_value(i), max_);
+    }
+  }
+  return max_;
+}
+
+Report summarize(const std::vector<Span> &spans) {
+  Report report;
+  // first begin and last end per frame
+  std::map<std::int64_t, std::pair<std::int64_t, std::int64_t>> frames;
+  for (const Span &span : spans) {
+    report.stages[static_cast<int>(span.stage)].add(span.end_ns -
+                                                    span.begin_ns);
+    if (span.frame_id == no_frame) {
+      continue;
+    }
+    auto inserted = frames.emplace(
+        span.frame_id, std::make_pair(span.begin_ns, span.end_ns));
+    if (!inserted.second) {
+      auto &extent = inserted.first->second;
+      extent.first = std::min(extent.first, span.begin_ns);
+      extent.second = std::max(extent.second, span.end_ns);
+    }
+  }
+  for (const auto &frame : frames) {
+    report.end_to_end.add(frame.second.second - frame.second.first);
+  }
+  return report;
+}
+
+void print_report(const Report &report, std::ostream &os) {
+  const auto ms = [](std::int64_t ns) { return ns / 1e6; };
+  const auto print_row = [&](const char *name, const Histogram &histogram) {
+    if (histogram.count() == 0) {
+      return;
+    }
+    os << std::left << std::setw(14) << name << std::right << std::setw(8)
+       << histogram.count() << std::fixed << std::setprecision(3)
+       << std::setw(10) << ms(histogram.percentile(50)) << std::setw(10)
+       << ms(histogram.percentile(90)) << std::setw(10)
+       << ms(histogram.percentile(99)) << std::setw(10) << ms(histogram.max())
+       << "\n";
+  };
+  os << std::left << std::setw(14) << "stage [ms]" << std::right
+     << std::setw(8) << "count" << std::setw(10) << "p50" << std::setw(10)
+     << "p90" << std::setw(10) << "p99" << std::setw(10) << "max"
+     << "\n";
+  for (int i = 0; i < stage_count; ++i) {
+    print_row(stage_name(static_cast<Stage>(i)), report.stages[i]);
+  }
+  print_row("end_to_end", report.end_to_end);
+  os.flush();
+}
+
+void write_chrome_trace(const std::vector<Span> &spans, std::ostream &os) {
+  const int pid = static_cast<int>(::getpid());
+  os << "{\"traceEvents\":[";
+  os << std::fixed << std::setprecision(3);
+  bool first = true;
+  for (const Span &span : spans) {
+    os << (first ? "\n" : ",\n");
+    first = false;
+    // trace event timestamps are in microseconds
+    os << "{\"name\":\"" << stage_name(span.stage)
+       << "\",\"cat\":\"frame\",\"pid\":" << pid << ",\"tid\":" << span.thread
+       << ",\"ts\":" << span.begin_ns / 1e3;
+    if (span.end_ns == span.begin_ns) {
+      os << ",\"ph\":\"i\",\"s\":\"t\"";
+    } else {
+      os << ",\"ph\":\"X\",\"dur\":" << (span.end_ns - span.begin_ns) / 1e3;
+    }
+    os << ",\"args\":{\"frame\":" << span.frame_id << "}}";
+  }
+  os << "\n]}\n";
+  os.flush();
+}
+
+} // namespace tracing
@@ -0,0 +1,191 @@
+#ifndef TRACING_HPP_5GQW0XRM
+#define TRACING_HPP_5GQW0XRM
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+/**
+ * @brief   Per-frame latency tracing. Every thread records spans into its own
+ * lock-free ring buffer, so recording costs two clock reads and a few stores,
+ * and never blocks or prints. Exporting happens off the hot path.
+ *
+ * Frames are identified by their pts on the 90 kHz clock RTP uses for video,
+ * which the RTP timestamp carries to the receiver. The receiver's
+ * demuxer counts timestamps from the first packet it sees, so sender and
+ * receiver ids match as long as the receiver is listening before the first
+ * frame is sent.
+ *
+ * Timestamps come from `std::chrono::steady_clock`, which is system wide on
+ * Linux, so traces of sender and receiver processes on the same host can be
+ * merged.
+ */
+namespace tracing {
+
+/**
+ * @brief   Pipeline stages a frame passes from capture to display
+ */
+enum class Stage : std::uint8_t {
+  Capture,      ///< from capture until handed to the transmitter
+  Convert,      ///< colour conversion to the codec's pixel format
+  Encode,       ///< encoder (and muxer in synchronous mode)
+  Mux,          ///< RTP packetization and send
+  Receive,      ///< packet returned by the demuxer (instant)
+  Decode,       ///< decoder
+  ColorConvert, ///< decoded frame to BGR(A)
+  Present       ///< display
+};
+
+constexpr int stage_count = 8;
+
+/// frame id for spans which can't be attributed to a frame
+constexpr std::int64_t no_frame = -1;
+
+/// clock rate of frame ids in Hz, the RTP video clock
+constexpr int clock_rate = 90000;
+
+/**
+ * @brief   Get printable name of a stage
+ */
+const char *stage_name(Stage stage);
+
+/**
+ * @brief   A recorded interval. Instant events have `begin_ns == end_ns`.
+ */
+struct Span {
+  std::int64_t frame_id;
+  std::int64_t begin_ns;
+  std::int64_t end_ns;
+  std::uint32_t thread; ///< sequential id of the recording thread
+  Stage stage;
+};
+
+/**
+ * @brief   Get monotonic time in nanoseconds
+ */
+std::int64_t now_ns();
+
+/**
+ * @brief   Record a span into the calling thread's ring buffer. The oldest
+ * spans are overwritten once the ring is full.
+ *
+ * @param stage
+ * @param frame_id  frame id or \ref no_frame
+ * @param begin_ns  start time from \ref now_ns
+ * @param end_ns    end time from \ref now_ns
+ */
+void record(Stage stage, std::int64_t frame_id, std::int64_t begin_ns,
+            std::int64_t end_ns);
+
+/**
+ * @brief   Turn recording on or off (on by default)
+ */
+void set_enabled(bool enabled);
+
+/**
+ * @brief   Records the lifetime of the object as span
+ */
+class ScopedSpan {
+  Stage stage_;
+  std::int64_t frame_id_;
+  std::int64_t begin_ns_;
+
+public:
+  ScopedSpan(Stage stage, std::int64_t frame_id = no_frame)
+      : stage_(stage), frame_id_(frame_id), begin_ns_(now_ns()) {}
+
+  ScopedSpan(const ScopedSpan &) = delete;
+  ScopedSpan &operator=(const ScopedSpan &) = delete;
+
+  /**
+   * @brief Set the frame id if it is only known at the end, e.g. after
+   * decoding
+   */
+  void set_frame_id(std::int64_t frame_id) { frame_id_ = frame_id; }
+
+  ~ScopedSpan() { record(stage_, frame_id_, begin_ns_, now_ns()); }
+};
+
+/**
+ * @brief   Copy the spans currently held by all threads' rings. Safe to call
+ * while other threads record.
+ *
+ * @return  spans, unordered
+ */
+std::vector<Span> collect();
+
+/**
+ * @brief   Make subsequent calls to \ref collect ignore everything recorded so
+ * far, e.g. to skip warm-up.
+ */
+void reset();
+
+/**
+ * @brief   Log-linear histogram of non-negative values, in the spirit of HDR
+ * histograms: values below 128 are exact, above that each power of two is
+ * split into 64 buckets, so percentiles are accurate to within 1.6% over the
+ * whole int64 range with constant memory.
+ */
+class Histogram {
+  std::vector<std::uint64_t> counts_;
+  std::uint64_t total_ = 0;
+  std::int64_t max_ = 0;
+
+public:
+  Histogram();
+
+  /**
+   * @brief Add a value, negative values count as 0
+   */
+  void add(std::int64_t value);
+
+  /**
+   * @brief Get number of values added
+   */
+  std::uint64_t count() const { return total_; }
+
+  /**
+   * @brief Get largest value added (exact)
+   */
+  std::int64_t max() const { return max_; }
+
+  /**
+   * @brief Get value at percentile
+   *
+   * @param percentile  in [0, 100]
+   *
+   * @return    value such that \ref percentile percent of values are not
+   * larger, 0 if empty
+   */
+  std::int64_t percentile(double percentile) const;
+};
+
+/**
+ * @brief   Latency distributions in nanoseconds
+ */
+struct Report {
+  Histogram stages[stage_count]; ///< duration of each stage
+  /// per frame, from the beginning of its first span to the end of its last
+  Histogram end_to_end;
+};
+
+/**
+ * @brief   Compute latency distributions from spans
+ */
+Report summarize(const std::vector<Span> &spans);
+
+/**
+ * @brief   Print count, p50, p90, p99 and max per stage in milliseconds. Stages
+ * without spans are omitted.
+ */
+void print_report(const Report &report, std::ostream &os);
+
+/**
+ * @brief   Write spans in Chrome's trace event format, for `chrome://tracing`
+ * or Perfetto. Files from several processes can be loaded together.
+ */
+void write_chrome_trace(const std::vector<Span> &spans, std::ostream &os);
+
+} // namespace tracing
+
+#endif /* end of include guard: TRACING_HPP_5GQW0XRM */
@@ -0,0 +1,150 @@
+#include "udp_relay.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <random>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+std::runtime_error socket_error(const std::string &what) {
+  return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+} // namespace
+
+UdpRelay::UdpRelay(unsigned int listen_port, const std::string &host,
+                   unsigned int port, const Impairment &impairment)
+    : impairment_(impairment), link_free_(Clock::now()), forwarded_(0),
+      lost_(0), queue_dropped_(0), reordered_(0), stop_(false) {
+  in_socket_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+  out_socket_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+  if (in_socket_ < 0 || out_socket_ < 0) {
+    const auto error = socket_error("Could not create socket");
+    ::close(in_socket_);
+    ::close(out_socket_);
+    throw error;
+  }
+  // wake up regularly to check for stop
+  timeval timeout{0, 100000};
+  ::setsockopt(in_socket_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  sockaddr_in local;
+  std::memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  local.sin_port = htons(listen_port);
+  sockaddr_in remote;
+  std::memset(&remote, 0, sizeof(remote));
+  remote.sin_family = AF_INET;
+  remote.sin_port = htons(port);
+  if (::inet_pton(AF_INET, host.c_str(), &remote.sin_addr) != 1) {
+    ::close(in_socket_);
+    ::close(out_socket_);
+    throw std::invalid_argument("Not an IPv4 address: " + host);
+  }
+  if (::bind(in_socket_, reinterpret_cast<sockaddr *>(&local),
+             sizeof(local)) < 0 ||
+      ::connect(out_socket_, reinterpret_cast<sockaddr *>(&remote),
+                sizeof(remote)) < 0) {
+    const auto error = socket_error("Could not set up relay to " + host +
+                                    ":" + std::to_string(port));
+    ::close(in_socket_);
+    ::close(out_socket_);
+    throw error;
+  }
+  receive_thread_ = std::thread(&UdpRelay::receive_loop, this);
+  send_thread_ = std::thread(&UdpRelay::send_loop, this);
+}
+
+void UdpRelay::receive_loop() {
+  // fixed seeds, so runs with the same settings lose the same datagrams.
+  // Reordering draws from a generator of its own, so loss stays the same
+  // whatever the reorder setting.
+  std::mt19937 random(42);
+  std::mt19937 reorder_random(43);
+  std::bernoulli_distribution lose(impairment_.loss);
+  std::bernoulli_distribution reorder(impairment_.reorder);
+  std::vector<char> buffer(65536);
+  while (!stop_.load()) {
+    const ssize_t size = ::recv(in_socket_, buffer.data(), buffer.size(), 0);
+    if (size < 0) {
+      continue; // timed out
+    }
+    if (lose(random)) {
+      ++lost_;
+      continue;
+    }
+    const auto now = Clock::now();
+    Clock::time_point sent = now;
+    if (impairment_.rate_kbps > 0) {
+      // the bottleneck sends one datagram after the other at its rate
+      const auto start = std::max(now, link_free_);
+      if (start - now > impairment_.queue) {
+        ++queue_dropped_;
+        continue;
+      }
+      link_free_ = start + std::chrono::microseconds(
+                               8000 * static_cast<std::int64_t>(size) /
+                               impairment_.rate_kbps);
+      sent = link_free_;
+    }
+    Datagram datagram{sent + impairment_.delay,
+                      std::vector<char>(buffer.data(), buffer.data() + size)};
+    if (impairment_.reorder > 0 && reorder(reorder_random)) {
+      datagram.due += impairment_.reorder_delay;
+      ++reordered_;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // mostly appended, held back ones go further in
+      const auto later = std::upper_bound(
+          queue_.begin(), queue_.end(), datagram.due,
+          [](Clock::time_point due, const Datagram &queued) {
+            return due < queued.due;
+          });
+      queue_.insert(later, std::move(datagram));
+    }
+    cv_.notify_one();
+  }
+}
+
+void UdpRelay::send_loop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_.load()) {
+    if (queue_.empty()) {
+      cv_.wait_for(lock, std::chrono::milliseconds(100));
+      continue;
+    }
+    if (Clock::now() < queue_.front().due) {
+      cv_.wait_until(lock, queue_.front().due);
+      continue;
+    }
+    Datagram datagram = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    if (::send(out_socket_, datagram.data.data(), datagram.data.size(), 0) >=
+        0) {
+      ++forwarded_;
+    }
+    lock.lock();
+  }
+}
+
+UdpRelay::Stats UdpRelay::get_stats() const {
+  return Stats{forwarded_.load(), lost_.load(), queue_dropped_.load(),
+               reordered_.load()};
+}
+
+UdpRelay::~UdpRelay() {
+  stop_.store(true);
+  cv_.notify_all();
+  receive_thread_.join();
+  send_thread_.join();
+  ::close(in_socket_);
+  ::close(out_socket_);
+}
@@ -0,0 +1,106 @@
+#ifndef UDP_RELAY_HPP_K3PD8XVA
+#define UDP_RELAY_HPP_K3PD8XVA
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief   What a \ref UdpRelay does to the datagrams it forwards
+ */
+struct Impairment {
+  double loss = 0; ///< share of datagrams dropped at random, 0 to 1
+  std::chrono::microseconds delay{0}; ///< added to every datagram
+  unsigned int rate_kbps = 0;         ///< link capacity, 0 for unlimited
+  std::chrono::milliseconds queue{100}; ///< with a capacity, datagrams that
+                                        ///< would wait longer are dropped
+  double reorder = 0; ///< share of datagrams held back at random, 0 to 1
+  std::chrono::microseconds reorder_delay{5000}; ///< how long, so the ones
+                                                 ///< after overtake them
+};
+
+/**
+ * @brief   Forwards UDP datagrams from a local port to another address while
+ * simulating a bad link: random loss, delay, reordering, and a bottleneck
+ * with a drop-tail queue. Put between an RTP sender and receiver on one
+ * machine to see how the stream copes, e.g. in the benchmark.
+ */
+class UdpRelay {
+public:
+  /**
+   * @brief Counters since construction
+   */
+  struct Stats {
+    std::uint64_t forwarded;
+    std::uint64_t lost;          ///< dropped at random
+    std::uint64_t queue_dropped; ///< dropped because the queue was full
+    std::uint64_t reordered;     ///< held back
+  };
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Datagram {
+    Clock::time_point due;
+    std::vector<char> data;
+  };
+
+  int in_socket_ = -1;
+  int out_socket_ = -1;
+  Impairment impairment_;
+  Clock::time_point link_free_; ///< when the bottleneck has sent its queue
+
+  std::deque<Datagram> queue_; ///< by due time
+  std::mutex mutex_;
+  std::condition_variable cv_;
+
+  std::atomic<std::uint64_t> forwarded_;
+  std::atomic<std::uint64_t> lost_;
+  std::atomic<std::uint64_t> queue_dropped_;
+  std::atomic<std::uint64_t> reordered_;
+
+  std::atomic<bool> stop_;
+  std::thread receive_thread_;
+  std::thread send_thread_;
+
+  /**
+   * @brief Receive datagrams and schedule or drop them, until stopped
+   */
+  void receive_loop();
+
+  /**
+   * @brief Send scheduled datagrams when they are due, until stopped
+   */
+  void send_loop();
+
+public:
+  /**
+   * @brief ctor. Starts forwarding right away.
+   *
+   * @param listen_port local port to receive on
+   * @param host    address to forward to, numeric IPv4
+   * @param port    port to forward to
+   * @param impairment  what to do to the traffic
+   * @throw std::runtime_error if the sockets can't be set up
+   */
+  UdpRelay(unsigned int listen_port, const std::string &host,
+           unsigned int port, const Impairment &impairment);
+
+  UdpRelay(const UdpRelay &) = delete;
+  UdpRelay &operator=(const UdpRelay &) = delete;
+
+  /**
+   * @brief Get counters
+   */
+  Stats get_stats() const;
+
+  ~UdpRelay();
+};
+
+#endif /* end of include guard: UDP_RELAY_HPP_K3PD8XVA */
@@ -0,0 +1,118 @@
+#include "zmq_sink.hpp"
+#include "tracing.hpp"
+#include <cstring>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/mathematics.h>
+}
+
+ZmqSink::ZmqSink(zmq::context_t &ctx, const std::string &endpoint,
+                 ZmqDelivery delivery, int hwm)
+    : endpoint_(endpoint), delivery_(delivery), dropped_(0) {
+  bind(ctx, hwm);
+}
+
+ZmqSink::ZmqSink(const std::string &endpoint, ZmqDelivery delivery, int hwm)
+    : own_ctx_(new zmq::context_t(1)), endpoint_(endpoint),
+      delivery_(delivery), dropped_(0) {
+  bind(*own_ctx_, hwm);
+}
+
+void ZmqSink::bind(zmq::context_t &ctx, int hwm) {
+  socket_ = zmq::socket_t(ctx, zmq::socket_type::pub);
+  socket_.set(zmq::sockopt::sndhwm, hwm);
+  // don't hold up shutdown for subscribers that went away
+  socket_.set(zmq::sockopt::linger, 0);
+  if (delivery_ == ZmqDelivery::Reliable) {
+    // report a full subscriber queue instead of silently dropping for it
+    socket_.set(zmq::sockopt::xpub_nodrop, 1);
+  }
+  socket_.bind(endpoint_);
+}
+
+void ZmqSink::open(const AVCodecContext *codec_ctx,
+                   const CodecProfile &profile) {
+  time_base_ = codec_ctx->time_base;
+  codec_id_ = codec_ctx->codec_id;
+  if (codec_ctx->extradata_size > 0) {
+    config_.assign(reinterpret_cast<const char *>(codec_ctx->extradata),
+                   codec_ctx->extradata_size);
+  }
+}
+
+void ZmqSink::release_buffer(void *data, void *hint) {
+  AVBufferRef *ref = static_cast<AVBufferRef *>(hint);
+  av_buffer_unref(&ref);
+}
+
+int ZmqSink::write(const AVPacket *pkt) {
+  const bool key = pkt->flags & AV_PKT_FLAG_KEY;
+  int size = 0;
+  const std::uint8_t *extradata =
+      av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &size);
+  if (extradata && size > 0) {
+    // the encoder was replaced, subscribers get its config from here on
+    config_.assign(reinterpret_cast<const char *>(extradata), size);
+  }
+  if (skipping_ && !key) {
+    ++dropped_;
+    return 0;
+  }
+  skipping_ = false;
+
+  ZmqPacketHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = zmq_packet_magic;
+  header.codec_id = static_cast<std::uint32_t>(codec_id_);
+  header.sequence = sequence_;
+  header.frame_id =
+      av_rescale_q(pkt->pts, time_base_, AVRational{1, tracing::clock_rate});
+  header.pts = pkt->pts;
+  header.time_base_num = time_base_.num;
+  header.time_base_den = time_base_.den;
+  const bool with_config = key && !config_.empty();
+  if (key) {
+    header.flags |= zmq_packet_key;
+  }
+  if (with_config) {
+    header.flags |= zmq_packet_config;
+  }
+
+  // never block the encoder, a full queue can only happen with
+  // ZmqDelivery::Reliable
+  if (!socket_.send(zmq::buffer(&header, sizeof(header)),
+                    zmq::send_flags::sndmore | zmq::send_flags::dontwait)) {
+    // the payload would be useless to the subscribers without its
+    // predecessors, so skip the rest of the GOP
+    skipping_ = true;
+    ++dropped_;
+    return 0;
+  }
+  zmq::message_t payload;
+  AVBufferRef *ref = pkt->buf ? av_buffer_ref(pkt->buf) : nullptr;
+  if (ref) {
+    // zero copy, zmq releases the reference once sent
+    payload = zmq::message_t(pkt->data, pkt->size, &ZmqSink::release_buffer,
+                             ref);
+  } else {
+    payload = zmq::message_t(pkt->data, pkt->size);
+  }
+  // the remaining parts of a message are always accepted
+  socket_.send(std::move(payload), with_config ? zmq::send_flags::sndmore
+                                               : zmq::send_flags::none);
+  if (with_config) {
+    socket_.send(zmq::buffer(config_.data(), config_.size()),
+                 zmq::send_flags::none);
+  }
+  ++sequence_;
+  return 0;
+}
+
+void ZmqSink::close() {
+  if (socket_) {
+    socket_.close();
+  }
+}
+
+ZmqSink::~ZmqSink() { close(); }
@@ -0,0 +1,109 @@
+#ifndef ZMQ_SINK_HPP_T5HB2KRD
+#define ZMQ_SINK_HPP_T5HB2KRD
+
+#include "packet_sink.hpp"
+#include <cstdint>
+#include <memory>
+#include <zmq.hpp>
+
+/**
+ * @brief   First part of every message a \ref ZmqSink publishes. It is
+ * followed by a part with the packet payload, and on keyframes by a part with
+ * the codec's extradata (e.g. h264 parameter sets), so receivers can join at
+ * any keyframe without further stream description. Sent in host byte order.
+ */
+struct ZmqPacketHeader {
+  std::uint32_t magic;    ///< \ref zmq_packet_magic
+  std::uint32_t codec_id; ///< AVCodecID of the payload
+  std::uint64_t sequence; ///< counts messages, gaps mean lost packets
+  std::int64_t frame_id;  ///< pts on the 90 kHz tracing clock
+  std::int64_t pts;       ///< pts in time_base
+  std::int32_t time_base_num;
+  std::int32_t time_base_den;
+  std::uint32_t flags; ///< \ref ZmqPacketFlags
+  std::uint32_t reserved;
+};
+
+static_assert(sizeof(ZmqPacketHeader) == 48, "Header layout is the protocol");
+
+constexpr std::uint32_t zmq_packet_magic = 0x41565a31; // "AVZ1"
+
+enum ZmqPacketFlags : std::uint32_t {
+  zmq_packet_key = 1,    ///< the payload is a keyframe
+  zmq_packet_config = 2, ///< an extradata part follows the payload
+};
+
+/**
+ * @brief   How a \ref ZmqSink deals with subscribers that fall behind by more
+ * than the high water mark. Both only ever drop the rest of a GOP, the next
+ * packet a subscriber decodes after a gap is a keyframe.
+ */
+enum class ZmqDelivery {
+  Latest,  ///< each subscriber drops on its own and resyncs at the next
+           ///< keyframe, the others are not affected
+  Reliable ///< all subscribers get the same packets. If any falls behind, the
+           ///< rest of the GOP is dropped for all of them.
+};
+
+/**
+ * @brief   Sink publishing packets on a ZeroMQ PUB socket, e.g. over TCP
+ * where RTP over UDP is too lossy. Payloads are sent without copying, the
+ * message holds a reference to the encoder's buffer until zmq is done
+ * with it.
+ *
+ * \ref AVReceiver subscribes to this.
+ */
+class ZmqSink : public PacketSink {
+  std::unique_ptr<zmq::context_t> own_ctx_; ///< when not given one
+  zmq::socket_t socket_;
+  std::string endpoint_;
+  ZmqDelivery delivery_;
+  AVRational time_base_;
+  AVCodecID codec_id_;
+  std::string config_; ///< extradata sent with every keyframe, updated
+                       ///< when the encoder is replaced
+  std::uint64_t sequence_ = 0;
+  bool skipping_ = false; ///< dropping until the next keyframe
+  std::atomic<std::uint64_t> dropped_;
+
+  /**
+   * @brief zmq free function releasing the buffer reference a message holds
+   */
+  static void release_buffer(void *data, void *hint);
+
+  /**
+   * @brief Bind the socket
+   */
+  void bind(zmq::context_t &ctx, int hwm);
+
+public:
+  /**
+   * @brief ctor. Binds right away, so subscribers can connect before the
+   * stream starts.
+   *
+   * @param ctx context to create the socket in. Must outlive the sink, and be
+   * shared with the receiver for `inproc://` endpoints.
+   * @param endpoint    e.g. `tcp://0.0.0.0:15001` or `inproc://video`
+   * @param delivery    what to do with subscribers that fall behind
+   * @param hwm max number of packets queued per subscriber
+   */
+  ZmqSink(zmq::context_t &ctx, const std::string &endpoint,
+          ZmqDelivery delivery = ZmqDelivery::Latest, int hwm = 30);
+
+  /**
+   * @brief ctor with a context of its own
+   */
+  ZmqSink(const std::string &endpoint,
+          ZmqDelivery delivery = ZmqDelivery::Latest, int hwm = 30);
+
+  void open(const AVCodecContext *codec_ctx,
+            const CodecProfile &profile) override;
+  int write(const AVPacket *pkt) override;
+  void close() override;
+  std::string name() const override { return endpoint_; }
+  std::uint64_t dropped() const override { return dropped_.load(); }
+
+  ~ZmqSink() override;
+};
+
+#endif /* end of include guard: ZMQ_SINK_HPP_T5HB2KRD */